@@ -1,33 +1,143 @@
+// Credits everything read from stdin to the kernel's entropy pool, so that
+// nothing in the test guests blocks waiting for randomness.
+//
+// Usage: addentropy [-b SIZE] [-u BITS] [-d]
+//
+//   -b SIZE  read and add SIZE bytes at a time (default 65536)
+//   -u BITS  stop as soon as the pool holds BITS bits of entropy, instead of
+//            at the end of input
+//   -d       keep running in the background once the pool is filled, and
+//            top it up again whenever it drops below that; implies
+//            `-u 256` unless given otherwise
+//
+// Without `-u`, all of the input is added and the pool is never looked at.
+
 #include <assert.h>
+#include <poll.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/ioctl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <linux/random.h>
 
-#define N 2048
+#define DEFAULT_SIZE 65536
+#define DEFAULT_BACKGROUND_BITS 256
+
+// How often the background feeder checks the pool if the kernel doesn't say
+// when it wants more entropy.
+#define POLL_INTERVAL_MS 1000
 
 struct entropy {
   int ent_count;
   int size;
-  unsigned char data[N];
+  unsigned char data[];
 };
 
-int main() {
-  struct entropy buf;
+// Reads up to `size` bytes, less only at the end of input.
+static ssize_t read_batch(unsigned char *data, size_t size) {
+  size_t filled = 0;
+  while (filled < size) {
+    ssize_t n = read(0, data + filled, size - filled);
+    if (n < 0) {
+      perror("failed to read entropy");
+      return -1;
+    }
+    if (n == 0)
+      break;
+    filled += n;
+  }
+  return filled;
+}
+
+static int entropy_count(int random_fd) {
+  int count;
+  if (ioctl(random_fd, RNDGETENTCNT, &count) != 0) {
+    perror("failed to get entropy count");
+    return -1;
+  }
+  return count;
+}
+
+// Adds input to the pool until it holds `until` bits (if that's positive)
+// or the input ends. Returns 0 at the end of input, 1 otherwise.
+static int fill(int random_fd, struct entropy *buf, size_t size, int until) {
   ssize_t n;
 
+  while ((n = read_batch(buf->data, size)) > 0) {
+    buf->ent_count = n * 8;
+    buf->size = n;
+    if (ioctl(random_fd, RNDADDENTROPY, buf) != 0) {
+      perror("failed to add entropy");
+    }
+    if (until > 0 && entropy_count(random_fd) >= until)
+      return 1;
+  }
+  return 0;
+}
+
+// Waits until the pool holds less than `until` bits. The kernel reports
+// /dev/random as writable once it drops below its write wakeup threshold,
+// which is what's waited for if `until` is above that.
+static void wait_for_drain(int random_fd, int until) {
+  for (;;) {
+    int count = entropy_count(random_fd);
+    if (count < 0 || count < until)
+      return;
+    struct pollfd pfd = { random_fd, POLLOUT, 0 };
+    poll(&pfd, 1, POLL_INTERVAL_MS);
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t size = DEFAULT_SIZE;
+  int until = 0;
+  int background = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:u:d")) != -1) {
+    switch (opt) {
+    case 'b':
+      size = strtoul(optarg, NULL, 0);
+      break;
+    case 'u':
+      until = atoi(optarg);
+      break;
+    case 'd':
+      background = 1;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-b SIZE] [-u BITS] [-d]\n", argv[0]);
+      return 1;
+    }
+  }
+  assert(size > 0);
+  if (background && until <= 0)
+    until = DEFAULT_BACKGROUND_BITS;
+
   int random_fd = open("/dev/random", O_RDWR);
   assert(random_fd >= 0);
 
-  while ((n = read(0, &buf.data, N)) > 0) {
-    buf.ent_count = n * 8;
-    buf.size = n;
-    if (ioctl(random_fd, RNDADDENTROPY, &buf) != 0) {
-      perror("failed to add entropy");
-    }
+  struct entropy *buf = malloc(sizeof(struct entropy) + size);
+  assert(buf != NULL);
+
+  if (!fill(random_fd, buf, size, until) || !background)
+    return 0;
+
+  // The pool is filled; leave the rest to a child so boot can carry on.
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("failed to start entropy feeder");
+    return 1;
   }
+  if (pid > 0)
+    return 0;
+  setsid();
+
+  do {
+    wait_for_drain(random_fd, until);
+  } while (fill(random_fd, buf, size, until));
 
   return 0;
 }
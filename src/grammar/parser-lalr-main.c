@@ -5,11 +5,40 @@
 
 extern int yylex();
 extern int rsparse();
+extern void lexer_reset_file(FILE *in);
+extern void lexer_reset_bytes(char const *bytes, int len);
 
-#define PUSHBACK_LEN 4
+// Tokens which a grammar action splits off a token the lexer returned (the
+// second `>` of `>>` closing two generic argument lists, say) and which are
+// returned by the next calls to `rslex`, in order, before the lexer is
+// asked for more. This is a ring buffer of whole tokens: the position of
+// the oldest one and the number queued.
+//
+// No action pushes back more than two tokens for any token it consumes,
+// so a handful of slots is plenty. If it ever overflows anyway the parse is
+// failed rather than silently dropping a token.
+#define PUSHBACK_LEN 8
 
-static char pushback[PUSHBACK_LEN];
+struct token {
+  int kind;
+  struct node *value;
+};
+
+static struct token pushback[PUSHBACK_LEN];
+static unsigned pushback_head;
+static unsigned pushback_count;
+static int pushback_overflow;
 static int verbose;
+static int sexp;
+
+extern struct node *rslval;
+extern void rserror(char const *s);
+
+static void pushback_reset() {
+  pushback_head = 0;
+  pushback_count = 0;
+  pushback_overflow = 0;
+}
 
 void print(const char* format, ...) {
   va_list args;
@@ -20,81 +49,207 @@ void print(const char* format, ...) {
   va_end(args);
 }
 
-// If there is a non-null char at the head of the pushback queue,
-// dequeue it and shift the rest of the queue forwards. Otherwise,
-// return the token from calling yylex.
+// Returns the oldest token in the pushback queue if there is one, and
+// otherwise the next token from calling yylex.
 int rslex() {
-  if (pushback[0] == '\0') {
+  if (pushback_count == 0) {
     return yylex();
-  } else {
-    char c = pushback[0];
-    memmove(pushback, pushback + 1, PUSHBACK_LEN - 1);
-    pushback[PUSHBACK_LEN - 1] = '\0';
-    return c;
   }
+  struct token *t = &pushback[pushback_head];
+  pushback_head = (pushback_head + 1) % PUSHBACK_LEN;
+  pushback_count--;
+  rslval = t->value;
+  return t->kind;
 }
 
-// Note: this does nothing if the pushback queue is full. As long as
-// there aren't more than PUSHBACK_LEN consecutive calls to push_back
-// in an action, this shouldn't be a problem.
-void push_back(char c) {
-  for (int i = 0; i < PUSHBACK_LEN; ++i) {
-    if (pushback[i] == '\0') {
-      pushback[i] = c;
-      break;
+// Queues a token with its semantic value to be returned by `rslex`.
+void push_back_token(int kind, struct node *value) {
+  if (pushback_count == PUSHBACK_LEN) {
+    if (!pushback_overflow) {
+      rserror("token pushback queue overflow");
     }
+    pushback_overflow = 1;
+    return;
   }
+  struct token *t =
+      &pushback[(pushback_head + pushback_count) % PUSHBACK_LEN];
+  t->kind = kind;
+  t->value = value;
+  pushback_count++;
+}
+
+// Queues a single character token.
+void push_back(char c) {
+  push_back_token(c, NULL);
 }
 
 extern int rsdebug;
 
+// All nodes, their child vectors and atom strings live in one bump
+// arena which is freed in one go once the tree has been printed. Nodes are
+// never freed individually: the parser only ever builds up a single tree.
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+struct arena_chunk {
+  struct arena_chunk *next;
+  size_t used;
+  size_t size;
+  char data[];
+};
+
+static struct arena_chunk *arena;
+
+static void *arena_alloc(size_t sz) {
+  sz = (sz + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  if (!arena || arena->size - arena->used < sz) {
+    size_t chunk_sz = sz > ARENA_CHUNK_SIZE ? sz : ARENA_CHUNK_SIZE;
+    struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + chunk_sz);
+    if (!chunk) {
+      fprintf(stderr, "out of memory\n");
+      exit(2);
+    }
+    chunk->next = arena;
+    chunk->used = 0;
+    chunk->size = chunk_sz;
+    arena = chunk;
+  }
+  void *p = arena->data + arena->used;
+  arena->used += sz;
+  return p;
+}
+
+// Frees all chunks but one, which is kept around (empty) for the next
+// input in batch mode.
+static void arena_reset() {
+  while (arena && arena->next) {
+    struct arena_chunk *next = arena->next;
+    free(arena);
+    arena = next;
+  }
+  if (arena) {
+    arena->used = 0;
+  }
+}
+
+static void arena_free_all() {
+  while (arena) {
+    struct arena_chunk *next = arena->next;
+    free(arena);
+    arena = next;
+  }
+}
+
+// Atom strings are interned, so every identifier and literal is only
+// stored once however often it occurs. The table is an open addressing hash
+// set of strings in the arena which doubles when it's half full.
+static char const **atoms;
+static size_t atoms_cap;
+static size_t n_atoms;
+
+static size_t hash_str(char const *s) {
+  size_t h = 2166136261u;
+  for (; *s; ++s) {
+    h = (h ^ (unsigned char)*s) * 16777619u;
+  }
+  return h;
+}
+
+static char const *intern(char const *s) {
+  if (2 * (n_atoms + 1) > atoms_cap) {
+    size_t new_cap = atoms_cap ? 2 * atoms_cap : 1024;
+    char const **new_atoms = calloc(new_cap, sizeof(char const *));
+    if (!new_atoms) {
+      fprintf(stderr, "out of memory\n");
+      exit(2);
+    }
+    for (size_t i = 0; i < atoms_cap; ++i) {
+      if (atoms[i]) {
+        size_t j = hash_str(atoms[i]) & (new_cap - 1);
+        while (new_atoms[j]) {
+          j = (j + 1) & (new_cap - 1);
+        }
+        new_atoms[j] = atoms[i];
+      }
+    }
+    free(atoms);
+    atoms = new_atoms;
+    atoms_cap = new_cap;
+  }
+
+  size_t i = hash_str(s) & (atoms_cap - 1);
+  while (atoms[i]) {
+    if (strcmp(atoms[i], s) == 0) {
+      return atoms[i];
+    }
+    i = (i + 1) & (atoms_cap - 1);
+  }
+  size_t len = strlen(s) + 1;
+  char *copy = arena_alloc(len);
+  memcpy(copy, s, len);
+  atoms[i] = copy;
+  n_atoms++;
+  return copy;
+}
+
 struct node {
-  struct node *next;
-  struct node *prev;
-  int own_string;
   char const *name;
   int n_elems;
-  struct node *elems[];
+  int cap_elems;
+  struct node **elems;
 };
 
+// The most recently created or extended node, which is the root of the
+// tree once the parse is complete.
 struct node *nodes = NULL;
 int n_nodes;
 
+// Appends the `n` nodes of `ap` to the children of `nd`, growing its child
+// vector by doubling. A vector that's outgrown stays behind in the arena.
+static void push_elems(struct node *nd, int n, va_list ap) {
+  int i = 0;
+  struct node *nn;
+  if (nd->n_elems + n > nd->cap_elems) {
+    int cap = nd->cap_elems ? 2 * nd->cap_elems : 4;
+    while (cap < nd->n_elems + n) {
+      cap *= 2;
+    }
+    struct node **elems = arena_alloc(cap * sizeof(struct node *));
+    if (nd->n_elems) {
+      memcpy(elems, nd->elems, nd->n_elems * sizeof(struct node *));
+    }
+    nd->elems = elems;
+    nd->cap_elems = cap;
+  }
+  while (i < n) {
+    nn = va_arg(ap, struct node *);
+    print("#   arg[%d]: %p\n", i, nn);
+    print("#            (%s ...)\n", nn->name);
+    nd->elems[nd->n_elems++] = nn;
+    ++i;
+  }
+}
+
 struct node *mk_node(char const *name, int n, ...) {
   va_list ap;
-  int i = 0;
-  unsigned sz = sizeof(struct node) + (n * sizeof(struct node *));
-  struct node *nn, *nd = (struct node *)malloc(sz);
+  struct node *nd = arena_alloc(sizeof(struct node));
 
   print("# New %d-ary node: %s = %p\n", n, name, nd);
 
-  nd->own_string = 0;
-  nd->prev = NULL;
-  nd->next = nodes;
-  if (nodes) {
-    nodes->prev = nd;
-  }
-  nodes = nd;
-
   nd->name = name;
-  nd->n_elems = n;
+  nd->n_elems = 0;
+  nd->cap_elems = n;
+  nd->elems = n ? arena_alloc(n * sizeof(struct node *)) : NULL;
+  nodes = nd;
 
   va_start(ap, n);
-  while (i < n) {
-    nn = va_arg(ap, struct node *);
-    print("#   arg[%d]: %p\n", i, nn);
-    print("#            (%s ...)\n", nn->name);
-    nd->elems[i++] = nn;
-  }
+  push_elems(nd, n, ap);
   va_end(ap);
   n_nodes++;
   return nd;
 }
 
 struct node *mk_atom(char *name) {
-  struct node *nd = mk_node((char const *)strdup(name), 0);
-  nd->own_string = 1;
-  return nd;
+  return mk_node(intern(name), 0);
 }
 
 struct node *mk_none() {
@@ -103,88 +258,313 @@ struct node *mk_none() {
 
 struct node *ext_node(struct node *nd, int n, ...) {
   va_list ap;
-  int i = 0, c = nd->n_elems + n;
-  unsigned sz = sizeof(struct node) + (c * sizeof(struct node *));
-  struct node *nn;
 
   print("# Extending %d-ary node by %d nodes: %s = %p",
-        nd->n_elems, c, nd->name, nd);
-
-  if (nd->next) {
-    nd->next->prev = nd->prev;
-  }
-  if (nd->prev) {
-    nd->prev->next = nd->next;
-  }
-  nd = realloc(nd, sz);
-  nd->prev = NULL;
-  nd->next = nodes;
-  nodes->prev = nd;
-  nodes = nd;
-
+        nd->n_elems, nd->n_elems + n, nd->name, nd);
   print(" ==> %p\n", nd);
+  nodes = nd;
 
   va_start(ap, n);
-  while (i < n) {
-    nn = va_arg(ap, struct node *);
-    print("#   arg[%d]: %p\n", i, nn);
-    print("#            (%s ...)\n", nn->name);
-    nd->elems[nd->n_elems++] = nn;
-    ++i;
-  }
+  push_elems(nd, n, ap);
   va_end(ap);
   return nd;
 }
 
 int const indent_step = 4;
 
-void print_indent(int depth) {
-  while (depth) {
-    if (depth-- % indent_step == 0) {
-      print("|");
-    } else {
-      print(" ");
-    }
+// Trees are written into a large buffer which is flushed to stdout when it
+// fills up (and after each tree), rather than with a call to `printf` per
+// node and per character of indentation.
+#define OUT_BUF_SIZE (1 << 16)
+
+static char out_buf[OUT_BUF_SIZE];
+static size_t out_len;
+
+static void out_flush() {
+  fwrite(out_buf, 1, out_len, stdout);
+  out_len = 0;
+}
+
+// Returns space for `n` more bytes of output, which must be filled in.
+static char *out_reserve(size_t n) {
+  if (out_len + n > OUT_BUF_SIZE) {
+    out_flush();
   }
+  if (n > OUT_BUF_SIZE) {
+    // Only a huge atom gets here; it's written straight through.
+    return NULL;
+  }
+  char *p = out_buf + out_len;
+  out_len += n;
+  return p;
 }
 
-void print_node(struct node *n, int depth) {
-  int i = 0;
-  print_indent(depth);
-  if (n->n_elems == 0) {
-    print("%s\n", n->name);
+static void out_write(char const *s, size_t n) {
+  char *p = out_reserve(n);
+  if (p) {
+    memcpy(p, s, n);
   } else {
-    print("(%s\n", n->name);
-    for (i = 0; i < n->n_elems; ++i) {
-      print_node(n->elems[i], depth + indent_step);
+    fwrite(s, 1, n, stdout);
+  }
+}
+
+static void out_char(char c) {
+  *out_reserve(1) = c;
+}
+
+// Indentation is a run of spaces with a `|` at every `indent_step`.
+static void out_indent(int depth) {
+  while (depth > 0) {
+    int run = depth < OUT_BUF_SIZE ? depth : OUT_BUF_SIZE;
+    char *p = out_reserve(run);
+    memset(p, ' ', run);
+    for (int i = 0; i < run; i += indent_step) {
+      p[i] = '|';
     }
-    print_indent(depth);
-    print(")\n");
+    depth -= run;
   }
 }
 
-int main(int argc, char **argv) {
-  if (argc == 2 && strcmp(argv[1], "-v") == 0) {
-    verbose = 1;
-  } else {
-    verbose = 0;
+// An atom as an S-expression token: as is if it can't be confused with
+// anything else, quoted and escaped otherwise (string literals, mostly).
+static void out_sexp_atom(char const *name) {
+  size_t n = strcspn(name, " \t\r\n()\"\\");
+  if (name[n] == '\0' && n > 0) {
+    out_write(name, n);
+    return;
+  }
+  out_char('"');
+  for (char const *c = name; *c; ++c) {
+    switch (*c) {
+    case '"': out_write("\\\"", 2); break;
+    case '\\': out_write("\\\\", 2); break;
+    case '\n': out_write("\\n", 2); break;
+    case '\r': out_write("\\r", 2); break;
+    case '\t': out_write("\\t", 2); break;
+    default: out_char(*c); break;
+    }
   }
+  out_char('"');
+}
+
+// Writes the tree rooted at `root`, either in the indented format of
+// verbose mode or as a single line S-expression. This walks the tree with
+// an explicit stack, as deeply nested expressions would otherwise overflow
+// the call stack.
+static void print_tree(struct node *root, int sexp) {
+  struct frame {
+    struct node *node;
+    int next;
+  };
+  static struct frame *stack;
+  static size_t stack_cap;
+  size_t depth = 0;
+
+  if (stack_cap == 0) {
+    stack_cap = 64;
+    stack = malloc(stack_cap * sizeof(struct frame));
+  }
+  stack[0].node = root;
+  stack[0].next = -1;
+  depth = 1;
+
+  while (depth > 0) {
+    struct frame *f = &stack[depth - 1];
+    struct node *n = f->node;
+    int level = (int)(depth - 1) * indent_step;
+
+    if (f->next == -1) {
+      // First visit.
+      if (n->n_elems == 0) {
+        if (sexp) {
+          if (depth > 1) {
+            out_char(' ');
+          }
+          out_sexp_atom(n->name);
+        } else {
+          out_indent(level);
+          out_write(n->name, strlen(n->name));
+          out_char('\n');
+        }
+        depth--;
+        continue;
+      }
+      if (sexp) {
+        if (depth > 1) {
+          out_char(' ');
+        }
+        out_char('(');
+        out_write(n->name, strlen(n->name));
+      } else {
+        out_indent(level);
+        out_char('(');
+        out_write(n->name, strlen(n->name));
+        out_char('\n');
+      }
+      f->next = 0;
+    }
+
+    if (f->next == n->n_elems) {
+      if (sexp) {
+        out_char(')');
+      } else {
+        out_indent(level);
+        out_write(")\n", 2);
+      }
+      depth--;
+      continue;
+    }
+
+    if (depth == stack_cap) {
+      stack_cap *= 2;
+      stack = realloc(stack, stack_cap * sizeof(struct frame));
+      f = &stack[depth - 1];
+    }
+    stack[depth].node = n->elems[f->next++];
+    stack[depth].next = -1;
+    depth++;
+  }
+  if (sexp) {
+    out_char('\n');
+  }
+  out_flush();
+}
+
+// Parses one input, which the lexer has been set up to read from, prints
+// its tree if asked to and frees it. Returns the parser's result.
+static int parse_one() {
   int ret = 0;
-  struct node *tmp;
-  memset(pushback, '\0', PUSHBACK_LEN);
+  pushback_reset();
+  nodes = NULL;
+  n_nodes = 0;
   ret = rsparse();
+  if (pushback_overflow && ret == 0) {
+    ret = 1;
+  }
   print("--- PARSE COMPLETE: ret:%d, n_nodes:%d ---\n", ret, n_nodes);
-  if (nodes) {
-    print_node(nodes, 0);
+  if (nodes && (verbose || sexp)) {
+    fflush(stdout);
+    print_tree(nodes, sexp);
+  }
+  if (atoms) {
+    memset(atoms, 0, atoms_cap * sizeof(char const *));
   }
-  while (nodes) {
-    tmp = nodes;
-    nodes = tmp->next;
-    if (tmp->own_string) {
-      free((void*)tmp->name);
+  n_atoms = 0;
+  arena_reset();
+  return ret;
+}
+
+static void print_result(int ret, char const *name) {
+  printf("%s %s\n", ret == 0 ? "ok" : "fail", name);
+  fflush(stdout);
+}
+
+// Batch mode over a list of files, one path per line, read from `list`.
+static int parse_file_list(FILE *list) {
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, list)) != -1) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+    if (len == 0) {
+      continue;
     }
-    free(tmp);
+    FILE *in = fopen(line, "r");
+    if (!in) {
+      perror(line);
+      print_result(1, line);
+      continue;
+    }
+    lexer_reset_file(in);
+    print_result(parse_one(), line);
+    fclose(in);
+  }
+  free(line);
+  return 0;
+}
+
+// Batch mode over sources on stdin, each a line with its length in bytes
+// followed by that many bytes. The results are named by their position in
+// the stream, starting at 0.
+static int parse_stdin_records() {
+  char *buf = NULL;
+  size_t cap = 0;
+  long len;
+  char name[32];
+  for (int i = 0; scanf("%ld", &len) == 1; ++i) {
+    if (len < 0 || getchar() != '\n') {
+      fprintf(stderr, "bad record header\n");
+      return 2;
+    }
+    if ((size_t)len > cap) {
+      cap = len;
+      buf = realloc(buf, cap);
+      if (!buf) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+      }
+    }
+    if (fread(buf, 1, len, stdin) != (size_t)len) {
+      fprintf(stderr, "truncated record\n");
+      return 2;
+    }
+    snprintf(name, sizeof(name), "%d", i);
+    lexer_reset_bytes(buf, len);
+    print_result(parse_one(), name);
+  }
+  free(buf);
+  return 0;
+}
+
+// usage: parser-lalr [-v] [--sexp] [--batch LIST | --batch-stdin]
+//
+// `-v` prints what the parser does and the tree it built, indented. With
+// `--sexp` the tree is printed as a single line S-expression instead (even
+// without `-v`), for comparing trees in bulk.
+//
+// Without a batch option a single source is parsed from stdin and the exit
+// status is the result. In batch mode each input gets a line `ok NAME` or
+// `fail NAME` on stdout instead; `--batch` reads paths one per line from
+// the file LIST (`-` for stdin), and `--batch-stdin` reads length-prefixed
+// sources from stdin.
+int main(int argc, char **argv) {
+  char const *batch_list = NULL;
+  int batch_stdin = 0;
+  verbose = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-v") == 0) {
+      verbose = 1;
+    } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+      batch_list = argv[++i];
+    } else if (strcmp(argv[i], "--batch-stdin") == 0) {
+      batch_stdin = 1;
+    } else if (strcmp(argv[i], "--sexp") == 0) {
+      sexp = 1;
+    } else {
+      fprintf(stderr,
+              "usage: %s [-v] [--sexp] [--batch LIST | --batch-stdin]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  int ret = 0;
+  if (batch_list) {
+    FILE *list = strcmp(batch_list, "-") == 0 ? stdin : fopen(batch_list, "r");
+    if (!list) {
+      perror(batch_list);
+      return 2;
+    }
+    ret = parse_file_list(list);
+  } else if (batch_stdin) {
+    ret = parse_stdin_records();
+  } else {
+    ret = parse_one();
   }
+  free(atoms);
+  arena_free_all();
   return ret;
 }
 
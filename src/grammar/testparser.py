@@ -7,15 +7,22 @@ import sys
 import os
 import subprocess
 import argparse
+import threading
 
-# usage: testparser.py [-h] [-p PARSER [PARSER ...]] -s SOURCE_DIR
+# usage: testparser.py [-h] [-p PARSER [PARSER ...]] -s SOURCE_DIR [-j JOBS]
 
 # Parsers should read from stdin and return exit status 0 for a
 # successful parse, and nonzero for an unsuccessful parse
+#
+# With -j, parsers are instead run in batch mode (`--batch -`, see
+# parser-lalr-main.c): the files are split into JOBS shards, each of which
+# is parsed by one parser process that reads the paths from stdin and
+# prints `ok PATH` or `fail PATH` for each.
 
 parser = argparse.ArgumentParser()
 parser.add_argument('-p', '--parser', nargs='+')
 parser.add_argument('-s', '--source-dir', nargs=1, required=True)
+parser.add_argument('-j', '--jobs', type=int, default=0)
 args = parser.parse_args(sys.argv[1:])
 
 total = 0
@@ -27,10 +34,27 @@ for parser in args.parser:
 devnull = open(os.devnull, 'w')
 print("\n")
 
+def record(parser, p, success):
+    if success != ('parse-fail' in p):
+        ok[parser] += 1
+    else:
+        bad[parser].append(p)
+
+
+def run_batch(parser, paths, results):
+    proc = subprocess.Popen([parser, '--batch', '-'], stdin=subprocess.PIPE,
+                            stdout=subprocess.PIPE, stderr=devnull,
+                            universal_newlines=True)
+    out, _ = proc.communicate(''.join(p + '\n' for p in paths))
+    for line in out.splitlines():
+        status, _, p = line.partition(' ')
+        results[p] = status == 'ok'
+
+
+paths = []
 for base, dirs, files in os.walk(args.source_dir[0]):
     for f in filter(lambda p: p.endswith('.rs'), files):
         p = os.path.join(base, f)
-        parse_fail = 'parse-fail' in p
         if sys.version_info.major == 3:
             lines = open(p, encoding='utf-8').readlines()
         else:
@@ -38,21 +62,33 @@ for base, dirs, files in os.walk(args.source_dir[0]):
         if any('ignore-test' in line or 'ignore-lexer-test' in line for line in lines):
             continue
         total += 1
+        if args.jobs > 0:
+            paths.append(p)
+            continue
         for parser in args.parser:
-            if subprocess.call(parser, stdin=open(p), stderr=subprocess.STDOUT, stdout=devnull) == 0:
-                if parse_fail:
-                    bad[parser].append(p)
-                else:
-                    ok[parser] += 1
-            else:
-                if parse_fail:
-                    ok[parser] += 1
-                else:
-                    bad[parser].append(p)
+            success = subprocess.call(parser, stdin=open(p), stderr=subprocess.STDOUT, stdout=devnull) == 0
+            record(parser, p, success)
         parser_stats = ', '.join(['{}: {}'.format(parser, ok[parser]) for parser in args.parser])
         sys.stdout.write("\033[K\r total: {}, {}, scanned {}"
                          .format(total, os.path.relpath(parser_stats), os.path.relpath(p)))
 
+if args.jobs > 0:
+    for parser in args.parser:
+        # A file the parser never reported on (e.g. because it crashed) counts
+        # as a failed parse.
+        results = {}
+        shards = [paths[i::args.jobs] for i in range(args.jobs)]
+        threads = [threading.Thread(target=run_batch, args=(parser, shard, results))
+                   for shard in shards if shard]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        for p in paths:
+            record(parser, p, results.get(p, False))
+    parser_stats = ', '.join(['{}: {}'.format(parser, ok[parser]) for parser in args.parser])
+    sys.stdout.write(" total: {}, {}".format(total, parser_stats))
+
 devnull.close()
 
 print("\n")
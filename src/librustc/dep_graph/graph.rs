@@ -937,6 +937,8 @@ pub enum WorkProductFileKind {
     Object,
     Bytecode,
     BytecodeCompressed,
+    /// The `.dwo` file of the object file with `-Z split-dwarf`.
+    SplitDwarf,
 }
 
 #[derive(Clone)]
@@ -817,6 +817,8 @@ macro_rules! options {
                   or the path to the linker plugin");
         pub const parse_merge_functions: Option<&str> =
             Some("one of: `disabled`, `trampolines`, or `aliases`");
+        pub const parse_multiversion: Option<&str> =
+            Some("`SYMBOL=FEATURES@CONDITION`");
     }
 
     #[allow(dead_code)]
@@ -886,6 +888,16 @@ macro_rules! options {
             }
         }
 
+        fn parse_multiversion(slot: &mut Vec<String>, v: Option<&str>) -> bool {
+            match v {
+                Some(s) if super::parse_multiversion_spec(s).is_some() => {
+                    slot.push(s.to_string());
+                    true
+                }
+                _ => false,
+            }
+        }
+
         fn parse_pathbuf_push(slot: &mut Vec<PathBuf>, v: Option<&str>) -> bool {
             match v {
                 Some(s) => { slot.push(PathBuf::from(s)); true },
@@ -1333,6 +1345,19 @@ options! {DebuggingOptions, DebuggingSetter, basic_debugging_options,
         "Generate PGO profile data, to a given file, or to the default location if it's empty."),
     pgo_use: String = (String::new(), parse_string, [TRACKED],
         "Use PGO profile data from the given profile file."),
+    pgo_sample_use: String = (String::new(), parse_string, [TRACKED],
+        "Use sampled PGO profile data (e.g. from `perf` via AutoFDO) from the given file."),
+    hot_cold_split: bool = (false, parse_bool, [TRACKED],
+        "Split the code profile data shows to be cold out of hot functions."),
+    multiversion: Vec<String> = (Vec::new(), parse_multiversion, [TRACKED],
+        "add a version of the function SYMBOL compiled with the target FEATURES, which is \
+         called instead if the `extern \"C\" fn() -> u32` CONDITION returns non-zero"),
+    profile_section_prefixes: bool = (false, parse_bool, [TRACKED],
+        "Place functions profile data shows to be hot or cold, and `#[cold]` functions, \
+         into `.text.hot` and `.text.unlikely` sections."),
+    split_dwarf: bool = (false, parse_bool, [TRACKED],
+        "put the debug info of each object file into a separate `.dwo` file, leaving only \
+         a skeleton in the object file (requires LLVM 7 or later)"),
     disable_instrumentation_preinliner: bool = (false, parse_bool, [TRACKED],
         "Disable the instrumentation pre-inliner, useful for profiling / PGO."),
     relro_level: Option<RelroLevel> = (None, parse_relro_level, [TRACKED],
@@ -1403,6 +1428,16 @@ options! {DebuggingOptions, DebuggingSetter, basic_debugging_options,
         "output a json file with profiler results"),
     emit_stack_sizes: bool = (false, parse_bool, [UNTRACKED],
         "emits a section containing stack size metadata"),
+    compress_debug_sections: Option<String> = (None, parse_opt_string, [TRACKED],
+        "compress the debug info sections of object files (`none`, `zlib-gnu` or `zlib`)"),
+    llvm_context_reuse: Option<usize> = (None, parse_opt_uint, [UNTRACKED],
+        "reuse each LLVM context for up to N codegen units"),
+    optimization_records: Option<String> = (None, parse_opt_string, [UNTRACKED],
+        "write the optimization remarks of the passes matching a regex (all of them if it's \
+         empty) to a `.opt.yaml` file per codegen unit"),
+    remark_hotness_threshold: Option<usize> = (None, parse_opt_uint, [UNTRACKED],
+        "with `-Z optimization-records`, leave out remarks about code that profile data \
+         shows to run fewer than N times"),
     plt: Option<bool> = (None, parse_opt_bool, [TRACKED],
           "whether to use the PLT when calling into shared libraries;
           only has effect for PIC code on systems with ELF binaries
@@ -1410,6 +1445,21 @@ options! {DebuggingOptions, DebuggingSetter, basic_debugging_options,
     merge_functions: Option<MergeFunctions> = (None, parse_merge_functions, [TRACKED],
         "control the operation of the MergeFunctions LLVM pass, taking
          the same values as the target option of the same name"),
+    lto_link_threads: Option<usize> = (None, parse_opt_uint, [UNTRACKED],
+        "link the modules of fat LTO on up to N threads (default: one per core), \
+         or one module after the other if N is 1"),
+    thinlto_summary_threads: Option<usize> = (None, parse_opt_uint, [UNTRACKED],
+        "parse the module summaries of ThinLTO on up to N threads (default: one per core), \
+         or read them into the combined index one after the other if N is 1"),
+    thinlto_cache_dir: Option<String> = (None, parse_opt_string, [UNTRACKED],
+        "keep the object files ThinLTO produces for each module in a cache in this \
+         directory, and reuse them when the module and everything it imports are unchanged"),
+    thinlto_fold_functions: bool = (false, parse_bool, [TRACKED],
+        "fold identical functions of different codegen units into one during ThinLTO \
+         (only with MergeFunctions enabled, and never in incremental builds)"),
+    lto_native_bitcode: bool = (false, parse_bool, [TRACKED],
+        "include ThinLTO bitcode from native static libraries bundled into rlibs \
+         in rustc's own LTO"),
 }
 
 pub fn default_lib_output() -> CrateType {
@@ -1942,6 +1992,13 @@ pub fn build_session_options_and_crate_config(
         );
     }
 
+    if debugging_opts.pgo_gen.is_some() && !debugging_opts.pgo_sample_use.is_empty() {
+        early_error(
+            error_format,
+            "options `-Z pgo-gen` and `-Z pgo-sample-use` are exclusive",
+        );
+    }
+
     let mut output_types = BTreeMap::new();
     if !debugging_opts.parse_only {
         for list in matches.opt_strs("emit") {
@@ -2322,6 +2379,21 @@ pub fn build_session_options_and_crate_config(
     )
 }
 
+/// Splits a `-Z multiversion` value `SYMBOL=FEATURES@CONDITION` into its
+/// three parts, none of which may be empty.
+pub fn parse_multiversion_spec(spec: &str) -> Option<(&str, &str, &str)> {
+    let eq = spec.find('=')?;
+    let at = spec.rfind('@')?;
+    if at < eq {
+        return None;
+    }
+    let (symbol, features, condition) = (&spec[..eq], &spec[eq + 1..at], &spec[at + 1..]);
+    if symbol.is_empty() || features.is_empty() || condition.is_empty() {
+        return None;
+    }
+    Some((symbol, features, condition))
+}
+
 pub fn parse_crate_types_from_list(list_list: Vec<String>) -> Result<Vec<CrateType>, String> {
     let mut crate_types: Vec<CrateType> = Vec::new();
     for unparsed_crate_type in &list_list {
@@ -3082,6 +3154,30 @@ mod tests {
         opts.debugging_opts.pgo_use = String::from("abc");
         assert_ne!(reference.dep_tracking_hash(), opts.dep_tracking_hash());
 
+        opts = reference.clone();
+        opts.debugging_opts.pgo_sample_use = String::from("abc");
+        assert_ne!(reference.dep_tracking_hash(), opts.dep_tracking_hash());
+
+        opts = reference.clone();
+        opts.debugging_opts.hot_cold_split = true;
+        assert_ne!(reference.dep_tracking_hash(), opts.dep_tracking_hash());
+
+        opts = reference.clone();
+        opts.debugging_opts.profile_section_prefixes = true;
+        assert_ne!(reference.dep_tracking_hash(), opts.dep_tracking_hash());
+
+        opts = reference.clone();
+        opts.debugging_opts.split_dwarf = true;
+        assert_ne!(reference.dep_tracking_hash(), opts.dep_tracking_hash());
+
+        opts = reference.clone();
+        opts.debugging_opts.compress_debug_sections = Some(String::from("zlib"));
+        assert_ne!(reference.dep_tracking_hash(), opts.dep_tracking_hash());
+
+        opts = reference.clone();
+        opts.debugging_opts.multiversion = vec![String::from("f=+avx2@has_avx2")];
+        assert_ne!(reference.dep_tracking_hash(), opts.dep_tracking_hash());
+
         opts = reference.clone();
         opts.cg.metadata = vec![String::from("A"), String::from("B")];
         assert!(reference.dep_tracking_hash() != opts.dep_tracking_hash());
@@ -3242,6 +3338,14 @@ mod tests {
         opts = reference.clone();
         opts.debugging_opts.merge_functions = Some(MergeFunctions::Disabled);
         assert!(reference.dep_tracking_hash() != opts.dep_tracking_hash());
+
+        opts = reference.clone();
+        opts.debugging_opts.thinlto_fold_functions = true;
+        assert!(reference.dep_tracking_hash() != opts.dep_tracking_hash());
+
+        opts = reference.clone();
+        opts.debugging_opts.lto_native_bitcode = true;
+        assert!(reference.dep_tracking_hash() != opts.dep_tracking_hash());
     }
 
     #[test]
@@ -1,6 +1,6 @@
 //! A helper class for dealing with static archives
 
-use std::ffi::{CString, CStr};
+use std::ffi::CString;
 use std::io;
 use std::mem;
 use std::path::{Path, PathBuf};
@@ -13,6 +13,7 @@ use crate::llvm::{self, ArchiveKind};
 use crate::metadata::METADATA_FILENAME;
 use rustc_codegen_ssa::back::archive::find_library;
 use rustc::session::Session;
+use rustc_data_structures::fx::FxHashSet;
 
 pub struct ArchiveConfig<'a> {
     pub sess: &'a Session,
@@ -26,6 +27,7 @@ pub struct ArchiveConfig<'a> {
 pub struct ArchiveBuilder<'a> {
     config: ArchiveConfig<'a>,
     removals: Vec<String>,
+    removed_members: FxHashSet<usize>,
     additions: Vec<Addition>,
     should_update_symbols: bool,
     src_archive: Option<Option<ArchiveRO>>,
@@ -56,6 +58,7 @@ impl<'a> ArchiveBuilder<'a> {
         ArchiveBuilder {
             config,
             removals: Vec::new(),
+            removed_members: FxHashSet::default(),
             additions: Vec::new(),
             should_update_symbols: false,
             src_archive: None,
@@ -67,6 +70,13 @@ impl<'a> ArchiveBuilder<'a> {
         self.removals.push(file.to_string());
     }
 
+    /// Removes the member at `index` of the source archive, counting in the
+    /// order `ArchiveRO::iter` yields them, but not other members of the same
+    /// name.
+    pub fn remove_member(&mut self, index: usize) {
+        self.removed_members.insert(index);
+    }
+
     /// Lists all files in an archive
     pub fn src_files(&mut self) -> Vec<String> {
         if self.src_archive().is_none() {
@@ -75,8 +85,11 @@ impl<'a> ArchiveBuilder<'a> {
 
         let archive = self.src_archive.as_ref().unwrap().as_ref().unwrap();
 
+        let removed_members = &self.removed_members;
         archive.iter()
-               .filter_map(|child| child.ok())
+               .enumerate()
+               .filter(|&(i, _)| !removed_members.contains(&i))
+               .filter_map(|(_, child)| child.ok())
                .filter(is_relevant_child)
                .filter_map(|child| child.name())
                .filter(|name| !self.removals.iter().any(|x| x == name))
@@ -190,6 +203,7 @@ impl<'a> ArchiveBuilder<'a> {
 
     fn build_with_llvm(&mut self, kind: ArchiveKind) -> io::Result<()> {
         let removals = mem::replace(&mut self.removals, Vec::new());
+        let removed_members = mem::replace(&mut self.removed_members, FxHashSet::default());
         let mut additions = mem::replace(&mut self.additions, Vec::new());
         let mut strings = Vec::new();
         let mut members = Vec::new();
@@ -199,13 +213,14 @@ impl<'a> ArchiveBuilder<'a> {
 
         unsafe {
             if let Some(archive) = self.src_archive() {
-                for child in archive.iter() {
+                for (i, child) in archive.iter().enumerate() {
                     let child = child.map_err(string_to_io_error)?;
                     let child_name = match child.name() {
                         Some(s) => s,
                         None => continue,
                     };
-                    if removals.iter().any(|r| r == child_name) {
+                    if removals.iter().any(|r| r == child_name) ||
+                       removed_members.contains(&i) {
                         continue
                     }
 
@@ -258,18 +273,15 @@ impl<'a> ArchiveBuilder<'a> {
                 }
             }
 
+            llvm::clear_errors();
             let r = llvm::LLVMRustWriteArchive(dst.as_ptr(),
                                                members.len() as libc::size_t,
                                                members.as_ptr() as *const &_,
                                                should_update_symbols,
                                                kind);
             let ret = if r.into_result().is_err() {
-                let err = llvm::LLVMRustGetLastError();
-                let msg = if err.is_null() {
-                    "failed to write archive".into()
-                } else {
-                    String::from_utf8_lossy(CStr::from_ptr(err).to_bytes())
-                };
+                let msg = llvm::last_error()
+                    .unwrap_or_else(|| "failed to write archive".to_owned());
                 Err(io::Error::new(io::ErrorKind::Other, msg))
             } else {
                 Ok(())
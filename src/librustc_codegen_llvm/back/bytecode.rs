@@ -6,6 +6,10 @@
 //! elsewhere, so we currently compress the bytecode via deflate to avoid taking
 //! up too much space on disk.
 //!
+//! This is the only place bitcode is stored compressed: it's inflated again in
+//! `back::lto` as each rlib is read, so LLVM itself only ever sees plain
+//! bitcode and doesn't need a compressed format of its own.
+//!
 //! After compressing the bytecode we then have the rest of the format to
 //! basically deal with various bugs in various archive implementations. The
 //! format currently is:
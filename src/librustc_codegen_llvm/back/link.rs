@@ -1,14 +1,16 @@
 use super::archive::{ArchiveBuilder, ArchiveConfig};
 use super::bytecode::RLIB_BYTECODE_EXTENSION;
+use super::lto;
 use super::rpath::RPathConfig;
 use super::rpath;
 use crate::back::wasm;
 use crate::metadata::METADATA_FILENAME;
 use crate::context::get_reloc_model;
 use crate::llvm;
+use crate::llvm::archive_ro::ArchiveRO;
 use rustc_codegen_ssa::back::linker::Linker;
 use rustc_codegen_ssa::back::link::{remove, ignored_for_lto, each_linked_rlib, linker_and_flavor,
-    get_linker};
+    get_linker, native_bitcode_in_lto, relevant_lib};
 use rustc_codegen_ssa::back::command::Command;
 use rustc::session::config::{self, DebugInfo, OutputFilenames, OutputType, PrintRequest};
 use rustc::session::config::{RUST_CGU_EXT, Lto, Sanitizer};
@@ -35,7 +37,6 @@ use std::iter;
 use std::path::{Path, PathBuf};
 use std::process::{Output, Stdio};
 use std::str;
-use syntax::attr;
 
 pub use rustc_codegen_utils::link::{find_crate_name, filename_for_input, default_output_for_target,
                                     invalid_output_for_target, filename_for_metadata,
@@ -1320,10 +1321,23 @@ fn add_upstream_rust_crates(cmd: &mut dyn Linker,
         let name = cratepath.file_name().unwrap().to_str().unwrap();
         let name = &name[3..name.len() - 5]; // chop off lib/.rlib
 
+        // The native bitcode that's already part of the LTO module.
+        let native_bitcode = if native_bitcode_in_lto(sess, &codegen_results.crate_info, cnum) {
+            let archive = ArchiveRO::open(cratepath).expect("wanted an rlib");
+            lto::native_lto_bitcode(&archive)
+                .map(|(index, _, _)| index)
+                .collect()
+        } else {
+            Vec::new()
+        };
+
         time(sess, &format!("altering {}.rlib", name), || {
             let cfg = archive_config(sess, &dst, Some(cratepath));
             let mut archive = ArchiveBuilder::new(cfg);
             archive.update_symbols();
+            for &index in &native_bitcode {
+                archive.remove_member(index);
+            }
 
             let mut any_objects = false;
             for f in archive.src_files() {
@@ -1478,13 +1492,6 @@ fn add_upstream_native_libraries(cmd: &mut dyn Linker,
     }
 }
 
-fn relevant_lib(sess: &Session, lib: &NativeLibrary) -> bool {
-    match lib.cfg {
-        Some(ref cfg) => attr::cfg_matches(cfg, &sess.parse_sess, None),
-        None => true,
-    }
-}
-
 fn are_upstream_rust_objects_already_included(sess: &Session) -> bool {
     match sess.lto() {
         Lto::Fat => true,
@@ -1,6 +1,6 @@
 use crate::back::bytecode::{DecodedBytecode, RLIB_BYTECODE_EXTENSION};
-use crate::back::write::{self, DiagnosticHandlers, with_llvm_pmb, save_temp_bitcode,
-    to_llvm_opt_settings};
+use crate::back::write::{self, DiagnosticHandlers, RemarkStream, with_llvm_pmb,
+    save_temp_bitcode, to_llvm_opt_settings};
 use crate::llvm::archive_ro::ArchiveRO;
 use crate::llvm::{self, True, False};
 use crate::time_graph::Timeline;
@@ -14,12 +14,15 @@ use rustc::dep_graph::WorkProduct;
 use rustc::dep_graph::cgu_reuse_tracker::CguReuse;
 use rustc::hir::def_id::LOCAL_CRATE;
 use rustc::middle::exported_symbols::SymbolExportLevel;
-use rustc::session::config::{self, Lto};
+use rustc::session::config::{self, Lto, OutputType, RUST_CGU_EXT};
 use rustc::util::common::time_ext;
 use rustc_data_structures::fx::FxHashMap;
-use rustc_codegen_ssa::{ModuleCodegen, ModuleKind};
+use rustc_codegen_ssa::{CompiledModule, ModuleCodegen, ModuleKind};
+use rustc_fs_util::path_to_c_string;
 
 use std::ffi::{CStr, CString};
+use std::fs;
+use std::path::Path;
 use std::ptr;
 use std::slice;
 use std::sync::Arc;
@@ -96,7 +99,19 @@ fn prepare_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
             }
         }
 
-        for &(cnum, ref path) in cgcx.each_linked_rlib_for_lto.iter() {
+        // All rlibs are opened up front and at once, so that the file system
+        // round trips of each don't add up, and so that the kernel reads
+        // ahead in all of them while we're busy with the first. Only the
+        // bytecode is read ahead, as the objects and metadata aren't needed.
+        let paths = cgcx.each_linked_rlib_for_lto.iter()
+            .map(|&(_, ref path)| &**path)
+            .collect::<Vec<_>>();
+        let archives = ArchiveRO::open_many(&paths,
+                                            llvm::FileAccess::Random,
+                                            Some(RLIB_BYTECODE_EXTENSION))
+            .map_err(|e| diag_handler.fatal(&format!("failed to open rlibs for LTO: {}", e)))?;
+
+        for (&(cnum, ref path), archive) in cgcx.each_linked_rlib_for_lto.iter().zip(archives) {
             let exported_symbols = cgcx.exported_symbols
                 .as_ref().expect("needs exported symbols for LTO");
             symbol_white_list.extend(
@@ -104,7 +119,6 @@ fn prepare_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
                     .iter()
                     .filter_map(symbol_filter));
 
-            let archive = ArchiveRO::open(&path).expect("wanted an rlib");
             let bytecodes = archive.iter().filter_map(|child| {
                 child.ok().and_then(|c| c.name().map(|name| (name, c)))
             }).filter(|&(name, _)| name.ends_with(RLIB_BYTECODE_EXTENSION));
@@ -121,6 +135,38 @@ fn prepare_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
                 let bc = SerializedModule::FromRlib(bc);
                 upstream_modules.push((bc, CString::new(id).unwrap()));
             }
+
+            // Native bitcode can't be told apart by name, and is identified by
+            // the archive it came from instead, like the linker would. Members
+            // may share a name too, so their position is part of the name of
+            // their module.
+            //
+            // Anything the native bitcode defines may be used by objects of
+            // the same library which aren't part of LTO (assembly, for
+            // example), so none of it is internalized.
+            if cgcx.native_bitcode_for_lto.contains(&cnum) {
+                let file_name = path.file_name().unwrap().to_string_lossy();
+                for (index, name, data) in native_lto_bitcode(&archive) {
+                    info!("adding native bitcode {} at {}", name, index);
+                    let mut ok = false;
+                    llvm::clear_errors();
+                    let defined = llvm::build_string(|s| unsafe {
+                        ok = llvm::LLVMRustGetBitcodeDefinedSymbols(s, data.as_ptr(), data.len());
+                    }).map_err(|e| {
+                        diag_handler.fatal(&format!("invalid symbol name in {}: {}", name, e))
+                    })?;
+                    if !ok {
+                        let msg = format!("failed to read the symbols of {}", name);
+                        return Err(write::llvm_err(&diag_handler, &msg));
+                    }
+                    symbol_white_list.extend(defined.split('\0')
+                        .filter(|s| !s.is_empty())
+                        .map(|s| CString::new(s).unwrap()));
+                    let id = format!("{}({}@{})", file_name, name, index);
+                    let bc = SerializedModule::FromRlib(data.to_vec());
+                    upstream_modules.push((bc, CString::new(id).unwrap()));
+                }
+            }
             timeline.record(&format!("load: {}", path.display()));
         }
     }
@@ -128,6 +174,25 @@ fn prepare_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
     Ok((symbol_white_list, upstream_modules))
 }
 
+/// Returns the position, name and contents of each native object bundled into
+/// the rlib `archive` that is ThinLTO bitcode, such as what `clang -flto=thin`
+/// emits for a C library. rustc's own bitcode is stored in its encoded form
+/// instead, and its objects are excluded in case they're bitcode as well
+/// because of `-C linker-plugin-lto`. The position counts all members in the
+/// order `ArchiveRO::iter` yields them, as `ArchiveBuilder::remove_member`
+/// does, since a name can be shared with other members.
+pub(crate) fn native_lto_bitcode<'a>(archive: &'a ArchiveRO)
+    -> impl Iterator<Item = (usize, &'a str, &'a [u8])> + 'a
+{
+    let rust_object = format!(".{}.{}", RUST_CGU_EXT, OutputType::Object.extension());
+    archive.iter().enumerate().filter_map(|(i, child)| {
+        child.ok().and_then(|c| c.name().map(|name| (i, name, c.data())))
+    }).filter(move |&(_, name, data)| {
+        !name.ends_with(&rust_object) &&
+            unsafe { llvm::LLVMRustIsThinLTOBitcode(data.as_ptr(), data.len()) }
+    })
+}
+
 /// Performs fat LTO by merging all modules into a single one and returning it
 /// for further optimization.
 pub(crate) fn run_fat(cgcx: &CodegenContext<LlvmCodegenBackend>,
@@ -180,10 +245,11 @@ pub(crate) fn run_thin(cgcx: &CodegenContext<LlvmCodegenBackend>,
 }
 
 pub(crate) fn prepare_thin(
-    module: ModuleCodegen<ModuleLlvm>
+    module: ModuleCodegen<ModuleLlvm>,
+    config: &ModuleConfig,
 ) -> (String, ThinBuffer) {
     let name = module.name.clone();
-    let buffer = ThinBuffer::new(module.module_llvm.llmod());
+    let buffer = ThinBuffer::new(module.module_llvm.llmod(), config.thinlto_fold_functions);
     (name, buffer)
 }
 
@@ -294,17 +360,34 @@ fn fat_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
         // know much about the memory management here so we err on the side of being
         // save and persist everything with the original module.
         let mut linker = Linker::new(llmod);
-        for (bc_decoded, name) in serialized_modules {
-            info!("linking {:?}", name);
-            time_ext(cgcx.time_passes, None, &format!("ll link {:?}", name), || {
-                let data = bc_decoded.data();
-                linker.add(&data).map_err(|()| {
-                    let msg = format!("failed to load bc of {:?}", name);
-                    write::llvm_err(&diag_handler, &msg)
+        let threads = cgcx.opts.debugging_opts.lto_link_threads.unwrap_or(0);
+        if threads == 1 {
+            for (bc_decoded, name) in serialized_modules {
+                info!("linking {:?}", name);
+                time_ext(cgcx.time_passes, None, &format!("ll link {:?}", name), || {
+                    let data = bc_decoded.data();
+                    linker.add(&data).map_err(|()| {
+                        let msg = format!("failed to load bc of {:?}", name);
+                        write::llvm_err(&diag_handler, &msg)
+                    })
+                })?;
+                timeline.record(&format!("link {:?}", name));
+                serialized_bitcode.push(bc_decoded);
+            }
+        } else {
+            // Everything is parsed and linked in groups on several threads,
+            // and definitions nothing refers to which aren't exported are
+            // internalized along the way, so that they're never parsed.
+            info!("linking {} modules", serialized_modules.len());
+            linker.set_preserved_symbols(symbol_white_list);
+            serialized_bitcode.extend(serialized_modules.into_iter().map(|(bc, _)| bc));
+            time_ext(cgcx.time_passes, None, "ll link", || {
+                let data = serialized_bitcode.iter().map(|bc| bc.data()).collect::<Vec<_>>();
+                linker.add_batch(&data, threads).map_err(|()| {
+                    write::llvm_err(&diag_handler, "failed to link bc")
                 })
             })?;
-            timeline.record(&format!("link {:?}", name));
-            serialized_bitcode.push(bc_decoded);
+            timeline.record("link");
         }
         drop(linker);
         save_temp_bitcode(&cgcx, &module, "lto.input");
@@ -343,6 +426,7 @@ impl Linker<'a> {
 
     fn add(&mut self, bytecode: &[u8]) -> Result<(), ()> {
         unsafe {
+            llvm::clear_errors();
             if llvm::LLVMRustLinkerAdd(self.0,
                                        bytecode.as_ptr() as *const libc::c_char,
                                        bytecode.len()) {
@@ -352,6 +436,31 @@ impl Linker<'a> {
             }
         }
     }
+
+    fn set_preserved_symbols(&mut self, symbols: &[*const libc::c_char]) {
+        unsafe {
+            llvm::LLVMRustLinkerSetPreservedSymbols(self.0, symbols.as_ptr(), symbols.len());
+        }
+    }
+
+    fn add_batch(&mut self, bytecodes: &[&[u8]], threads: usize) -> Result<(), ()> {
+        let ptrs = bytecodes.iter()
+            .map(|bc| bc.as_ptr() as *const libc::c_char)
+            .collect::<Vec<_>>();
+        let lens = bytecodes.iter().map(|bc| bc.len()).collect::<Vec<_>>();
+        unsafe {
+            llvm::clear_errors();
+            if llvm::LLVMRustLinkerAddBatch(self.0,
+                                            ptrs.as_ptr(),
+                                            lens.as_ptr(),
+                                            bytecodes.len(),
+                                            threads as libc::c_uint) {
+                Ok(())
+            } else {
+                Err(())
+            }
+        }
+    }
 }
 
 impl Drop for Linker<'a> {
@@ -465,11 +574,23 @@ fn thin_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
         // tried-and-true interface we may wish to try to upstream some of this
         // to LLVM itself, right now we reimplement a lot of what they do
         // upstream...
+        // Negative limits leave LLVM's defaults in place.
+        let import_options = llvm::ThinLTOImportOptions {
+            instr_limit: -1,
+            hot_multiplier: -1.0,
+            critical_multiplier: -1.0,
+            cold_multiplier: -1.0,
+            merge_functions: cgcx.regular_module_config.thinlto_fold_functions as libc::c_int,
+            summary_threads: cgcx.opts.debugging_opts.thinlto_summary_threads
+                .unwrap_or(0) as libc::c_int,
+        };
+        llvm::clear_errors();
         let data = llvm::LLVMRustCreateThinLTOData(
             thin_modules.as_ptr(),
             thin_modules.len() as u32,
             symbol_white_list.as_ptr(),
             symbol_white_list.len() as u32,
+            &import_options,
         ).ok_or_else(|| {
             write::llvm_err(&diag_handler, "failed to prepare thin LTO context")
         })?;
@@ -477,6 +598,8 @@ fn thin_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
         info!("thin LTO data created");
         timeline.record("data");
 
+        prune_thin_lto_cache(cgcx, diag_handler);
+
         let import_map = if cgcx.incr_comp_session_dir.is_some() {
             ThinLTOImports::from_thin_lto_data(data)
         } else {
@@ -510,7 +633,8 @@ fn thin_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
 
             // If the module hasn't changed and none of the modules it imports
             // from has changed, we can re-use the post-ThinLTO version of the
-            // module.
+            // module. (What other modules need it to export can't change in
+            // that case, as functions are never folded in incremental builds.)
             if green_modules.contains_key(module_name) {
                 let imports_all_green = import_map.modules_imported_by(module_name)
                     .iter()
@@ -540,13 +664,16 @@ fn thin_lto(cgcx: &CodegenContext<LlvmCodegenBackend>,
 pub(crate) fn run_pass_manager(cgcx: &CodegenContext<LlvmCodegenBackend>,
                     module: &ModuleCodegen<ModuleLlvm>,
                     config: &ModuleConfig,
-                    thin: bool) {
+                    thin: bool) -> Result<(), FatalError> {
     // Now we have one massive module inside of llmod. Time to run the
     // LTO-specific optimization passes that LLVM provides.
     //
     // This code is based off the code found in llvm's LTO code generator:
     //      tools/lto/LTOCodeGenerator.cpp
     debug!("running the pass manager");
+    let diag_handler = cgcx.create_diag_handler();
+    let _remarks = RemarkStream::new(cgcx, &diag_handler, &*module.module_llvm.llcx,
+                                     &module.name, "lto.opt.yaml")?;
     unsafe {
         let pm = llvm::LLVMCreatePassManager();
         llvm::LLVMRustAddAnalysisPasses(module.module_llvm.tm, pm, module.module_llvm.llmod());
@@ -602,6 +729,7 @@ pub(crate) fn run_pass_manager(cgcx: &CodegenContext<LlvmCodegenBackend>,
         llvm::LLVMDisposePassManager(pm);
     }
     debug!("lto done");
+    Ok(())
 }
 
 pub struct ModuleBuffer(&'static mut llvm::ModuleBuffer);
@@ -662,9 +790,11 @@ unsafe impl Send for ThinBuffer {}
 unsafe impl Sync for ThinBuffer {}
 
 impl ThinBuffer {
-    pub fn new(m: &llvm::Module) -> ThinBuffer {
+    /// With `function_hashes`, identical functions of this module can be folded into those of
+    /// others by ThinLTO, which is done along with `-Z merge-functions`.
+    pub fn new(m: &llvm::Module, function_hashes: bool) -> ThinBuffer {
         unsafe {
-            let buffer = llvm::LLVMRustThinLTOBufferCreate(m);
+            let buffer = llvm::LLVMRustThinLTOBufferCreate(m, function_hashes);
             ThinBuffer(buffer)
         }
     }
@@ -703,7 +833,7 @@ pub unsafe fn optimize_thin_module(
     // into that context. One day, however, we may do this for upstream
     // crates but for locally codegened modules we may be able to reuse
     // that LLVM Context and Module.
-    let llcx = llvm::LLVMRustContextCreate(cgcx.fewer_names);
+    let llcx = llvm::LLVMRustContextAcquire(cgcx.fewer_names);
     let llmod_raw = parse_module(
         llcx,
         &thin_module.shared.module_names[thin_module.idx],
@@ -729,6 +859,7 @@ pub unsafe fn optimize_thin_module(
         // an error.
         let mut cu1 = ptr::null_mut();
         let mut cu2 = ptr::null_mut();
+        llvm::clear_errors();
         llvm::LLVMRustThinLTOGetDICompileUnit(llmod, &mut cu1, &mut cu2);
         if !cu2.is_null() {
             let msg = "multiple source DICompileUnits found";
@@ -751,24 +882,28 @@ pub unsafe fn optimize_thin_module(
         //
         // You can find some more comments about these functions in the LLVM
         // bindings we've got (currently `PassWrapper.cpp`)
+        llvm::clear_errors();
         if !llvm::LLVMRustPrepareThinLTORename(thin_module.shared.data.0, llmod) {
             let msg = "failed to prepare thin LTO module";
             return Err(write::llvm_err(&diag_handler, msg))
         }
         save_temp_bitcode(cgcx, &module, "thin-lto-after-rename");
         timeline.record("rename");
+        llvm::clear_errors();
         if !llvm::LLVMRustPrepareThinLTOResolveWeak(thin_module.shared.data.0, llmod) {
             let msg = "failed to prepare thin LTO module";
             return Err(write::llvm_err(&diag_handler, msg))
         }
         save_temp_bitcode(cgcx, &module, "thin-lto-after-resolve");
         timeline.record("resolve");
+        llvm::clear_errors();
         if !llvm::LLVMRustPrepareThinLTOInternalize(thin_module.shared.data.0, llmod) {
             let msg = "failed to prepare thin LTO module";
             return Err(write::llvm_err(&diag_handler, msg))
         }
         save_temp_bitcode(cgcx, &module, "thin-lto-after-internalize");
         timeline.record("internalize");
+        llvm::clear_errors();
         if !llvm::LLVMRustPrepareThinLTOImport(thin_module.shared.data.0, llmod) {
             let msg = "failed to prepare thin LTO module";
             return Err(write::llvm_err(&diag_handler, msg))
@@ -816,13 +951,152 @@ pub unsafe fn optimize_thin_module(
         // little differently.
         info!("running thin lto passes over {}", module.name);
         let config = cgcx.config(module.kind);
-        run_pass_manager(cgcx, &module, config, true);
+        run_pass_manager(cgcx, &module, config, true)?;
         save_temp_bitcode(cgcx, &module, "thin-lto-after-pm");
         timeline.record("thin-done");
     }
     Ok(module)
 }
 
+/// Whether everything codegen writes for a ThinLTO module is its object file,
+/// which is all that the cache of `-Z thinlto-cache-dir` keeps.
+fn thin_lto_output_is_cacheable(cgcx: &CodegenContext<LlvmCodegenBackend>,
+                                config: &ModuleConfig) -> bool {
+    config.emit_obj &&
+        !config.obj_is_bitcode &&
+        !config.no_integrated_as &&
+        !config.emit_bc &&
+        !config.emit_bc_compressed &&
+        !config.emit_ir &&
+        !config.emit_asm &&
+        !config.split_dwarf &&
+        !cgcx.save_temps &&
+        cgcx.opts.debugging_opts.optimization_records.is_none()
+}
+
+pub(crate) fn thin_lto_cache_key(cgcx: &CodegenContext<LlvmCodegenBackend>,
+                                 thin: &ThinModule<LlvmCodegenBackend>,
+                                 config: &ModuleConfig) -> Option<String> {
+    if cgcx.opts.debugging_opts.thinlto_cache_dir.is_none() ||
+       !thin_lto_output_is_cacheable(cgcx, config) {
+        return None
+    }
+    let tm = (cgcx.tm_factory.0)().ok()?;
+    let opt_level = config.opt_level.map(|x| to_llvm_opt_settings(x).0)
+        .unwrap_or(llvm::CodeGenOptLevel::None);
+
+    // LLVM's part of the key covers the bitcode, the ThinLTO analysis and the
+    // target machine. Everything else rustc tells LLVM is derived from the
+    // tracked options, so their hash and the compiler version are added.
+    let extra = CString::new(format!("{} {:x}",
+                                     option_env!("CFG_VERSION").unwrap_or("unknown"),
+                                     cgcx.opts.dep_tracking_hash())).unwrap();
+    let mut found = false;
+    let key = llvm::build_string(|s| unsafe {
+        found = llvm::LLVMRustThinLTOComputeCacheKey(
+            s,
+            thin.shared.data.0,
+            thin.shared.module_names[thin.idx].as_ptr(),
+            tm,
+            opt_level,
+            extra.as_ptr(),
+        );
+    });
+    unsafe {
+        llvm::LLVMRustDisposeTargetMachine(tm);
+    }
+    if !found {
+        return None
+    }
+    key.ok()
+}
+
+pub(crate) fn load_from_thin_lto_cache(cgcx: &CodegenContext<LlvmCodegenBackend>,
+                                       thin: &ThinModule<LlvmCodegenBackend>,
+                                       key: &str) -> Option<CompiledModule> {
+    let dir = cgcx.opts.debugging_opts.thinlto_cache_dir.as_ref()?;
+    let dir = path_to_c_string(Path::new(dir));
+    let key = CString::new(key).unwrap();
+    let obj_out = cgcx.output_filenames.temp_path(OutputType::Object, Some(thin.name()));
+    unsafe {
+        llvm::clear_errors();
+        let cache = llvm::LLVMRustThinLTOCacheCreate(dir.as_ptr())?;
+        let entry = llvm::LLVMRustThinLTOCacheLookup(cache, key.as_ptr());
+        llvm::LLVMRustThinLTOCacheFree(cache);
+        let entry = entry?;
+        let data = slice::from_raw_parts(llvm::LLVMGetBufferStart(entry) as *const u8,
+                                         llvm::LLVMGetBufferSize(entry));
+        let written = fs::write(&obj_out, data);
+        llvm::LLVMDisposeMemoryBuffer(entry);
+        written.ok()?;
+    }
+    info!(" - {}: taken from the ThinLTO cache", thin.name());
+    Some(CompiledModule {
+        name: thin.name().to_string(),
+        kind: ModuleKind::Regular,
+        object: Some(obj_out),
+        bytecode: None,
+        bytecode_compressed: None,
+        dwo: None,
+    })
+}
+
+pub(crate) fn store_in_thin_lto_cache(cgcx: &CodegenContext<LlvmCodegenBackend>,
+                                      diag_handler: &Handler,
+                                      module: &CompiledModule,
+                                      key: &str) {
+    let (dir, object) = match (&cgcx.opts.debugging_opts.thinlto_cache_dir, &module.object) {
+        (&Some(ref dir), &Some(ref object)) => (dir, object),
+        _ => return,
+    };
+    let error = match fs::read(object) {
+        Ok(data) => unsafe {
+            let dir = path_to_c_string(Path::new(dir));
+            let key = CString::new(key).unwrap();
+            llvm::clear_errors();
+            match llvm::LLVMRustThinLTOCacheCreate(dir.as_ptr()) {
+                Some(cache) => {
+                    let result = llvm::LLVMRustThinLTOCacheStore(
+                        cache, key.as_ptr(), data.as_ptr(), data.len());
+                    llvm::LLVMRustThinLTOCacheFree(cache);
+                    if result == llvm::LLVMRustResult::Success {
+                        return
+                    }
+                }
+                None => {}
+            }
+            llvm::last_error().unwrap_or_else(|| "unknown error".to_string())
+        },
+        Err(e) => e.to_string(),
+    };
+    diag_handler.warn(&format!("failed to add {} to the ThinLTO cache: {}",
+                               object.display(), error));
+}
+
+/// Removes old entries from the cache of `-Z thinlto-cache-dir`, following
+/// LLVM's default pruning policy.
+fn prune_thin_lto_cache(cgcx: &CodegenContext<LlvmCodegenBackend>, diag_handler: &Handler) {
+    let dir = match cgcx.opts.debugging_opts.thinlto_cache_dir {
+        Some(ref dir) => path_to_c_string(Path::new(dir)),
+        None => return,
+    };
+    unsafe {
+        llvm::clear_errors();
+        let pruned = match llvm::LLVMRustThinLTOCacheCreate(dir.as_ptr()) {
+            Some(cache) => {
+                let result = llvm::LLVMRustThinLTOCachePrune(cache, "\0".as_ptr() as *const _);
+                llvm::LLVMRustThinLTOCacheFree(cache);
+                result == llvm::LLVMRustResult::Success
+            }
+            None => false,
+        };
+        if !pruned {
+            let msg = llvm::last_error().unwrap_or_else(|| "unknown error".to_string());
+            diag_handler.warn(&format!("failed to prune the ThinLTO cache: {}", msg));
+        }
+    }
+}
+
 #[derive(Debug, Default)]
 pub struct ThinLTOImports {
     // key = llvm name of importing module, value = list of modules it imports from
@@ -836,28 +1110,41 @@ impl ThinLTOImports {
 
     /// Loads the ThinLTO import map from ThinLTOData.
     unsafe fn from_thin_lto_data(data: *const llvm::ThinLTOData) -> ThinLTOImports {
-        unsafe extern "C" fn imported_module_callback(payload: *mut libc::c_void,
-                                                      importing_module_name: *const libc::c_char,
-                                                      imported_module_name: *const libc::c_char) {
-            let map = &mut* (payload as *mut ThinLTOImports);
-            let importing_module_name = CStr::from_ptr(importing_module_name);
-            let importing_module_name = module_name_to_str(&importing_module_name);
-            let imported_module_name = CStr::from_ptr(imported_module_name);
-            let imported_module_name = module_name_to_str(&imported_module_name);
-
-            if !map.imports.contains_key(importing_module_name) {
-                map.imports.insert(importing_module_name.to_owned(), vec![]);
-            }
+        let mut graph = llvm::ThinLTOImportGraph {
+            num_modules: 0,
+            module_names: ptr::null(),
+            module_name_lens: ptr::null(),
+            edge_offsets: ptr::null(),
+            edges: ptr::null(),
+            guid_offsets: ptr::null(),
+            guids: ptr::null(),
+        };
+        llvm::LLVMRustThinLTOGetImportGraph(data, &mut graph);
 
-            map.imports
-               .get_mut(importing_module_name)
-               .unwrap()
-               .push(imported_module_name.to_owned());
-        }
         let mut map = ThinLTOImports::default();
-        llvm::LLVMRustGetThinLTOModuleImports(data,
-                                              imported_module_callback,
-                                              &mut map as *mut _ as *mut libc::c_void);
+        if graph.num_modules == 0 {
+            return map
+        }
+
+        let names = slice::from_raw_parts(graph.module_names, graph.num_modules);
+        let lens = slice::from_raw_parts(graph.module_name_lens, graph.num_modules);
+        let names = names.iter().zip(lens).map(|(&name, &len)| {
+            let bytes = slice::from_raw_parts(name as *const u8, len + 1);
+            module_name_to_str(CStr::from_bytes_with_nul_unchecked(bytes))
+        }).collect::<Vec<_>>();
+
+        let offsets = slice::from_raw_parts(graph.edge_offsets, graph.num_modules + 1);
+        let edges = slice::from_raw_parts(graph.edges, offsets[graph.num_modules] as usize);
+        for (i, importing_module_name) in names.iter().enumerate() {
+            let imported = &edges[offsets[i] as usize..offsets[i + 1] as usize];
+            if imported.is_empty() {
+                continue
+            }
+            map.imports.insert(
+                importing_module_name.to_string(),
+                imported.iter().map(|&m| names[m as usize].to_owned()).collect(),
+            );
+        }
         map
     }
 }
@@ -874,6 +1161,7 @@ fn parse_module<'a>(
     diag_handler: &Handler,
 ) -> Result<&'a llvm::Module, FatalError> {
     unsafe {
+        llvm::clear_errors();
         llvm::LLVMRustParseBitcodeForLTO(
             cx,
             data.as_ptr(),
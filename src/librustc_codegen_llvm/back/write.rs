@@ -11,7 +11,7 @@ use crate::type_::Type;
 use crate::context::{is_pie_binary, get_reloc_model};
 use crate::common;
 use crate::LlvmCodegenBackend;
-use rustc_codegen_ssa::back::write::{CodegenContext, ModuleConfig, run_assembler};
+use rustc_codegen_ssa::back::write::{CodegenContext, ModuleConfig, run_assembler, dwo_path};
 use rustc_codegen_ssa::traits::*;
 use rustc::hir::def_id::LOCAL_CRATE;
 use rustc::session::config::{self, OutputType, Passes, Lto};
@@ -28,6 +28,7 @@ use std::fs;
 use std::io::{self, Write};
 use std::path::Path;
 use std::str;
+use std::ptr;
 use std::sync::Arc;
 use std::slice;
 use libc::{c_uint, c_void, c_char, size_t};
@@ -49,6 +50,12 @@ pub const CODE_GEN_MODEL_ARGS: &[(&str, llvm::CodeModel)] = &[
     ("large", llvm::CodeModel::Large),
 ];
 
+pub const DEBUG_COMPRESSION_ARGS: &[(&str, llvm::DebugCompression)] = &[
+    ("none", llvm::DebugCompression::None),
+    ("zlib-gnu", llvm::DebugCompression::ZlibGnu),
+    ("zlib", llvm::DebugCompression::Zlib),
+];
+
 pub const TLS_MODEL_ARGS : [(&str, llvm::ThreadLocalMode); 4] = [
     ("global-dynamic", llvm::ThreadLocalMode::GeneralDynamic),
     ("local-dynamic", llvm::ThreadLocalMode::LocalDynamic),
@@ -57,9 +64,24 @@ pub const TLS_MODEL_ARGS : [(&str, llvm::ThreadLocalMode); 4] = [
 ];
 
 pub fn llvm_err(handler: &errors::Handler, msg: &str) -> FatalError {
-    match llvm::last_error() {
-        Some(err) => handler.fatal(&format!("{}: {}", msg, err)),
-        None => handler.fatal(&msg),
+    let mut errors = llvm::take_errors();
+    let last = match errors.pop() {
+        Some(err) => err,
+        None => return handler.fatal(&msg),
+    };
+    // Callers clear the errors before the call that failed (see
+    // `llvm::clear_errors`), so all of these are from that call. The earlier
+    // ones are often what caused the last one, e.g. each module that failed
+    // to load before ThinLTO gave up.
+    for err in errors {
+        match err.module {
+            Some(module) => handler.err(&format!("{}: {}", module, err.message)),
+            None => handler.err(&err.message),
+        }
+    }
+    match last.module {
+        Some(module) => handler.fatal(&format!("{}: {}: {}", msg, module, last.message)),
+        None => handler.fatal(&format!("{}: {}", msg, last.message)),
     }
 }
 
@@ -69,10 +91,19 @@ pub fn write_output_file(
         pm: &llvm::PassManager<'ll>,
         m: &'ll llvm::Module,
         output: &Path,
+        dwo_output: Option<&Path>,
         file_type: llvm::FileType) -> Result<(), FatalError> {
     unsafe {
         let output_c = path_to_c_string(output);
-        let result = llvm::LLVMRustWriteOutputFile(target, pm, m, output_c.as_ptr(), file_type);
+        llvm::clear_errors();
+        let result = match dwo_output {
+            Some(dwo_output) => {
+                let dwo_output_c = path_to_c_string(dwo_output);
+                llvm::LLVMRustWriteOutputFileWithDwo(target, pm, m, output_c.as_ptr(),
+                                                     dwo_output_c.as_ptr(), file_type)
+            }
+            None => llvm::LLVMRustWriteOutputFile(target, pm, m, output_c.as_ptr(), file_type),
+        };
         if result.into_result().is_err() {
             let msg = format!("could not write output to {}", output.display());
             Err(llvm_err(handler, &msg))
@@ -146,6 +177,21 @@ pub fn target_machine_factory(sess: &Session, optlvl: config::OptLevel, find_fea
         None => llvm::CodeModel::None,
     };
 
+    let debug_compression = match sess.opts.debugging_opts.compress_debug_sections {
+        Some(ref s) => {
+            match DEBUG_COMPRESSION_ARGS.iter().find(|arg| arg.0 == s) {
+                Some(x) => x.1,
+                _ => {
+                    sess.err(&format!("{:?} is not a valid debug section compression format",
+                                      s));
+                    sess.abort_if_errors();
+                    bug!();
+                }
+            }
+        }
+        None => llvm::DebugCompression::None,
+    };
+
     let features = attributes::llvm_target_features(sess).collect::<Vec<_>>();
     let mut singlethread = sess.target.target.options.singlethread;
 
@@ -170,6 +216,7 @@ pub fn target_machine_factory(sess: &Session, optlvl: config::OptLevel, find_fea
     let asm_comments = sess.asm_comments();
 
     Arc::new(move || {
+        llvm::clear_errors();
         let tm = unsafe {
             llvm::LLVMRustCreateTargetMachine(
                 triple.as_ptr(), cpu.as_ptr(), features.as_ptr(),
@@ -184,6 +231,7 @@ pub fn target_machine_factory(sess: &Session, optlvl: config::OptLevel, find_fea
                 singlethread,
                 asm_comments,
                 emit_stack_size_section,
+                debug_compression,
             )
         };
 
@@ -241,6 +289,62 @@ impl<'a> Drop for DiagnosticHandlers<'a> {
     }
 }
 
+/// Streams the optimization remarks emitted in a context to a YAML file of a module with
+/// `-Z optimization-records`, until dropped. Has to be created after, and so dropped before,
+/// the `DiagnosticHandlers` of the context, whose callback it passes everything else on to.
+///
+/// Each stage a module goes through writes its own file, named with `extension`:
+/// `opt.yaml` while optimizing, `lto.opt.yaml` during LTO and `codegen.opt.yaml` while
+/// generating code. That way no stage truncates the remarks of another one of the same module.
+pub struct RemarkStream<'a> {
+    llcx: Option<&'a llvm::Context>,
+}
+
+impl<'a> RemarkStream<'a> {
+    pub fn new(cgcx: &CodegenContext<LlvmCodegenBackend>,
+               handler: &Handler,
+               llcx: &'a llvm::Context,
+               module_name: &str,
+               extension: &str) -> Result<Self, FatalError> {
+        let filter = match cgcx.opts.debugging_opts.optimization_records {
+            Some(ref filter) => filter,
+            None => return Ok(RemarkStream { llcx: None }),
+        };
+        let path = cgcx.output_filenames.temp_path_ext(extension, Some(module_name));
+        let path_c = path_to_c_string(&path);
+        let filter_c = if filter.is_empty() {
+            None
+        } else {
+            Some(CString::new(filter.as_bytes()).unwrap())
+        };
+        let threshold = cgcx.opts.debugging_opts.remark_hotness_threshold;
+        unsafe {
+            llvm::clear_errors();
+            let streaming = llvm::LLVMRustContextStreamRemarks(
+                llcx,
+                path_c.as_ptr(),
+                filter_c.as_ref().map_or(ptr::null(), |filter| filter.as_ptr()),
+                threshold.is_some(),
+                threshold.unwrap_or(0) as u64);
+            if !streaming {
+                let msg = format!("could not write optimization records to {}", path.display());
+                return Err(llvm_err(handler, &msg));
+            }
+        }
+        Ok(RemarkStream { llcx: Some(llcx) })
+    }
+}
+
+impl<'a> Drop for RemarkStream<'a> {
+    fn drop(&mut self) {
+        if let Some(llcx) = self.llcx {
+            unsafe {
+                llvm::LLVMRustContextStopRemarks(llcx);
+            }
+        }
+    }
+}
+
 unsafe extern "C" fn report_inline_asm<'a, 'b>(cgcx: &'a CodegenContext<LlvmCodegenBackend>,
                                                msg: &'b str,
                                                cookie: c_uint) {
@@ -313,6 +417,7 @@ pub(crate) unsafe fn optimize(cgcx: &CodegenContext<LlvmCodegenBackend>,
     let llcx = &*module.module_llvm.llcx;
     let tm = &*module.module_llvm.tm;
     let _handlers = DiagnosticHandlers::new(cgcx, diag_handler, llcx);
+    let _remarks = RemarkStream::new(cgcx, diag_handler, llcx, &module.name, "opt.yaml")?;
 
     let module_name = module.name.clone();
     let module_name = Some(&module_name[..]);
@@ -451,11 +556,19 @@ pub(crate) unsafe fn codegen(cgcx: &CodegenContext<LlvmCodegenBackend>,
         let module_name = module.name.clone();
         let module_name = Some(&module_name[..]);
         let handlers = DiagnosticHandlers::new(cgcx, diag_handler, llcx);
+        let remarks = RemarkStream::new(cgcx, diag_handler, llcx, &module.name,
+                                        "codegen.opt.yaml")?;
 
         if cgcx.msvc_imps_needed {
             create_msvc_imps(cgcx, llcx, llmod);
         }
 
+        // Done for every module, whether it went through LTO or not, right
+        // before emitting it.
+        if config.profile_section_prefixes {
+            llvm::LLVMRustSetProfileSectionPrefixes(llmod);
+        }
+
         // A codegen-specific pass manager is used to generate object
         // files for an LLVM module.
         //
@@ -494,7 +607,7 @@ pub(crate) unsafe fn codegen(cgcx: &CodegenContext<LlvmCodegenBackend>,
 
 
         if write_bc || config.emit_bc_compressed || config.embed_bitcode {
-            let thin = ThinBuffer::new(llmod);
+            let thin = ThinBuffer::new(llmod, config.thinlto_fold_functions);
             let data = thin.data();
             timeline.record("make-bc");
 
@@ -578,15 +691,21 @@ pub(crate) unsafe fn codegen(cgcx: &CodegenContext<LlvmCodegenBackend>,
                     llmod
                 };
                 with_codegen(tm, llmod, config.no_builtins, |cpm| {
-                    write_output_file(diag_handler, tm, cpm, llmod, &path,
+                    write_output_file(diag_handler, tm, cpm, llmod, &path, None,
                                       llvm::FileType::AssemblyFile)
                 })?;
                 timeline.record("asm");
             }
 
             if write_obj {
+                let dwo_out = if config.split_dwarf {
+                    Some(dwo_path(&cgcx.output_filenames, &module.name))
+                } else {
+                    None
+                };
                 with_codegen(tm, llmod, config.no_builtins, |cpm| {
                     write_output_file(diag_handler, tm, cpm, llmod, &obj_out,
+                                      dwo_out.as_ref().map(|p| &**p),
                                       llvm::FileType::ObjectFile)
                 })?;
                 timeline.record("obj");
@@ -617,11 +736,16 @@ pub(crate) unsafe fn codegen(cgcx: &CodegenContext<LlvmCodegenBackend>,
             }
         }
 
+        drop(remarks);
         drop(handlers);
     }
+    // Only object files LLVM writes itself have their debug info split off.
+    let emit_dwo = config.split_dwarf && config.emit_obj && !config.obj_is_bitcode &&
+        !config.no_integrated_as;
     Ok(module.into_compiled_module(config.emit_obj,
                                    config.emit_bc,
                                    config.emit_bc_compressed,
+                                   emit_dwo,
                                    &cgcx.output_filenames))
 }
 
@@ -688,7 +812,6 @@ pub unsafe fn with_llvm_pmb(llmod: &llvm::Module,
                             opt_level: llvm::CodeGenOptLevel,
                             prepare_for_thin_lto: bool,
                             f: &mut dyn FnMut(&llvm::PassManagerBuilder)) {
-    use std::ptr;
 
     // Create the PassManagerBuilder for LLVM. We configure it with
     // reasonable defaults and prepare it to actually populate the pass
@@ -709,6 +832,12 @@ pub unsafe fn with_llvm_pmb(llmod: &llvm::Module,
         Some(CString::new(config.pgo_use.as_bytes()).unwrap())
     };
 
+    let pgo_sample_use_path = if config.pgo_sample_use.is_empty() {
+        None
+    } else {
+        Some(CString::new(config.pgo_sample_use.as_bytes()).unwrap())
+    };
+
     llvm::LLVMRustConfigurePassManagerBuilder(
         builder,
         opt_level,
@@ -718,6 +847,8 @@ pub unsafe fn with_llvm_pmb(llmod: &llvm::Module,
         prepare_for_thin_lto,
         pgo_gen_path.as_ref().map_or(ptr::null(), |s| s.as_ptr()),
         pgo_use_path.as_ref().map_or(ptr::null(), |s| s.as_ptr()),
+        pgo_sample_use_path.as_ref().map_or(ptr::null(), |s| s.as_ptr()),
+        config.hot_cold_split,
     );
 
     llvm::LLVMPassManagerBuilderSetSizeLevel(builder, opt_size as u32);
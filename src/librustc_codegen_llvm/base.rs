@@ -193,6 +193,11 @@ pub fn compile_codegen_unit<'a, 'tcx>(tcx: TyCtxt<'a, 'tcx, 'tcx>,
                 }
             }
 
+            cx.append_global_asm();
+
+            // Only once all uses of the multiversioned functions exist
+            cx.multiversion_functions();
+
             // Create the llvm.used variable
             // This variable has type [N x i8*] and is stored in the llvm.metadata section
             if !cx.used_statics().borrow().is_empty() {
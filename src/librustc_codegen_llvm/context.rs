@@ -10,7 +10,7 @@ use crate::monomorphize::partitioning::CodegenUnit;
 use crate::type_::Type;
 use crate::type_of::PointeeInfo;
 use rustc_codegen_ssa::traits::*;
-use libc::c_uint;
+use libc::{c_uint, c_char};
 
 use rustc_data_structures::base_n;
 use rustc_data_structures::small_c_str::SmallCStr;
@@ -25,12 +25,12 @@ use rustc_codegen_ssa::callee::resolve_and_get_fn;
 use rustc_codegen_ssa::base::wants_msvc_seh;
 use crate::callee::get_fn;
 
-use std::ffi::CStr;
+use std::ffi::{CStr, CString};
 use std::cell::{Cell, RefCell};
 use std::iter;
 use std::str;
 use std::sync::Arc;
-use syntax::symbol::LocalInternedString;
+use syntax::symbol::{LocalInternedString, Symbol};
 use crate::abi::Abi;
 
 /// There is one `CodegenCx` per compilation unit. Each one has its own LLVM
@@ -78,6 +78,10 @@ pub struct CodegenCx<'ll, 'tcx: 'll> {
     /// See <http://llvm.org/docs/LangRef.html#the-llvm-used-global-variable> for details
     pub used_statics: RefCell<Vec<&'ll Value>>,
 
+    /// Module level assembly from `global_asm!`, in the order it was
+    /// encountered.
+    pub global_asm: RefCell<Vec<Symbol>>,
+
     pub lltypes: RefCell<FxHashMap<(Ty<'tcx>, Option<VariantIdx>), &'ll Type>>,
     pub scalar_lltypes: RefCell<FxHashMap<Ty<'tcx>, &'ll Type>>,
     pub pointee_infos: RefCell<FxHashMap<(Ty<'tcx>, Size), Option<PointeeInfo>>>,
@@ -293,6 +297,7 @@ impl<'ll, 'tcx> CodegenCx<'ll, 'tcx> {
             const_globals: Default::default(),
             statics_to_rauw: RefCell::new(Vec::new()),
             used_statics: RefCell::new(Vec::new()),
+            global_asm: RefCell::new(Vec::new()),
             lltypes: Default::default(),
             scalar_lltypes: Default::default(),
             pointee_infos: Default::default(),
@@ -457,6 +462,73 @@ impl MiscMethods<'tcx> for CodegenCx<'ll, 'tcx> {
 }
 
 impl CodegenCx<'b, 'tcx> {
+    /// Appends the assembly collected by `codegen_global_asm` to the module.
+    crate fn append_global_asm(&self) {
+        let asm = self.global_asm.borrow();
+        if asm.is_empty() {
+            return
+        }
+        let asm = asm.iter().map(|s| s.as_str()).collect::<Vec<_>>();
+        let ptrs = asm.iter().map(|s| s.as_ptr() as *const c_char).collect::<Vec<_>>();
+        let lens = asm.iter().map(|s| s.len()).collect::<Vec<_>>();
+        unsafe {
+            llvm::LLVMRustAppendModuleInlineAsmBulk(self.llmod,
+                                                    ptrs.as_ptr(),
+                                                    lens.as_ptr(),
+                                                    ptrs.len());
+        }
+    }
+
+    /// Multiversions the functions `-Z multiversion` asks for which are defined
+    /// in this module, see `LLVMRustMultiversionFunction`. Each
+    /// `SYMBOL=FEATURES@CONDITION` adds a version of `SYMBOL` compiled with
+    /// `FEATURES`, which is called if the `extern "C" fn() -> u32` `CONDITION`
+    /// returns non-zero. Versions are tried in the order they're given in.
+    crate fn multiversion_functions(&self) {
+        let mut functions: Vec<(&str, &'b Value, Vec<CString>, Vec<&'b Value>)> = Vec::new();
+        for spec in &self.sess().opts.debugging_opts.multiversion {
+            let (symbol, features, condition) = config::parse_multiversion_spec(spec).unwrap();
+            let f = match self.get_defined_value(symbol) {
+                Some(f) => f,
+                None => continue,
+            };
+            if unsafe { llvm::LLVMIsAGlobalVariable(f).is_some() } {
+                self.sess().err(&format!("can't multiversion `{}`, it isn't a function", symbol));
+                continue;
+            }
+            let condition = self.get_declared_value(condition).unwrap_or_else(|| {
+                self.declare_cfn(condition, self.type_func(&[], self.type_i32()))
+            });
+            let i = match functions.iter().position(|&(s, ..)| s == symbol) {
+                Some(i) => i,
+                None => {
+                    functions.push((symbol, f, Vec::new(), Vec::new()));
+                    functions.len() - 1
+                }
+            };
+            functions[i].2.push(CString::new(features).unwrap());
+            functions[i].3.push(condition);
+        }
+
+        for (symbol, f, features, conditions) in functions {
+            let features = features.iter().map(|f| f.as_ptr()).collect::<Vec<_>>();
+            // Dispatch through a function rather than an ifunc, which only
+            // works for ELF.
+            llvm::clear_errors();
+            let dispatch = unsafe {
+                llvm::LLVMRustMultiversionFunction(f,
+                                                   features.as_ptr(),
+                                                   conditions.as_ptr(),
+                                                   features.len(),
+                                                   false)
+            };
+            if dispatch.is_none() {
+                let msg = llvm::last_error().unwrap_or_else(|| "unknown error".to_owned());
+                self.sess().err(&format!("failed to multiversion `{}`: {}", symbol, msg));
+            }
+        }
+    }
+
     crate fn get_intrinsic(&self, key: &str) -> &'b Value {
         if let Some(v) = self.intrinsics.borrow().get(key).cloned() {
             return v;
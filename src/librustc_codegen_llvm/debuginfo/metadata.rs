@@ -845,7 +845,12 @@ pub fn compile_unit_metadata(tcx: TyCtxt<'_, '_, '_>,
     let work_dir = SmallCStr::new(&tcx.sess.working_dir.0.to_string_lossy());
     let producer = CString::new(producer).unwrap();
     let flags = "\0";
-    let split_name = "\0";
+    let split_name = if tcx.sess.opts.debugging_opts.split_dwarf {
+        let dwo = rustc_codegen_ssa::back::write::dwo_path(&tcx.output_filenames(LOCAL_CRATE), codegen_unit_name);
+        path_to_c_string(&dwo)
+    } else {
+        CString::new("").unwrap()
+    };
     let kind = DebugEmissionKind::from_generic(tcx.sess.opts.debuginfo);
 
     unsafe {
@@ -860,7 +865,7 @@ pub fn compile_unit_metadata(tcx: TyCtxt<'_, '_, '_>,
             tcx.sess.opts.optimize != config::OptLevel::No,
             flags.as_ptr() as *const _,
             0,
-            split_name.as_ptr() as *const _,
+            split_name.as_ptr(),
             kind);
 
         if tcx.sess.opts.debugging_opts.profile {
@@ -1796,35 +1801,42 @@ fn set_members_of_composite_type(cx: &CodegenCx<'ll, 'tcx>,
         }
     }
 
-    let member_metadata: Vec<_> = member_descriptions
-        .into_iter()
-        .map(|member_description| {
-            let member_name = CString::new(member_description.name).unwrap();
-            unsafe {
-                Some(llvm::LLVMRustDIBuilderCreateVariantMemberType(
-                    DIB(cx),
-                    composite_type_metadata,
-                    member_name.as_ptr(),
-                    unknown_file_metadata(cx),
-                    UNKNOWN_LINE_NUMBER,
-                    member_description.size.bits(),
-                    member_description.align.bits() as u32,
-                    member_description.offset.bits(),
-                    match member_description.discriminant {
-                        None => None,
-                        Some(value) => Some(cx.const_u64(value)),
-                    },
-                    member_description.flags,
-                    member_description.type_metadata))
+    // The members are only created once the builder is finalized, and only
+    // if the composite type is still reachable from the module by then.
+    let member_names: Vec<_> = member_descriptions
+        .iter()
+        .map(|member_description| CString::new(&member_description.name[..]).unwrap())
+        .collect();
+    let members: Vec<_> = member_descriptions
+        .iter()
+        .zip(&member_names)
+        .map(|(member_description, member_name)| {
+            llvm::debuginfo::DIMember {
+                name: member_name.as_ptr(),
+                file: unknown_file_metadata(cx),
+                line_no: UNKNOWN_LINE_NUMBER,
+                size_in_bits: member_description.size.bits(),
+                align_in_bits: member_description.align.bits() as u32,
+                offset_in_bits: member_description.offset.bits(),
+                flags: member_description.flags,
+                ty: member_description.type_metadata,
+                discriminant: match member_description.discriminant {
+                    None => None,
+                    Some(value) => Some(cx.const_u64(value)),
+                },
+                is_variant: true,
             }
         })
         .collect();
 
     let type_params = compute_type_parameters(cx, composite_type);
     unsafe {
-        let type_array = create_DIArray(DIB(cx), &member_metadata[..]);
-        llvm::LLVMRustDICompositeTypeReplaceArrays(
-            DIB(cx), composite_type_metadata, Some(type_array), type_params);
+        llvm::LLVMRustDIBuilderDeferMembers(
+            DIB(cx), composite_type_metadata, members.as_ptr(), members.len());
+        if type_params.is_some() {
+            llvm::LLVMRustDICompositeTypeReplaceArrays(
+                DIB(cx), composite_type_metadata, None, type_params);
+        }
     }
 }
 
@@ -203,10 +203,33 @@ impl WriteBackendMethods for LlvmCodegenBackend {
     ) -> Result<CompiledModule, FatalError> {
         back::write::codegen(cgcx, diag_handler, module, config, timeline)
     }
+    fn thin_lto_cache_key(
+        cgcx: &CodegenContext<Self>,
+        thin: &ThinModule<Self>,
+        config: &ModuleConfig,
+    ) -> Option<String> {
+        back::lto::thin_lto_cache_key(cgcx, thin, config)
+    }
+    fn load_from_thin_lto_cache(
+        cgcx: &CodegenContext<Self>,
+        thin: &ThinModule<Self>,
+        key: &str,
+    ) -> Option<CompiledModule> {
+        back::lto::load_from_thin_lto_cache(cgcx, thin, key)
+    }
+    fn store_in_thin_lto_cache(
+        cgcx: &CodegenContext<Self>,
+        diag_handler: &Handler,
+        module: &CompiledModule,
+        key: &str,
+    ) {
+        back::lto::store_in_thin_lto_cache(cgcx, diag_handler, module, key)
+    }
     fn prepare_thin(
-        module: ModuleCodegen<Self::Module>
+        module: ModuleCodegen<Self::Module>,
+        config: &ModuleConfig,
     ) -> (String, Self::ThinBuffer) {
-        back::lto::prepare_thin(module)
+        back::lto::prepare_thin(module, config)
     }
     fn serialize_module(
         module: ModuleCodegen<Self::Module>
@@ -218,7 +241,7 @@ impl WriteBackendMethods for LlvmCodegenBackend {
         module: &ModuleCodegen<Self::Module>,
         config: &ModuleConfig,
         thin: bool
-    ) {
+    ) -> Result<(), FatalError> {
         back::lto::run_pass_manager(cgcx, module, config, thin)
     }
 }
@@ -368,7 +391,7 @@ unsafe impl Sync for ModuleLlvm { }
 impl ModuleLlvm {
     fn new(tcx: TyCtxt<'_, '_, '_>, mod_name: &str) -> Self {
         unsafe {
-            let llcx = llvm::LLVMRustContextCreate(tcx.sess.fewer_names());
+            let llcx = llvm::LLVMRustContextAcquire(tcx.sess.fewer_names());
             let llmod_raw = context::create_module(tcx, llcx, mod_name) as *const _;
 
             ModuleLlvm {
@@ -386,7 +409,7 @@ impl ModuleLlvm {
         handler: &Handler,
     ) -> Result<Self, FatalError> {
         unsafe {
-            let llcx = llvm::LLVMRustContextCreate(cgcx.fewer_names);
+            let llcx = llvm::LLVMRustContextAcquire(cgcx.fewer_names);
             let llmod_raw = buffer.parse(name, llcx, handler)?;
             let tm = match (cgcx.tm_factory.0)() {
                 Ok(m) => m,
@@ -414,7 +437,8 @@ impl ModuleLlvm {
 impl Drop for ModuleLlvm {
     fn drop(&mut self) {
         unsafe {
-            llvm::LLVMContextDispose(&mut *(self.llcx as *mut _));
+            llvm::LLVMRustContextRelease(&mut *(self.llcx as *mut _),
+                                         Some(&mut *(self.llmod_raw as *mut _)));
             llvm::LLVMRustDisposeTargetMachine(&mut *(self.tm as *mut _));
         }
     }
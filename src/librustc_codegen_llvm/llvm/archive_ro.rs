@@ -1,9 +1,12 @@
 //! A wrapper around LLVM's archive (.a) code
 
+use std::ffi::CString;
 use std::path::Path;
+use std::ptr;
 use std::slice;
 use std::str;
 use rustc_fs_util::path_to_c_string;
+use super::{FileAccess, LLVMRustResult};
 
 pub struct ArchiveRO {
     pub raw: &'static mut super::Archive,
@@ -29,6 +32,7 @@ impl ArchiveRO {
     pub fn open(dst: &Path) -> Result<ArchiveRO, String> {
         return unsafe {
             let s = path_to_c_string(dst);
+            super::clear_errors();
             let ar = super::LLVMRustOpenArchive(s.as_ptr()).ok_or_else(|| {
                 super::last_error().unwrap_or_else(|| "failed to open archive".to_owned())
             })?;
@@ -36,6 +40,60 @@ impl ArchiveRO {
         };
     }
 
+    /// Same as `open`, except that the archive is always mapped into memory
+    /// and the kernel is told that it's going to be read as `access` says.
+    /// The children whose names end with `prefetch`, if any, are read ahead
+    /// right away as well.
+    pub fn open_with_access(dst: &Path,
+                            access: FileAccess,
+                            prefetch: Option<&str>) -> Result<ArchiveRO, String> {
+        unsafe {
+            let s = path_to_c_string(dst);
+            let prefetch = prefetch.map(|p| CString::new(p).unwrap());
+            super::clear_errors();
+            let ar = super::LLVMRustOpenArchiveWithAccess(
+                s.as_ptr(),
+                access,
+                prefetch.as_ref().map_or(ptr::null(), |p| p.as_ptr()),
+            ).ok_or_else(|| {
+                super::last_error().unwrap_or_else(|| "failed to open archive".to_owned())
+            })?;
+            Ok(ArchiveRO { raw: ar })
+        }
+    }
+
+    /// Opens all archives in `dsts` like `open_with_access`, concurrently.
+    pub fn open_many(dsts: &[&Path],
+                     access: FileAccess,
+                     prefetch: Option<&str>) -> Result<Vec<ArchiveRO>, String> {
+        unsafe {
+            let paths = dsts.iter().map(|p| path_to_c_string(p)).collect::<Vec<_>>();
+            let ptrs = paths.iter().map(|p| p.as_ptr()).collect::<Vec<_>>();
+            let prefetch = prefetch.map(|p| CString::new(p).unwrap());
+            let mut archives = dsts.iter().map(|_| None).collect::<Vec<_>>();
+            super::clear_errors();
+            let result = super::LLVMRustOpenArchives(
+                ptrs.as_ptr(),
+                ptrs.len(),
+                access,
+                prefetch.as_ref().map_or(ptr::null(), |p| p.as_ptr()),
+                archives.as_mut_ptr(),
+            );
+            if let LLVMRustResult::Failure = result {
+                let errors = super::take_errors().into_iter().map(|e| match e.module {
+                    Some(path) => format!("{}: {}", path, e.message),
+                    None => e.message,
+                }).collect::<Vec<_>>();
+                return Err(if errors.is_empty() {
+                    "failed to open archives".to_owned()
+                } else {
+                    errors.join("\n")
+                })
+            }
+            Ok(archives.into_iter().map(|raw| ArchiveRO { raw: raw.unwrap() }).collect())
+        }
+    }
+
     pub fn iter(&self) -> Iter<'_> {
         unsafe {
             Iter {
@@ -58,6 +116,7 @@ impl<'a> Iterator for Iter<'a> {
 
     fn next(&mut self) -> Option<Result<Child<'a>, String>> {
         unsafe {
+            super::clear_errors();
             match super::LLVMRustArchiveIteratorNext(self.raw) {
                 Some(raw) => Some(Ok(Child { raw })),
                 None => super::last_error().map(Err),
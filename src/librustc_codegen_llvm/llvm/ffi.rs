@@ -2,7 +2,7 @@ use super::debuginfo::{
     DIBuilder, DIDescriptor, DIFile, DILexicalBlock, DISubprogram, DIType,
     DIBasicType, DIDerivedType, DICompositeType, DIScope, DIVariable,
     DIGlobalVariableExpression, DIArray, DISubrange, DITemplateTypeParameter, DIEnumerator,
-    DINameSpace, DIFlags, DISPFlags, DebugEmissionKind,
+    DINameSpace, DIFlags, DISPFlags, DebugEmissionKind, DIMember,
 };
 
 use libc::{c_uint, c_int, size_t, c_char};
@@ -117,6 +117,26 @@ pub enum Attribute {
     ReturnsTwice    = 25,
 }
 
+/// LLVMRustAttributeSpecKind
+#[repr(C)]
+#[derive(Copy, Clone, Debug)]
+pub enum AttributeSpecKind {
+    Enum,
+    Alignment,
+    Dereferenceable,
+    DereferenceableOrNull,
+}
+
+/// LLVMRustAttributeSpec
+#[repr(C)]
+#[derive(Copy, Clone, Debug)]
+pub struct AttributeSpec {
+    pub index: c_uint,
+    pub kind: AttributeSpecKind,
+    pub attr: Attribute,
+    pub value: u64,
+}
+
 /// LLVMIntPredicate
 #[derive(Copy, Clone)]
 #[repr(C)]
@@ -334,6 +354,16 @@ impl SynchronizationScope {
     }
 }
 
+/// LLVMRustSaturatingOp
+#[derive(Copy, Clone)]
+#[repr(C)]
+pub enum SaturatingOp {
+    SAdd,
+    UAdd,
+    SSub,
+    USub,
+}
+
 /// LLVMRustFileType
 #[derive(Copy, Clone)]
 #[repr(C)]
@@ -383,6 +413,15 @@ impl AsmDialect {
     }
 }
 
+/// LLVMRustDebugCompression
+#[derive(Copy, Clone, PartialEq)]
+#[repr(C)]
+pub enum DebugCompression {
+    None,
+    ZlibGnu,
+    Zlib,
+}
+
 /// LLVMRustCodeGenOptLevel
 #[derive(Copy, Clone, PartialEq)]
 #[repr(C)]
@@ -396,6 +435,71 @@ pub enum CodeGenOptLevel {
     Aggressive,
 }
 
+/// LLVMRustFunctionTier
+#[derive(Copy, Clone, PartialEq)]
+#[repr(C)]
+pub enum FunctionTier {
+    Normal,
+    Hot,
+    Cold,
+    None,
+}
+
+/// LLVMRustPassBuilderOptLevel
+#[derive(Copy, Clone, PartialEq)]
+#[repr(C)]
+pub enum PassBuilderOptLevel {
+    O0,
+    O1,
+    O2,
+    O3,
+    Os,
+    Oz,
+}
+
+/// LLVMRustOptStage
+#[derive(Copy, Clone, PartialEq)]
+#[repr(C)]
+pub enum OptStage {
+    PreLinkNoLTO,
+    PreLinkThinLTO,
+    PreLinkFatLTO,
+    ThinLTO,
+    FatLTO,
+}
+
+/// LLVMRustSanitizerOptions
+#[repr(C)]
+pub struct SanitizerOptions {
+    pub sanitize_address: bool,
+    pub sanitize_memory: bool,
+    pub sanitize_thread: bool,
+    pub sanitize_recover: bool,
+    pub sanitize_memory_track_origins: c_int,
+}
+
+/// LLVMRustErrorKind
+#[derive(Copy, Clone, PartialEq, Debug)]
+#[repr(C)]
+pub enum ErrorKind {
+    Other,
+    Io,
+    Bitcode,
+    Archive,
+    Link,
+    ThinLTO,
+}
+
+/// LLVMRustErrorInfo
+#[repr(C)]
+pub struct ErrorInfo {
+    pub kind: ErrorKind,
+    pub module: *const c_char,
+    pub module_len: size_t,
+    pub message: *const c_char,
+    pub message_len: size_t,
+}
+
 /// LLVMRelocMode
 #[derive(Copy, Clone, PartialEq)]
 #[repr(C)]
@@ -456,6 +560,16 @@ pub enum ArchiveKind {
     K_COFF,
 }
 
+/// LLVMRustFileAccess
+#[derive(Copy, Clone, PartialEq, Debug)]
+#[repr(C)]
+pub enum FileAccess {
+    Default,
+    Random,
+    Sequential,
+    WillNeed,
+}
+
 /// LLVMRustPassKind
 #[derive(Copy, Clone, PartialEq, Debug)]
 #[repr(C)]
@@ -472,10 +586,52 @@ extern { pub type ThinLTOData; }
 /// LLVMRustThinLTOBuffer
 extern { pub type ThinLTOBuffer; }
 
+/// LLVMRustThinLTOCache
+extern { pub type ThinLTOCache; }
+
 // LLVMRustModuleNameCallback
 pub type ThinLTOModuleNameCallback =
     unsafe extern "C" fn(*mut c_void, *const c_char, *const c_char);
 
+/// LLVMRustModuleStageTimer
+extern { pub type ModuleStageTimer; }
+
+// LLVMRustModuleStageCallback
+pub type ModuleStageCallback =
+    unsafe extern "C" fn(*mut c_void, *const c_char, *const c_char);
+
+/// LLVMRustFunctionCodegenStats
+#[repr(C)]
+pub struct FunctionCodegenStats {
+    pub name: *const c_char,
+    pub name_len: size_t,
+    pub code_size: u64,
+    pub machine_instructions: u64,
+    pub stack_size: u64,
+    pub loop_spills: u64,
+    pub loop_reloads: u64,
+    pub inlined_call_sites: u64,
+}
+
+// LLVMRustFunctionCodegenStatsCallback
+pub type FunctionCodegenStatsCallback =
+    unsafe extern "C" fn(*mut c_void, *const FunctionCodegenStats);
+
+// LLVMRustProfiledFunctionCallback
+pub type ProfiledFunctionCallback =
+    unsafe extern "C" fn(*mut c_void, *const c_char, size_t, u64, FunctionTier);
+
+/// LLVMRustModuleCostInfo
+#[repr(C)]
+#[derive(Default)]
+pub struct ModuleCostInfo {
+    pub functions: u64,
+    pub basic_blocks: u64,
+    pub instructions: u64,
+    pub calls: u64,
+    pub loops: u64,
+}
+
 /// LLVMRustThinLTOModule
 #[repr(C)]
 pub struct ThinLTOModule {
@@ -484,6 +640,48 @@ pub struct ThinLTOModule {
     pub len: usize,
 }
 
+/// LLVMRustThinLTOFileModule
+#[repr(C)]
+pub struct ThinLTOFileModule {
+    pub identifier: *const c_char,
+    pub path: *const c_char,
+    pub offset: u64,
+    pub len: usize,
+}
+
+/// LLVMRustThinLTOImportOptions
+#[repr(C)]
+pub struct ThinLTOImportOptions {
+    pub instr_limit: c_int,
+    pub hot_multiplier: f32,
+    pub critical_multiplier: f32,
+    pub cold_multiplier: f32,
+    pub merge_functions: c_int,
+    pub summary_threads: c_int,
+}
+
+/// LLVMRustThinLTOImportGraph
+#[repr(C)]
+pub struct ThinLTOImportGraph {
+    pub num_modules: size_t,
+    pub module_names: *const *const c_char,
+    pub module_name_lens: *const size_t,
+    pub edge_offsets: *const u32,
+    pub edges: *const u32,
+    pub guid_offsets: *const u32,
+    pub guids: *const u64,
+}
+
+/// LLVMRustThinLTOImportStats
+#[repr(C)]
+#[derive(Default)]
+pub struct ThinLTOImportStats {
+    pub source_modules: c_uint,
+    pub functions: c_uint,
+    pub globals: c_uint,
+    pub instructions: u64,
+}
+
 /// LLVMThreadLocalMode
 #[derive(Copy, Clone)]
 #[repr(C)]
@@ -525,6 +723,15 @@ extern { pub type Archive; }
 pub struct ArchiveIterator<'a>(InvariantOpaque<'a>);
 #[repr(C)]
 pub struct ArchiveChild<'a>(InvariantOpaque<'a>);
+/// LLVMRustArchiveChildInfo
+#[repr(C)]
+pub struct ArchiveChildInfo {
+    pub name: *const c_char,
+    pub name_len: size_t,
+    pub data: *const u8,
+    pub data_len: size_t,
+    pub offset: u64,
+}
 extern { pub type Twine; }
 extern { pub type DiagnosticInfo; }
 extern { pub type SMDiagnostic; }
@@ -625,9 +832,43 @@ pub mod debuginfo {
             }
         }
     }
+
+    /// LLVMRustDIMember
+    #[repr(C)]
+    pub struct DIMember<'a> {
+        pub name: *const ::libc::c_char,
+        pub file: &'a DIFile,
+        pub line_no: ::libc::c_uint,
+        pub size_in_bits: u64,
+        pub align_in_bits: u32,
+        pub offset_in_bits: u64,
+        pub flags: DIFlags,
+        pub ty: &'a DIType,
+        pub discriminant: Option<&'a super::Value>,
+        pub is_variant: bool,
+    }
+}
+
+// These values **must** match with LLVMRustFastMathFlags!!
+bitflags! {
+    #[repr(C)]
+    #[derive(Default)]
+    pub struct FastMathFlags: ::libc::uint32_t {
+        const AllowReassoc    = (1 << 0);
+        const NoNaNs          = (1 << 1);
+        const NoInfs          = (1 << 2);
+        const NoSignedZeros   = (1 << 3);
+        const AllowReciprocal = (1 << 4);
+        const AllowContract   = (1 << 5);
+        const ApproxFunc      = (1 << 6);
+    }
 }
 
 extern { pub type ModuleBuffer; }
+extern { pub type ObjectBuffer; }
+extern { pub type CodegenSession; }
+extern { pub type TargetMachineFactory; }
+extern { pub type InternTable; }
 
 extern "C" {
     pub fn LLVMRustInstallFatalErrorHandler();
@@ -635,6 +876,21 @@ extern "C" {
     // Create and destroy contexts.
     pub fn LLVMRustContextCreate(shouldDiscardNames: bool) -> &'static mut Context;
     pub fn LLVMContextDispose(C: &'static mut Context);
+    pub fn LLVMRustContextDispose(C: &'static mut Context);
+    pub fn LLVMRustContextPoolConfigure(MaxIdle: c_uint, MaxUses: c_uint);
+    pub fn LLVMRustContextAcquire(shouldDiscardNames: bool) -> &'static mut Context;
+    pub fn LLVMRustContextRelease(C: &'static mut Context, M: Option<&'static mut Module>);
+    pub fn LLVMRustContextGetInternTable(C: &'a Context) -> &'a mut InternTable;
+    pub fn LLVMRustInternedType(T: &InternTable, Id: u32) -> Option<&'a Type>;
+    pub fn LLVMRustInternType(T: &mut InternTable, Id: u32, Ty: &'a Type);
+    pub fn LLVMRustInternedMetadata(T: &InternTable, Id: u32) -> Option<&'a Metadata>;
+    pub fn LLVMRustInternMetadata(T: &mut InternTable, Id: u32, MD: &'a Metadata);
+    pub fn LLVMRustInternArrayType(T: &mut InternTable,
+                                   Id: u32,
+                                   ElementTy: &'a Type,
+                                   ElementCount: u64)
+                                   -> &'a Type;
+    pub fn LLVMRustStructCreateNamed(C: &'a Context, Name: *const c_char) -> &'a Type;
     pub fn LLVMGetMDKindIDInContext(C: &Context, Name: *const c_char, SLen: c_uint) -> c_uint;
 
     // Create modules.
@@ -649,6 +905,10 @@ extern "C" {
     /// See Module::setModuleInlineAsm.
     pub fn LLVMSetModuleInlineAsm(M: &Module, Asm: *const c_char);
     pub fn LLVMRustAppendModuleInlineAsm(M: &Module, Asm: *const c_char);
+    pub fn LLVMRustAppendModuleInlineAsmBulk(M: &Module,
+                                             Asms: *const *const c_char,
+                                             Lens: *const size_t,
+                                             N: size_t);
 
     /// See llvm::LLVMTypeKind::getTypeID.
     pub fn LLVMRustGetTypeKind(Ty: &Type) -> TypeKind;
@@ -800,6 +1060,9 @@ extern "C" {
                                               Name: *const c_char,
                                               Value: *const c_char);
     pub fn LLVMRustRemoveFunctionAttributes(Fn: &Value, index: c_uint, attr: Attribute);
+    pub fn LLVMRustAddFunctionAttributes(Fn: &Value,
+                                         Specs: *const AttributeSpec,
+                                         Len: size_t);
 
     // Operations on parameters
     pub fn LLVMCountParams(Fn: &Value) -> c_uint;
@@ -824,6 +1087,9 @@ extern "C" {
     pub fn LLVMRustAddDereferenceableOrNullCallSiteAttr(Instr: &Value,
                                                         index: c_uint,
                                                         bytes: u64);
+    pub fn LLVMRustAddCallSiteAttributes(Instr: &Value,
+                                         Specs: *const AttributeSpec,
+                                         Len: size_t);
 
     // Operations on load/store instructions (only)
     pub fn LLVMSetVolatile(MemoryAccessInst: &Value, volatile: Bool);
@@ -1021,6 +1287,7 @@ extern "C" {
     pub fn LLVMBuildFNeg(B: &Builder<'a>, V: &'a Value, Name: *const c_char) -> &'a Value;
     pub fn LLVMBuildNot(B: &Builder<'a>, V: &'a Value, Name: *const c_char) -> &'a Value;
     pub fn LLVMRustSetHasUnsafeAlgebra(Instr: &Value);
+    pub fn LLVMRustSetFastMathFlags(Instr: &Value, Flags: FastMathFlags);
 
     // Memory
     pub fn LLVMBuildAlloca(B: &Builder<'a>, Ty: &'a Type, Name: *const c_char) -> &'a Value;
@@ -1162,6 +1429,44 @@ extern "C" {
                                 Size: &'a Value,
                                 IsVolatile: bool)
                                 -> &'a Value;
+    pub fn LLVMRustBuildMemSet(B: &Builder<'a>,
+                               Dst: &'a Value,
+                               DstAlign: c_uint,
+                               Val: &'a Value,
+                               Size: &'a Value,
+                               IsVolatile: bool)
+                               -> &'a Value;
+    pub fn LLVMRustBuildElementAtomicMemCpy(B: &Builder<'a>,
+                                            Dst: &'a Value,
+                                            DstAlign: c_uint,
+                                            Src: &'a Value,
+                                            SrcAlign: c_uint,
+                                            Size: &'a Value,
+                                            ElementSize: u32)
+                                            -> &'a Value;
+    pub fn LLVMRustBuildElementAtomicMemMove(B: &Builder<'a>,
+                                             Dst: &'a Value,
+                                             DstAlign: c_uint,
+                                             Src: &'a Value,
+                                             SrcAlign: c_uint,
+                                             Size: &'a Value,
+                                             ElementSize: u32)
+                                             -> &'a Value;
+    pub fn LLVMRustBuildElementAtomicMemSet(B: &Builder<'a>,
+                                            Dst: &'a Value,
+                                            DstAlign: c_uint,
+                                            Val: &'a Value,
+                                            Size: &'a Value,
+                                            ElementSize: u32)
+                                            -> &'a Value;
+    pub fn LLVMRustBuildMemCpyInline(B: &Builder<'a>,
+                                     Dst: &'a Value,
+                                     DstAlign: c_uint,
+                                     Src: &'a Value,
+                                     SrcAlign: c_uint,
+                                     Size: u64,
+                                     IsVolatile: bool)
+                                     -> Option<&'a Value>;
     pub fn LLVMBuildSelect(B: &Builder<'a>,
                            If: &'a Value,
                            Then: &'a Value,
@@ -1210,6 +1515,16 @@ extern "C" {
                                          Acc: &'a Value,
                                          Src: &'a Value)
                                          -> &'a Value;
+    pub fn LLVMRustBuildVectorReduceFAddWithFlags(B: &Builder<'a>,
+                                                  Acc: &'a Value,
+                                                  Src: &'a Value,
+                                                  Flags: FastMathFlags)
+                                                  -> &'a Value;
+    pub fn LLVMRustBuildVectorReduceFMulWithFlags(B: &Builder<'a>,
+                                                  Acc: &'a Value,
+                                                  Src: &'a Value,
+                                                  Flags: FastMathFlags)
+                                                  -> &'a Value;
     pub fn LLVMRustBuildVectorReduceAdd(B: &Builder<'a>,
                                         Src: &'a Value)
                                         -> &'a Value;
@@ -1253,6 +1568,48 @@ extern "C" {
         LHS: &'a Value,
     ) -> &'a Value;
 
+    pub fn LLVMRustBuildMaskedLoad(B: &Builder<'a>,
+                                   Ptr: &'a Value,
+                                   Align: c_uint,
+                                   Mask: &'a Value,
+                                   PassThru: Option<&'a Value>)
+                                   -> &'a Value;
+    pub fn LLVMRustBuildMaskedStore(B: &Builder<'a>,
+                                    Val: &'a Value,
+                                    Ptr: &'a Value,
+                                    Align: c_uint,
+                                    Mask: &'a Value)
+                                    -> &'a Value;
+    pub fn LLVMRustBuildMaskedGather(B: &Builder<'a>,
+                                     Ptrs: &'a Value,
+                                     Align: c_uint,
+                                     Mask: &'a Value,
+                                     PassThru: Option<&'a Value>)
+                                     -> &'a Value;
+    pub fn LLVMRustBuildMaskedScatter(B: &Builder<'a>,
+                                      Val: &'a Value,
+                                      Ptrs: &'a Value,
+                                      Align: c_uint,
+                                      Mask: &'a Value)
+                                      -> &'a Value;
+    pub fn LLVMRustBuildSaturatingOp(B: &Builder<'a>,
+                                     Op: SaturatingOp,
+                                     LHS: &'a Value,
+                                     RHS: &'a Value)
+                                     -> &'a Value;
+    pub fn LLVMRustBuildFunnelShift(B: &Builder<'a>,
+                                    Hi: &'a Value,
+                                    Lo: &'a Value,
+                                    Amt: &'a Value,
+                                    IsLeft: bool)
+                                    -> &'a Value;
+    pub fn LLVMRustBuildShuffleVector(B: &Builder<'a>,
+                                      V1: &'a Value,
+                                      V2: &'a Value,
+                                      Mask: *const i32,
+                                      Len: size_t)
+                                      -> &'a Value;
+
     // Atomic Operations
     pub fn LLVMRustBuildAtomicLoad(B: &Builder<'a>,
                                    PointerVal: &'a Value,
@@ -1350,12 +1707,19 @@ extern "C" {
     /// LLVMDisposeMemoryBuffer() to get rid of it.
     pub fn LLVMRustCreateMemoryBufferWithContentsOfFile(
         Path: *const c_char,
+        Access: FileAccess,
     ) -> Option<&'static mut MemoryBuffer>;
+    pub fn LLVMGetBufferStart(MemBuf: &MemoryBuffer) -> *const c_char;
+    pub fn LLVMGetBufferSize(MemBuf: &MemoryBuffer) -> size_t;
+    pub fn LLVMDisposeMemoryBuffer(MemBuf: &'static mut MemoryBuffer);
 
     pub fn LLVMStartMultithreaded() -> Bool;
 
-    /// Returns a string describing the last error caused by an LLVMRust* call.
-    pub fn LLVMRustGetLastError() -> *const c_char;
+    /// Returns the number of errors reported by LLVMRust* calls on this thread
+    /// which haven't been cleared.
+    pub fn LLVMRustGetErrorCount() -> size_t;
+    pub fn LLVMRustGetError(Index: size_t, Info: &mut ErrorInfo) -> bool;
+    pub fn LLVMRustClearErrors();
 
     /// Print the pass timings since static dtors aren't picking them up.
     pub fn LLVMRustPrintPassTimings();
@@ -1615,6 +1979,11 @@ extern "C" {
                                                 Elements: Option<&'a DIArray>,
                                                 Params: Option<&'a DIArray>);
 
+    pub fn LLVMRustDIBuilderDeferMembers(Builder: &DIBuilder<'a>,
+                                         CompositeType: &'a DIType,
+                                         Members: *const DIMember<'a>,
+                                         Len: size_t);
+
 
     pub fn LLVMRustDIBuilderCreateDebugLocation(Context: &'a Context,
                                                 Line: c_uint,
@@ -1656,9 +2025,34 @@ extern "C" {
                                        TrapUnreachable: bool,
                                        Singlethread: bool,
                                        AsmComments: bool,
-                                       EmitStackSizeSection: bool)
+                                       EmitStackSizeSection: bool,
+                                       DebugCompression: DebugCompression)
                                        -> Option<&'static mut TargetMachine>;
     pub fn LLVMRustDisposeTargetMachine(T: &'static mut TargetMachine);
+    pub fn LLVMRustCreateTargetMachineFactory(Triple: *const c_char,
+                                              CPU: *const c_char,
+                                              Features: *const c_char,
+                                              Model: CodeModel,
+                                              Reloc: RelocMode,
+                                              Level: CodeGenOptLevel,
+                                              UseSoftFP: bool,
+                                              PositionIndependentExecutable: bool,
+                                              FunctionSections: bool,
+                                              DataSections: bool,
+                                              TrapUnreachable: bool,
+                                              Singlethread: bool,
+                                              AsmComments: bool,
+                                              EmitStackSizeSection: bool,
+                                              DebugCompression: DebugCompression)
+                                              -> Option<&'static mut TargetMachineFactory>;
+    pub fn LLVMRustTargetMachineFactoryFree(F: &'static mut TargetMachineFactory);
+    pub fn LLVMRustTargetMachineFactoryAcquire(F: &TargetMachineFactory)
+                                               -> Option<&'static mut TargetMachine>;
+    pub fn LLVMRustTargetMachineFactoryRelease(F: &TargetMachineFactory,
+                                               T: &'static mut TargetMachine);
+    pub fn LLVMRustTargetMachineFactoryHasFeature(F: &TargetMachineFactory,
+                                                  Feature: *const c_char)
+                                                  -> bool;
     pub fn LLVMRustAddAnalysisPasses(T: &'a TargetMachine, PM: &PassManager<'a>, M: &'a Module);
     pub fn LLVMRustAddBuilderLibraryInfo(PMB: &'a PassManagerBuilder,
                                          M: &'a Module,
@@ -1670,17 +2064,70 @@ extern "C" {
                                                LoopVectorize: bool,
                                                PrepareForThinLTO: bool,
                                                PGOGenPath: *const c_char,
-                                               PGOUsePath: *const c_char);
+                                               PGOUsePath: *const c_char,
+                                               PGOSampleUsePath: *const c_char,
+                                               HotColdSplit: bool);
     pub fn LLVMRustAddLibraryInfo(PM: &PassManager<'a>,
                                   M: &'a Module,
                                   DisableSimplifyLibCalls: bool);
     pub fn LLVMRustRunFunctionPassManager(PM: &PassManager<'a>, M: &'a Module);
+    pub fn LLVMRustGetFunctionTier(Fn: &Value) -> FunctionTier;
+    pub fn LLVMRustRunTieredFunctionPassManager(PM: &PassManager<'a>,
+                                                ColdPM: &PassManager<'a>,
+                                                M: &'a Module);
+    pub fn LLVMRustMarkColdFunctionsForSize(M: &Module, MinSize: bool) -> c_uint;
+    pub fn LLVMRustSetProfileSectionPrefixes(M: &Module) -> c_uint;
+    pub fn LLVMRustForEachProfiledFunction(M: &Module,
+                                           Callback: ProfiledFunctionCallback,
+                                           CallbackPayload: *mut c_void);
+    pub fn LLVMRustOptimizeWithNewPassManager(M: &'a Module,
+                                              TM: &'a TargetMachine,
+                                              OptLevel: PassBuilderOptLevel,
+                                              OptStage: OptStage,
+                                              DisableSimplifyLibCalls: bool,
+                                              DebugPassManager: bool,
+                                              SanitizerOptions: Option<&SanitizerOptions>,
+                                              PGOGenPath: *const c_char,
+                                              PGOUsePath: *const c_char)
+                                              -> LLVMRustResult;
     pub fn LLVMRustWriteOutputFile(T: &'a TargetMachine,
                                    PM: &PassManager<'a>,
                                    M: &'a Module,
                                    Output: *const c_char,
                                    FileType: FileType)
                                    -> LLVMRustResult;
+    pub fn LLVMRustWriteOutputFileWithDwo(T: &'a TargetMachine,
+                                          PM: &PassManager<'a>,
+                                          M: &'a Module,
+                                          Output: *const c_char,
+                                          DwoOutput: *const c_char,
+                                          FileType: FileType)
+                                          -> LLVMRustResult;
+    pub fn LLVMRustWriteOutputFileWithStats(T: &'a TargetMachine,
+                                            PM: &PassManager<'a>,
+                                            M: &'a Module,
+                                            Output: *const c_char,
+                                            FileType: FileType,
+                                            Callback: FunctionCodegenStatsCallback,
+                                            CallbackPayload: *mut c_void)
+                                            -> LLVMRustResult;
+    pub fn LLVMRustWriteOutputBuffer(T: &'a TargetMachine,
+                                     PM: &PassManager<'a>,
+                                     M: &'a Module,
+                                     FileType: FileType)
+                                     -> Option<&'static mut ObjectBuffer>;
+    pub fn LLVMRustObjectBufferPtr(p: &ObjectBuffer) -> *const u8;
+    pub fn LLVMRustObjectBufferLen(p: &ObjectBuffer) -> usize;
+    pub fn LLVMRustObjectBufferFree(p: &'static mut ObjectBuffer);
+    pub fn LLVMRustCodegenSessionCreate(T: &'static mut TargetMachine,
+                                        Triple: *const c_char,
+                                        DisableSimplifyLibCalls: bool,
+                                        FileType: FileType)
+                                        -> Option<&'static mut CodegenSession>;
+    pub fn LLVMRustCodegenSessionFree(S: &'static mut CodegenSession);
+    pub fn LLVMRustCodegenSessionEmit(S: &mut CodegenSession,
+                                      M: &Module)
+                                      -> &'static mut ObjectBuffer;
     pub fn LLVMRustPrintModule(PM: &PassManager<'a>,
                                M: &'a Module,
                                Output: *const c_char,
@@ -1688,21 +2135,57 @@ extern "C" {
                                                    size_t,
                                                    *mut c_char,
                                                    size_t) -> size_t);
+    pub fn LLVMRustPrintModuleFiltered(M: &Module,
+                                       Output: *const c_char,
+                                       Demangle: extern fn(*const c_char,
+                                                           size_t,
+                                                           *mut c_char,
+                                                           size_t) -> size_t,
+                                       Patterns: *const *const c_char,
+                                       NumPatterns: size_t)
+                                       -> LLVMRustResult;
     pub fn LLVMRustSetLLVMOptions(Argc: c_int, Argv: *const *const c_char);
     pub fn LLVMRustPrintPasses();
     pub fn LLVMRustSetNormalizedTarget(M: &Module, triple: *const c_char);
     pub fn LLVMRustAddAlwaysInlinePass(P: &PassManagerBuilder, AddLifetimes: bool);
     pub fn LLVMRustRunRestrictionPass(M: &Module, syms: *const *const c_char, len: size_t);
+    pub fn LLVMRustRunRestrictionPassWithPatterns(M: &Module,
+                                                  syms: *const *const c_char,
+                                                  len: size_t,
+                                                  patterns: *const *const c_char,
+                                                  num_patterns: size_t)
+                                                  -> bool;
     pub fn LLVMRustMarkAllFunctionsNounwind(M: &Module);
 
     pub fn LLVMRustOpenArchive(path: *const c_char) -> Option<&'static mut Archive>;
+    pub fn LLVMRustOpenArchiveWithAccess(path: *const c_char,
+                                         access: FileAccess,
+                                         prefetch: *const c_char)
+                                         -> Option<&'static mut Archive>;
+    pub fn LLVMRustOpenArchives(paths: *const *const c_char,
+                                n: size_t,
+                                access: FileAccess,
+                                prefetch: *const c_char,
+                                archives: *mut Option<&'static mut Archive>)
+                                -> LLVMRustResult;
     pub fn LLVMRustArchiveIteratorNew(AR: &'a Archive) -> &'a mut ArchiveIterator<'a>;
     pub fn LLVMRustArchiveIteratorNext(
         AIR: &ArchiveIterator<'a>,
     ) -> Option<&'a mut ArchiveChild<'a>>;
     pub fn LLVMRustArchiveChildName(ACR: &ArchiveChild<'_>, size: &mut size_t) -> *const c_char;
     pub fn LLVMRustArchiveChildData(ACR: &ArchiveChild<'_>, size: &mut size_t) -> *const c_char;
+    pub fn LLVMRustArchiveFindSymbol(AR: &'a Archive,
+                                     Name: *const c_char)
+                                     -> Option<&'a mut ArchiveChild<'a>>;
+    pub fn LLVMRustArchiveFindChild(AR: &'a Archive,
+                                    Name: *const c_char)
+                                    -> Option<&'a mut ArchiveChild<'a>>;
     pub fn LLVMRustArchiveChildFree(ACR: &'a mut ArchiveChild<'a>);
+    pub fn LLVMRustArchiveGetChildren(AR: &Archive,
+                                      Children: *mut ArchiveChildInfo,
+                                      Capacity: size_t,
+                                      NumChildren: &mut size_t)
+                                      -> LLVMRustResult;
     pub fn LLVMRustArchiveIteratorFree(AIR: &'a mut ArchiveIterator<'a>);
     pub fn LLVMRustDestroyArchive(AR: &'static mut Archive);
 
@@ -1724,6 +2207,14 @@ extern "C" {
                                                 loc_filename_out: &RustString,
                                                 message_out: &RustString);
 
+    pub fn LLVMRustContextStreamRemarks(C: &Context,
+                                        Path: *const c_char,
+                                        PassFilter: *const c_char,
+                                        WithHotness: bool,
+                                        HotnessThreshold: u64)
+                                        -> bool;
+    pub fn LLVMRustContextStopRemarks(C: &Context);
+
     pub fn LLVMRustUnpackInlineAsmDiagnostic(DI: &'a DiagnosticInfo,
                                              cookie_out: &mut c_uint,
                                              message_out: &mut Option<&'a Twine>,
@@ -1746,10 +2237,32 @@ extern "C" {
                                 WriteSymbtab: bool,
                                 Kind: ArchiveKind)
                                 -> LLVMRustResult;
+    pub fn LLVMRustWriteThinArchive(Dst: *const c_char,
+                                    NumMembers: size_t,
+                                    Members: *const &RustArchiveMember<'_>,
+                                    WriteSymbtab: bool)
+                                    -> LLVMRustResult;
+    pub fn LLVMRustArchiveReplaceMember(Path: *const c_char,
+                                        Name: *const c_char,
+                                        Data: *const u8,
+                                        Len: size_t,
+                                        WriteSymbtab: bool,
+                                        Kind: ArchiveKind)
+                                        -> LLVMRustResult;
+    pub fn LLVMRustWriteArchiveParallel(Dst: *const c_char,
+                                        NumMembers: size_t,
+                                        Members: *const &RustArchiveMember<'_>,
+                                        WriteSymbtab: bool,
+                                        Kind: ArchiveKind)
+                                        -> LLVMRustResult;
     pub fn LLVMRustArchiveMemberNew(Filename: *const c_char,
                                     Name: *const c_char,
                                     Child: Option<&ArchiveChild<'a>>)
                                     -> &'a mut RustArchiveMember<'a>;
+    pub fn LLVMRustArchiveMemberNewFromBuffer(Name: *const c_char,
+                                              Data: *const u8,
+                                              Len: size_t)
+                                              -> &'a mut RustArchiveMember<'a>;
     pub fn LLVMRustArchiveMemberFree(Member: &'a mut RustArchiveMember<'a>);
 
     pub fn LLVMRustSetDataLayoutFromTargetMachine(M: &'a Module, TM: &'a TargetMachine);
@@ -1770,9 +2283,23 @@ extern "C" {
     pub fn LLVMRustModuleBufferLen(p: &ModuleBuffer) -> usize;
     pub fn LLVMRustModuleBufferFree(p: &'static mut ModuleBuffer);
     pub fn LLVMRustModuleCost(M: &Module) -> u64;
-
-    pub fn LLVMRustThinLTOBufferCreate(M: &Module) -> &'static mut ThinLTOBuffer;
+    pub fn LLVMRustGetModuleCostInfo(M: &Module, Info: *mut ModuleCostInfo);
+    pub fn LLVMRustMultiversionFunction(Fn: &'a Value,
+                                        Features: *const *const c_char,
+                                        Conditions: *const &'a Value,
+                                        NumVersions: size_t,
+                                        UseIFunc: bool)
+                                        -> Option<&'a Value>;
+
+    pub fn LLVMRustThinLTOBufferCreate(M: &Module,
+                                       WithFunctionHashes: bool)
+                                       -> &'static mut ThinLTOBuffer;
     pub fn LLVMRustThinLTOBufferFree(M: &'static mut ThinLTOBuffer);
+    pub fn LLVMRustModuleSerialize(M: &Module,
+                                   WithSummary: bool,
+                                   WithFunctionHashes: bool,
+                                   SizeHint: size_t)
+                                   -> &'static mut ThinLTOBuffer;
     pub fn LLVMRustThinLTOBufferPtr(M: &ThinLTOBuffer) -> *const c_char;
     pub fn LLVMRustThinLTOBufferLen(M: &ThinLTOBuffer) -> size_t;
     pub fn LLVMRustCreateThinLTOData(
@@ -1780,6 +2307,18 @@ extern "C" {
         NumModules: c_uint,
         PreservedSymbols: *const *const c_char,
         PreservedSymbolsLen: c_uint,
+        Options: *const ThinLTOImportOptions,
+    ) -> Option<&'static mut ThinLTOData>;
+    pub fn LLVMRustIsThinLTOBitcode(Data: *const u8, Len: size_t) -> bool;
+    pub fn LLVMRustGetBitcodeDefinedSymbols(Out: &RustString,
+                                            Data: *const u8,
+                                            Len: size_t) -> bool;
+    pub fn LLVMRustCreateThinLTODataFromFiles(
+        Modules: *const ThinLTOFileModule,
+        NumModules: c_uint,
+        PreservedSymbols: *const *const c_char,
+        PreservedSymbolsLen: c_uint,
+        Options: *const ThinLTOImportOptions,
     ) -> Option<&'static mut ThinLTOData>;
     pub fn LLVMRustPrepareThinLTORename(
         Data: &ThinLTOData,
@@ -1802,7 +2341,58 @@ extern "C" {
         ModuleNameCallback: ThinLTOModuleNameCallback,
         CallbackPayload: *mut c_void,
     );
+    pub fn LLVMRustThinLTOGetImportGraph(
+        Data: *const ThinLTOData,
+        Graph: &mut ThinLTOImportGraph,
+    );
+    pub fn LLVMRustThinLTOGetImportStats(
+        Data: &ThinLTOData,
+        ModuleId: *const c_char,
+        Stats: *mut ThinLTOImportStats,
+    ) -> bool;
+    pub fn LLVMRustModuleStageTimerStart(
+        M: &Module,
+        Stage: *const c_char,
+    ) -> &'static mut ModuleStageTimer;
+    pub fn LLVMRustModuleStageTimerFinish(
+        Timer: &'static mut ModuleStageTimer,
+        M: &Module,
+        Callback: ModuleStageCallback,
+        CallbackPayload: *mut c_void,
+    );
     pub fn LLVMRustFreeThinLTOData(Data: &'static mut ThinLTOData);
+    pub fn LLVMRustThinLTODataWrite(Data: &ThinLTOData, Path: *const c_char) -> LLVMRustResult;
+    pub fn LLVMRustThinLTODataLoad(
+        Path: *const c_char,
+        Modules: *const ThinLTOModule,
+        NumModules: c_uint,
+        PreservedSymbols: *const *const c_char,
+        PreservedSymbolsLen: c_uint,
+        Options: *const ThinLTOImportOptions,
+        Changed: *mut bool,
+    ) -> Option<&'static mut ThinLTOData>;
+    #[allow(improper_ctypes)]
+    pub fn LLVMRustThinLTOComputeCacheKey(
+        KeyOut: &RustString,
+        Data: &ThinLTOData,
+        ModuleId: *const c_char,
+        TM: &TargetMachine,
+        OptLevel: CodeGenOptLevel,
+        Extra: *const c_char,
+    ) -> bool;
+    pub fn LLVMRustThinLTOCacheCreate(Path: *const c_char) -> Option<&'static mut ThinLTOCache>;
+    pub fn LLVMRustThinLTOCacheFree(Cache: &'static mut ThinLTOCache);
+    pub fn LLVMRustThinLTOCacheLookup(
+        Cache: &ThinLTOCache,
+        Key: *const c_char,
+    ) -> Option<&'static mut MemoryBuffer>;
+    pub fn LLVMRustThinLTOCacheStore(
+        Cache: &ThinLTOCache,
+        Key: *const c_char,
+        Data: *const u8,
+        Len: usize,
+    ) -> LLVMRustResult;
+    pub fn LLVMRustThinLTOCachePrune(Cache: &ThinLTOCache, Policy: *const c_char) -> LLVMRustResult;
     pub fn LLVMRustParseBitcodeForLTO(
         Context: &Context,
         Data: *const u8,
@@ -1818,5 +2408,13 @@ extern "C" {
     pub fn LLVMRustLinkerAdd(linker: &Linker<'_>,
                              bytecode: *const c_char,
                              bytecode_len: usize) -> bool;
+    pub fn LLVMRustLinkerSetPreservedSymbols(linker: &Linker<'_>,
+                                             symbols: *const *const c_char,
+                                             num_symbols: usize);
+    pub fn LLVMRustLinkerAddBatch(linker: &Linker<'_>,
+                                  bytecodes: *const *const c_char,
+                                  bytecode_lens: *const usize,
+                                  num_bytecodes: usize,
+                                  threads: c_uint) -> bool;
     pub fn LLVMRustLinkerFree(linker: &'a mut Linker<'a>);
 }
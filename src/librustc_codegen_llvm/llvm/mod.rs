@@ -14,6 +14,7 @@ pub use self::Linkage::*;
 use std::str::FromStr;
 use std::string::FromUtf8Error;
 use std::slice;
+use std::ptr;
 use std::ffi::CStr;
 use std::cell::RefCell;
 use libc::{c_uint, c_char, size_t};
@@ -235,20 +236,63 @@ pub fn twine_to_string(tr: &Twine) -> String {
     }
 }
 
-pub fn last_error() -> Option<String> {
+/// An error reported by an LLVMRust* call.
+#[derive(Debug)]
+pub struct Error {
+    pub kind: ErrorKind,
+    /// The identifier of the module the error is about, if any.
+    pub module: Option<String>,
+    pub message: String,
+}
+
+/// Returns the errors reported on this thread since they were last taken,
+/// oldest first, and clears them.
+pub fn take_errors() -> Vec<Error> {
     unsafe {
-        let cstr = LLVMRustGetLastError();
-        if cstr.is_null() {
-            None
-        } else {
-            let err = CStr::from_ptr(cstr).to_bytes();
-            let err = String::from_utf8_lossy(err).to_string();
-            libc::free(cstr as *mut _);
-            Some(err)
+        let count = LLVMRustGetErrorCount();
+        let mut errors = Vec::with_capacity(count);
+        for i in 0..count {
+            let mut info = ErrorInfo {
+                kind: ErrorKind::Other,
+                module: ptr::null(),
+                module_len: 0,
+                message: ptr::null(),
+                message_len: 0,
+            };
+            if !LLVMRustGetError(i, &mut info) {
+                break;
+            }
+            let module = slice::from_raw_parts(info.module as *const u8, info.module_len);
+            let message = slice::from_raw_parts(info.message as *const u8, info.message_len);
+            errors.push(Error {
+                kind: info.kind,
+                module: if module.is_empty() {
+                    None
+                } else {
+                    Some(String::from_utf8_lossy(module).into_owned())
+                },
+                message: String::from_utf8_lossy(message).into_owned(),
+            });
         }
+        LLVMRustClearErrors();
+        errors
     }
 }
 
+/// Returns the message of the last error reported on this thread, and clears
+/// all of them.
+pub fn last_error() -> Option<String> {
+    take_errors().pop().map(|e| e.message)
+}
+
+/// Forgets the errors reported on this thread so far. This is done before
+/// each call whose failure is then reported with `take_errors` or
+/// `last_error`, so that the errors reported are only the ones of that call
+/// rather than also any left over from earlier calls which didn't fail.
+pub fn clear_errors() {
+    unsafe { LLVMRustClearErrors() }
+}
+
 pub struct OperandBundleDef<'a> {
     pub raw: &'a mut ffi::OperandBundleDef<'a>,
 }
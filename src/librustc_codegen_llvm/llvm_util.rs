@@ -4,7 +4,7 @@ use syntax_pos::symbol::Symbol;
 use rustc::session::Session;
 use rustc::session::config::PrintRequest;
 use rustc_target::spec::MergeFunctions;
-use libc::c_int;
+use libc::{c_int, c_uint};
 use std::ffi::CString;
 use syntax::feature_gate::UnstableFeatures;
 
@@ -87,6 +87,12 @@ unsafe fn configure_llvm(sess: &Session) {
 
     llvm::LLVMRustSetLLVMOptions(llvm_args.len() as c_int,
                                  llvm_args.as_ptr());
+
+    // Keep up to one idle context per codegen thread around for the next
+    // codegen unit.
+    if let Some(uses) = sess.opts.debugging_opts.llvm_context_reuse {
+        llvm::LLVMRustContextPoolConfigure(num_cpus::get() as c_uint, uses as c_uint);
+    }
 }
 
 // WARNING: the features after applying `to_llvm_feature` must be known
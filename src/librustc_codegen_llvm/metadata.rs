@@ -21,7 +21,12 @@ impl MetadataLoader for LlvmMetadataLoader {
         // Use ArchiveRO for speed here, it's backed by LLVM and uses mmap
         // internally to read the file. We also avoid even using a memcpy by
         // just keeping the archive along while the metadata is in use.
-        let archive = ArchiveRO::open(filename)
+        //
+        // Nothing but the metadata is needed from the rlib here, so the
+        // kernel is asked to read that ahead and nothing else.
+        let archive = ArchiveRO::open_with_access(filename,
+                                                  llvm::FileAccess::Random,
+                                                  Some(METADATA_FILENAME))
             .map(|ar| OwningRef::new(box ar))
             .map_err(|e| {
                 debug!("llvm didn't like `{}`: {}", filename.display(), e);
@@ -48,7 +53,8 @@ impl MetadataLoader for LlvmMetadataLoader {
                           -> Result<MetadataRef, String> {
         unsafe {
             let buf = path_to_c_string(filename);
-            let mb = llvm::LLVMRustCreateMemoryBufferWithContentsOfFile(buf.as_ptr())
+            let mb = llvm::LLVMRustCreateMemoryBufferWithContentsOfFile(buf.as_ptr(),
+                                                                      llvm::FileAccess::Default)
                 .ok_or_else(|| format!("error reading library: '{}'", filename.display()))?;
             let of = ObjectFile::new(mb)
                 .map(|of| OwningRef::new(box of))
@@ -42,7 +42,7 @@ impl CodegenCx<'ll, 'tcx> {
     crate fn type_named_struct(&self, name: &str) -> &'ll Type {
         let name = SmallCStr::new(name);
         unsafe {
-            llvm::LLVMStructCreateNamed(self.llcx, name.as_ptr())
+            llvm::LLVMRustStructCreateNamed(self.llcx, name.as_ptr())
         }
     }
 
@@ -4,9 +4,10 @@
 use rustc::session::{Session, config};
 use rustc::session::search_paths::PathKind;
 use rustc::middle::dependency_format::Linkage;
-use rustc::middle::cstore::LibSource;
+use rustc::middle::cstore::{LibSource, NativeLibrary, NativeLibraryKind};
 use rustc_target::spec::LinkerFlavor;
 use rustc::hir::def_id::CrateNum;
+use syntax::attr;
 
 use super::command::Command;
 use crate::CrateInfo;
@@ -134,6 +135,36 @@ pub fn ignored_for_lto(sess: &Session, info: &CrateInfo, cnum: CrateNum) -> bool
         (info.compiler_builtins == Some(cnum) || info.is_no_builtins.contains(&cnum))
 }
 
+/// Returns whether the native objects bundled into the rlib of `cnum` which
+/// are ThinLTO bitcode are included in our own LTO (`-Z lto-native-bitcode`),
+/// and hence must not be passed on to the linker.
+///
+/// This is only the case if the crate's Rust objects are included as well,
+/// and not for static libraries, whose native symbols must stay exported to
+/// whatever they're linked into later. Crates with native static libraries
+/// that are disabled by `cfg` don't have any of their native objects linked,
+/// so none of them are included here either.
+pub fn native_bitcode_in_lto(sess: &Session, info: &CrateInfo, cnum: CrateNum) -> bool {
+    let lto = match sess.lto() {
+        config::Lto::Fat => true,
+        config::Lto::Thin => !sess.opts.cg.linker_plugin_lto.enabled(),
+        config::Lto::No | config::Lto::ThinLocal => false,
+    };
+    lto && sess.opts.debugging_opts.lto_native_bitcode &&
+        !sess.crate_types.borrow().contains(&config::CrateType::Staticlib) &&
+        !ignored_for_lto(sess, info, cnum) &&
+        info.native_libraries[&cnum].iter().all(|lib| {
+            lib.kind != NativeLibraryKind::NativeStatic || relevant_lib(sess, lib)
+        })
+}
+
+pub fn relevant_lib(sess: &Session, lib: &NativeLibrary) -> bool {
+    match lib.cfg {
+        Some(ref cfg) => attr::cfg_matches(cfg, &sess.parse_sess, None),
+        None => true,
+    }
+}
+
 pub fn linker_and_flavor(sess: &Session) -> (PathBuf, LinkerFlavor) {
     fn infer_from(
         sess: &Session,
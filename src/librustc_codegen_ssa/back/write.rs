@@ -14,7 +14,7 @@ use rustc::dep_graph::cgu_reuse_tracker::CguReuseTracker;
 use rustc::middle::cstore::EncodedMetadata;
 use rustc::session::config::{self, OutputFilenames, OutputType, Passes, Sanitizer, Lto};
 use rustc::session::Session;
-use rustc::util::nodemap::FxHashMap;
+use rustc::util::nodemap::{FxHashMap, FxHashSet};
 use rustc::util::time_graph::{self, TimeGraph, Timeline};
 use rustc::hir::def_id::{CrateNum, LOCAL_CRATE};
 use rustc::ty::TyCtxt;
@@ -56,6 +56,9 @@ pub struct ModuleConfig {
 
     pub pgo_gen: Option<String>,
     pub pgo_use: String,
+    pub pgo_sample_use: String,
+    pub hot_cold_split: bool,
+    pub profile_section_prefixes: bool,
 
     // Flags indicating which outputs to produce.
     pub emit_pre_lto_bc: bool,
@@ -66,6 +69,8 @@ pub struct ModuleConfig {
     pub emit_ir: bool,
     pub emit_asm: bool,
     pub emit_obj: bool,
+    // Put the debug info of object files into `.dwo` files next to them.
+    pub split_dwarf: bool,
     // Miscellaneous flags.  These are mostly copied from command-line
     // options.
     pub verify_llvm_ir: bool,
@@ -75,6 +80,8 @@ pub struct ModuleConfig {
     pub vectorize_loop: bool,
     pub vectorize_slp: bool,
     pub merge_functions: bool,
+    // Fold identical functions of different codegen units in ThinLTO.
+    pub thinlto_fold_functions: bool,
     pub inline_threshold: Option<usize>,
     // Instead of creating an object file by doing LLVM codegen, just
     // make the object file bitcode. Provides easy compatibility with
@@ -94,6 +101,9 @@ impl ModuleConfig {
 
             pgo_gen: None,
             pgo_use: String::new(),
+            pgo_sample_use: String::new(),
+            hot_cold_split: false,
+            profile_section_prefixes: false,
 
             emit_no_opt_bc: false,
             emit_pre_lto_bc: false,
@@ -103,6 +113,7 @@ impl ModuleConfig {
             emit_ir: false,
             emit_asm: false,
             emit_obj: false,
+            split_dwarf: false,
             obj_is_bitcode: false,
             embed_bitcode: false,
             embed_bitcode_marker: false,
@@ -115,6 +126,7 @@ impl ModuleConfig {
             vectorize_loop: false,
             vectorize_slp: false,
             merge_functions: false,
+            thinlto_fold_functions: false,
             inline_threshold: None
         }
     }
@@ -170,6 +182,13 @@ impl ModuleConfig {
                 sess.opts.optimize == config::OptLevel::Aggressive
             }
         };
+
+        // Folding makes a module's object depend on what the other modules
+        // export, which incremental reuse of post-ThinLTO objects doesn't
+        // track, so it's never done in incremental builds.
+        self.thinlto_fold_functions = self.merge_functions &&
+                                      sess.opts.debugging_opts.thinlto_fold_functions &&
+                                      sess.opts.incremental.is_none();
     }
 
     pub fn bitcode_needed(&self) -> bool {
@@ -209,6 +228,9 @@ pub struct CodegenContext<B: WriteBackendMethods> {
     pub opts: Arc<config::Options>,
     pub crate_types: Vec<config::CrateType>,
     pub each_linked_rlib_for_lto: Vec<(CrateNum, PathBuf)>,
+    // The crates of `each_linked_rlib_for_lto` whose bundled native bitcode is
+    // included in LTO, see `link::native_bitcode_in_lto`.
+    pub native_bitcode_for_lto: FxHashSet<CrateNum>,
     pub output_filenames: Arc<OutputFilenames>,
     pub regular_module_config: Arc<ModuleConfig>,
     pub metadata_module_config: Arc<ModuleConfig>,
@@ -256,6 +278,12 @@ impl<B: WriteBackendMethods> CodegenContext<B> {
     }
 }
 
+/// The `.dwo` file the debug info of a codegen unit goes into with `-Z split-dwarf`. The
+/// skeleton compile unit in the object file refers to it by this name.
+pub fn dwo_path(outputs: &OutputFilenames, codegen_unit_name: &str) -> PathBuf {
+    outputs.temp_path_ext("dwo", Some(codegen_unit_name))
+}
+
 fn generate_lto_work<B: ExtraBackendMethods>(
     cgcx: &CodegenContext<B>,
     needs_fat_lto: Vec<FatLTOInput<B>>,
@@ -372,6 +400,12 @@ pub fn start_async_codegen<B: ExtraBackendMethods>(
 
     modules_config.pgo_gen = sess.opts.debugging_opts.pgo_gen.clone();
     modules_config.pgo_use = sess.opts.debugging_opts.pgo_use.clone();
+    modules_config.pgo_sample_use = sess.opts.debugging_opts.pgo_sample_use.clone();
+    modules_config.hot_cold_split = sess.opts.debugging_opts.hot_cold_split;
+    modules_config.profile_section_prefixes =
+        sess.opts.debugging_opts.profile_section_prefixes;
+    modules_config.split_dwarf =
+        sess.opts.debugging_opts.split_dwarf && sess.opts.debuginfo != config::DebugInfo::None;
 
     modules_config.opt_level = Some(sess.opts.optimize);
     modules_config.opt_size = Some(sess.opts.optimize);
@@ -491,6 +525,9 @@ fn copy_all_cgu_workproducts_to_incr_comp_cache_dir(
         if let Some(ref path) = module.bytecode_compressed {
             files.push((WorkProductFileKind::BytecodeCompressed, path.clone()));
         }
+        if let Some(ref path) = module.dwo {
+            files.push((WorkProductFileKind::SplitDwarf, path.clone()));
+        }
 
         if let Some((id, product)) =
                 copy_cgu_workproducts_to_incr_comp_cache_dir(sess, &module.name, &files) {
@@ -800,7 +837,7 @@ fn execute_optimize_work_item<B: ExtraBackendMethods>(
             WorkItemResult::Compiled(module)
         }
         ComputedLtoType::Thin => {
-            let (name, thin_buffer) = B::prepare_thin(module);
+            let (name, thin_buffer) = B::prepare_thin(module, module_config);
             if let Some(path) = bitcode {
                 fs::write(&path, thin_buffer.data()).unwrap_or_else(|e| {
                     panic!("Error writing pre-lto-bitcode file `{}`: {}",
@@ -839,6 +876,7 @@ fn execute_copy_from_cache_work_item<B: ExtraBackendMethods>(
     let mut object = None;
     let mut bytecode = None;
     let mut bytecode_compressed = None;
+    let mut dwo = None;
     for (kind, saved_file) in &module.source.saved_files {
         let obj_out = match kind {
             WorkProductFileKind::Object => {
@@ -860,6 +898,14 @@ fn execute_copy_from_cache_work_item<B: ExtraBackendMethods>(
                 bytecode_compressed = Some(path.clone());
                 path
             }
+            // The skeleton compile unit of the object file names this path,
+            // so the `.dwo` file is put back where it was written in the
+            // first place.
+            WorkProductFileKind::SplitDwarf => {
+                let path = dwo_path(&cgcx.output_filenames, &module.name);
+                dwo = Some(path.clone());
+                path
+            }
         };
         let source_file = in_incr_comp_dir(&incr_comp_session_dir,
                                            &saved_file);
@@ -886,6 +932,7 @@ fn execute_copy_from_cache_work_item<B: ExtraBackendMethods>(
         object,
         bytecode,
         bytecode_compressed,
+        dwo,
     }))
 }
 
@@ -897,10 +944,29 @@ fn execute_lto_work_item<B: ExtraBackendMethods>(
 ) -> Result<WorkItemResult<B>, FatalError> {
     let diag_handler = cgcx.create_diag_handler();
 
+    // A ThinLTO module the cache has an object file for needs neither to be
+    // optimized nor code generated.
+    let cache_key = match module {
+        lto::LtoModuleCodegen::Thin(ref thin) => {
+            let key = B::thin_lto_cache_key(cgcx, thin, module_config);
+            if let Some(ref key) = key {
+                if let Some(compiled) = B::load_from_thin_lto_cache(cgcx, thin, key) {
+                    timeline.record("thin-lto-cache-hit");
+                    return Ok(WorkItemResult::Compiled(compiled));
+                }
+            }
+            key
+        }
+        lto::LtoModuleCodegen::Fat { .. } => None,
+    };
+
     unsafe {
-        let module = module.optimize(cgcx, timeline)?;
-        let module = B::codegen(cgcx, &diag_handler, module, module_config, timeline)?;
-        Ok(WorkItemResult::Compiled(module))
+        let optimized = module.optimize(cgcx, timeline)?;
+        let compiled = B::codegen(cgcx, &diag_handler, optimized, module_config, timeline)?;
+        if let Some(key) = cache_key {
+            B::store_in_thin_lto_cache(cgcx, &diag_handler, &compiled, &key);
+        }
+        Ok(WorkItemResult::Compiled(compiled))
     }
 }
 
@@ -1001,11 +1067,15 @@ fn start_executing_work<B: ExtraBackendMethods>(
     }).expect("failed to spawn helper thread");
 
     let mut each_linked_rlib_for_lto = Vec::new();
+    let mut native_bitcode_for_lto = FxHashSet::default();
     drop(link::each_linked_rlib(sess, crate_info, &mut |cnum, path| {
         if link::ignored_for_lto(sess, crate_info, cnum) {
             return
         }
         each_linked_rlib_for_lto.push((cnum, path.to_path_buf()));
+        if link::native_bitcode_in_lto(sess, crate_info, cnum) {
+            native_bitcode_for_lto.insert(cnum);
+        }
     }));
 
     let assembler_cmd = if modules_config.no_integrated_as {
@@ -1027,6 +1097,7 @@ fn start_executing_work<B: ExtraBackendMethods>(
         backend: backend.clone(),
         crate_types: sess.crate_types.borrow().clone(),
         each_linked_rlib_for_lto,
+        native_bitcode_for_lto,
         lto: sess.lto(),
         no_landing_pads: sess.no_landing_pads(),
         fewer_names: sess.fewer_names(),
@@ -67,6 +67,7 @@ impl<M> ModuleCodegen<M> {
                             emit_obj: bool,
                             emit_bc: bool,
                             emit_bc_compressed: bool,
+                            emit_dwo: bool,
                             outputs: &OutputFilenames) -> CompiledModule {
         let object = if emit_obj {
             Some(outputs.temp_path(OutputType::Object, Some(&self.name)))
@@ -84,6 +85,11 @@ impl<M> ModuleCodegen<M> {
         } else {
             None
         };
+        let dwo = if emit_dwo {
+            Some(back::write::dwo_path(outputs, &self.name))
+        } else {
+            None
+        };
 
         CompiledModule {
             name: self.name.clone(),
@@ -91,6 +97,7 @@ impl<M> ModuleCodegen<M> {
             object,
             bytecode,
             bytecode_compressed,
+            dwo,
         }
     }
 }
@@ -102,6 +109,8 @@ pub struct CompiledModule {
     pub object: Option<PathBuf>,
     pub bytecode: Option<PathBuf>,
     pub bytecode_compressed: Option<PathBuf>,
+    /// The `.dwo` file the debug info of `object` was split off into.
+    pub dwo: Option<PathBuf>,
 }
 
 pub struct CachedModuleCodegen {
@@ -51,8 +51,31 @@ pub trait WriteBackendMethods: 'static + Sized + Clone {
         config: &ModuleConfig,
         timeline: &mut Timeline,
     ) -> Result<CompiledModule, FatalError>;
+    /// Computes the key under which the ThinLTO cache (`-Z thinlto-cache-dir`)
+    /// keeps the object file of `thin`, or `None` if there is no cache or the
+    /// module's output can't be restored from an object file alone.
+    fn thin_lto_cache_key(
+        cgcx: &CodegenContext<Self>,
+        thin: &ThinModule<Self>,
+        config: &ModuleConfig,
+    ) -> Option<String>;
+    /// Writes the object file cached under `key` to where `codegen` would have
+    /// written the object file of `thin`, if the cache has an entry for it.
+    fn load_from_thin_lto_cache(
+        cgcx: &CodegenContext<Self>,
+        thin: &ThinModule<Self>,
+        key: &str,
+    ) -> Option<CompiledModule>;
+    /// Adds the object file of `module` to the ThinLTO cache under `key`.
+    fn store_in_thin_lto_cache(
+        cgcx: &CodegenContext<Self>,
+        diag_handler: &Handler,
+        module: &CompiledModule,
+        key: &str,
+    );
     fn prepare_thin(
-        module: ModuleCodegen<Self::Module>
+        module: ModuleCodegen<Self::Module>,
+        config: &ModuleConfig,
     ) -> (String, Self::ThinBuffer);
     fn serialize_module(
         module: ModuleCodegen<Self::Module>
@@ -62,7 +85,7 @@ pub trait WriteBackendMethods: 'static + Sized + Clone {
         llmod: &ModuleCodegen<Self::Module>,
         config: &ModuleConfig,
         thin: bool,
-    );
+    ) -> Result<(), FatalError>;
 }
 
 pub trait ThinBufferMethods: Send + Sync {
@@ -26,6 +26,7 @@ pub fn copy_cgu_workproducts_to_incr_comp_cache_dir(
                      WorkProductFileKind::Object => "o",
                      WorkProductFileKind::Bytecode => "bc",
                      WorkProductFileKind::BytecodeCompressed => "bc.z",
+                     WorkProductFileKind::SplitDwarf => "dwo",
                  };
                  let file_name = format!("{}.{}", cgu_name, extension);
                  let path_in_incr_dir = in_incr_comp_dir_sess(sess, &file_name);
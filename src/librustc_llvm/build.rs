@@ -14,6 +14,20 @@ fn detect_llvm_link() -> (&'static str, &'static str) {
     }
 }
 
+fn build_bench(cfg: &cc::Build, llvm_config: &Path, llvm_link_arg: &str) {
+    let out_dir = PathBuf::from(env::var_os("OUT_DIR").expect("OUT_DIR was not set"));
+    let mut cmd = cfg.get_compiler().to_command();
+    cmd.arg("-I").arg("../rustllvm")
+       .arg("../rustllvm/bench/RustLLVMBench.cpp")
+       .arg("-o").arg(out_dir.join("rustllvm-bench"))
+       .arg(out_dir.join("librustllvm.a"));
+    let libs = output(Command::new(llvm_config)
+                          .arg(llvm_link_arg)
+                          .args(&["--ldflags", "--libs", "--system-libs"]));
+    cmd.args(libs.split_whitespace());
+    build_helper::run(&mut cmd);
+}
+
 fn main() {
     if env::var_os("RUST_CHECK").is_some() {
         // If we're just running `check`, there's no need for LLVM to be built.
@@ -165,6 +179,14 @@ fn main() {
 
     let (llvm_kind, llvm_link_arg) = detect_llvm_link();
 
+    // The benchmark in `../rustllvm/bench` isn't needed by rustc, so it's only
+    // built if asked for. It's linked against the shims just compiled and
+    // ends up next to them in the build directory.
+    println!("cargo:rerun-if-env-changed=RUSTC_LLVM_BENCH");
+    if env::var_os("RUSTC_LLVM_BENCH").is_some() && !is_crossed && !target.contains("windows") {
+        build_bench(&cfg, &llvm_config, llvm_link_arg);
+    }
+
     // Link in all LLVM libraries, if we're uwring the "wrong" llvm-config then
     // we don't pick up system libs because unfortunately they're for the host
     // of llvm-config, not the target that we're attempting to link.
@@ -2,7 +2,13 @@
 
 #include "llvm/Object/Archive.h"
 #include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Object/SymbolicFile.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+
+#include <map>
+#include <set>
 
 using namespace llvm;
 using namespace llvm::object;
@@ -11,6 +17,9 @@ struct RustArchiveMember {
   const char *Filename;
   const char *Name;
   Archive::Child Child;
+  // Contents of a new member that's only in memory, in which case both
+  // `Filename` and `Child` are unset.
+  StringRef Buffer;
 
   RustArchiveMember()
       : Filename(nullptr), Name(nullptr),
@@ -20,6 +29,20 @@ struct RustArchiveMember {
   ~RustArchiveMember() {}
 };
 
+struct RustArchive {
+  OwningBinary<Archive> Binary;
+
+  // Every child of the archive and an index of them by name, built on the
+  // first lookup by name. If several children have the same name the first
+  // one is found, same as when iterating.
+  bool Indexed;
+  std::vector<Archive::Child> Children;
+  StringMap<size_t> ChildIndex;
+
+  RustArchive(OwningBinary<Archive> Binary)
+      : Binary(std::move(Binary)), Indexed(false) {}
+};
+
 struct RustArchiveIterator {
   bool First;
   Archive::child_iterator Cur;
@@ -49,41 +72,128 @@ static Archive::Kind fromRust(LLVMRustArchiveKind Kind) {
   }
 }
 
-typedef OwningBinary<Archive> *LLVMRustArchiveRef;
+typedef RustArchive *LLVMRustArchiveRef;
 typedef RustArchiveMember *LLVMRustArchiveMemberRef;
 typedef Archive::Child *LLVMRustArchiveChildRef;
 typedef Archive::Child const *LLVMRustArchiveChildConstRef;
 typedef RustArchiveIterator *LLVMRustArchiveIteratorRef;
 
-extern "C" LLVMRustArchiveRef LLVMRustOpenArchive(char *Path) {
-  ErrorOr<std::unique_ptr<MemoryBuffer>> BufOr =
-      MemoryBuffer::getFile(Path, -1, false);
-  if (!BufOr) {
-    LLVMRustSetLastError(BufOr.getError().message().c_str());
-    return nullptr;
-  }
+// Opens the archive at `Path` to be read as described by `Access`. If
+// `Prefetch` isn't null, the kernel is also told to start reading the
+// children whose names end with it (e.g. the metadata or the bytecode of an
+// rlib) right away, which is useful with `Random` access where nothing else
+// is read ahead. Returns an error message on failure.
+static std::string openArchive(const char *Path, LLVMRustFileAccess Access,
+                               const char *Prefetch, RustArchive *&Ret) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufOr = rustOpenFile(Path, Access);
+  if (!BufOr)
+    return BufOr.getError().message();
 
   Expected<std::unique_ptr<Archive>> ArchiveOr =
       Archive::create(BufOr.get()->getMemBufferRef());
+  if (!ArchiveOr)
+    return toString(ArchiveOr.takeError());
+
+  if (Prefetch) {
+    Error Err = Error::success();
+    for (const Archive::Child &Child : ArchiveOr.get()->children(Err)) {
+      Expected<StringRef> NameOrErr = Child.getName();
+      if (!NameOrErr) {
+        // Whoever reads the child will run into this as well.
+        consumeError(NameOrErr.takeError());
+        break;
+      }
+      if (!NameOrErr->endswith(Prefetch))
+        continue;
+      Expected<StringRef> BufOrErr = Child.getBuffer();
+      if (BufOrErr)
+        rustAdviseFileRange(*BufOr.get(), *BufOrErr,
+                            LLVMRustFileAccess::WillNeed);
+      else
+        consumeError(BufOrErr.takeError());
+    }
+    consumeError(std::move(Err));
+  }
 
-  if (!ArchiveOr) {
-    LLVMRustSetLastError(toString(ArchiveOr.takeError()).c_str());
+  Ret = new RustArchive(OwningBinary<Archive>(std::move(ArchiveOr.get()),
+                                              std::move(BufOr.get())));
+  return std::string();
+}
+
+extern "C" LLVMRustArchiveRef LLVMRustOpenArchive(char *Path) {
+  RustArchive *Ret = nullptr;
+  std::string Error =
+      openArchive(Path, LLVMRustFileAccess::Default, nullptr, Ret);
+  if (!Error.empty()) {
+    LLVMRustSetLastError(Error.c_str());
     return nullptr;
   }
+  return Ret;
+}
 
-  OwningBinary<Archive> *Ret = new OwningBinary<Archive>(
-      std::move(ArchiveOr.get()), std::move(BufOr.get()));
-
+// Same as `LLVMRustOpenArchive`, but with the file mapped and read as
+// described by `Access` and `Prefetch`, see `openArchive`.
+extern "C" LLVMRustArchiveRef
+LLVMRustOpenArchiveWithAccess(const char *Path, LLVMRustFileAccess Access,
+                              const char *Prefetch) {
+  RustArchive *Ret = nullptr;
+  std::string Error = openArchive(Path, Access, Prefetch, Ret);
+  if (!Error.empty()) {
+    LLVMRustSetLastError(Error.c_str());
+    return nullptr;
+  }
   return Ret;
 }
 
+// Opens the `N` archives at `Paths` like `LLVMRustOpenArchiveWithAccess`, on
+// a thread pool. Opening an archive is mostly waiting for the file system
+// (which adds up for the many rlibs of a crate graph on a network file
+// system), so the archives are opened concurrently even though there's
+// hardly any work to do for each.
+//
+// On failure an error is reported for each archive that couldn't be opened,
+// and none of them are returned.
+extern "C" LLVMRustResult
+LLVMRustOpenArchives(const char *const *Paths, size_t N,
+                     LLVMRustFileAccess Access, const char *Prefetch,
+                     LLVMRustArchiveRef *Archives) {
+  // More threads than cores, as they spend their time blocked on I/O.
+  const size_t MaxThreads = 16;
+  std::vector<std::string> Errors(N);
+  for (size_t I = 0; I < N; I++)
+    Archives[I] = nullptr;
+  {
+    ThreadPool Pool(std::max<size_t>(std::min<size_t>(MaxThreads, N), 1));
+    for (size_t I = 0; I < N; I++)
+      Pool.async([&, I] {
+        Errors[I] = openArchive(Paths[I], Access, Prefetch, Archives[I]);
+      });
+  }
+
+  bool Failed = false;
+  for (size_t I = 0; I < N; I++) {
+    if (!Errors[I].empty()) {
+      LLVMRustReportError(LLVMRustErrorKind::Archive, Paths[I],
+                          Errors[I].c_str());
+      Failed = true;
+    }
+  }
+  if (!Failed)
+    return LLVMRustResult::Success;
+  for (size_t I = 0; I < N; I++) {
+    delete Archives[I];
+    Archives[I] = nullptr;
+  }
+  return LLVMRustResult::Failure;
+}
+
 extern "C" void LLVMRustDestroyArchive(LLVMRustArchiveRef RustArchive) {
   delete RustArchive;
 }
 
 extern "C" LLVMRustArchiveIteratorRef
 LLVMRustArchiveIteratorNew(LLVMRustArchiveRef RustArchive) {
-  Archive *Archive = RustArchive->getBinary();
+  Archive *Archive = RustArchive->Binary.getBinary();
   RustArchiveIterator *RAI = new RustArchiveIterator();
   RAI->Cur = Archive->child_begin(RAI->Err);
   if (RAI->Err) {
@@ -125,6 +235,65 @@ LLVMRustArchiveIteratorNext(LLVMRustArchiveIteratorRef RAI) {
   return Ret;
 }
 
+// Finds the child defining the symbol `Name` using the archive's symbol
+// table, without looking at any other child. Returns null if no child
+// defines it, or if the archive has no symbol table. If there was an error
+// reading the archive an error is reported as well.
+//
+// Like `LLVMRustArchiveIteratorNext`, the returned child must be freed with
+// `LLVMRustArchiveChildFree`.
+extern "C" LLVMRustArchiveChildConstRef
+LLVMRustArchiveFindSymbol(LLVMRustArchiveRef RustArchive, const char *Name) {
+  Expected<Optional<Archive::Child>> ChildOrErr =
+      RustArchive->Binary.getBinary()->findSym(Name);
+  if (!ChildOrErr) {
+    LLVMRustSetLastError(toString(ChildOrErr.takeError()).c_str());
+    return nullptr;
+  }
+  if (!ChildOrErr->hasValue())
+    return nullptr;
+  return new Archive::Child(ChildOrErr->getValue());
+}
+
+// Finds the child named `Name` (e.g. the metadata of an rlib). The first
+// lookup indexes all children by name, so this is a hash lookup afterwards.
+// Returns null if there's no such child, or if the archive couldn't be read
+// in which case an error is reported as well.
+//
+// The returned child must be freed with `LLVMRustArchiveChildFree`.
+extern "C" LLVMRustArchiveChildConstRef
+LLVMRustArchiveFindChild(LLVMRustArchiveRef RustArchive, const char *Name) {
+  if (!RustArchive->Indexed) {
+    Error Err = Error::success();
+    for (const Archive::Child &Child :
+         RustArchive->Binary.getBinary()->children(Err)) {
+      Expected<StringRef> NameOrErr = Child.getName();
+      if (!NameOrErr) {
+        consumeError(std::move(Err));
+        LLVMRustSetLastError(toString(NameOrErr.takeError()).c_str());
+        RustArchive->Children.clear();
+        RustArchive->ChildIndex.clear();
+        return nullptr;
+      }
+      RustArchive->ChildIndex.insert(
+          std::make_pair(*NameOrErr, RustArchive->Children.size()));
+      RustArchive->Children.push_back(Child);
+    }
+    if (Err) {
+      LLVMRustSetLastError(toString(std::move(Err)).c_str());
+      RustArchive->Children.clear();
+      RustArchive->ChildIndex.clear();
+      return nullptr;
+    }
+    RustArchive->Indexed = true;
+  }
+
+  auto It = RustArchive->ChildIndex.find(Name);
+  if (It == RustArchive->ChildIndex.end())
+    return nullptr;
+  return new Archive::Child(RustArchive->Children[It->second]);
+}
+
 extern "C" void LLVMRustArchiveChildFree(LLVMRustArchiveChildRef Child) {
   delete Child;
 }
@@ -161,6 +330,62 @@ extern "C" const char *LLVMRustArchiveChildData(LLVMRustArchiveChildRef Child,
   return Buf.data();
 }
 
+// One child of an archive, as filled in by `LLVMRustArchiveGetChildren`.
+struct LLVMRustArchiveChildInfo {
+  const char *Name;
+  size_t NameLen;
+  const char *Data;
+  size_t DataLen;
+  uint64_t Offset; // of the child's header within the archive
+};
+
+// Describes all children of the archive in a single pass, for callers that
+// look at every child anyway. This avoids the allocation of a child and a
+// few calls across the FFI boundary for each one that iterating costs.
+//
+// Up to `Capacity` entries of `Children` are filled in, and the total number
+// of children is stored into `NumChildren`, so a caller which doesn't know
+// the number yet can call this first with a `Capacity` of zero. Names and
+// data point into the archive (usually mapped into memory), so they're only
+// valid for as long as it's open.
+extern "C" LLVMRustResult
+LLVMRustArchiveGetChildren(LLVMRustArchiveRef RustArchive,
+                           LLVMRustArchiveChildInfo *Children,
+                           size_t Capacity, size_t *NumChildren) {
+  size_t N = 0;
+  Error Err = Error::success();
+  for (const Archive::Child &Child :
+       RustArchive->Binary.getBinary()->children(Err)) {
+    if (N < Capacity) {
+      Expected<StringRef> NameOrErr = Child.getName();
+      if (!NameOrErr) {
+        consumeError(std::move(Err));
+        LLVMRustSetLastError(toString(NameOrErr.takeError()).c_str());
+        return LLVMRustResult::Failure;
+      }
+      Expected<StringRef> BufOrErr = Child.getBuffer();
+      if (!BufOrErr) {
+        consumeError(std::move(Err));
+        LLVMRustSetLastError(toString(BufOrErr.takeError()).c_str());
+        return LLVMRustResult::Failure;
+      }
+      LLVMRustArchiveChildInfo &Info = Children[N];
+      Info.Name = NameOrErr->data();
+      Info.NameLen = NameOrErr->size();
+      Info.Data = BufOrErr->data();
+      Info.DataLen = BufOrErr->size();
+      Info.Offset = Child.getChildOffset();
+    }
+    N++;
+  }
+  if (Err) {
+    LLVMRustSetLastError(toString(std::move(Err)).c_str());
+    return LLVMRustResult::Failure;
+  }
+  *NumChildren = N;
+  return LLVMRustResult::Success;
+}
+
 extern "C" LLVMRustArchiveMemberRef
 LLVMRustArchiveMemberNew(char *Filename, char *Name,
                          LLVMRustArchiveChildRef Child) {
@@ -172,15 +397,27 @@ LLVMRustArchiveMemberNew(char *Filename, char *Name,
   return Member;
 }
 
+// Creates a member named `Name` from the `Len` bytes at `Data`, which must
+// stay alive until the archive is written.
+extern "C" LLVMRustArchiveMemberRef
+LLVMRustArchiveMemberNewFromBuffer(char *Name, const char *Data, size_t Len) {
+  RustArchiveMember *Member = new RustArchiveMember;
+  Member->Name = Name;
+  Member->Buffer = StringRef(Data, Len);
+  return Member;
+}
+
 extern "C" void LLVMRustArchiveMemberFree(LLVMRustArchiveMemberRef Member) {
   delete Member;
 }
 
-extern "C" LLVMRustResult
-LLVMRustWriteArchive(char *Dst, size_t NumMembers,
-                     const LLVMRustArchiveMemberRef *NewMembers,
-                     bool WriteSymbtab, LLVMRustArchiveKind RustKind) {
-
+// Writes an archive with `writeArchive`. A thin archive only refers to its
+// members by path (relative to the archive) rather than containing them, so
+// all of its members must be files.
+static LLVMRustResult
+writeRustArchive(char *Dst, size_t NumMembers,
+                 const LLVMRustArchiveMemberRef *NewMembers,
+                 bool WriteSymbtab, LLVMRustArchiveKind RustKind, bool Thin) {
   std::vector<NewArchiveMember> Members;
   auto Kind = fromRust(RustKind);
 
@@ -194,8 +431,17 @@ LLVMRustWriteArchive(char *Dst, size_t NumMembers,
         LLVMRustSetLastError(toString(MOrErr.takeError()).c_str());
         return LLVMRustResult::Failure;
       }
-      MOrErr->MemberName = sys::path::filename(MOrErr->MemberName);
+      // `writeArchive` needs the whole path for members of thin archives.
+      if (!Thin)
+        MOrErr->MemberName = sys::path::filename(MOrErr->MemberName);
       Members.push_back(std::move(*MOrErr));
+    } else if (Thin && (Member->Buffer.data() ||
+                        !Member->Child.getParent()->isThin())) {
+      LLVMRustSetLastError("members of thin archives must be files");
+      return LLVMRustResult::Failure;
+    } else if (Member->Buffer.data()) {
+      Members.push_back(
+          NewArchiveMember(MemoryBufferRef(Member->Buffer, Member->Name)));
     } else {
       Expected<NewArchiveMember> MOrErr =
           NewArchiveMember::getOldMember(Member->Child, true);
@@ -207,10 +453,499 @@ LLVMRustWriteArchive(char *Dst, size_t NumMembers,
     }
   }
 
-  auto Result = writeArchive(Dst, Members, WriteSymbtab, Kind, true, false);
+  auto Result = writeArchive(Dst, Members, WriteSymbtab, Kind, true, Thin);
   if (!Result)
     return LLVMRustResult::Success;
   LLVMRustSetLastError(toString(std::move(Result)).c_str());
 
   return LLVMRustResult::Failure;
 }
+
+extern "C" LLVMRustResult
+LLVMRustWriteArchive(char *Dst, size_t NumMembers,
+                     const LLVMRustArchiveMemberRef *NewMembers,
+                     bool WriteSymbtab, LLVMRustArchiveKind RustKind) {
+  return writeRustArchive(Dst, NumMembers, NewMembers, WriteSymbtab, RustKind,
+                          /* Thin = */ false);
+}
+
+// Writes a GNU thin archive (`!<thin>`), which lists its members including
+// their symbols but leaves the contents where they are. This makes creating
+// intermediate archives nearly free, but they're only valid for as long as
+// the member files exist. All members must be files, or members of another
+// thin archive.
+extern "C" LLVMRustResult
+LLVMRustWriteThinArchive(char *Dst, size_t NumMembers,
+                         const LLVMRustArchiveMemberRef *NewMembers,
+                         bool WriteSymbtab) {
+  return writeRustArchive(Dst, NumMembers, NewMembers, WriteSymbtab,
+                          LLVMRustArchiveKind::GNU, /* Thin = */ true);
+}
+
+// Below is an archive writer for GNU archives which reads the symbols of
+// its members in parallel, unlike `writeArchive` which parses every member
+// serially on the calling thread. It also doesn't parse members copied from
+// an existing archive at all when that archive has a symbol table, their
+// entries in the old symbol table are reused instead.
+//
+// The output has the same layout as what `writeArchive` produces for
+// deterministic archives: a `/` (or `/SYM64/`) symbol table, a `//` table of
+// long member names and then all the members. It's streamed into a
+// temporary file next to the destination which is renamed over it at the
+// end, so a failed write doesn't leave a truncated archive behind.
+
+namespace {
+
+struct PendingArchiveMember {
+  std::string Name;
+  StringRef Data;
+  std::unique_ptr<MemoryBuffer> OwnedData;
+  const char *Filename;
+
+  // All global symbols defined by this member, each terminated by a NUL.
+  std::string Symbols;
+  uint64_t NumSymbols;
+  bool HaveSymbols;
+
+  // The mode written into the member's header, the same one
+  // `NewArchiveMember` would have for it.
+  unsigned Perms;
+
+  std::string Error;
+  uint64_t Offset;
+
+  PendingArchiveMember()
+      : Filename(nullptr), NumSymbols(0), HaveSymbols(false), Perms(0644),
+        Offset(0) {}
+};
+
+// The symbol table of an existing archive, split up by member.
+typedef std::map<uint64_t, std::pair<std::string, uint64_t>> OldSymbolTable;
+
+} // namespace
+
+static std::string errorMessage(Error Err) { return toString(std::move(Err)); }
+static std::string errorMessage(std::error_code EC) { return EC.message(); }
+
+// Collects the symbols of every member of `A` by the offset of the member,
+// returning false if the archive has no (usable) symbol table.
+static bool readOldSymbolTable(const Archive &A, OldSymbolTable &Table) {
+  if (!A.hasSymbolTable())
+    return false;
+  for (const Archive::Symbol &Sym : A.symbols()) {
+    Expected<Archive::Child> ChildOrErr = Sym.getMember();
+    if (!ChildOrErr) {
+      consumeError(ChildOrErr.takeError());
+      Table.clear();
+      return false;
+    }
+    auto &Entry = Table[ChildOrErr->getChildOffset()];
+    Entry.first += Sym.getName();
+    Entry.first += '\0';
+    Entry.second++;
+  }
+  return true;
+}
+
+// Reads the symbols an archive symbol table should list for `Member`, the
+// same ones `writeArchive` would: all defined global symbols, plus indirect
+// ones. Members which aren't object files (or bitcode) don't define any.
+static void readMemberSymbols(PendingArchiveMember &Member) {
+  LLVMContext Context;
+  Expected<std::unique_ptr<SymbolicFile>> ObjOrErr =
+      SymbolicFile::createSymbolicFile(
+          MemoryBufferRef(Member.Data, Member.Name), file_magic::unknown,
+          &Context);
+  if (!ObjOrErr) {
+    consumeError(ObjOrErr.takeError());
+    return;
+  }
+
+  raw_string_ostream OS(Member.Symbols);
+  for (const BasicSymbolRef &Sym : (*ObjOrErr)->symbols()) {
+    uint32_t Flags = Sym.getFlags();
+    if (!(Flags & BasicSymbolRef::SF_Global) ||
+        (Flags & BasicSymbolRef::SF_FormatSpecific))
+      continue;
+    if ((Flags & BasicSymbolRef::SF_Undefined) &&
+        !(Flags & BasicSymbolRef::SF_Indirect))
+      continue;
+    auto Err = Sym.printName(OS);
+    if (Err) {
+      Member.Error = errorMessage(std::move(Err));
+      return;
+    }
+    OS << '\0';
+    Member.NumSymbols++;
+  }
+  OS.flush();
+}
+
+static void writeGNUMemberHeader(raw_ostream &OS, StringRef Name,
+                                 unsigned Perms, uint64_t Size) {
+  std::string Mode;
+  raw_string_ostream(Mode) << format("%o", Perms);
+  OS << left_justify(Name, 16) << left_justify("0", 12)
+     << left_justify("0", 6) << left_justify("0", 6)
+     << left_justify(Mode, 8) << left_justify(std::to_string(Size), 10)
+     << "`\n";
+}
+
+static void writeBigEndian(raw_ostream &OS, uint64_t V, unsigned Width) {
+  for (unsigned I = Width; I-- > 0;)
+    OS << char((V >> (I * 8)) & 0xff);
+}
+
+static LLVMRustResult
+writeGNUArchive(StringRef Dst, std::vector<PendingArchiveMember> &Members,
+                bool WriteSymbtab) {
+  // Names that don't fit in a header go into the `//` member.
+  std::string LongNames;
+  std::vector<std::string> HeaderNames;
+  for (const PendingArchiveMember &Member : Members) {
+    if (Member.Name.size() < 16 &&
+        Member.Name.find('/') == std::string::npos) {
+      HeaderNames.push_back(Member.Name + "/");
+    } else {
+      HeaderNames.push_back("/" + std::to_string(LongNames.size()));
+      LongNames += Member.Name;
+      LongNames += "/\n";
+    }
+  }
+  if (LongNames.size() % 2)
+    LongNames += '\n';
+
+  uint64_t NumSymbols = 0, SymbolsSize = 0;
+  if (WriteSymbtab) {
+    for (const PendingArchiveMember &Member : Members) {
+      NumSymbols += Member.NumSymbols;
+      SymbolsSize += Member.Symbols.size();
+    }
+  }
+  // Like `writeArchive` there's no symbol table if there are no symbols.
+  bool HaveSymtab = NumSymbols > 0;
+
+  // Lay out the members, switching to 64-bit offsets in the symbol table if
+  // the archive turns out to be too large for 32-bit ones.
+  unsigned Width = 4;
+  uint64_t SymtabSize = 0;
+  for (;;) {
+    SymtabSize = alignTo(Width + Width * NumSymbols + SymbolsSize, 2);
+    uint64_t Pos = 8;
+    if (HaveSymtab)
+      Pos += 60 + SymtabSize;
+    if (!LongNames.empty())
+      Pos += 60 + LongNames.size();
+    for (PendingArchiveMember &Member : Members) {
+      Member.Offset = Pos;
+      Pos += 60 + alignTo(Member.Data.size(), 2);
+    }
+    if (Width == 8 || !HaveSymtab || Members.back().Offset <= UINT32_MAX)
+      break;
+    Width = 8;
+  }
+
+  // Created the same way `writeArchive` creates its temporary file, so the
+  // archive ends up with the permissions the umask allows rather than only
+  // being accessible by its owner.
+  Expected<sys::fs::TempFile> Temp =
+      sys::fs::TempFile::create(Dst + ".temp-archive-%%%%%%%.a");
+  if (!Temp) {
+    LLVMRustSetLastError(toString(Temp.takeError()).c_str());
+    return LLVMRustResult::Failure;
+  }
+
+  {
+    raw_fd_ostream OS(Temp->FD, /* shouldClose = */ false);
+    OS << "!<arch>\n";
+
+    if (HaveSymtab) {
+      writeGNUMemberHeader(OS, Width == 8 ? "/SYM64/" : "/", 0, SymtabSize);
+      writeBigEndian(OS, NumSymbols, Width);
+      for (const PendingArchiveMember &Member : Members)
+        for (uint64_t I = 0; I < Member.NumSymbols; I++)
+          writeBigEndian(OS, Member.Offset, Width);
+      for (const PendingArchiveMember &Member : Members)
+        OS << Member.Symbols;
+      for (uint64_t I = Width + Width * NumSymbols + SymbolsSize;
+           I < SymtabSize; I++)
+        OS << '\0';
+    }
+
+    if (!LongNames.empty()) {
+      OS << left_justify("//", 48)
+         << left_justify(std::to_string(LongNames.size()), 10) << "`\n"
+         << LongNames;
+    }
+
+    for (size_t I = 0; I < Members.size(); I++) {
+      const PendingArchiveMember &Member = Members[I];
+      writeGNUMemberHeader(OS, HeaderNames[I], Member.Perms,
+                           Member.Data.size());
+      OS << Member.Data;
+      if (Member.Data.size() % 2)
+        OS << '\n';
+    }
+
+    OS.flush();
+    if (OS.has_error()) {
+      OS.clear_error();
+      consumeError(Temp->discard());
+      LLVMRustSetLastError("failed to write archive");
+      return LLVMRustResult::Failure;
+    }
+  }
+
+  if (Error Err = Temp->keep(Dst)) {
+    LLVMRustSetLastError(toString(std::move(Err)).c_str());
+    return LLVMRustResult::Failure;
+  }
+  return LLVMRustResult::Success;
+}
+
+// Same as `LLVMRustWriteArchive`, except that GNU archives are written by the
+// parallel writer above. Other kinds of archives are passed on to
+// `LLVMRustWriteArchive`.
+extern "C" LLVMRustResult
+LLVMRustWriteArchiveParallel(char *Dst, size_t NumMembers,
+                             const LLVMRustArchiveMemberRef *NewMembers,
+                             bool WriteSymbtab, LLVMRustArchiveKind RustKind) {
+  if (RustKind != LLVMRustArchiveKind::GNU || NumMembers == 0)
+    return LLVMRustWriteArchive(Dst, NumMembers, NewMembers, WriteSymbtab,
+                                RustKind);
+
+  std::vector<PendingArchiveMember> Members(NumMembers);
+  std::map<const Archive *, OldSymbolTable> OldSymbolTables;
+  std::set<const Archive *> WithoutSymbolTable;
+
+  for (size_t I = 0; I < NumMembers; I++) {
+    auto Member = NewMembers[I];
+    PendingArchiveMember &Pending = Members[I];
+    assert(Member->Name);
+    if (Member->Filename) {
+      // Read on the thread pool along with the symbols.
+      Pending.Filename = Member->Filename;
+      Pending.Name = sys::path::filename(Member->Filename).str();
+      // The mode is read from the file on the thread pool.
+    } else if (Member->Buffer.data()) {
+      Pending.Name = Member->Name;
+      Pending.Data = Member->Buffer;
+    } else {
+      Expected<StringRef> NameOrErr = Member->Child.getName();
+      if (!NameOrErr) {
+        LLVMRustSetLastError(toString(NameOrErr.takeError()).c_str());
+        return LLVMRustResult::Failure;
+      }
+      Expected<StringRef> BufOrErr = Member->Child.getBuffer();
+      if (!BufOrErr) {
+        LLVMRustSetLastError(toString(BufOrErr.takeError()).c_str());
+        return LLVMRustResult::Failure;
+      }
+      Expected<sys::fs::perms> PermsOrErr = Member->Child.getAccessMode();
+      if (!PermsOrErr) {
+        LLVMRustSetLastError(toString(PermsOrErr.takeError()).c_str());
+        return LLVMRustResult::Failure;
+      }
+      Pending.Name = NameOrErr->str();
+      Pending.Data = *BufOrErr;
+      Pending.Perms = *PermsOrErr;
+
+      const Archive *Parent = Member->Child.getParent();
+      if (WriteSymbtab && !WithoutSymbolTable.count(Parent)) {
+        auto It = OldSymbolTables.find(Parent);
+        if (It == OldSymbolTables.end()) {
+          OldSymbolTable Table;
+          if (!readOldSymbolTable(*Parent, Table)) {
+            WithoutSymbolTable.insert(Parent);
+            continue;
+          }
+          It = OldSymbolTables.emplace(Parent, std::move(Table)).first;
+        }
+        // A member that isn't in the table doesn't define any symbols.
+        auto Entry = It->second.find(Member->Child.getChildOffset());
+        if (Entry != It->second.end()) {
+          Pending.Symbols = Entry->second.first;
+          Pending.NumSymbols = Entry->second.second;
+        }
+        Pending.HaveSymbols = true;
+      }
+    }
+  }
+
+  {
+    ThreadPool Pool(std::min<unsigned>(heavyweight_hardware_concurrency(),
+                                       NumMembers));
+    for (PendingArchiveMember &Pending : Members) {
+      if (!Pending.Filename && (!WriteSymbtab || Pending.HaveSymbols))
+        continue;
+      Pool.async([&Pending, WriteSymbtab] {
+        if (Pending.Filename) {
+          sys::fs::file_status Status;
+          if (std::error_code EC = sys::fs::status(Pending.Filename, Status)) {
+            Pending.Error = EC.message();
+            return;
+          }
+          Pending.Perms = Status.permissions();
+          ErrorOr<std::unique_ptr<MemoryBuffer>> BufOr =
+              MemoryBuffer::getFile(Pending.Filename, -1, false);
+          if (!BufOr) {
+            Pending.Error = BufOr.getError().message();
+            return;
+          }
+          Pending.OwnedData = std::move(*BufOr);
+          Pending.Data = Pending.OwnedData->getBuffer();
+        }
+        if (WriteSymbtab && !Pending.HaveSymbols)
+          readMemberSymbols(Pending);
+      });
+    }
+  }
+
+  for (const PendingArchiveMember &Pending : Members) {
+    if (!Pending.Error.empty()) {
+      LLVMRustSetLastError(Pending.Error.c_str());
+      return LLVMRustResult::Failure;
+    }
+  }
+
+  return writeGNUArchive(Dst, Members, WriteSymbtab);
+}
+
+// Replaces the member named `Name` of the archive at `Path` with the `Len`
+// bytes at `Data`, or appends it if there's no such member.
+//
+// This is meant for updating the metadata of an rlib, which is always its
+// last member and doesn't define any symbols. In that case (for a GNU archive
+// and a name short enough to not need the long name table) the symbol table
+// doesn't change, so everything before the old member is copied as it is and
+// the new one appended. Otherwise the whole archive is rewritten, with the
+// symbols of the untouched members taken from its symbol table. Either way
+// the new archive is written into a temporary file which is then renamed
+// over the old one, so it's never seen half written. Thin archives aren't
+// supported here.
+extern "C" LLVMRustResult
+LLVMRustArchiveReplaceMember(char *Path, char *Name, const char *Data,
+                             size_t Len, bool WriteSymbtab,
+                             LLVMRustArchiveKind RustKind) {
+  std::unique_ptr<RustArchive> Old(LLVMRustOpenArchive(Path));
+  if (!Old)
+    return LLVMRustResult::Failure;
+  const Archive &A = *Old->Binary.getBinary();
+  if (A.isThin()) {
+    LLVMRustSetLastError("can't replace members of thin archives");
+    return LLVMRustResult::Failure;
+  }
+
+  std::vector<RustArchiveMember> Members;
+  size_t Replaced = SIZE_MAX;
+  Error Err = Error::success();
+  for (const Archive::Child &Child : A.children(Err)) {
+    Expected<StringRef> NameOrErr = Child.getName();
+    if (!NameOrErr) {
+      consumeError(std::move(Err));
+      LLVMRustSetLastError(toString(NameOrErr.takeError()).c_str());
+      return LLVMRustResult::Failure;
+    }
+    // The name of an old member is taken from `Child`.
+    RustArchiveMember Member;
+    Member.Name = "";
+    Member.Child = Child;
+    if (*NameOrErr == Name && Replaced == SIZE_MAX) {
+      Replaced = Members.size();
+      Member.Name = Name;
+      Member.Buffer = StringRef(Data, Len);
+    }
+    Members.push_back(Member);
+  }
+  if (Err) {
+    LLVMRustSetLastError(toString(std::move(Err)).c_str());
+    return LLVMRustResult::Failure;
+  }
+  if (Replaced == SIZE_MAX) {
+    RustArchiveMember Member;
+    Member.Name = Name;
+    Member.Buffer = StringRef(Data, Len);
+    Replaced = Members.size();
+    Members.push_back(Member);
+  }
+
+  // The old archive must already be in the format that's asked for, as the
+  // fast path leaves everything but the last member as it is.
+  StringRef NameRef(Name);
+  bool FastPath = RustKind == LLVMRustArchiveKind::GNU &&
+                  (A.kind() == Archive::K_GNU ||
+                   A.kind() == Archive::K_GNU64) &&
+                  Replaced == Members.size() - 1 &&
+                  NameRef.size() < 16 && NameRef.find('/') == StringRef::npos;
+
+  // Neither the old nor the new member may define symbols.
+  uint64_t TruncateTo = A.getMemoryBufferRef().getBufferSize();
+  if (FastPath && Members[Replaced].Child.getParent()) {
+    uint64_t Offset = Members[Replaced].Child.getChildOffset();
+    for (const Archive::Symbol &Sym : A.symbols()) {
+      Expected<Archive::Child> ChildOrErr = Sym.getMember();
+      if (!ChildOrErr) {
+        consumeError(ChildOrErr.takeError());
+        FastPath = false;
+        break;
+      }
+      if (ChildOrErr->getChildOffset() == Offset) {
+        FastPath = false;
+        break;
+      }
+    }
+    TruncateTo = Offset;
+  }
+  if (FastPath && WriteSymbtab) {
+    PendingArchiveMember New;
+    New.Name = NameRef.str();
+    New.Data = StringRef(Data, Len);
+    readMemberSymbols(New);
+    FastPath = New.NumSymbols == 0 && New.Error.empty();
+  }
+
+  if (!FastPath) {
+    // Both writers rename their own temporary file over `Path` only once
+    // they're done reading the members out of the old archive.
+    std::vector<LLVMRustArchiveMemberRef> MemberRefs;
+    for (RustArchiveMember &Member : Members)
+      MemberRefs.push_back(&Member);
+    return LLVMRustWriteArchiveParallel(Path, MemberRefs.size(),
+                                        MemberRefs.data(), WriteSymbtab,
+                                        RustKind);
+  }
+
+  Expected<sys::fs::TempFile> Temp =
+      sys::fs::TempFile::create(Twine(Path) + ".temp-archive-%%%%%%%.a");
+  if (!Temp) {
+    LLVMRustSetLastError(toString(Temp.takeError()).c_str());
+    return LLVMRustResult::Failure;
+  }
+
+  {
+    raw_fd_ostream OS(Temp->FD, /* shouldClose = */ false);
+    OS << A.getMemoryBufferRef().getBuffer().take_front(TruncateTo);
+    if (TruncateTo % 2)
+      OS << '\n';
+    writeGNUMemberHeader(OS, (NameRef + "/").str(), 0644, Len);
+    OS << StringRef(Data, Len);
+    if (Len % 2)
+      OS << '\n';
+    OS.flush();
+    if (OS.has_error()) {
+      OS.clear_error();
+      consumeError(Temp->discard());
+      LLVMRustSetLastError("failed to write archive");
+      return LLVMRustResult::Failure;
+    }
+  }
+
+  // Unmap the old archive before it's replaced.
+  Members.clear();
+  Old.reset();
+  if (Error Err = Temp->keep(Path)) {
+    LLVMRustSetLastError(toString(std::move(Err)).c_str());
+    return LLVMRustResult::Failure;
+  }
+  return LLVMRustResult::Success;
+}
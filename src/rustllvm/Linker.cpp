@@ -1,4 +1,9 @@
 #include "llvm/Linker/Linker.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/ThreadPool.h"
 
 #include "rustllvm.h"
 
@@ -6,11 +11,19 @@ using namespace llvm;
 
 struct RustLinker {
   Linker L;
+  Module &Dst;
   LLVMContext &Ctx;
 
+  // Symbols which must stay visible outside of the linked module, see
+  // `LLVMRustLinkerSetPreservedSymbols`.
+  bool Internalize;
+  StringSet<> Preserved;
+
   RustLinker(Module &M) :
     L(M),
-    Ctx(M.getContext())
+    Dst(M),
+    Ctx(M.getContext()),
+    Internalize(false)
   {}
 };
 
@@ -27,23 +40,285 @@ LLVMRustLinkerFree(RustLinker *L) {
   delete L;
 }
 
-extern "C" bool
-LLVMRustLinkerAdd(RustLinker *L, char *BC, size_t Len) {
-  std::unique_ptr<MemoryBuffer> Buf =
-      MemoryBuffer::getMemBufferCopy(StringRef(BC, Len));
+// Tells the linker which symbols will be exported from the final module,
+// such that `LLVMRustLinkerAddBatch` can internalize everything else as it
+// links modules in instead of leaving that to `LLVMRustRunRestrictionPass`
+// afterwards.
+extern "C" void
+LLVMRustLinkerSetPreservedSymbols(RustLinker *L, char **Symbols, size_t Len) {
+  L->Internalize = true;
+  for (size_t I = 0; I < Len; I++)
+    L->Preserved.insert(Symbols[I]);
+}
+
+// Gives internal linkage to all external definitions of the lazily loaded
+// module `Src` which aren't in `Needed`. The linker only materializes and
+// links internal definitions that something it links refers to, so if
+// nothing does they're never even parsed. Members of `llvm.used` and
+// `llvm.compiler.used` are kept as they are, as they're referenced from
+// outside the IR.
+static void internalizeUnneeded(Module &Src, const StringSet<> &Needed) {
+  SmallPtrSet<GlobalValue *, 8> Used;
+  collectUsedGlobalVariables(Src, Used, /* CompilerUsed = */ false);
+  collectUsedGlobalVariables(Src, Used, /* CompilerUsed = */ true);
+  for (GlobalValue &GV : Src.global_values()) {
+    if (!GV.hasExternalLinkage() || GV.isDeclaration() || !GV.hasName() ||
+        GV.getName().startswith("llvm.") || Needed.count(GV.getName()) ||
+        Used.count(&GV))
+      continue;
+    if (auto *GO = dyn_cast<GlobalObject>(&GV))
+      if (GO->hasComdat())
+        continue;
+    GV.setLinkage(GlobalValue::InternalLinkage);
+    GV.setVisibility(GlobalValue::DefaultVisibility);
+    GV.setDLLStorageClass(GlobalValue::DefaultStorageClass);
+  }
+}
+
+// The linker only links linkonce and available_externally definitions of a
+// module if the destination already refers to them, or if something else it
+// links does. Linked into the final destination one by one, modules may
+// well provide such definitions for modules linked earlier (or for the
+// destination itself), so when modules are linked into an intermediate
+// module of a group instead, each of these definitions is declared in the
+// group's module first, which makes the linker keep it. Unused copies are
+// dropped again when the group is linked into the final destination.
+static void declareLinkOnce(Module &Group, Module &Src) {
+  for (Function &F : Src) {
+    if (F.isDeclaration() || !F.hasName() ||
+        !(F.hasLinkOnceLinkage() || F.hasAvailableExternallyLinkage()) ||
+        Group.getNamedValue(F.getName()))
+      continue;
+    Function::Create(F.getFunctionType(), GlobalValue::ExternalLinkage,
+                     F.getName(), &Group);
+  }
+  for (GlobalVariable &GV : Src.globals()) {
+    if (GV.isDeclaration() || !GV.hasName() ||
+        !(GV.hasLinkOnceLinkage() || GV.hasAvailableExternallyLinkage()) ||
+        Group.getNamedValue(GV.getName()))
+      continue;
+    new GlobalVariable(Group, GV.getValueType(), GV.isConstant(),
+                       GlobalValue::ExternalLinkage, nullptr, GV.getName(),
+                       nullptr, GV.getThreadLocalMode(),
+                       GV.getType()->getAddressSpace());
+  }
+}
 
+// Links `Buf` with `L`. `Group` is the module `L` links into if that's the
+// intermediate module of `linkGroup`, see `declareLinkOnce`.
+static bool linkBuffer(Linker &L, LLVMContext &Ctx, MemoryBufferRef Buf,
+                       const StringSet<> *Needed, Module *Group,
+                       std::string &Error) {
   Expected<std::unique_ptr<Module>> SrcOrError =
-      llvm::getLazyBitcodeModule(Buf->getMemBufferRef(), L->Ctx);
+      llvm::getLazyBitcodeModule(Buf, Ctx);
   if (!SrcOrError) {
-    LLVMRustSetLastError(toString(SrcOrError.takeError()).c_str());
+    Error = toString(SrcOrError.takeError());
     return false;
   }
 
   auto Src = std::move(*SrcOrError);
+  if (Needed)
+    internalizeUnneeded(*Src, *Needed);
+  if (Group)
+    declareLinkOnce(*Group, *Src);
+
+  // Errors are reported through the context's diagnostic handler.
+  return !L.linkInModule(std::move(Src));
+}
 
-  if (L->L.linkInModule(std::move(Src))) {
-    LLVMRustSetLastError("");
+// Links the bitcode module `BC` into the destination module.
+//
+// The bitcode is read straight out of the caller's buffer without copying
+// it, which is fine as the buffer only needs to live until this returns: the
+// lazily loaded source module is materialized as needed and destroyed by
+// `linkInModule`, so nothing refers to the buffer afterwards.
+//
+// This doesn't internalize anything even if there are preserved symbols, as
+// it's not known here what the modules linked later refer to.
+extern "C" bool
+LLVMRustLinkerAdd(RustLinker *L, char *BC, size_t Len) {
+  MemoryBufferRef Buf(StringRef(BC, Len), "");
+  std::string Error;
+  if (!linkBuffer(L->L, L->Ctx, Buf, nullptr, nullptr, Error)) {
+    LLVMRustSetLastError(Error.c_str());
     return false;
   }
   return true;
 }
+
+// Diagnostic handler for the private contexts of `linkGroup`. Errors are
+// recorded to be reported by `LLVMRustLinkerAddBatch`, anything else is
+// printed like the default handler would.
+static void handleGroupDiagnostic(const DiagnosticInfo &DI, void *Error) {
+  std::string Message;
+  raw_string_ostream OS(Message);
+  DiagnosticPrinterRawOStream DP(OS);
+  DI.print(DP);
+  OS.flush();
+  if (DI.getSeverity() == DS_Error) {
+    std::string &FirstError = *static_cast<std::string *>(Error);
+    if (FirstError.empty())
+      FirstError = Message;
+  } else {
+    errs() << Message << "\n";
+  }
+}
+
+// Links `Modules` together in a context of its own and serializes the result
+// into `Out`. Returns an error message on failure.
+static std::string linkGroup(ArrayRef<MemoryBufferRef> Modules,
+                             bool DiscardValueNames, const StringSet<> *Needed,
+                             SmallVectorImpl<char> &Out) {
+  LLVMContext Ctx;
+  Ctx.setDiscardValueNames(DiscardValueNames);
+  std::string Error;
+  Ctx.setDiagnosticHandlerCallBack(handleGroupDiagnostic, &Error);
+
+  // The data layout and triple are taken from the first module linked in.
+  Module Dst("", Ctx);
+  Linker L(Dst);
+  for (const MemoryBufferRef &Buf : Modules) {
+    if (!linkBuffer(L, Ctx, Buf, Needed, &Dst, Error))
+      return Error.empty() ? "failed to link module" : Error;
+  }
+
+  raw_svector_ostream OS(Out);
+#if LLVM_VERSION_GE(7, 0)
+  WriteBitcodeToFile(Dst, OS);
+#else
+  WriteBitcodeToFile(&Dst, OS);
+#endif
+  return std::string();
+}
+
+// Collects the names of all symbols that the lazily loaded module `Buf`
+// refers to but doesn't define. Returns false if that's not known because
+// the module contains inline assembly, which may refer to anything.
+static bool collectReferences(MemoryBufferRef Buf, std::vector<std::string> &Refs,
+                              std::string &Error) {
+  LLVMContext Ctx;
+  Expected<std::unique_ptr<Module>> MOrError =
+      llvm::getLazyBitcodeModule(Buf, Ctx);
+  if (!MOrError) {
+    Error = toString(MOrError.takeError());
+    return true;
+  }
+  if (!(*MOrError)->getModuleInlineAsm().empty())
+    return false;
+  for (const GlobalValue &GV : (*MOrError)->global_values())
+    if (GV.isDeclaration() && GV.hasName())
+      Refs.push_back(GV.getName().str());
+  return true;
+}
+
+// Links `N` bitcode modules into the destination module on up to `Threads`
+// threads (or one per core if that's 0). This links the same definitions as
+// calling `LLVMRustLinkerAdd` on each of them in order, except that it may
+// keep linkonce and available_externally definitions which that would have
+// dropped, and which are dropped again later if nothing uses them.
+//
+// If `LLVMRustLinkerSetPreservedSymbols` was called, the external
+// definitions of each module which aren't preserved and which no other
+// module refers to are internalized as the module is linked in, so that
+// they're never materialized unless something else in their module needs
+// them. The references of all modules are collected up front for this,
+// which only requires reading the module level records of each.
+//
+// An `LLVMContext` can only be used by one thread at a time and all of a
+// module's IR lives in its context, so modules can't be parsed in parallel
+// straight into the destination. Instead the modules are split into
+// contiguous groups which are each linked on a thread pool in a context of
+// their own, and serialized again. The groups are then linked into the
+// destination in order, which is the only serial part left.
+//
+// Linking in order within and across groups means that, just like linking
+// one by one, the first definition of a linkonce/weak symbol wins. The
+// groups also only carry one copy of every such symbol (the many generic
+// instantiations shared between crates), so the final merge has much less
+// to parse than the original modules.
+extern "C" bool
+LLVMRustLinkerAddBatch(RustLinker *L, char **BCs, size_t *Lens, size_t N,
+                       unsigned Threads) {
+  // Below this many modules per thread it's not worth the extra round trip
+  // through bitcode.
+  const size_t MinModulesPerGroup = 4;
+  if (Threads == 0)
+    Threads = heavyweight_hardware_concurrency();
+  size_t NumGroups = std::min<size_t>(Threads, N / MinModulesPerGroup);
+
+  bool Parallel = NumGroups >= 2;
+#if !LLVM_ENABLE_THREADS
+  Parallel = false;
+#endif
+
+  std::vector<MemoryBufferRef> Modules;
+  for (size_t I = 0; I < N; I++)
+    Modules.push_back(MemoryBufferRef(StringRef(BCs[I], Lens[I]), ""));
+
+  StringSet<> Needed;
+  bool Internalize = L->Internalize;
+  if (Internalize) {
+    std::vector<std::vector<std::string>> Refs(N);
+    std::vector<std::string> Errors(N);
+    std::vector<char> Known(N);
+    {
+      ThreadPool Pool(Parallel ? std::min<size_t>(Threads, N) : 1);
+      for (size_t I = 0; I < N; I++)
+        Pool.async([&, I] {
+          Known[I] = collectReferences(Modules[I], Refs[I], Errors[I]);
+        });
+    }
+    for (size_t I = 0; I < N; I++) {
+      if (!Errors[I].empty()) {
+        LLVMRustSetLastError(Errors[I].c_str());
+        return false;
+      }
+      Internalize &= Known[I] != 0;
+      for (const std::string &Ref : Refs[I])
+        Needed.insert(Ref);
+    }
+    Internalize &= L->Dst.getModuleInlineAsm().empty();
+    for (const GlobalValue &GV : L->Dst.global_values())
+      if (GV.isDeclaration() && GV.hasName())
+        Needed.insert(GV.getName());
+    for (const auto &Sym : L->Preserved)
+      Needed.insert(Sym.getKey());
+  }
+  const StringSet<> *NeededPtr = Internalize ? &Needed : nullptr;
+
+  if (!Parallel) {
+    for (const MemoryBufferRef &Buf : Modules) {
+      std::string Error;
+      if (!linkBuffer(L->L, L->Ctx, Buf, NeededPtr, nullptr, Error)) {
+        LLVMRustSetLastError(Error.c_str());
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::vector<SmallVector<char, 0>> Groups(NumGroups);
+  std::vector<std::string> Errors(NumGroups);
+  bool DiscardValueNames = L->Ctx.shouldDiscardValueNames();
+  {
+    ThreadPool Pool(NumGroups);
+    for (size_t G = 0; G < NumGroups; G++) {
+      ArrayRef<MemoryBufferRef> Group = makeArrayRef(Modules).slice(
+          G * N / NumGroups, (G + 1) * N / NumGroups - G * N / NumGroups);
+      Pool.async([&, G, Group] {
+        Errors[G] = linkGroup(Group, DiscardValueNames, NeededPtr, Groups[G]);
+      });
+    }
+  }
+
+  for (size_t G = 0; G < NumGroups; G++) {
+    if (!Errors[G].empty()) {
+      LLVMRustSetLastError(Errors[G].c_str());
+      return false;
+    }
+    if (!LLVMRustLinkerAdd(L, Groups[G].data(), Groups[G].size()))
+      return false;
+    Groups[G] = SmallVector<char, 0>();
+  }
+  return true;
+}
@@ -1,24 +1,51 @@
 #include <stdio.h>
 
+#include <mutex>
 #include <vector>
 #include <set>
 
 #include "rustllvm.h"
 
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/ModuleSummaryAnalysis.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/CodeGen/TargetSubtargetInfo.h"
 #include "llvm/IR/AutoUpgrade.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/Mangler.h"
 #include "llvm/IR/AssemblyAnnotationWriter.h"
+#include "llvm/Bitcode/BitcodeWriterPass.h"
 #include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/Compression.h"
 #include "llvm/Support/CBindingWrapping.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/GlobPattern.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/IPO/AlwaysInliner.h"
 #include "llvm/Transforms/IPO/FunctionImport.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/FunctionImportUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+#if LLVM_VERSION_GE(8, 0)
+#include "llvm/Transforms/Instrumentation/MemorySanitizer.h"
+#include "llvm/Transforms/Instrumentation/ThreadSanitizer.h"
+#endif
 #include "llvm/LTO/LTO.h"
 
 #include "llvm-c/Transforms/PassManagerBuilder.h"
@@ -211,6 +238,31 @@ static CodeModel::Model fromRust(LLVMRustCodeModel Model) {
   }
 }
 
+enum class LLVMRustDebugCompression {
+  None,
+  ZlibGnu,
+  Zlib,
+};
+
+// Returns false if LLVM was built without zlib, which both compressed formats
+// need.
+static bool fromRust(LLVMRustDebugCompression Compression,
+                     DebugCompressionType &Type) {
+  switch (Compression) {
+  case LLVMRustDebugCompression::None:
+    Type = DebugCompressionType::None;
+    return true;
+  case LLVMRustDebugCompression::ZlibGnu:
+    Type = DebugCompressionType::GNU;
+    return zlib::isAvailable();
+  case LLVMRustDebugCompression::Zlib:
+    Type = DebugCompressionType::Z;
+    return zlib::isAvailable();
+  default:
+    report_fatal_error("Bad DebugCompression.");
+  }
+}
+
 enum class LLVMRustCodeGenOptLevel {
   Other,
   None,
@@ -326,29 +378,14 @@ extern "C" const char* LLVMRustGetHostCPUName(size_t *len) {
   return Name.data();
 }
 
-extern "C" LLVMTargetMachineRef LLVMRustCreateTargetMachine(
-    const char *TripleStr, const char *CPU, const char *Feature,
-    LLVMRustCodeModel RustCM, LLVMRustRelocMode RustReloc,
-    LLVMRustCodeGenOptLevel RustOptLevel, bool UseSoftFloat,
-    bool PositionIndependentExecutable, bool FunctionSections,
-    bool DataSections,
-    bool TrapUnreachable,
-    bool Singlethread,
-    bool AsmComments,
-    bool EmitStackSizeSection) {
-
-  auto OptLevel = fromRust(RustOptLevel);
-  auto RM = fromRust(RustReloc);
-
-  std::string Error;
-  Triple Trip(Triple::normalize(TripleStr));
-  const llvm::Target *TheTarget =
-      TargetRegistry::lookupTarget(Trip.getTriple(), Error);
-  if (TheTarget == nullptr) {
-    LLVMRustSetLastError(Error.c_str());
-    return nullptr;
-  }
-
+static TargetOptions buildTargetOptions(bool UseSoftFloat,
+                                        bool FunctionSections,
+                                        bool DataSections,
+                                        bool TrapUnreachable,
+                                        bool Singlethread,
+                                        bool AsmComments,
+                                        bool EmitStackSizeSection,
+                                        DebugCompressionType Compression) {
   TargetOptions Options;
 
   Options.FloatABIType = FloatABI::Default;
@@ -374,6 +411,48 @@ extern "C" LLVMTargetMachineRef LLVMRustCreateTargetMachine(
 
   Options.EmitStackSizeSection = EmitStackSizeSection;
 
+  // Objects are written with their `.debug_*` sections compressed, each one
+  // only if that actually makes it smaller. The compression happens while
+  // the object is emitted, so on the codegen thread of each unit.
+  Options.CompressDebugSections = Compression;
+  return Options;
+}
+
+extern "C" LLVMTargetMachineRef LLVMRustCreateTargetMachine(
+    const char *TripleStr, const char *CPU, const char *Feature,
+    LLVMRustCodeModel RustCM, LLVMRustRelocMode RustReloc,
+    LLVMRustCodeGenOptLevel RustOptLevel, bool UseSoftFloat,
+    bool PositionIndependentExecutable, bool FunctionSections,
+    bool DataSections,
+    bool TrapUnreachable,
+    bool Singlethread,
+    bool AsmComments,
+    bool EmitStackSizeSection,
+    LLVMRustDebugCompression RustCompression) {
+
+  auto OptLevel = fromRust(RustOptLevel);
+  auto RM = fromRust(RustReloc);
+
+  std::string Error;
+  Triple Trip(Triple::normalize(TripleStr));
+  const llvm::Target *TheTarget =
+      TargetRegistry::lookupTarget(Trip.getTriple(), Error);
+  if (TheTarget == nullptr) {
+    LLVMRustSetLastError(Error.c_str());
+    return nullptr;
+  }
+
+  DebugCompressionType Compression;
+  if (!fromRust(RustCompression, Compression)) {
+    LLVMRustSetLastError("debug section compression format not supported "
+                         "by this version of LLVM");
+    return nullptr;
+  }
+
+  TargetOptions Options = buildTargetOptions(
+      UseSoftFloat, FunctionSections, DataSections, TrapUnreachable,
+      Singlethread, AsmComments, EmitStackSizeSection, Compression);
+
   Optional<CodeModel::Model> CM;
   if (RustCM != LLVMRustCodeModel::None)
     CM = fromRust(RustCM);
@@ -386,6 +465,123 @@ extern "C" void LLVMRustDisposeTargetMachine(LLVMTargetMachineRef TM) {
   delete unwrap(TM);
 }
 
+// Everything needed to create target machines with one configuration, which
+// is looked up and checked once.
+//
+// LLVM can't copy a `TargetMachine`, and creating one means parsing the
+// feature string into a new subtarget each time. Target machines handed back
+// through `LLVMRustTargetMachineFactoryRelease` are kept instead and handed
+// out again by `LLVMRustTargetMachineFactoryAcquire`, so each codegen thread
+// only ever creates a few of them. A target machine may be used for any
+// number of modules in turn, but only by one thread at a time.
+struct LLVMRustTargetMachineFactory {
+  const llvm::Target *TheTarget;
+  std::string Triple;
+  std::string CPU;
+  std::string Features;
+  TargetOptions Options;
+  Optional<Reloc::Model> RM;
+  Optional<CodeModel::Model> CM;
+  CodeGenOpt::Level OptLevel;
+
+  // Only used to answer feature queries, never for codegen, which leaves it
+  // safe to use from several threads.
+  std::unique_ptr<TargetMachine> Prototype;
+
+  std::mutex Lock;
+  std::vector<std::unique_ptr<TargetMachine>> Idle;
+
+  std::unique_ptr<TargetMachine> create() const {
+    return std::unique_ptr<TargetMachine>(TheTarget->createTargetMachine(
+        Triple, CPU, Features, Options, RM, CM, OptLevel));
+  }
+};
+
+// Takes the same arguments as `LLVMRustCreateTargetMachine`, and fails the
+// same way if the target doesn't exist.
+extern "C" LLVMRustTargetMachineFactory *LLVMRustCreateTargetMachineFactory(
+    const char *TripleStr, const char *CPU, const char *Feature,
+    LLVMRustCodeModel RustCM, LLVMRustRelocMode RustReloc,
+    LLVMRustCodeGenOptLevel RustOptLevel, bool UseSoftFloat,
+    bool PositionIndependentExecutable, bool FunctionSections,
+    bool DataSections,
+    bool TrapUnreachable,
+    bool Singlethread,
+    bool AsmComments,
+    bool EmitStackSizeSection,
+    LLVMRustDebugCompression RustCompression) {
+  auto Ret = llvm::make_unique<LLVMRustTargetMachineFactory>();
+
+  std::string Error;
+  Ret->Triple = Triple::normalize(TripleStr);
+  Ret->TheTarget = TargetRegistry::lookupTarget(Ret->Triple, Error);
+  if (Ret->TheTarget == nullptr) {
+    LLVMRustSetLastError(Error.c_str());
+    return nullptr;
+  }
+
+  DebugCompressionType Compression;
+  if (!fromRust(RustCompression, Compression)) {
+    LLVMRustSetLastError("debug section compression format not supported "
+                         "by this version of LLVM");
+    return nullptr;
+  }
+
+  Ret->CPU = CPU;
+  Ret->Features = Feature;
+  Ret->Options = buildTargetOptions(
+      UseSoftFloat, FunctionSections, DataSections, TrapUnreachable,
+      Singlethread, AsmComments, EmitStackSizeSection, Compression);
+  Ret->RM = fromRust(RustReloc);
+  if (RustCM != LLVMRustCodeModel::None)
+    Ret->CM = fromRust(RustCM);
+  Ret->OptLevel = fromRust(RustOptLevel);
+
+  Ret->Prototype = Ret->create();
+  if (!Ret->Prototype) {
+    LLVMRustSetLastError("failed to create target machine");
+    return nullptr;
+  }
+  return Ret.release();
+}
+
+extern "C" void
+LLVMRustTargetMachineFactoryFree(LLVMRustTargetMachineFactory *Factory) {
+  delete Factory;
+}
+
+// Returns a target machine which the caller has to either hand back through
+// `LLVMRustTargetMachineFactoryRelease` or dispose of with
+// `LLVMRustDisposeTargetMachine`.
+extern "C" LLVMTargetMachineRef
+LLVMRustTargetMachineFactoryAcquire(LLVMRustTargetMachineFactory *Factory) {
+  {
+    std::lock_guard<std::mutex> Guard(Factory->Lock);
+    if (!Factory->Idle.empty()) {
+      TargetMachine *TM = Factory->Idle.back().release();
+      Factory->Idle.pop_back();
+      return wrap(TM);
+    }
+  }
+  return wrap(Factory->create().release());
+}
+
+// Gives a target machine from `LLVMRustTargetMachineFactoryAcquire` back to
+// the factory, which frees it when it's freed itself.
+extern "C" void
+LLVMRustTargetMachineFactoryRelease(LLVMRustTargetMachineFactory *Factory,
+                                    LLVMTargetMachineRef TM) {
+  std::lock_guard<std::mutex> Guard(Factory->Lock);
+  Factory->Idle.emplace_back(unwrap(TM));
+}
+
+// Same as `LLVMRustHasFeature` for the factory's target machines.
+extern "C" bool
+LLVMRustTargetMachineFactoryHasFeature(const LLVMRustTargetMachineFactory *Factory,
+                                       const char *Feature) {
+  return LLVMRustHasFeature(wrap(Factory->Prototype.get()), Feature);
+}
+
 // Unfortunately, LLVM doesn't expose a C API to add the corresponding analysis
 // passes for a target to a pass manager. We export that functionality through
 // this function.
@@ -400,7 +596,8 @@ extern "C" void LLVMRustAddAnalysisPasses(LLVMTargetMachineRef TM,
 extern "C" void LLVMRustConfigurePassManagerBuilder(
     LLVMPassManagerBuilderRef PMBR, LLVMRustCodeGenOptLevel OptLevel,
     bool MergeFunctions, bool SLPVectorize, bool LoopVectorize, bool PrepareForThinLTO,
-    const char* PGOGenPath, const char* PGOUsePath) {
+    const char* PGOGenPath, const char* PGOUsePath,
+    const char* PGOSampleUsePath, bool HotColdSplit) {
 #if LLVM_VERSION_GE(7, 0)
   unwrap(PMBR)->MergeFunctions = MergeFunctions;
 #endif
@@ -418,34 +615,88 @@ extern "C" void LLVMRustConfigurePassManagerBuilder(
     assert(!PGOGenPath);
     unwrap(PMBR)->PGOInstrUse = PGOUsePath;
   }
+  // A sampled profile (e.g. converted from `perf` data with AutoFDO) is
+  // matched to the code by debug line tables, so the module needs at least
+  // those. Symbol remapping for it is the `-sample-profile-remapping-file`
+  // LLVM option.
+  if (PGOSampleUsePath) {
+    assert(!PGOGenPath);
+    unwrap(PMBR)->PGOSampleUse = PGOSampleUsePath;
+  }
+
+  // Moves the cold parts of functions, as known from the profile, out into
+  // functions of their own, so the hot code is denser. This waits until
+  // after (Thin)LTO when preparing for it, like LLVM's own option does.
+#if LLVM_VERSION_GE(7, 0)
+  if (HotColdSplit && !PrepareForThinLTO) {
+    unwrap(PMBR)->addExtension(
+        PassManagerBuilder::EP_OptimizerLast,
+        [](const PassManagerBuilder &, legacy::PassManagerBase &PM) {
+          PM.add(createHotColdSplittingPass());
+        });
+  }
+#endif
+}
+
+// Returns the library info for `TargetTriple`, which is only computed the
+// first time it's asked for. Working out which of the several hundred known
+// library functions a target has is much more expensive than copying the
+// result, and this is needed for every module.
+//
+// Entries are never removed, so the returned reference stays valid; there's
+// only a handful of different triples in a process.
+static const TargetLibraryInfoImpl &
+getTargetLibraryInfo(StringRef TargetTriple, bool DisableSimplifyLibCalls) {
+  static std::mutex Lock;
+  static StringMap<std::unique_ptr<TargetLibraryInfoImpl>> Cache;
+
+  std::string Key = TargetTriple.str();
+  Key += DisableSimplifyLibCalls ? '\1' : '\0';
+
+  std::lock_guard<std::mutex> Guard(Lock);
+  std::unique_ptr<TargetLibraryInfoImpl> &TLII = Cache[Key];
+  if (!TLII) {
+    TLII.reset(new TargetLibraryInfoImpl(Triple(TargetTriple)));
+    if (DisableSimplifyLibCalls)
+      TLII->disableAllFunctions();
+  }
+  return *TLII;
 }
 
 // Unfortunately, the LLVM C API doesn't provide a way to set the `LibraryInfo`
 // field of a PassManagerBuilder, we expose our own method of doing so.
+//
+// The builder deletes its `LibraryInfo` when it's disposed of, so it's given
+// a copy of the cached one.
 extern "C" void LLVMRustAddBuilderLibraryInfo(LLVMPassManagerBuilderRef PMBR,
                                               LLVMModuleRef M,
                                               bool DisableSimplifyLibCalls) {
-  Triple TargetTriple(unwrap(M)->getTargetTriple());
-  TargetLibraryInfoImpl *TLI = new TargetLibraryInfoImpl(TargetTriple);
-  if (DisableSimplifyLibCalls)
-    TLI->disableAllFunctions();
-  unwrap(PMBR)->LibraryInfo = TLI;
+  const TargetLibraryInfoImpl &TLII =
+      getTargetLibraryInfo(unwrap(M)->getTargetTriple(), DisableSimplifyLibCalls);
+  delete unwrap(PMBR)->LibraryInfo;
+  unwrap(PMBR)->LibraryInfo = new TargetLibraryInfoImpl(TLII);
 }
 
 // Unfortunately, the LLVM C API doesn't provide a way to create the
 // TargetLibraryInfo pass, so we use this method to do so.
 extern "C" void LLVMRustAddLibraryInfo(LLVMPassManagerRef PMR, LLVMModuleRef M,
                                        bool DisableSimplifyLibCalls) {
-  Triple TargetTriple(unwrap(M)->getTargetTriple());
-  TargetLibraryInfoImpl TLII(TargetTriple);
-  if (DisableSimplifyLibCalls)
-    TLII.disableAllFunctions();
+  const TargetLibraryInfoImpl &TLII =
+      getTargetLibraryInfo(unwrap(M)->getTargetTriple(), DisableSimplifyLibCalls);
   unwrap(PMR)->add(new TargetLibraryInfoWrapperPass(TLII));
 }
 
 // Unfortunately, the LLVM C API doesn't provide an easy way of iterating over
 // all the functions in a module, so we do that manually here. You'll find
 // similar code in clang's BackendUtil.cpp file.
+//
+// The functions are deliberately optimized one after the other on this
+// thread. All of a module's IR lives in one `LLVMContext`, which only one
+// thread may use at a time, so running `P` on several threads would mean
+// copying the module into a context per thread and linking the results back,
+// which renames and re-uniques values and so doesn't give the same module as
+// the serial run. The passes of `P` are also configured from Rust and can't
+// be recreated per thread. Use more codegen units to optimize in parallel.
 extern "C" void LLVMRustRunFunctionPassManager(LLVMPassManagerRef PMR,
                                                LLVMModuleRef M) {
   llvm::legacy::FunctionPassManager *P =
@@ -464,6 +715,339 @@ extern "C" void LLVMRustRunFunctionPassManager(LLVMPassManagerRef PMR,
   P->doFinalization();
 }
 
+enum class LLVMRustFunctionTier {
+  Normal,
+  Hot,
+  Cold,
+  // `optnone` functions, which passes skip anyway.
+  None,
+};
+
+static LLVMRustFunctionTier getFunctionTier(const Function &F,
+                                            ProfileSummaryInfo &PSI) {
+  if (F.hasFnAttribute(Attribute::OptimizeNone))
+    return LLVMRustFunctionTier::None;
+  // Covers `#[cold]`, and functions the profile says are rarely entered.
+  // `minsize` isn't a sign of being cold: all functions have it with
+  // `-C opt-level=z`.
+  if (PSI.isFunctionEntryCold(&F))
+    return LLVMRustFunctionTier::Cold;
+  if (PSI.isFunctionEntryHot(&F))
+    return LLVMRustFunctionTier::Hot;
+  return LLVMRustFunctionTier::Normal;
+}
+
+extern "C" LLVMRustFunctionTier LLVMRustGetFunctionTier(LLVMValueRef Fn) {
+  Function *F = unwrap<Function>(Fn);
+  ProfileSummaryInfo PSI(*F->getParent());
+  return getFunctionTier(*F, PSI);
+}
+
+// Same as `LLVMRustRunFunctionPassManager`, except that cold functions are
+// run through `ColdPMR` instead, which is expected to hold a cheaper
+// pipeline, so that little time is spent on code which hardly ever runs.
+// Functions are cold if they're `#[cold]`, or if the module has a profile
+// which says they're rarely entered.
+extern "C" void LLVMRustRunTieredFunctionPassManager(LLVMPassManagerRef PMR,
+                                                     LLVMPassManagerRef ColdPMR,
+                                                     LLVMModuleRef M) {
+  llvm::legacy::FunctionPassManager *P =
+      unwrap<llvm::legacy::FunctionPassManager>(PMR);
+  llvm::legacy::FunctionPassManager *ColdP =
+      unwrap<llvm::legacy::FunctionPassManager>(ColdPMR);
+  P->doInitialization();
+  ColdP->doInitialization();
+
+  // Upgrade all calls to old intrinsics first.
+  for (Module::iterator I = unwrap(M)->begin(), E = unwrap(M)->end(); I != E;)
+    UpgradeCallsToIntrinsic(&*I++); // must be post-increment, as we remove
+
+  ProfileSummaryInfo PSI(*unwrap(M));
+  for (Function &F : *unwrap(M)) {
+    if (F.isDeclaration())
+      continue;
+    if (getFunctionTier(F, PSI) == LLVMRustFunctionTier::Cold)
+      ColdP->run(F);
+    else
+      P->run(F);
+  }
+
+  ColdP->doFinalization();
+  P->doFinalization();
+}
+
+// Module passes can't be given a pipeline per function, but most of the
+// expensive ones (inlining into a function, unrolling, vectorization) do
+// much less in functions optimized for size. This marks all cold functions
+// as such, and also as `minsize` if `MinSize` is set, before the module
+// passes are run. Returns the number of functions marked.
+extern "C" unsigned LLVMRustMarkColdFunctionsForSize(LLVMModuleRef M,
+                                                     bool MinSize) {
+  ProfileSummaryInfo PSI(*unwrap(M));
+  unsigned Marked = 0;
+  for (Function &F : *unwrap(M)) {
+    if (F.isDeclaration() || F.hasFnAttribute(Attribute::AlwaysInline) ||
+        getFunctionTier(F, PSI) != LLVMRustFunctionTier::Cold)
+      continue;
+    F.addFnAttr(Attribute::OptimizeForSize);
+    if (MinSize)
+      F.addFnAttr(Attribute::MinSize);
+    Marked++;
+  }
+  return Marked;
+}
+
+// Puts each hot function into a `.text.hot.` section and each cold one into
+// a `.text.unlikely.` section (with function sections enabled), so that the
+// linker groups them together. Returns the number of functions given a
+// prefix. `CodeGenPrepare` does the same for the functions hot or cold
+// according to the profile, this also covers `#[cold]` functions.
+extern "C" unsigned LLVMRustSetProfileSectionPrefixes(LLVMModuleRef M) {
+  ProfileSummaryInfo PSI(*unwrap(M));
+  unsigned Assigned = 0;
+  for (Function &F : *unwrap(M)) {
+    if (F.isDeclaration() || F.hasSection())
+      continue;
+    switch (getFunctionTier(F, PSI)) {
+    case LLVMRustFunctionTier::Hot:
+      F.setSectionPrefix(".hot");
+      break;
+    case LLVMRustFunctionTier::Cold:
+      F.setSectionPrefix(".unlikely");
+      break;
+    default:
+      continue;
+    }
+    Assigned++;
+  }
+  return Assigned;
+}
+
+extern "C" typedef void (*LLVMRustProfiledFunctionCallback)(
+    void *,       // payload
+    const char *, // symbol name, as the linker sees it
+    size_t,       // symbol name length
+    uint64_t,     // entry count
+    LLVMRustFunctionTier);
+
+// Calls `Callback` for each function defined in `M` that the profile has an
+// entry count for, hottest first. The symbol names include any prefix the
+// object format adds, so that they can go straight into a symbol ordering
+// file for lld or gold (`--symbol-ordering-file`); collecting them from all
+// modules and sorting by count packs the hot code of the whole program
+// together.
+extern "C" void
+LLVMRustForEachProfiledFunction(LLVMModuleRef M,
+                                LLVMRustProfiledFunctionCallback Callback,
+                                void *Payload) {
+  Module &Mod = *unwrap(M);
+  ProfileSummaryInfo PSI(Mod);
+  std::vector<std::pair<uint64_t, Function *>> Counted;
+  for (Function &F : Mod) {
+    if (F.isDeclaration() || !F.hasName())
+      continue;
+    auto Count = F.getEntryCount();
+#if LLVM_VERSION_GE(7, 0)
+    if (Count.hasValue())
+      Counted.push_back(std::make_pair(Count.getCount(), &F));
+#else
+    if (Count)
+      Counted.push_back(std::make_pair(*Count, &F));
+#endif
+  }
+  std::stable_sort(Counted.begin(), Counted.end(),
+                   [](const std::pair<uint64_t, Function *> &A,
+                      const std::pair<uint64_t, Function *> &B) {
+                     return A.first > B.first;
+                   });
+
+  Mangler Mang;
+  SmallString<128> Name;
+  for (const auto &Entry : Counted) {
+    Name.clear();
+    Mang.getNameWithPrefix(Name, Entry.second, false);
+    Callback(Payload, Name.data(), Name.size(), Entry.first,
+             getFunctionTier(*Entry.second, PSI));
+  }
+}
+
+enum class LLVMRustPassBuilderOptLevel {
+  O0,
+  O1,
+  O2,
+  O3,
+  Os,
+  Oz,
+};
+
+static PassBuilder::OptimizationLevel fromRust(LLVMRustPassBuilderOptLevel Level) {
+  switch (Level) {
+  case LLVMRustPassBuilderOptLevel::O0:
+    return PassBuilder::O0;
+  case LLVMRustPassBuilderOptLevel::O1:
+    return PassBuilder::O1;
+  case LLVMRustPassBuilderOptLevel::O2:
+    return PassBuilder::O2;
+  case LLVMRustPassBuilderOptLevel::O3:
+    return PassBuilder::O3;
+  case LLVMRustPassBuilderOptLevel::Os:
+    return PassBuilder::Os;
+  case LLVMRustPassBuilderOptLevel::Oz:
+    return PassBuilder::Oz;
+  default:
+    report_fatal_error("Bad PassBuilderOptLevel.");
+  }
+}
+
+enum class LLVMRustOptStage {
+  PreLinkNoLTO,
+  PreLinkThinLTO,
+  PreLinkFatLTO,
+  ThinLTO,
+  FatLTO,
+};
+
+struct LLVMRustSanitizerOptions {
+  bool SanitizeAddress;
+  bool SanitizeMemory;
+  bool SanitizeThread;
+  bool SanitizeRecover;
+  int SanitizeMemoryTrackOrigins;
+};
+
+// Optimizes `M` with the new pass manager's default pipeline for `OptLevel`
+// and `OptStage`, as an alternative to configuring a `PassManagerBuilder`
+// and running the legacy function and module pass managers.
+//
+// The post-link ThinLTO pipeline is meant to run after the
+// `LLVMRustPrepareThinLTO*` functions, so it's not given a summary index:
+// importing has already been done by then.
+//
+// Sanitizer passes are run after the optimization pipeline, once any
+// functions were inlined, for the stages whose pipeline ends in the
+// `OptimizerLast` extension point where the legacy pass manager runs them.
+// This LLVM doesn't have new pass manager versions of all of them, so they're
+// run with a legacy pass manager of their own.
+extern "C" LLVMRustResult
+LLVMRustOptimizeWithNewPassManager(LLVMModuleRef ModuleRef,
+                                   LLVMTargetMachineRef TMRef,
+                                   LLVMRustPassBuilderOptLevel OptLevelRust,
+                                   LLVMRustOptStage OptStage,
+                                   bool DisableSimplifyLibCalls,
+                                   bool DebugPassManager,
+                                   const LLVMRustSanitizerOptions *SanitizerOptions,
+                                   const char *PGOGenPath,
+                                   const char *PGOUsePath) {
+  Module *TheModule = unwrap(ModuleRef);
+  TargetMachine *TM = unwrap(TMRef);
+  PassBuilder::OptimizationLevel OptLevel = fromRust(OptLevelRust);
+
+  Optional<PGOOptions> PGOOpt;
+  if (PGOGenPath) {
+    assert(!PGOUsePath);
+    PGOOpt = PGOOptions();
+    PGOOpt->ProfileGenFile = PGOGenPath;
+    PGOOpt->RunProfileGen = true;
+  } else if (PGOUsePath) {
+    PGOOpt = PGOOptions();
+    PGOOpt->ProfileUseFile = PGOUsePath;
+  }
+
+  PassBuilder PB(TM, PGOOpt);
+
+  LoopAnalysisManager LAM(DebugPassManager);
+  FunctionAnalysisManager FAM(DebugPassManager);
+  CGSCCAnalysisManager CGAM(DebugPassManager);
+  ModuleAnalysisManager MAM(DebugPassManager);
+
+  // The default alias analysis pipeline has to be registered before the
+  // standard function analyses, which would register an empty one.
+  FAM.registerPass([&] { return PB.buildDefaultAAPipeline(); });
+
+  const TargetLibraryInfoImpl &TLII =
+      getTargetLibraryInfo(TheModule->getTargetTriple(), DisableSimplifyLibCalls);
+  FAM.registerPass([&] { return TargetLibraryAnalysis(TLII); });
+
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM(DebugPassManager);
+  if (OptLevel == PassBuilder::O0) {
+    // The default pipelines can't be built for O0, which only needs to run
+    // the always-inliner (and the sanitizers below).
+    MPM.addPass(AlwaysInlinerPass());
+  } else {
+    switch (OptStage) {
+    case LLVMRustOptStage::PreLinkNoLTO:
+      MPM.addPass(PB.buildPerModuleDefaultPipeline(OptLevel, DebugPassManager));
+      break;
+    case LLVMRustOptStage::PreLinkThinLTO:
+      MPM.addPass(PB.buildThinLTOPreLinkDefaultPipeline(OptLevel, DebugPassManager));
+      break;
+    case LLVMRustOptStage::PreLinkFatLTO:
+      MPM.addPass(PB.buildLTOPreLinkDefaultPipeline(OptLevel, DebugPassManager));
+      break;
+    case LLVMRustOptStage::ThinLTO:
+#if LLVM_VERSION_GE(7, 0)
+      MPM.addPass(PB.buildThinLTODefaultPipeline(OptLevel, DebugPassManager,
+                                                 /*ImportSummary=*/nullptr));
+#else
+      MPM.addPass(PB.buildThinLTODefaultPipeline(OptLevel, DebugPassManager));
+#endif
+      break;
+    case LLVMRustOptStage::FatLTO:
+#if LLVM_VERSION_GE(7, 0)
+      MPM.addPass(PB.buildLTODefaultPipeline(OptLevel, DebugPassManager,
+                                             /*ExportSummary=*/nullptr));
+#else
+      MPM.addPass(PB.buildLTODefaultPipeline(OptLevel, DebugPassManager));
+#endif
+      break;
+    }
+  }
+
+  MPM.run(*TheModule, MAM);
+
+  // Instrumenting before linking for ThinLTO or after linking for fat LTO
+  // would either be too early or do it twice.
+  bool Instrument = OptStage == LLVMRustOptStage::PreLinkNoLTO ||
+                    OptStage == LLVMRustOptStage::PreLinkFatLTO ||
+                    OptStage == LLVMRustOptStage::ThinLTO;
+  if (SanitizerOptions && Instrument) {
+    legacy::PassManager SanitizerPM;
+    if (SanitizerOptions->SanitizeAddress) {
+      SanitizerPM.add(createAddressSanitizerFunctionPass(
+          /*CompileKernel=*/false, SanitizerOptions->SanitizeRecover,
+          /*UseAfterScope=*/true));
+      SanitizerPM.add(createAddressSanitizerModulePass(
+          /*CompileKernel=*/false, SanitizerOptions->SanitizeRecover));
+    }
+    if (SanitizerOptions->SanitizeMemory) {
+#if LLVM_VERSION_GE(8, 0)
+      SanitizerPM.add(createMemorySanitizerLegacyPassPass(
+          SanitizerOptions->SanitizeMemoryTrackOrigins,
+          SanitizerOptions->SanitizeRecover));
+#else
+      SanitizerPM.add(createMemorySanitizerPass(
+          SanitizerOptions->SanitizeMemoryTrackOrigins,
+          SanitizerOptions->SanitizeRecover));
+#endif
+    }
+    if (SanitizerOptions->SanitizeThread) {
+#if LLVM_VERSION_GE(8, 0)
+      SanitizerPM.add(createThreadSanitizerLegacyPassPass());
+#else
+      SanitizerPM.add(createThreadSanitizerPass());
+#endif
+    }
+    SanitizerPM.run(*TheModule);
+  }
+  return LLVMRustResult::Success;
+}
+
 extern "C" void LLVMRustSetLLVMOptions(int Argc, char **Argv) {
   // Initializing the command-line options more than once is not allowed. So,
   // check if they've already been initialized.  (This could happen if we're
@@ -493,10 +1077,13 @@ static TargetMachine::CodeGenFileType fromRust(LLVMRustFileType Type) {
   }
 }
 
-extern "C" LLVMRustResult
-LLVMRustWriteOutputFile(LLVMTargetMachineRef Target, LLVMPassManagerRef PMR,
-                        LLVMModuleRef M, const char *Path,
-                        LLVMRustFileType RustFileType) {
+// Emits `M` into `Path`. If `DwoPath` is given, debug info is split: the
+// object only gets a skeleton compile unit and the rest goes into a `.dwo`
+// file at `DwoPath`, which linkers never have to read.
+static LLVMRustResult writeOutputFile(LLVMTargetMachineRef Target,
+                                      LLVMPassManagerRef PMR, LLVMModuleRef M,
+                                      const char *Path, const char *DwoPath,
+                                      LLVMRustFileType RustFileType) {
   llvm::legacy::PassManager *PM = unwrap<llvm::legacy::PassManager>(PMR);
   auto FileType = fromRust(RustFileType);
 
@@ -512,11 +1099,42 @@ LLVMRustWriteOutputFile(LLVMTargetMachineRef Target, LLVMPassManagerRef PMR,
 
 #if LLVM_VERSION_GE(7, 0)
   buffer_ostream BOS(OS);
-  unwrap(Target)->addPassesToEmitFile(*PM, BOS, nullptr, FileType, false);
+  std::unique_ptr<raw_fd_ostream> DOS;
+  std::unique_ptr<buffer_ostream> DBOS;
+  if (DwoPath) {
+    DOS.reset(new raw_fd_ostream(DwoPath, EC, sys::fs::F_None));
+    if (EC) {
+      LLVMRustSetLastError(EC.message().c_str());
+      return LLVMRustResult::Failure;
+    }
+    DBOS.reset(new buffer_ostream(*DOS));
+
+    // Each compile unit names the `.dwo` file of the codegen unit it was
+    // created for. After fat LTO several of them share this module and its
+    // one `.dwo` file, so they're all pointed at the file actually written.
+    // There's no setter for the name, it's operand 3 of the node.
+    MDString *DwoName = MDString::get(unwrap(M)->getContext(), DwoPath);
+    for (DICompileUnit *CU : unwrap(M)->debug_compile_units())
+      CU->replaceOperandWith(3, DwoName);
+  }
+  // Setting the split file is what makes the asm printer split debug info.
+  // The name it records in the skeleton comes from the compile unit, though.
+  // The target machine is shared with other modules that are emitted without
+  // a `.dwo` file, so the previous options are put back once this is done.
+  TargetOptions SavedOptions = unwrap(Target)->Options;
+  if (DwoPath)
+    unwrap(Target)->Options.MCOptions.SplitDwarfFile = DwoPath;
+  unwrap(Target)->addPassesToEmitFile(*PM, BOS, DBOS.get(), FileType, false);
+  PM->run(*unwrap(M));
+  unwrap(Target)->Options = SavedOptions;
 #else
+  if (DwoPath) {
+    LLVMRustSetLastError("split debug info requires LLVM 7 or later");
+    return LLVMRustResult::Failure;
+  }
   unwrap(Target)->addPassesToEmitFile(*PM, OS, FileType, false);
-#endif
   PM->run(*unwrap(M));
+#endif
 
   // Apparently `addPassesToEmitFile` adds a pointer to our on-the-stack output
   // stream (OS), so the only real safe place to delete this is here? Don't we
@@ -525,53 +1143,466 @@ LLVMRustWriteOutputFile(LLVMTargetMachineRef Target, LLVMPassManagerRef PMR,
   return LLVMRustResult::Success;
 }
 
+extern "C" LLVMRustResult
+LLVMRustWriteOutputFile(LLVMTargetMachineRef Target, LLVMPassManagerRef PMR,
+                        LLVMModuleRef M, const char *Path,
+                        LLVMRustFileType RustFileType) {
+  return writeOutputFile(Target, PMR, M, Path, nullptr, RustFileType);
+}
 
-// Callback to demangle function name
-// Parameters:
-// * name to be demangled
-// * name len
-// * output buffer
-// * output buffer len
-// Returns len of demangled string, or 0 if demangle failed.
-typedef size_t (*DemangleFn)(const char*, size_t, char*, size_t);
-
-
-namespace {
+// Same as `LLVMRustWriteOutputFile`, but with the debug info split off into
+// `DwoPath`. The module's compile unit has to have been created with the
+// name of the `.dwo` file as its `SplitName`, which is what the skeleton
+// compile unit points debuggers at. Combining `.dwo` files into a DWARF
+// package is up to `llvm-dwp`.
+extern "C" LLVMRustResult
+LLVMRustWriteOutputFileWithDwo(LLVMTargetMachineRef Target,
+                               LLVMPassManagerRef PMR, LLVMModuleRef M,
+                               const char *Path, const char *DwoPath,
+                               LLVMRustFileType RustFileType) {
+  return writeOutputFile(Target, PMR, M, Path, DwoPath, RustFileType);
+}
 
-class RustAssemblyAnnotationWriter : public AssemblyAnnotationWriter {
-  DemangleFn Demangle;
-  std::vector<char> Buf;
+// An object file or assembly emitted into memory by
+// `LLVMRustWriteOutputBuffer`.
+struct LLVMRustObjectBuffer {
+  SmallVector<char, 0> data;
+};
 
-public:
-  RustAssemblyAnnotationWriter(DemangleFn Demangle) : Demangle(Demangle) {}
+// Same as `LLVMRustWriteOutputFile`, except that the output is kept in
+// memory and returned instead of written to a file. This saves a round trip
+// through the file system when the output only ends up in an archive anyway
+// (see `LLVMRustArchiveMemberNewFromBuffer`) or gets piped somewhere.
+//
+// `raw_svector_ostream` can be seeked, so unlike a file descriptor it doesn't
+// need to be wrapped in a `buffer_ostream` (and copied once more) for object
+// files. Returns null on failure.
+extern "C" LLVMRustObjectBuffer *
+LLVMRustWriteOutputBuffer(LLVMTargetMachineRef Target, LLVMPassManagerRef PMR,
+                          LLVMModuleRef M, LLVMRustFileType RustFileType) {
+  llvm::legacy::PassManager *PM = unwrap<llvm::legacy::PassManager>(PMR);
+  auto FileType = fromRust(RustFileType);
 
-  // Return empty string if demangle failed
-  // or if name does not need to be demangled
-  StringRef CallDemangle(StringRef name) {
-    if (!Demangle) {
-      return StringRef();
+  auto Ret = llvm::make_unique<LLVMRustObjectBuffer>();
+  {
+    raw_svector_ostream OS(Ret->data);
+#if LLVM_VERSION_GE(7, 0)
+    bool Failed =
+        unwrap(Target)->addPassesToEmitFile(*PM, OS, nullptr, FileType, false);
+#else
+    bool Failed = unwrap(Target)->addPassesToEmitFile(*PM, OS, FileType, false);
+#endif
+    if (Failed) {
+      delete PM;
+      LLVMRustSetLastError("target does not support this output file type");
+      return nullptr;
     }
+    PM->run(*unwrap(M));
+  }
 
-    if (Buf.size() < name.size() * 2) {
-      // Semangled name usually shorter than mangled,
-      // but allocate twice as much memory just in case
-      Buf.resize(name.size() * 2);
-    }
+  // As above, the pass manager holds on to `OS`.
+  delete PM;
+  return Ret.release();
+}
 
-    auto R = Demangle(name.data(), name.size(), Buf.data(), Buf.size());
-    if (!R) {
-      // Demangle failed.
-      return StringRef();
+extern "C" void
+LLVMRustObjectBufferFree(LLVMRustObjectBuffer *Buffer) {
+  delete Buffer;
+}
+
+extern "C" const char *
+LLVMRustObjectBufferPtr(const LLVMRustObjectBuffer *Buffer) {
+  return Buffer->data.data();
+}
+
+extern "C" size_t
+LLVMRustObjectBufferLen(const LLVMRustObjectBuffer *Buffer) {
+  return Buffer->data.size();
+}
+
+
+// A codegen pipeline that's set up once and then run over many modules, for
+// a worker thread emitting one codegen unit after another. Setting up the
+// pipeline with `addPassesToEmitFile` (which constructs all target passes and
+// the `TargetPassConfig`) has a measurable cost when done for every one of
+// hundreds of modules.
+//
+// Reusing a pass manager like this is supported by LLVM as long as every
+// module has the same target and data layout, see `-compile-twice` in `llc`.
+// The passes write into `Sink` through `OS`, and after each module the
+// output is moved out of `Sink` into a fresh `LLVMRustObjectBuffer`.
+//
+// A session isn't thread safe, each thread should create its own.
+struct LLVMRustCodegenSession {
+  std::unique_ptr<TargetMachine> TM;
+  legacy::PassManager PM;
+  SmallVector<char, 0> Sink;
+  raw_svector_ostream OS;
+
+  LLVMRustCodegenSession(TargetMachine *TM) : TM(TM), OS(Sink) {}
+};
+
+// Creates a session emitting `RustFileType` output for modules with the
+// target triple `Triple`. The session takes ownership of `TMR`, even if it
+// fails to be created, which happens if the target can't emit the requested
+// kind of file.
+extern "C" LLVMRustCodegenSession *
+LLVMRustCodegenSessionCreate(LLVMTargetMachineRef TMR, const char *Triple,
+                             bool DisableSimplifyLibCalls,
+                             LLVMRustFileType RustFileType) {
+  auto Ret = llvm::make_unique<LLVMRustCodegenSession>(unwrap(TMR));
+  TargetMachine *TM = Ret->TM.get();
+
+  // The same analyses `LLVMRustAddAnalysisPasses` and
+  // `LLVMRustAddLibraryInfo` add for a single module.
+  Ret->PM.add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
+  Ret->PM.add(new TargetLibraryInfoWrapperPass(
+      getTargetLibraryInfo(Triple, DisableSimplifyLibCalls)));
+
+#if LLVM_VERSION_GE(7, 0)
+  bool Failed = TM->addPassesToEmitFile(Ret->PM, Ret->OS, nullptr,
+                                        fromRust(RustFileType), false);
+#else
+  bool Failed = TM->addPassesToEmitFile(Ret->PM, Ret->OS,
+                                        fromRust(RustFileType), false);
+#endif
+  if (Failed) {
+    LLVMRustSetLastError("target does not support this output file type");
+    return nullptr;
+  }
+  return Ret.release();
+}
+
+extern "C" void
+LLVMRustCodegenSessionFree(LLVMRustCodegenSession *Session) {
+  delete Session;
+}
+
+// Runs the session's pipeline over `M` and returns the output.
+extern "C" LLVMRustObjectBuffer *
+LLVMRustCodegenSessionEmit(LLVMRustCodegenSession *Session, LLVMModuleRef M) {
+  Session->Sink.clear();
+  Session->PM.run(*unwrap(M));
+
+  auto Ret = llvm::make_unique<LLVMRustObjectBuffer>();
+  Ret->data = std::move(Session->Sink);
+  Session->Sink.clear();
+  return Ret.release();
+}
+
+// What `LLVMRustWriteOutputFileWithStats` reports for each function that was
+// code generated. Counts a report for this LLVM or output doesn't carry are
+// left at 0.
+struct LLVMRustFunctionCodegenStats {
+  const char *Name;
+  size_t NameLen;
+  // Size of the function's symbol, only known for object files.
+  uint64_t CodeSize;
+  uint64_t MachineInstructions;
+  uint64_t StackSize;
+  // The register allocator only reports spills and reloads within loops.
+  uint64_t LoopSpills;
+  uint64_t LoopReloads;
+  // Distinct call sites that were inlined into the function, as recorded by
+  // debug info.
+  uint64_t InlinedCallSites;
+};
+
+extern "C" typedef void (*LLVMRustFunctionCodegenStatsCallback)(
+    void *, // payload
+    const LLVMRustFunctionCodegenStats *);
+
+namespace {
+
+// Collects the analysis remarks codegen emits for every function into
+// `Stats`, while it's installed on a context. Its previous diagnostic handler
+// gets all other diagnostics, and the remarks it asked for itself.
+class CodegenStatsHandler : public DiagnosticHandler {
+  std::unique_ptr<DiagnosticHandler> Prev;
+  StringMap<LLVMRustFunctionCodegenStats> &Stats;
+
+  static bool isStatsPass(StringRef PassName) {
+    return PassName == "asm-printer" || PassName == "prologepilog" ||
+           PassName == "regalloc";
+  }
+
+  bool prevWants(const DiagnosticInfoOptimizationBase &R) const {
+    if (!Prev)
+      return false;
+    StringRef PassName = R.getPassName();
+    switch (R.getKind()) {
+    case DK_MachineOptimizationRemarkAnalysis:
+      return Prev->isAnalysisRemarkEnabled(PassName);
+    case DK_MachineOptimizationRemarkMissed:
+      return Prev->isMissedOptRemarkEnabled(PassName);
+    default:
+      return Prev->isPassedOptRemarkEnabled(PassName);
     }
+  }
 
-    auto Demangled = StringRef(Buf.data(), R);
-    if (Demangled == name) {
-      // Do not print anything if demangled name is equal to mangled.
-      return StringRef();
+  void record(const DiagnosticInfoOptimizationBase &R) {
+    LLVMRustFunctionCodegenStats &S = Stats[R.getFunction().getName()];
+    for (const DiagnosticInfoOptimizationBase::Argument &Arg : R.getArgs()) {
+      uint64_t Value;
+      if (StringRef(Arg.Val).getAsInteger(10, Value))
+        continue;
+      if (Arg.Key == "NumInstructions")
+        S.MachineInstructions += Value;
+      else if (Arg.Key == "NumStackBytes")
+        S.StackSize += Value;
+      else if (Arg.Key == "NumSpills")
+        S.LoopSpills += Value;
+      else if (Arg.Key == "NumReloads")
+        S.LoopReloads += Value;
+    }
+  }
+
+public:
+  CodegenStatsHandler(std::unique_ptr<DiagnosticHandler> Prev,
+                      StringMap<LLVMRustFunctionCodegenStats> &Stats)
+      : Prev(std::move(Prev)), Stats(Stats) {}
+
+  std::unique_ptr<DiagnosticHandler> takePrev() { return std::move(Prev); }
+
+  bool handleDiagnostics(const DiagnosticInfo &DI) override {
+    if (auto *R = dyn_cast<DiagnosticInfoOptimizationBase>(&DI)) {
+      if (isStatsPass(R->getPassName())) {
+        record(*R);
+        if (!prevWants(*R))
+          return true;
+      }
+    }
+    return Prev && Prev->handleDiagnostics(DI);
+  }
+
+  bool isAnalysisRemarkEnabled(StringRef PassName) const override {
+    return isStatsPass(PassName) ||
+           (Prev && Prev->isAnalysisRemarkEnabled(PassName));
+  }
+  bool isMissedOptRemarkEnabled(StringRef PassName) const override {
+    return isStatsPass(PassName) ||
+           (Prev && Prev->isMissedOptRemarkEnabled(PassName));
+  }
+  bool isPassedOptRemarkEnabled(StringRef PassName) const override {
+    return Prev && Prev->isPassedOptRemarkEnabled(PassName);
+  }
+  bool isAnyRemarkEnabled() const override { return true; }
+};
+
+}
+
+// Same as `LLVMRustWriteOutputFile`, and then calls `Callback` with the
+// statistics of every function that was code generated, in module order.
+//
+// The machine functions are gone by the time the pass manager is done, so
+// what's reported is taken from the analysis remarks codegen emits for each
+// function anyway, which are turned on while this runs. Code sizes are read
+// from the symbol table of the emitted object file.
+extern "C" LLVMRustResult
+LLVMRustWriteOutputFileWithStats(LLVMTargetMachineRef Target,
+                                 LLVMPassManagerRef PMR, LLVMModuleRef M,
+                                 const char *Path, LLVMRustFileType RustFileType,
+                                 LLVMRustFunctionCodegenStatsCallback Callback,
+                                 void *CallbackPayload) {
+  Module &Mod = *unwrap(M);
+  LLVMContext &Ctx = Mod.getContext();
+
+  // Function names as they appear in the object file, and inlined call sites,
+  // which codegen may well drop the debug info for.
+  StringMap<LLVMRustFunctionCodegenStats> Stats;
+  std::vector<std::pair<Function *, std::string>> Functions;
+  Mangler Mang;
+  for (Function &F : Mod) {
+    if (F.isDeclaration())
+      continue;
+    LLVMRustFunctionCodegenStats &S = Stats[F.getName()];
+    memset(&S, 0, sizeof(S));
+    SmallPtrSet<const DILocation *, 16> Sites;
+    for (const BasicBlock &BB : F)
+      for (const Instruction &I : BB)
+        if (const DILocation *Loc = I.getDebugLoc())
+          for (Loc = Loc->getInlinedAt(); Loc; Loc = Loc->getInlinedAt())
+            Sites.insert(Loc);
+    S.InlinedCallSites = Sites.size();
+
+    std::string SymbolName;
+    raw_string_ostream OS(SymbolName);
+    Mang.getNameWithPrefix(OS, &F, false);
+    Functions.emplace_back(&F, OS.str());
+  }
+
+  auto *Handler = new CodegenStatsHandler(Ctx.getDiagnosticHandler(), Stats);
+  Ctx.setDiagnosticHandler(std::unique_ptr<DiagnosticHandler>(Handler));
+  LLVMRustResult Result =
+      LLVMRustWriteOutputFile(Target, PMR, M, Path, RustFileType);
+  Ctx.setDiagnosticHandler(Handler->takePrev());
+  if (Result != LLVMRustResult::Success)
+    return Result;
+
+  StringMap<uint64_t> SymbolSizes;
+  if (RustFileType == LLVMRustFileType::ObjectFile) {
+    Expected<object::OwningBinary<object::ObjectFile>> ObjOrErr =
+        object::ObjectFile::createObjectFile(Path);
+    if (!ObjOrErr) {
+      LLVMRustSetLastError(toString(ObjOrErr.takeError()).c_str());
+      return LLVMRustResult::Failure;
     }
+    for (const auto &Sym : object::computeSymbolSizes(*ObjOrErr->getBinary())) {
+      Expected<StringRef> NameOrErr = Sym.first.getName();
+      if (!NameOrErr) {
+        consumeError(NameOrErr.takeError());
+        continue;
+      }
+      SymbolSizes[*NameOrErr] = Sym.second;
+    }
+  }
+
+  for (auto &F : Functions) {
+    // Functions which codegen dropped, like unused local ones, aren't
+    // reported.
+    StringRef Name = F.first->getName();
+    auto It = Stats.find(Name);
+    if (It == Stats.end() || It->second.MachineInstructions == 0)
+      continue;
+    LLVMRustFunctionCodegenStats &S = It->second;
+    S.Name = Name.data();
+    S.NameLen = Name.size();
+    auto Size = SymbolSizes.find(F.second);
+    if (Size != SymbolSizes.end())
+      S.CodeSize = Size->second;
+    Callback(CallbackPayload, &S);
+  }
+  return LLVMRustResult::Success;
+}
+
+// Callback to demangle function name
+// Parameters:
+// * name to be demangled
+// * name len
+// * output buffer
+// * output buffer len
+// Returns len of demangled string, or 0 if demangle failed.
+typedef size_t (*DemangleFn)(const char*, size_t, char*, size_t);
+
+
+namespace {
+
+// Returns the value called by `I` if it's a call or invoke, along with the
+// name of the instruction.
+static const Value *getCalledValue(const Instruction *I, const char *&Name) {
+  if (const CallInst *CI = dyn_cast<CallInst>(I)) {
+    Name = "call";
+    return CI->getCalledValue();
+  }
+  if (const InvokeInst *II = dyn_cast<InvokeInst>(I)) {
+    Name = "invoke";
+    return II->getCalledValue();
+  }
+  return nullptr;
+}
+
+// Demangled names of the symbols of a module, computed once per symbol no
+// matter how many call sites refer to it.
+class DemangleCache {
+  DemangleFn Demangle;
+  std::vector<char> Buf;
+  // The empty string for names which don't need demangling.
+  StringMap<std::string> Names;
+
+  static std::string demangle(DemangleFn Demangle, StringRef Name,
+                              std::vector<char> &Buf) {
+    // Demangled names are usually shorter than mangled ones, but allocate
+    // twice as much memory just in case, and more if that wasn't enough.
+    size_t Size = Name.size() * 2 + 16;
+    for (int Attempt = 0; Attempt < 3; Attempt++, Size *= 2) {
+      if (Buf.size() < Size)
+        Buf.resize(Size);
+      size_t R = Demangle(Name.data(), Name.size(), Buf.data(), Buf.size());
+      if (R) {
+        StringRef Demangled(Buf.data(), R);
+        // Do not print anything if demangled name is equal to mangled.
+        return Demangled == Name ? std::string() : Demangled.str();
+      }
+      // A failure is either a name that isn't mangled, or a buffer that's too
+      // small. Only a mangled name is worth retrying, and all of those start
+      // with `_`.
+      if (!Name.startswith("_"))
+        break;
+    }
+    return std::string();
+  }
 
-    return Demangled;
+public:
+  DemangleCache(DemangleFn Demangle) : Demangle(Demangle) {}
+
+  bool enabled() const { return Demangle != nullptr; }
+
+  // Demangles the names of all functions in `M` and of everything they call
+  // up front, spread over a thread pool. Demangling has no shared state, so
+  // this is safe as long as the callback doesn't have any either.
+  void fill(const Module &M) {
+    if (!Demangle)
+      return;
+    for (const Function &F : M) {
+      if (F.hasName())
+        Names.insert(std::make_pair(F.getName(), std::string()));
+      for (const BasicBlock &BB : F)
+        for (const Instruction &I : BB) {
+          const char *Name;
+          const Value *Callee = getCalledValue(&I, Name);
+          if (Callee && Callee->hasName())
+            Names.insert(std::make_pair(Callee->getName(), std::string()));
+        }
+    }
+
+    std::vector<StringMapEntry<std::string> *> Entries;
+    for (auto &Entry : Names)
+      Entries.push_back(&Entry);
+
+    // Below this many names per thread it's not worth starting threads.
+    const size_t MinNamesPerThread = 1024;
+    size_t Threads = std::min<size_t>(heavyweight_hardware_concurrency(),
+                                      Entries.size() / MinNamesPerThread);
+#if !LLVM_ENABLE_THREADS
+    Threads = 1;
+#endif
+    if (Threads < 2) {
+      for (auto *Entry : Entries)
+        Entry->getValue() = demangle(Demangle, Entry->getKey(), Buf);
+      return;
+    }
+
+    ThreadPool Pool(Threads);
+    size_t N = Entries.size();
+    for (size_t T = 0; T < Threads; T++) {
+      Pool.async([&, T] {
+        std::vector<char> ThreadBuf;
+        for (size_t I = T * N / Threads; I < (T + 1) * N / Threads; I++)
+          Entries[I]->getValue() =
+              demangle(Demangle, Entries[I]->getKey(), ThreadBuf);
+      });
+    }
+  }
+
+  // Return empty string if demangle failed
+  // or if name does not need to be demangled
+  StringRef lookup(StringRef Name) {
+    if (!Demangle)
+      return StringRef();
+    auto Inserted = Names.insert(std::make_pair(Name, std::string()));
+    if (Inserted.second)
+      Inserted.first->getValue() = demangle(Demangle, Name, Buf);
+    return Inserted.first->getValue();
   }
+};
+
+class RustAssemblyAnnotationWriter : public AssemblyAnnotationWriter {
+  DemangleCache &Cache;
+
+public:
+  RustAssemblyAnnotationWriter(DemangleCache &Cache) : Cache(Cache) {}
+
+  StringRef CallDemangle(StringRef name) { return Cache.lookup(name); }
 
   void emitFunctionAnnot(const Function *F,
                          formatted_raw_ostream &OS) override {
@@ -586,20 +1617,10 @@ public:
   void emitInstructionAnnot(const Instruction *I,
                             formatted_raw_ostream &OS) override {
     const char *Name;
-    const Value *Value;
-    if (const CallInst *CI = dyn_cast<CallInst>(I)) {
-      Name = "call";
-      Value = CI->getCalledValue();
-    } else if (const InvokeInst* II = dyn_cast<InvokeInst>(I)) {
-      Name = "invoke";
-      Value = II->getCalledValue();
-    } else {
-      // Could demangle more operations, e. g.
-      // `store %place, @function`.
-      return;
-    }
-
-    if (!Value->hasName()) {
+    const Value *Value = getCalledValue(I, Name);
+    // Could demangle more operations, e. g.
+    // `store %place, @function`.
+    if (!Value || !Value->hasName()) {
       return;
     }
 
@@ -622,7 +1643,11 @@ public:
       : ModulePass(ID), OS(&OS), Demangle(Demangle) {}
 
   bool runOnModule(Module &M) override {
-    RustAssemblyAnnotationWriter AW(Demangle);
+    // Printing itself has to stay serial, as the numbering of metadata and
+    // unnamed values depends on everything printed before.
+    DemangleCache Cache(Demangle);
+    Cache.fill(M);
+    RustAssemblyAnnotationWriter AW(Cache);
 
     M.print(*OS, &AW, false);
 
@@ -663,6 +1688,72 @@ extern "C" void LLVMRustPrintModule(LLVMPassManagerRef PMR, LLVMModuleRef M,
   PM->run(*unwrap(M));
 }
 
+// Prints only the functions of `M` whose mangled or demangled name matches
+// one of the glob `Patterns` (a plain name matches just itself), along with
+// the declarations of everything they refer to, so that the result is still
+// valid IR. To see such functions before and after each pass instead, there's
+// `-print-before-all`/`-print-after-all` with `-filter-print-funcs=<name>`.
+extern "C" LLVMRustResult
+LLVMRustPrintModuleFiltered(LLVMModuleRef M, const char *Path,
+                            DemangleFn Demangle, const char **Patterns,
+                            size_t NumPatterns) {
+  std::vector<GlobPattern> Globs;
+  for (size_t I = 0; I < NumPatterns; I++) {
+    Expected<GlobPattern> PatOrErr = GlobPattern::create(Patterns[I]);
+    if (!PatOrErr) {
+      LLVMRustSetLastError(toString(PatOrErr.takeError()).c_str());
+      return LLVMRustResult::Failure;
+    }
+    Globs.push_back(std::move(*PatOrErr));
+  }
+
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::F_None);
+  if (EC) {
+    LLVMRustSetLastError(EC.message().c_str());
+    return LLVMRustResult::Failure;
+  }
+
+  const Module &Mod = *unwrap(M);
+  DemangleCache Cache(Demangle);
+  auto Matches = [&](StringRef Name) {
+    return llvm::any_of(Globs, [&](const GlobPattern &Glob) {
+      return Glob.match(Name);
+    });
+  };
+  SmallPtrSet<const GlobalValue *, 16> Selected;
+  for (const Function &F : Mod)
+    if (!F.isDeclaration() && F.hasName() &&
+        (Matches(F.getName()) || Matches(Cache.lookup(F.getName()))))
+      Selected.insert(&F);
+
+  // Everything else is turned into a declaration by the clone, and then
+  // dropped if the selected functions don't refer to it.
+  ValueToValueMapTy VMap;
+#if LLVM_VERSION_GE(7, 0)
+  std::unique_ptr<Module> Filtered =
+      CloneModule(Mod, VMap, [&](const GlobalValue *GV) {
+        return Selected.count(GV) != 0;
+      });
+#else
+  std::unique_ptr<Module> Filtered =
+      CloneModule(&Mod, VMap, [&](const GlobalValue *GV) {
+        return Selected.count(GV) != 0;
+      });
+#endif
+  std::vector<GlobalValue *> Unused;
+  for (GlobalValue &GV : Filtered->global_values())
+    if (GV.isDeclaration() && GV.use_empty())
+      Unused.push_back(&GV);
+  for (GlobalValue *GV : Unused)
+    GV->eraseFromParent();
+
+  formatted_raw_ostream FOS(OS);
+  RustAssemblyAnnotationWriter AW(Cache);
+  Filtered->print(FOS, &AW, false);
+  return LLVMRustResult::Success;
+}
+
 extern "C" void LLVMRustPrintPasses() {
   LLVMInitializePasses();
   struct MyListener : PassRegistrationListener {
@@ -692,13 +1783,12 @@ extern "C" void LLVMRustRunRestrictionPass(LLVMModuleRef M, char **Symbols,
                                            size_t Len) {
   llvm::legacy::PassManager passes;
 
-  auto PreserveFunctions = [=](const GlobalValue &GV) {
-    for (size_t I = 0; I < Len; I++) {
-      if (GV.getName() == Symbols[I]) {
-        return true;
-      }
-    }
-    return false;
+  StringSet<> Preserved;
+  for (size_t I = 0; I < Len; I++)
+    Preserved.insert(Symbols[I]);
+
+  auto PreserveFunctions = [&](const GlobalValue &GV) {
+    return Preserved.count(GV.getName()) != 0;
   };
 
   passes.add(llvm::createInternalizePass(PreserveFunctions));
@@ -706,22 +1796,73 @@ extern "C" void LLVMRustRunRestrictionPass(LLVMModuleRef M, char **Symbols,
   passes.run(*unwrap(M));
 }
 
+// Same as `LLVMRustRunRestrictionPass`, except that symbols matching any of
+// the glob `Patterns` (as in the `global:` section of a version script, e.g.
+// `foo_*`) are preserved as well, so callers don't need to expand them into
+// lists of symbols first. Returns false if a pattern is invalid.
+extern "C" bool
+LLVMRustRunRestrictionPassWithPatterns(LLVMModuleRef M,
+                                       char **Symbols, size_t Len,
+                                       char **Patterns, size_t NumPatterns) {
+  StringSet<> Preserved;
+  for (size_t I = 0; I < Len; I++)
+    Preserved.insert(Symbols[I]);
+
+  std::vector<GlobPattern> Globs;
+  for (size_t I = 0; I < NumPatterns; I++) {
+    Expected<GlobPattern> PatOrErr = GlobPattern::create(Patterns[I]);
+    if (!PatOrErr) {
+      LLVMRustSetLastError(toString(PatOrErr.takeError()).c_str());
+      return false;
+    }
+    Globs.push_back(std::move(*PatOrErr));
+  }
+
+  auto PreserveFunctions = [&](const GlobalValue &GV) {
+    StringRef Name = GV.getName();
+    return Preserved.count(Name) != 0 ||
+           llvm::any_of(Globs, [&](const GlobPattern &Glob) {
+             return Glob.match(Name);
+           });
+  };
+
+  llvm::legacy::PassManager passes;
+  passes.add(llvm::createInternalizePass(PreserveFunctions));
+  passes.run(*unwrap(M));
+  return true;
+}
+
+// Lowers `M` for a build where nothing unwinds (`-C panic=abort`): every
+// function is marked nounwind, every invoke becomes a call followed by a
+// branch to its normal destination, and the landing pads and cleanup/catch
+// funclets which nothing can unwind to anymore are deleted. This leaves
+// the optimizer much less IR to look at than just marking the invokes
+// nounwind, which keeps all of the unwinding paths around until
+// `SimplifyCFG` gets to them.
+//
+// Invokes are always terminators, so only the last instruction of each
+// block needs to be looked at.
 extern "C" void LLVMRustMarkAllFunctionsNounwind(LLVMModuleRef M) {
-  for (Module::iterator GV = unwrap(M)->begin(), E = unwrap(M)->end(); GV != E;
-       ++GV) {
-    GV->setDoesNotThrow();
-    Function *F = dyn_cast<Function>(GV);
-    if (F == nullptr)
+  SmallVector<BasicBlock *, 16> InvokeBlocks;
+  for (Function &F : *unwrap(M)) {
+    F.setDoesNotThrow();
+    if (F.isDeclaration())
       continue;
 
-    for (Function::iterator B = F->begin(), BE = F->end(); B != BE; ++B) {
-      for (BasicBlock::iterator I = B->begin(), IE = B->end(); I != IE; ++I) {
-        if (isa<InvokeInst>(I)) {
-          InvokeInst *CI = cast<InvokeInst>(I);
-          CI->setDoesNotThrow();
-        }
+    for (BasicBlock &BB : F) {
+      if (auto *II = dyn_cast_or_null<InvokeInst>(BB.getTerminator())) {
+        // `removeUnwindEdge` copies the attributes over to the new call.
+        II->setDoesNotThrow();
+        InvokeBlocks.push_back(&BB);
       }
     }
+    if (InvokeBlocks.empty())
+      continue;
+
+    for (BasicBlock *BB : InvokeBlocks)
+      removeUnwindEdge(BB);
+    InvokeBlocks.clear();
+    removeUnreachableBlocks(F);
   }
 }
 
@@ -764,6 +1905,36 @@ extern "C" void LLVMRustSetModulePIELevel(LLVMModuleRef M) {
 // and various online resources about ThinLTO to make heads or tails of all
 // this.
 
+// Tuning for which functions ThinLTO imports across modules, an optional
+// argument to the `LLVMRustCreateThinLTOData` functions below. Each field
+// corresponds to one of the `-import-*` options of
+// `lib/Transforms/IPO/FunctionImport.cpp`, and a negative value leaves LLVM's
+// default (or whatever `-C llvm-args` set) in place. They're passed on to
+// LLVM's `ComputeCrossModuleImport` through those options, see
+// `ScopedOptionOverride`.
+//
+// `InstrLimit` is the largest function (in IR instructions) considered for
+// import. The multipliers scale that limit for call sites the summaries know
+// to be hot, critical or cold, which is only the case for modules that were
+// compiled with profile data (`-C profile-use`).
+//
+// `MergeFunctions` isn't an LLVM option: if positive, identical internal
+// functions of different modules are folded into one, see
+// `FunctionHashesName`. rustc only sets it for `-Z thinlto-fold-functions`.
+//
+// `SummaryThreads` doesn't change the result: it's the number of threads the
+// module summaries are parsed on (one per core if not positive), see
+// `loadThinLTOSummaries`, and it isn't saved with the data, see
+// `encodeImportOptions`.
+struct LLVMRustThinLTOImportOptions {
+  int InstrLimit;
+  float HotMultiplier;
+  float CriticalMultiplier;
+  float ColdMultiplier;
+  int MergeFunctions;
+  int SummaryThreads;
+};
+
 // This is a shared data structure which *must* be threadsafe to share
 // read-only amongst threads. This also corresponds basically to the arguments
 // of the `ProcessThinLTOModule` function in the LLVM source.
@@ -777,6 +1948,17 @@ struct LLVMRustThinLTOData {
   // from.
   StringMap<MemoryBufferRef> ModuleMap;
 
+  // Buffers backing `ModuleMap` which are owned by us rather than the caller,
+  // see `LLVMRustCreateThinLTODataFromFiles`.
+  std::vector<std::unique_ptr<MemoryBuffer>> OwnedModules;
+
+  // Parsed top-level structure (identification, module and string table
+  // blocks) of every module that's been imported from so far. This doesn't
+  // depend on any `LLVMContext`, so it's shared between all threads
+  // importing, see `getImportSource` below.
+  mutable std::mutex ImportSourcesLock;
+  mutable StringMap<std::unique_ptr<BitcodeModule>> ImportSources;
+
   // A set that we manage of everything we *don't* want internalized. Note that
   // this includes all transitive references right now as well, but it may not
   // always!
@@ -788,6 +1970,34 @@ struct LLVMRustThinLTOData {
   StringMap<FunctionImporter::ExportSetTy> ExportLists;
   StringMap<GVSummaryMapTy> ModuleToDefinedGVSummaries;
 
+  // The linkage each module's LinkOnce/Weak symbols were resolved to. This
+  // doesn't affect anything we do here directly, but it's an input to the
+  // per-module cache key as the linkages change the output of each module.
+  StringMap<std::map<GlobalValue::GUID, GlobalValue::LinkageTypes>> ResolvedODR;
+
+  // Internal functions of each module which are replaced by an identical
+  // function of another module, see `foldIdenticalFunctions`.
+  struct FoldedFunction {
+    std::string Name;
+    std::string Target;
+    std::string TargetModule;
+  };
+  StringMap<std::vector<FoldedFunction>> FoldedFunctions;
+
+  // The import graph as handed out by `LLVMRustThinLTOGetImportGraph`,
+  // computed once the lists above are final.
+  struct ImportGraphData {
+    std::vector<const char *> Names;
+    std::vector<size_t> NameLens;
+    std::vector<uint32_t> EdgeOffsets;
+    std::vector<uint32_t> Edges;
+    std::vector<uint32_t> GUIDOffsets;
+    std::vector<uint64_t> GUIDs;
+  } ImportGraph;
+
+  // The options the import lists above were computed with.
+  LLVMRustThinLTOImportOptions ImportOptions = { -1, -1.0f, -1.0f, -1.0f, -1, 0 };
+
 #if LLVM_VERSION_GE(7, 0)
   LLVMRustThinLTOData() : Index(/* HaveGVs = */ false) {}
 #endif
@@ -800,6 +2010,15 @@ struct LLVMRustThinLTOModule {
   size_t len;
 };
 
+// Just an argument to the `LLVMRustCreateThinLTODataFromFiles` function
+// below: a module stored at `offset` in the file `path`.
+struct LLVMRustThinLTOFileModule {
+  const char *identifier;
+  const char *path;
+  uint64_t offset;
+  size_t len;
+};
+
 // This is copied from `lib/LTO/ThinLTOCodeGenerator.cpp`, not sure what it
 // does.
 static const GlobalValueSummary *
@@ -823,85 +2042,904 @@ getFirstDefinitionForLinker(const GlobalValueSummaryList &GVSummaryList) {
   return FirstDefForLinker->get();
 }
 
-// The main entry point for creating the global ThinLTO analysis. The structure
-// here is basically the same as before threads are spawned in the `run`
-// function of `lib/LTO/ThinLTOCodeGenerator.cpp`.
-extern "C" LLVMRustThinLTOData*
-LLVMRustCreateThinLTOData(LLVMRustThinLTOModule *modules,
-                          int num_modules,
-                          const char **preserved_symbols,
-                          int num_symbols) {
-  auto Ret = llvm::make_unique<LLVMRustThinLTOData>();
+#if LLVM_VERSION_GE(8, 0)
+// Returns a copy of `Summary` whose references and call edges are mapped
+// through `Remap`. The edge lists can't be changed once a summary is built,
+// so this is how a summary is moved to another index. Everything else is
+// copied as is, except for the aliasee of an alias, which is left for the
+// caller to set.
+static std::unique_ptr<GlobalValueSummary>
+remapSummary(const GlobalValueSummary &Summary,
+             function_ref<ValueInfo(ValueInfo)> Remap) {
+  std::vector<ValueInfo> Refs;
+  Refs.reserve(Summary.refs().size());
+  for (const ValueInfo &Ref : Summary.refs())
+    Refs.push_back(Remap(Ref));
+
+  std::unique_ptr<GlobalValueSummary> Ret;
+  if (auto *FS = dyn_cast<FunctionSummary>(&Summary)) {
+    std::vector<FunctionSummary::EdgeTy> Calls;
+    Calls.reserve(FS->calls().size());
+    for (const FunctionSummary::EdgeTy &Edge : FS->calls())
+      Calls.push_back(std::make_pair(Remap(Edge.first), Edge.second));
+    Ret = llvm::make_unique<FunctionSummary>(
+        FS->flags(), FS->instCount(), FS->fflags(), FS->entryCount(),
+        std::move(Refs), std::move(Calls), FS->type_tests().vec(),
+        FS->type_test_assume_vcalls().vec(),
+        FS->type_checked_load_vcalls().vec(),
+        FS->type_test_assume_const_vcalls().vec(),
+        FS->type_checked_load_const_vcalls().vec());
+  } else if (auto *GVS = dyn_cast<GlobalVarSummary>(&Summary)) {
+    Ret = llvm::make_unique<GlobalVarSummary>(GVS->flags(), GVS->varflags(),
+                                              std::move(Refs));
+  } else {
+    Ret = llvm::make_unique<AliasSummary>(Summary.flags());
+  }
+  Ret->setOriginalName(Summary.getOriginalName());
+  return Ret;
+}
 
-  // Load each module's summary and merge it into one combined index
-  for (int i = 0; i < num_modules; i++) {
-    auto module = &modules[i];
-    StringRef buffer(module->data, module->len);
-    MemoryBufferRef mem_buffer(buffer, module->identifier);
+// Copies all summaries of the per-module index `Src` into the combined index
+// `Dst` as module number `ModuleId`, along with its flags and type ID
+// summaries. This has the same result as reading the summary straight into
+// `Dst` with `readModuleSummaryIndex`, which is what lets us parse summaries
+// on many threads and only merge them serially.
+//
+// Summaries refer to other values through `ValueInfo`s, which point into the
+// index owning them, so every reference and call edge is mapped to the
+// corresponding entry of `Dst` along the way.
+static void mergeModuleSummaryIndex(ModuleSummaryIndex &Dst,
+                                    ModuleSummaryIndex &Src,
+                                    uint64_t ModuleId) {
+  auto remap = [&](ValueInfo VI) {
+    StringRef Name = VI.name();
+    ValueInfo Ret = Name.empty()
+        ? Dst.getOrInsertValueInfo(VI.getGUID())
+        : Dst.getOrInsertValueInfo(VI.getGUID(), Dst.saveString(Name));
+    if (VI.isReadOnly())
+      Ret.setReadOnly();
+    return Ret;
+  };
 
-    Ret->ModuleMap[module->identifier] = mem_buffer;
+  StringMap<StringRef> ModulePaths;
+  for (const auto &Path : Src.modulePaths()) {
+    auto *Module = Dst.addModule(Path.getKey(), ModuleId, Path.second.second);
+    ModulePaths[Path.getKey()] = Module->getKey();
+  }
 
-    if (Error Err = readModuleSummaryIndex(mem_buffer, Ret->Index, i)) {
-      LLVMRustSetLastError(toString(std::move(Err)).c_str());
-      return nullptr;
+  // Aliases point straight at the summary of their aliasee, which has to be
+  // redirected to its copy once everything is copied.
+  DenseMap<const GlobalValueSummary *, GlobalValueSummary *> Copies;
+  std::vector<std::pair<AliasSummary *, const AliasSummary *>> Aliases;
+  for (auto &Entry : Src) {
+    ValueInfo VI = Src.getValueInfo(Entry);
+    for (const auto &Summary : Entry.second.SummaryList) {
+      std::unique_ptr<GlobalValueSummary> Copy = remapSummary(*Summary, remap);
+      Copy->setModulePath(ModulePaths.lookup(Summary->modulePath()));
+      Copies[Summary.get()] = Copy.get();
+      if (auto *AS = dyn_cast<AliasSummary>(Summary.get()))
+        Aliases.push_back(std::make_pair(cast<AliasSummary>(Copy.get()), AS));
+      Dst.addGlobalValueSummary(remap(VI), std::move(Copy));
     }
   }
+  for (const auto &Alias : Aliases)
+    Alias.first->setAliasee(Copies.lookup(&Alias.second->getAliasee()));
+
+  for (const auto &Def : Src.cfiFunctionDefs())
+    Dst.cfiFunctionDefs().insert(Def);
+  for (const auto &Decl : Src.cfiFunctionDecls())
+    Dst.cfiFunctionDecls().insert(Decl);
+  for (const auto &TypeId : Src.typeIds())
+    Dst.getOrInsertTypeIdSummary(TypeId.second.first) = TypeId.second.second;
+
+  // Reading a summary only ever sets these.
+  if (Src.withGlobalValueDeadStripping())
+    Dst.setWithGlobalValueDeadStripping();
+  if (Src.skipModuleByDistributedBackend())
+    Dst.setSkipModuleByDistributedBackend();
+  if (Src.hasSyntheticEntryCounts())
+    Dst.setHasSyntheticEntryCounts();
+  if (Src.enableSplitLTOUnit())
+    Dst.setEnableSplitLTOUnit();
+}
+#endif
 
-  // Collect for each module the list of function it defines (GUID -> Summary)
-  Ret->Index.collectDefinedGVSummariesPerModule(Ret->ModuleToDefinedGVSummaries);
+// Returns whether `Data` is bitcode with a ThinLTO summary, which is what's
+// needed to take part in the analysis of `LLVMRustCreateThinLTOData`. This is
+// how rustc tells bitcode that clang produced for native static libraries
+// (with `-flto=thin`) apart from regular objects.
+extern "C" bool
+LLVMRustIsThinLTOBitcode(const char *Data, size_t Len) {
+  const unsigned char *Start = reinterpret_cast<const unsigned char *>(Data);
+  if (!isBitcode(Start, Start + Len))
+    return false;
+  Expected<BitcodeLTOInfo> InfoOrErr =
+      getBitcodeLTOInfo(MemoryBufferRef(StringRef(Data, Len), ""));
+  if (!InfoOrErr) {
+    consumeError(InfoOrErr.takeError());
+    return false;
+  }
+  return InfoOrErr->IsThinLTO;
+}
 
-  // Convert the preserved symbols set from string to GUID, this is then needed
-  // for internalization.
-  for (int i = 0; i < num_symbols; i++) {
-    auto GUID = GlobalValue::getGUID(preserved_symbols[i]);
-    Ret->GUIDPreservedSymbols.insert(GUID);
+// Writes the name of every definition in the bitcode `Data` that's visible
+// outside of it into `Out`, each followed by a NUL. This is what rustc
+// preserves of the native bitcode it includes in LTO, as it can't know which
+// of these regular objects and assembly outside of LTO refer to.
+extern "C" bool
+LLVMRustGetBitcodeDefinedSymbols(RustStringRef Out, const char *Data,
+                                 size_t Len) {
+  LLVMContext Ctx;
+  Expected<std::unique_ptr<Module>> MOrErr = getLazyBitcodeModule(
+      MemoryBufferRef(StringRef(Data, Len), ""), Ctx);
+  if (!MOrErr) {
+    LLVMRustSetLastError(toString(MOrErr.takeError()).c_str());
+    return false;
   }
+  RawRustStringOstream OS(Out);
+  for (const GlobalValue &GV : (*MOrErr)->global_values()) {
+    if (GV.isDeclaration() || GV.hasLocalLinkage() || !GV.hasName())
+      continue;
+    OS << GV.getName() << '\0';
+  }
+  return true;
+}
 
-  // Collect the import/export lists for all modules from the call-graph in the
-  // combined index
-  //
-  // This is copied from `lib/LTO/ThinLTOCodeGenerator.cpp`
-#if LLVM_VERSION_GE(7, 0)
-  auto deadIsPrevailing = [&](GlobalValue::GUID G) {
-    return PrevailingType::Unknown;
-  };
-#if LLVM_VERSION_GE(8, 0)
-  computeDeadSymbolsWithConstProp(Ret->Index, Ret->GUIDPreservedSymbols,
-                                  deadIsPrevailing, /* ImportEnabled = */ true);
-#else
-  computeDeadSymbols(Ret->Index, Ret->GUIDPreservedSymbols, deadIsPrevailing);
-#endif
-#else
-  computeDeadSymbols(Ret->Index, Ret->GUIDPreservedSymbols);
+// Reads the summary of each module in `Modules` into the combined `Index`,
+// using module IDs in the order the modules are given.
+//
+// Most of the time here is spent parsing bitcode, so where possible each
+// summary is parsed into its own index on a thread pool first. The results
+// are then merged in module order, so the combined index is independent of
+// how the work was scheduled.
+static bool loadThinLTOSummaries(ModuleSummaryIndex &Index,
+                                 ArrayRef<MemoryBufferRef> Modules,
+                                 int Threads) {
+  int num_modules = Modules.size();
+  if (Threads <= 0)
+    Threads = heavyweight_hardware_concurrency();
+
+#if LLVM_VERSION_GE(8, 0) && LLVM_ENABLE_THREADS
+  if (num_modules > 1 && Threads > 1) {
+    std::vector<std::unique_ptr<ModuleSummaryIndex>> Summaries(num_modules);
+    std::vector<std::string> Errors(num_modules);
+    {
+      ThreadPool Pool(std::min(Threads, num_modules));
+      for (int i = 0; i < num_modules; i++) {
+        Pool.async([&, i] {
+          Expected<std::unique_ptr<ModuleSummaryIndex>> SummaryOrErr =
+              getModuleSummaryIndex(Modules[i]);
+          if (!SummaryOrErr)
+            Errors[i] = toString(SummaryOrErr.takeError());
+          else
+            Summaries[i] = std::move(*SummaryOrErr);
+        });
+      }
+    }
+
+    // Report every module that failed to parse, not just the first.
+    bool Failed = false;
+    for (int i = 0; i < num_modules; i++) {
+      if (!Summaries[i]) {
+        std::string Identifier = Modules[i].getBufferIdentifier().str();
+        LLVMRustReportError(LLVMRustErrorKind::Bitcode, Identifier.c_str(),
+                            Errors[i].c_str());
+        Failed = true;
+      }
+    }
+    if (Failed)
+      return false;
+    for (int i = 0; i < num_modules; i++)
+      mergeModuleSummaryIndex(Index, *Summaries[i], i);
+    return true;
+  }
 #endif
-  ComputeCrossModuleImport(
-    Ret->Index,
-    Ret->ModuleToDefinedGVSummaries,
-    Ret->ImportLists,
-    Ret->ExportLists
-  );
 
-  // Resolve LinkOnce/Weak symbols, this has to be computed early be cause it
-  // impacts the caching.
-  //
-  // This is copied from `lib/LTO/ThinLTOCodeGenerator.cpp` with some of this
-  // being lifted from `lib/LTO/LTO.cpp` as well
-  StringMap<std::map<GlobalValue::GUID, GlobalValue::LinkageTypes>> ResolvedODR;
-  DenseMap<GlobalValue::GUID, const GlobalValueSummary *> PrevailingCopy;
-  for (auto &I : Ret->Index) {
-    if (I.second.SummaryList.size() > 1)
-      PrevailingCopy[I.first] = getFirstDefinitionForLinker(I.second.SummaryList);
+  for (int i = 0; i < num_modules; i++) {
+    if (Error Err = readModuleSummaryIndex(Modules[i], Index, i)) {
+      std::string Identifier = Modules[i].getBufferIdentifier().str();
+      LLVMRustReportError(LLVMRustErrorKind::Bitcode, Identifier.c_str(),
+                          toString(std::move(Err)).c_str());
+      return false;
+    }
   }
-  auto isPrevailing = [&](GlobalValue::GUID GUID, const GlobalValueSummary *S) {
-    const auto &Prevailing = PrevailingCopy.find(GUID);
-    if (Prevailing == PrevailingCopy.end())
-      return true;
+  return true;
+}
+
+// Identical functions in different modules (typically the same generic
+// instantiated in several codegen units under different names) are folded
+// into one by ThinLTO if `LLVMRustThinLTOImportOptions::MergeFunctions` is
+// set. When a module is serialized for ThinLTO, a structural hash of each
+// function body is stored in the named metadata below. The global analysis
+// then picks the first live copy of each body as the prevailing one and
+// exports it, and each module holding another internal copy replaces that
+// with a reference to the prevailing one when it's renamed, see
+// `applyFoldedFunctions`. Like the summary, the hashes are only there for the
+// global analysis, and they're dropped again when a module is loaded for
+// anything else.
+static const char FunctionHashesName[] = "rust.thinlto.function_hashes";
+
+static void stripFunctionHashes(Module &M) {
+  if (NamedMDNode *Hashes = M.getNamedMetadata(FunctionHashesName))
+    M.eraseNamedMetadata(Hashes);
+}
+
+// The flags of a function recorded with its hash.
+enum FunctionHashFlags : uint64_t {
+  FunctionHashLocal = 1 << 0,
+  // Only functions whose address isn't significant can be folded into
+  // another one, as they'd compare equal afterwards.
+  FunctionHashUnnamedAddr = 1 << 1,
+};
+
+// Calls to a folded function can't be inlined anymore, so small functions
+// (which are usually inlined anyway) are left alone.
+static const unsigned MinFoldedInstructions = 16;
+
+namespace {
+
+// Computes a hash of a function which only depends on what the function
+// does: its signature and attributes, and its instructions with everything
+// they refer to. The hash is MD5 over all of it, so equal hashes mean equal
+// functions for all practical purposes.
+//
+// Internal functions and non-constant internal globals have different
+// definitions in every module even with the same name, so functions
+// referring to them can't be folded. Internal constants, such as string
+// literals, are compared by their contents instead. Debug info isn't part of
+// the hash, neither of instructions nor of the function itself.
+class FunctionHasher {
+  const Function &F;
+  DenseMap<Type *, uint64_t> &TypeHashes;
+  MD5 Hash;
+  DenseMap<const Value *, unsigned> Locals;
+  DenseMap<const Metadata *, unsigned> Nodes;
+  SmallPtrSet<Type *, 8> VisitingTypes;
+  bool Foldable = true;
+
+  void addInt(uint64_t V) {
+    Hash.update(makeArrayRef(reinterpret_cast<const uint8_t *>(&V), sizeof(V)));
+  }
+
+  void addString(StringRef S) {
+    addInt(S.size());
+    Hash.update(S);
+  }
+
+  void addAPInt(const APInt &V) {
+    addInt(V.getBitWidth());
+    for (unsigned I = 0; I < V.getNumWords(); I++)
+      addInt(V.getRawData()[I]);
+  }
+
+  void addAttributes(AttributeList Attrs) {
+    addInt(Attrs.getNumAttrSets());
+    for (unsigned I = Attrs.index_begin(); I != Attrs.index_end(); I++)
+      addString(Attrs.getAsString(I));
+  }
+
+  void addType(Type *T) {
+    // Named structs are hashed by structure as their names differ between
+    // modules. A struct referring to itself is only expanded once.
+    if (VisitingTypes.empty()) {
+      auto It = TypeHashes.find(T);
+      if (It != TypeHashes.end()) {
+        addInt(It->second);
+        return;
+      }
+      MD5 Outer = Hash;
+      Hash = MD5();
+      addTypeStructure(T);
+      MD5::MD5Result Result;
+      Hash.final(Result);
+      Hash = Outer;
+      TypeHashes[T] = Result.low();
+      addInt(Result.low());
+      return;
+    }
+    addTypeStructure(T);
+  }
+
+  void addTypeStructure(Type *T) {
+    addInt(T->getTypeID());
+    switch (T->getTypeID()) {
+    case Type::IntegerTyID:
+      addInt(cast<IntegerType>(T)->getBitWidth());
+      break;
+    case Type::PointerTyID:
+      addInt(T->getPointerAddressSpace());
+      addTypeStructure(T->getPointerElementType());
+      break;
+    case Type::ArrayTyID:
+      addInt(T->getArrayNumElements());
+      addTypeStructure(T->getArrayElementType());
+      break;
+    case Type::VectorTyID:
+      addInt(T->getVectorNumElements());
+      addTypeStructure(T->getVectorElementType());
+      break;
+    case Type::FunctionTyID: {
+      auto *FT = cast<FunctionType>(T);
+      addInt(FT->isVarArg());
+      addInt(FT->getNumParams());
+      addTypeStructure(FT->getReturnType());
+      for (Type *Param : FT->params())
+        addTypeStructure(Param);
+      break;
+    }
+    case Type::StructTyID: {
+      auto *ST = cast<StructType>(T);
+      if (ST->isOpaque()) {
+        addString(ST->getName());
+        break;
+      }
+      if (!VisitingTypes.insert(T).second) {
+        addInt(~0ULL);
+        break;
+      }
+      addInt(ST->isPacked());
+      addInt(ST->getNumElements());
+      for (Type *Element : ST->elements())
+        addTypeStructure(Element);
+      VisitingTypes.erase(T);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  void addMetadata(const Metadata *MD, unsigned Depth) {
+    if (!MD) {
+      addInt(0);
+      return;
+    }
+    // Nodes are numbered in the order they're first seen, which also covers
+    // cycles such as those of alias scopes.
+    auto Inserted = Nodes.insert(std::make_pair(MD, Nodes.size()));
+    if (!Inserted.second) {
+      addInt(1);
+      addInt(Inserted.first->second);
+      return;
+    }
+    if (Depth > 16) {
+      Foldable = false;
+      return;
+    }
+    if (auto *S = dyn_cast<MDString>(MD)) {
+      addInt(2);
+      addString(S->getString());
+    } else if (auto *C = dyn_cast<ConstantAsMetadata>(MD)) {
+      addInt(3);
+      addConstant(C->getValue(), 0);
+    } else if (auto *N = dyn_cast<MDTuple>(MD)) {
+      addInt(4);
+      addInt(N->isDistinct());
+      addInt(N->getNumOperands());
+      for (const MDOperand &Op : N->operands())
+        addMetadata(Op.get(), Depth + 1);
+    } else {
+      // Debug info nodes and references to local values.
+      Foldable = false;
+    }
+  }
+
+  void addConstant(const Constant *C, unsigned Depth) {
+    if (Depth > 8) {
+      Foldable = false;
+      return;
+    }
+    addInt(C->getValueID());
+    addType(C->getType());
+    if (auto *GV = dyn_cast<GlobalValue>(C)) {
+      if (GV == &F)
+        return;
+      if (!GV->hasLocalLinkage()) {
+        addString(GV->getName());
+        return;
+      }
+      auto *GVar = dyn_cast<GlobalVariable>(GV);
+      if (!GVar || !GVar->isConstant() || !GVar->hasInitializer() ||
+          !GVar->hasGlobalUnnamedAddr() || GVar->isThreadLocal()) {
+        Foldable = false;
+        return;
+      }
+      addInt(GVar->getAlignment());
+      addString(GVar->getSection());
+      addConstant(GVar->getInitializer(), Depth + 1);
+    } else if (auto *CI = dyn_cast<ConstantInt>(C)) {
+      addAPInt(CI->getValue());
+    } else if (auto *CF = dyn_cast<ConstantFP>(C)) {
+      addAPInt(CF->getValueAPF().bitcastToAPInt());
+    } else if (auto *CDS = dyn_cast<ConstantDataSequential>(C)) {
+      addString(CDS->getRawDataValues());
+    } else if (auto *CE = dyn_cast<ConstantExpr>(C)) {
+      addInt(CE->getOpcode());
+      addInt(CE->getRawSubclassOptionalData());
+      if (CE->isCompare())
+        addInt(CE->getPredicate());
+      if (CE->hasIndices())
+        for (unsigned Index : CE->getIndices())
+          addInt(Index);
+      if (auto *GEP = dyn_cast<GEPOperator>(CE))
+        addType(GEP->getSourceElementType());
+      addInt(CE->getNumOperands());
+      for (const Use &Op : CE->operands())
+        addConstant(cast<Constant>(Op.get()), Depth + 1);
+    } else if (isa<ConstantAggregate>(C)) {
+      addInt(C->getNumOperands());
+      for (const Use &Op : C->operands())
+        addConstant(cast<Constant>(Op.get()), Depth + 1);
+    } else if (isa<BlockAddress>(C)) {
+      Foldable = false;
+    }
+    // Anything else (null, undef, zeroinitializer, none) is fully described
+    // by its kind and type.
+  }
+
+  void addValue(const Value *V) {
+    auto It = Locals.find(V);
+    if (It != Locals.end()) {
+      addInt(1);
+      addInt(It->second);
+    } else if (auto *C = dyn_cast<Constant>(V)) {
+      addInt(2);
+      addConstant(C, 0);
+    } else if (auto *IA = dyn_cast<InlineAsm>(V)) {
+      addInt(3);
+      addType(IA->getFunctionType());
+      addString(IA->getAsmString());
+      addString(IA->getConstraintString());
+      addInt(IA->hasSideEffects());
+      addInt(IA->isAlignStack());
+      addInt(IA->getDialect());
+    } else if (auto *MAV = dyn_cast<MetadataAsValue>(V)) {
+      addInt(4);
+      addMetadata(MAV->getMetadata(), 0);
+    } else {
+      Foldable = false;
+    }
+  }
+
+  void addOrdering(AtomicOrdering Ordering, SyncScope::ID Scope) {
+    addInt(static_cast<uint64_t>(Ordering));
+    addInt(Scope);
+  }
+
+  void addInstruction(const Instruction &I) {
+    addInt(I.getOpcode());
+    addType(I.getType());
+    addInt(I.getRawSubclassOptionalData());
+    addInt(I.getNumOperands());
+    for (const Use &Op : I.operands())
+      addValue(Op.get());
+
+    if (auto *Cmp = dyn_cast<CmpInst>(&I)) {
+      addInt(Cmp->getPredicate());
+    } else if (auto *AI = dyn_cast<AllocaInst>(&I)) {
+      addType(AI->getAllocatedType());
+      addInt(AI->getAlignment());
+      addInt(AI->isUsedWithInAlloca());
+      addInt(AI->isSwiftError());
+    } else if (auto *LI = dyn_cast<LoadInst>(&I)) {
+      addInt(LI->getAlignment());
+      addInt(LI->isVolatile());
+      addOrdering(LI->getOrdering(), LI->getSyncScopeID());
+    } else if (auto *SI = dyn_cast<StoreInst>(&I)) {
+      addInt(SI->getAlignment());
+      addInt(SI->isVolatile());
+      addOrdering(SI->getOrdering(), SI->getSyncScopeID());
+    } else if (auto *GEP = dyn_cast<GetElementPtrInst>(&I)) {
+      addType(GEP->getSourceElementType());
+    } else if (auto *CI = dyn_cast<CallInst>(&I)) {
+      addInt(CI->getCallingConv());
+      addInt(CI->getTailCallKind());
+      addAttributes(CI->getAttributes());
+    } else if (auto *II = dyn_cast<InvokeInst>(&I)) {
+      addInt(II->getCallingConv());
+      addAttributes(II->getAttributes());
+    } else if (auto *EVI = dyn_cast<ExtractValueInst>(&I)) {
+      for (unsigned Index : EVI->indices())
+        addInt(Index);
+    } else if (auto *IVI = dyn_cast<InsertValueInst>(&I)) {
+      for (unsigned Index : IVI->indices())
+        addInt(Index);
+    } else if (auto *RMW = dyn_cast<AtomicRMWInst>(&I)) {
+      addInt(RMW->getOperation());
+      addInt(RMW->isVolatile());
+      addOrdering(RMW->getOrdering(), RMW->getSyncScopeID());
+    } else if (auto *CX = dyn_cast<AtomicCmpXchgInst>(&I)) {
+      addInt(CX->isVolatile());
+      addInt(CX->isWeak());
+      addOrdering(CX->getSuccessOrdering(), CX->getSyncScopeID());
+      addOrdering(CX->getFailureOrdering(), CX->getSyncScopeID());
+    } else if (auto *FI = dyn_cast<FenceInst>(&I)) {
+      addOrdering(FI->getOrdering(), FI->getSyncScopeID());
+    } else if (auto *LP = dyn_cast<LandingPadInst>(&I)) {
+      addInt(LP->isCleanup());
+      for (unsigned C = 0; C < LP->getNumClauses(); C++)
+        addInt(LP->isCatch(C));
+    } else if (auto *PN = dyn_cast<PHINode>(&I)) {
+      // Incoming blocks aren't operands.
+      for (const BasicBlock *BB : PN->blocks())
+        addValue(BB);
+    }
+
+    SmallVector<std::pair<unsigned, MDNode *>, 4> MDs;
+    I.getAllMetadataOtherThanDebugLoc(MDs);
+    addInt(MDs.size());
+    for (const auto &MD : MDs) {
+      addInt(MD.first);
+      addMetadata(MD.second, 0);
+    }
+  }
+
+public:
+  FunctionHasher(const Function &F, DenseMap<Type *, uint64_t> &TypeHashes)
+      : F(F), TypeHashes(TypeHashes) {}
+
+  // Returns false if the function can't be folded with any other.
+  bool hash(MD5::MD5Result &Result, unsigned &NumInstructions) {
+    if (F.hasPrefixData() || F.hasPrologueData())
+      return false;
+
+    // Arguments, blocks and instructions are identified by their position,
+    // numbered up front so that forward references hash like backward ones.
+    for (const Argument &A : F.args())
+      Locals[&A] = Locals.size();
+    for (const BasicBlock &BB : F) {
+      Locals[&BB] = Locals.size();
+      for (const Instruction &I : BB)
+        Locals[&I] = Locals.size();
+    }
+
+    addType(F.getFunctionType());
+    addInt(F.getCallingConv());
+    addAttributes(F.getAttributes());
+    addString(F.getSection());
+    addInt(F.getAlignment());
+    addString(F.hasGC() ? F.getGC() : "");
+    addInt(F.hasPersonalityFn());
+    if (F.hasPersonalityFn())
+      addValue(F.getPersonalityFn());
+
+    SmallVector<std::pair<unsigned, MDNode *>, 4> MDs;
+    F.getAllMetadata(MDs);
+    MDs.erase(std::remove_if(MDs.begin(), MDs.end(),
+                             [](const std::pair<unsigned, MDNode *> &MD) {
+                               return MD.first == LLVMContext::MD_dbg;
+                             }),
+              MDs.end());
+    addInt(MDs.size());
+    for (const auto &MD : MDs) {
+      addInt(MD.first);
+      addMetadata(MD.second, 0);
+    }
+
+    NumInstructions = 0;
+    for (const BasicBlock &BB : F) {
+      addInt(~0ULL);
+      for (const Instruction &I : BB) {
+        if (isa<DbgInfoIntrinsic>(I))
+          continue;
+        addInstruction(I);
+        NumInstructions++;
+      }
+      if (!Foldable)
+        return false;
+    }
+    Hash.final(Result);
+    return true;
+  }
+};
+
+// One function of a module as recorded in `FunctionHashesName`.
+struct FunctionHashEntry {
+  GlobalValue::GUID GUID;
+  uint64_t Low;
+  uint64_t High;
+  bool Local;
+  bool UnnamedAddr;
+  std::string Name;
+};
+
+} // namespace
+
+// Records the hashes of all functions of `M` that could be folded in the
+// named metadata `FunctionHashesName`, which the caller removes again after
+// serializing the module. Returns null if there are none.
+static NamedMDNode *addFunctionHashes(Module &M) {
+  DenseMap<Type *, uint64_t> TypeHashes;
+  std::string Blob;
+  raw_string_ostream OS(Blob);
+  auto WriteU64 = [&](uint64_t V) {
+    OS.write(reinterpret_cast<const char *>(&V), sizeof(V));
+  };
+  for (const Function &F : M) {
+    if (F.isDeclaration() || F.hasAvailableExternallyLinkage() ||
+        !F.hasName())
+      continue;
+    MD5::MD5Result Result;
+    unsigned NumInstructions;
+    FunctionHasher Hasher(F, TypeHashes);
+    if (!Hasher.hash(Result, NumInstructions) ||
+        NumInstructions < MinFoldedInstructions)
+      continue;
+    WriteU64(F.getGUID());
+    WriteU64(Result.low());
+    WriteU64(Result.high());
+    uint64_t Flags = 0;
+    if (F.hasLocalLinkage())
+      Flags |= FunctionHashLocal;
+    if (F.hasGlobalUnnamedAddr())
+      Flags |= FunctionHashUnnamedAddr;
+    WriteU64(Flags);
+    WriteU64(F.getName().size());
+    OS << F.getName();
+  }
+  OS.flush();
+  if (Blob.empty())
+    return nullptr;
+
+  NamedMDNode *Hashes = M.getOrInsertNamedMetadata(FunctionHashesName);
+  Hashes->addOperand(MDNode::get(M.getContext(),
+                                 MDString::get(M.getContext(), Blob)));
+  return Hashes;
+}
+
+// Reads back what `addFunctionHashes` recorded in the serialized module
+// `Buf`, without parsing any function bodies.
+static Error readFunctionHashes(MemoryBufferRef Buf,
+                                std::vector<FunctionHashEntry> &Entries) {
+  LLVMContext Ctx;
+  Expected<std::unique_ptr<Module>> MOrErr = getLazyBitcodeModule(
+      Buf, Ctx, /* ShouldLazyLoadMetadata = */ true);
+  if (!MOrErr)
+    return MOrErr.takeError();
+  if (Error Err = (*MOrErr)->materializeMetadata())
+    return Err;
+  NamedMDNode *Hashes = (*MOrErr)->getNamedMetadata(FunctionHashesName);
+  if (!Hashes || Hashes->getNumOperands() != 1)
+    return Error::success();
+  auto *Node = Hashes->getOperand(0);
+  auto *Str = Node->getNumOperands() == 1
+                  ? dyn_cast_or_null<MDString>(Node->getOperand(0).get())
+                  : nullptr;
+  if (!Str)
+    return Error::success();
+
+  StringRef Blob = Str->getString();
+  auto ReadU64 = [&](uint64_t &V) {
+    if (Blob.size() < sizeof(V))
+      return false;
+    memcpy(&V, Blob.data(), sizeof(V));
+    Blob = Blob.drop_front(sizeof(V));
+    return true;
+  };
+  while (!Blob.empty()) {
+    FunctionHashEntry E;
+    uint64_t Flags, NameLen;
+    if (!ReadU64(E.GUID) || !ReadU64(E.Low) || !ReadU64(E.High) ||
+        !ReadU64(Flags) || !ReadU64(NameLen) || Blob.size() < NameLen)
+      return make_error<StringError>("corrupt function hashes",
+                                     inconvertibleErrorCode());
+    E.Local = Flags & FunctionHashLocal;
+    E.UnnamedAddr = Flags & FunctionHashUnnamedAddr;
+    E.Name = Blob.take_front(NameLen).str();
+    Blob = Blob.drop_front(NameLen);
+    Entries.push_back(std::move(E));
+  }
+  return Error::success();
+}
+
+// Decides which functions are folded into which, see `FunctionHashesName`.
+// This has to run after the import lists are computed, as duplicates that
+// other modules import or refer to can't be removed, and before the index
+// is internalized, so that the prevailing copies stay external.
+static bool foldIdenticalFunctions(LLVMRustThinLTOData *Ret,
+                                   ArrayRef<MemoryBufferRef> Modules) {
+  size_t N = Modules.size();
+  std::vector<std::vector<FunctionHashEntry>> Hashes(N);
+  std::vector<std::string> Errors(N);
+  {
+    ThreadPool Pool(std::max<size_t>(
+        std::min<size_t>(heavyweight_hardware_concurrency(), N), 1));
+    for (size_t I = 0; I < N; I++)
+      Pool.async([&, I] {
+        if (Error Err = readFunctionHashes(Modules[I], Hashes[I]))
+          Errors[I] = toString(std::move(Err));
+      });
+  }
+  for (size_t I = 0; I < N; I++) {
+    if (!Errors[I].empty()) {
+      std::string Identifier = Modules[I].getBufferIdentifier().str();
+      LLVMRustReportError(LLVMRustErrorKind::Bitcode, Identifier.c_str(),
+                          Errors[I].c_str());
+      return false;
+    }
+  }
+
+  // The first live copy of each body, in module order. Copies the linker
+  // may replace with another definition (weak ones) can't be folded into.
+  std::map<std::pair<uint64_t, uint64_t>,
+           std::pair<StringRef, const FunctionHashEntry *>> Prevailing;
+  for (size_t I = 0; I < N; I++) {
+    StringRef ModuleId = Modules[I].getBufferIdentifier();
+    for (const FunctionHashEntry &E : Hashes[I]) {
+      GlobalValueSummary *S = Ret->Index.findSummaryInModule(E.GUID, ModuleId);
+      if (!S || !S->isLive() || !isa<FunctionSummary>(S) ||
+          GlobalValue::isInterposableLinkage(S->linkage()))
+        continue;
+      auto Inserted = Prevailing.insert(std::make_pair(
+          std::make_pair(E.Low, E.High), std::make_pair(ModuleId, &E)));
+      if (Inserted.second)
+        continue;
+
+      StringRef TargetModule = Inserted.first->second.first;
+      const FunctionHashEntry &Target = *Inserted.first->second.second;
+      auto Exports = Ret->ExportLists.find(ModuleId);
+      if (!E.Local || !E.UnnamedAddr || TargetModule == ModuleId ||
+          (Exports != Ret->ExportLists.end() && Exports->second.count(E.GUID)))
+        continue;
+
+      // Exported internal functions are promoted to external ones under the
+      // name `renameModuleForThinLTO` gives them.
+      Ret->ExportLists[TargetModule].insert(Target.GUID);
+      std::string TargetName =
+          Target.Local ? ModuleSummaryIndex::getGlobalNameForLocal(
+                             Target.Name, Ret->Index.getModuleHash(TargetModule))
+                       : Target.Name;
+      Ret->FoldedFunctions[ModuleId].push_back(
+          {E.Name, std::move(TargetName), TargetModule.str()});
+    }
+  }
+  return true;
+}
+
+// The imported functions of one source module are a set of GUIDs in LLVM 8,
+// but a map from GUID to import threshold before that.
+static GlobalValue::GUID importedGUID(GlobalValue::GUID GUID) { return GUID; }
+static GlobalValue::GUID
+importedGUID(const std::pair<const GlobalValue::GUID, unsigned> &Entry) {
+  return Entry.first;
+}
+
+static void insertImportedGUID(FunctionImporter::FunctionsToImportTy &Set,
+                               GlobalValue::GUID GUID) {
+#if LLVM_VERSION_GE(8, 0)
+  Set.insert(GUID);
+#else
+  Set.emplace(GUID, 0);
+#endif
+}
+
+namespace {
+
+// Sets one of LLVM's command line options for as long as this object is
+// alive, restoring the previous value afterwards, unless `Value` is negative.
+// The import heuristics of `ComputeCrossModuleImport` can't be passed to it
+// in any other way. The options are process-wide, so overrides may only be
+// alive while `ImportOptionsLock` is held; rustc doesn't read them anywhere
+// else. Options that aren't registered are left alone.
+template <typename T>
+class ScopedOptionOverride {
+  cl::opt<T> *Opt;
+  T Prev;
+
+public:
+  ScopedOptionOverride(StringRef Name, double Value) : Opt(nullptr), Prev() {
+    if (Value < 0)
+      return;
+    StringMap<cl::Option *> &Opts = cl::getRegisteredOptions();
+    auto It = Opts.find(Name);
+    if (It == Opts.end())
+      return;
+    // `T` is the type the option is declared with in `FunctionImport.cpp`.
+    Opt = static_cast<cl::opt<T> *>(It->second);
+    Prev = Opt->getValue();
+    Opt->setValue(static_cast<T>(Value));
+  }
+
+  ~ScopedOptionOverride() {
+    if (Opt)
+      Opt->setValue(Prev);
+  }
+};
+
+} // namespace
+
+static std::mutex ImportOptionsLock;
+
+static void computeImportGraph(LLVMRustThinLTOData *Data);
+
+// Performs the global ThinLTO analysis over `Modules`. The structure here is
+// basically the same as before threads are spawned in the `run` function of
+// `lib/LTO/ThinLTOCodeGenerator.cpp`.
+static bool buildThinLTOData(LLVMRustThinLTOData *Ret,
+                             ArrayRef<MemoryBufferRef> Modules,
+                             const char **preserved_symbols,
+                             int num_symbols,
+                             const LLVMRustThinLTOImportOptions *Options) {
+  if (Options)
+    Ret->ImportOptions = *Options;
+
+  // Load each module's summary and merge it into one combined index
+  for (const MemoryBufferRef &Module : Modules)
+    Ret->ModuleMap[Module.getBufferIdentifier()] = Module;
+  if (!loadThinLTOSummaries(Ret->Index, Modules,
+                            Ret->ImportOptions.SummaryThreads))
+    return false;
+
+  // Collect for each module the list of function it defines (GUID -> Summary)
+  Ret->Index.collectDefinedGVSummariesPerModule(Ret->ModuleToDefinedGVSummaries);
+
+  // Convert the preserved symbols set from string to GUID, this is then needed
+  // for internalization.
+  for (int i = 0; i < num_symbols; i++) {
+    auto GUID = GlobalValue::getGUID(preserved_symbols[i]);
+    Ret->GUIDPreservedSymbols.insert(GUID);
+  }
+
+  // Collect the import/export lists for all modules from the call-graph in the
+  // combined index
+  //
+  // This is copied from `lib/LTO/ThinLTOCodeGenerator.cpp`
+#if LLVM_VERSION_GE(7, 0)
+  auto deadIsPrevailing = [&](GlobalValue::GUID G) {
+    return PrevailingType::Unknown;
+  };
+#if LLVM_VERSION_GE(8, 0)
+  computeDeadSymbolsWithConstProp(Ret->Index, Ret->GUIDPreservedSymbols,
+                                  deadIsPrevailing, /* ImportEnabled = */ true);
+#else
+  computeDeadSymbols(Ret->Index, Ret->GUIDPreservedSymbols, deadIsPrevailing);
+#endif
+#else
+  computeDeadSymbols(Ret->Index, Ret->GUIDPreservedSymbols);
+#endif
+  {
+    const LLVMRustThinLTOImportOptions &Opts = Ret->ImportOptions;
+    std::lock_guard<std::mutex> Lock(ImportOptionsLock);
+    ScopedOptionOverride<unsigned> InstrLimit("import-instr-limit",
+                                              Opts.InstrLimit);
+    ScopedOptionOverride<float> Hot("import-hot-multiplier",
+                                    Opts.HotMultiplier);
+    ScopedOptionOverride<float> Critical("import-critical-multiplier",
+                                         Opts.CriticalMultiplier);
+    ScopedOptionOverride<float> Cold("import-cold-multiplier",
+                                     Opts.ColdMultiplier);
+    ComputeCrossModuleImport(
+      Ret->Index,
+      Ret->ModuleToDefinedGVSummaries,
+      Ret->ImportLists,
+      Ret->ExportLists
+    );
+  }
+
+  if (Ret->ImportOptions.MergeFunctions > 0 &&
+      !foldIdenticalFunctions(Ret, Modules))
+    return false;
+
+  // Resolve LinkOnce/Weak symbols, this has to be computed early be cause it
+  // impacts the caching.
+  //
+  // This is copied from `lib/LTO/ThinLTOCodeGenerator.cpp` with some of this
+  // being lifted from `lib/LTO/LTO.cpp` as well
+  DenseMap<GlobalValue::GUID, const GlobalValueSummary *> PrevailingCopy;
+  for (auto &I : Ret->Index) {
+    if (I.second.SummaryList.size() > 1)
+      PrevailingCopy[I.first] = getFirstDefinitionForLinker(I.second.SummaryList);
+  }
+  auto isPrevailing = [&](GlobalValue::GUID GUID, const GlobalValueSummary *S) {
+    const auto &Prevailing = PrevailingCopy.find(GUID);
+    if (Prevailing == PrevailingCopy.end())
+      return true;
     return Prevailing->second == S;
   };
   auto recordNewLinkage = [&](StringRef ModuleIdentifier,
                               GlobalValue::GUID GUID,
                               GlobalValue::LinkageTypes NewLinkage) {
-    ResolvedODR[ModuleIdentifier][GUID] = NewLinkage;
+    Ret->ResolvedODR[ModuleIdentifier][GUID] = NewLinkage;
   };
 #if LLVM_VERSION_GE(8, 0)
   thinLTOResolvePrevailingInIndex(Ret->Index, isPrevailing, recordNewLinkage);
@@ -932,6 +2970,68 @@ LLVMRustCreateThinLTOData(LLVMRustThinLTOModule *modules,
   };
   thinLTOInternalizeAndPromoteInIndex(Ret->Index, isExported);
 
+  computeImportGraph(Ret);
+  return true;
+}
+
+// The main entry point for creating the global ThinLTO analysis, over modules
+// which are serialized in memory owned by the caller. `Options` may be null
+// to use LLVM's default import heuristics.
+extern "C" LLVMRustThinLTOData*
+LLVMRustCreateThinLTOData(LLVMRustThinLTOModule *modules,
+                          int num_modules,
+                          const char **preserved_symbols,
+                          int num_symbols,
+                          const LLVMRustThinLTOImportOptions *Options) {
+  auto Ret = llvm::make_unique<LLVMRustThinLTOData>();
+
+  std::vector<MemoryBufferRef> Modules;
+  for (int i = 0; i < num_modules; i++) {
+    auto module = &modules[i];
+    StringRef buffer(module->data, module->len);
+    Modules.push_back(MemoryBufferRef(buffer, module->identifier));
+  }
+
+  if (!buildThinLTOData(Ret.get(), Modules, preserved_symbols, num_symbols,
+                        Options))
+    return nullptr;
+  return Ret.release();
+}
+
+// Same as `LLVMRustCreateThinLTOData`, except that the modules are read from
+// files instead, such as object members of an rlib, which saves the caller
+// from keeping every module resident for the whole LTO session.
+//
+// Each module is mapped into memory rather than read, so only the pages
+// that are actually looked at are loaded: the summary while building the
+// index here, and the functions that are imported from it later in
+// `LLVMRustPrepareThinLTOImport`. Clean mapped pages can also be dropped by
+// the kernel under memory pressure at any time.
+extern "C" LLVMRustThinLTOData*
+LLVMRustCreateThinLTODataFromFiles(LLVMRustThinLTOFileModule *modules,
+                                   int num_modules,
+                                   const char **preserved_symbols,
+                                   int num_symbols,
+                                   const LLVMRustThinLTOImportOptions *Options) {
+  auto Ret = llvm::make_unique<LLVMRustThinLTOData>();
+
+  std::vector<MemoryBufferRef> Modules;
+  for (int i = 0; i < num_modules; i++) {
+    auto module = &modules[i];
+    ErrorOr<std::unique_ptr<MemoryBuffer>> BufOr =
+        MemoryBuffer::getFileSlice(module->path, module->len, module->offset);
+    if (!BufOr) {
+      LLVMRustSetLastError(BufOr.getError().message().c_str());
+      return nullptr;
+    }
+    Modules.push_back(MemoryBufferRef(BufOr.get()->getBuffer(),
+                                      module->identifier));
+    Ret->OwnedModules.push_back(std::move(BufOr.get()));
+  }
+
+  if (!buildThinLTOData(Ret.get(), Modules, preserved_symbols, num_symbols,
+                        Options))
+    return nullptr;
   return Ret.release();
 }
 
@@ -940,6 +3040,352 @@ LLVMRustFreeThinLTOData(LLVMRustThinLTOData *Data) {
   delete Data;
 }
 
+// The functions below save an `LLVMRustThinLTOData` to disk and load it back
+// in a later session, so that a rebuild where no module summary changed can
+// skip reading every summary and redoing the whole-program analysis above.
+//
+// Note that there's no way to "patch" a loaded index for a handful of changed
+// modules: dead symbol computation, import lists and internalization are all
+// whole-program decisions which also rewrite the linkages stored in the index
+// itself. If anything changed then `LLVMRustThinLTODataLoad` reports which
+// modules did and the caller is expected to fall back to
+// `LLVMRustCreateThinLTOData`.
+//
+// The file starts with a small header of our own followed by the combined
+// index serialized as bitcode with LLVM's own `WriteIndexToFile`. Integers in
+// the header are always little-endian and maps are written in key order, so
+// the same data gives the same file on any host.
+
+static const char ThinLTODataMagic[] = "RUSTTLTO";
+static const uint64_t ThinLTODataVersion = 4;
+
+// The fields of `LLVMRustThinLTOImportOptions` which affect the result, in the
+// form they're saved with the data. The multipliers are saved as their bits.
+static std::vector<uint64_t>
+encodeImportOptions(const LLVMRustThinLTOImportOptions &Options) {
+  return {static_cast<uint64_t>(static_cast<int64_t>(Options.InstrLimit)),
+          FloatToBits(Options.HotMultiplier),
+          FloatToBits(Options.CriticalMultiplier),
+          FloatToBits(Options.ColdMultiplier),
+          static_cast<uint64_t>(static_cast<int64_t>(Options.MergeFunctions))};
+}
+
+// The keys of `Map` in order, as a `StringMap` is iterated in hash order.
+template <typename T>
+static std::vector<StringRef> sortedKeys(const StringMap<T> &Map) {
+  std::vector<StringRef> Keys;
+  Keys.reserve(Map.size());
+  for (const auto &Entry : Map)
+    Keys.push_back(Entry.getKey());
+  std::sort(Keys.begin(), Keys.end());
+  return Keys;
+}
+
+// A cheap fingerprint of a module's serialized bitcode, used to detect
+// whether the module changed since the data was written.
+static std::pair<uint64_t, uint64_t> fingerprintModule(StringRef Data) {
+  MD5 Hasher;
+  Hasher.update(Data);
+  MD5::MD5Result Result;
+  Hasher.final(Result);
+  return std::make_pair(Result.low(), Result.high());
+}
+
+namespace {
+
+class ThinLTODataWriter {
+  raw_ostream &OS;
+
+public:
+  ThinLTODataWriter(raw_ostream &OS) : OS(OS) {}
+
+  void writeU64(uint64_t V) {
+    for (unsigned I = 0; I < sizeof(V); I++)
+      OS << static_cast<char>((V >> (I * 8)) & 0xff);
+  }
+
+  void writeGUIDs(std::vector<GlobalValue::GUID> GUIDs) {
+    std::sort(GUIDs.begin(), GUIDs.end());
+    writeU64(GUIDs.size());
+    for (auto GUID : GUIDs)
+      writeU64(GUID);
+  }
+
+  void writeString(StringRef S) {
+    writeU64(S.size());
+    OS << S;
+  }
+};
+
+class ThinLTODataReader {
+  StringRef Buf;
+  bool Failed;
+
+public:
+  ThinLTODataReader(StringRef Buf) : Buf(Buf), Failed(false) {}
+
+  bool failed() const { return Failed; }
+
+  uint64_t readU64() {
+    uint64_t V = 0;
+    if (Buf.size() < sizeof(V)) {
+      Failed = true;
+      return 0;
+    }
+    for (unsigned I = 0; I < sizeof(V); I++)
+      V |= static_cast<uint64_t>(static_cast<uint8_t>(Buf[I])) << (I * 8);
+    Buf = Buf.drop_front(sizeof(V));
+    return V;
+  }
+
+  StringRef readBytes(uint64_t Len) {
+    if (Failed || Buf.size() < Len) {
+      Failed = true;
+      return StringRef();
+    }
+    StringRef Ret = Buf.take_front(Len);
+    Buf = Buf.drop_front(Len);
+    return Ret;
+  }
+
+  StringRef readString() {
+    uint64_t Len = readU64();
+    return readBytes(Len);
+  }
+};
+
+} // namespace
+
+extern "C" LLVMRustResult
+LLVMRustThinLTODataWrite(const LLVMRustThinLTOData *Data, const char *Path) {
+  std::error_code EC;
+  raw_fd_ostream OS(Path, EC, sys::fs::F_None);
+  if (EC) {
+    LLVMRustSetLastError(EC.message().c_str());
+    return LLVMRustResult::Failure;
+  }
+  ThinLTODataWriter W(OS);
+
+  OS << ThinLTODataMagic;
+  W.writeU64(ThinLTODataVersion);
+  W.writeU64(LLVM_VERSION_MAJOR);
+  W.writeU64(LLVM_VERSION_MINOR);
+  for (uint64_t Option : encodeImportOptions(Data->ImportOptions))
+    W.writeU64(Option);
+
+  W.writeU64(Data->ModuleMap.size());
+  for (StringRef Identifier : sortedKeys(Data->ModuleMap)) {
+    W.writeString(Identifier);
+    auto Fingerprint =
+        fingerprintModule(Data->ModuleMap.lookup(Identifier).getBuffer());
+    W.writeU64(Fingerprint.first);
+    W.writeU64(Fingerprint.second);
+  }
+
+  W.writeGUIDs(std::vector<GlobalValue::GUID>(
+      Data->GUIDPreservedSymbols.begin(), Data->GUIDPreservedSymbols.end()));
+
+  W.writeU64(Data->ImportLists.size());
+  for (StringRef Module : sortedKeys(Data->ImportLists)) {
+    const auto &ImportList = Data->ImportLists.find(Module)->getValue();
+    W.writeString(Module);
+    W.writeU64(ImportList.size());
+    for (StringRef Source : sortedKeys(ImportList)) {
+      W.writeString(Source);
+      std::vector<GlobalValue::GUID> GUIDs;
+      for (const auto &Entry : ImportList.find(Source)->getValue())
+        GUIDs.push_back(importedGUID(Entry));
+      W.writeGUIDs(std::move(GUIDs));
+    }
+  }
+
+  W.writeU64(Data->ExportLists.size());
+  for (StringRef Module : sortedKeys(Data->ExportLists)) {
+    const auto &ExportList = Data->ExportLists.find(Module)->getValue();
+    W.writeString(Module);
+    W.writeGUIDs(std::vector<GlobalValue::GUID>(ExportList.begin(),
+                                                ExportList.end()));
+  }
+
+  // The linkages of one module are a `std::map`, so already in order.
+  W.writeU64(Data->ResolvedODR.size());
+  for (StringRef Module : sortedKeys(Data->ResolvedODR)) {
+    const auto &Resolved = Data->ResolvedODR.find(Module)->getValue();
+    W.writeString(Module);
+    W.writeU64(Resolved.size());
+    for (const auto &Linkage : Resolved) {
+      W.writeU64(Linkage.first);
+      W.writeU64(Linkage.second);
+    }
+  }
+
+  W.writeU64(Data->FoldedFunctions.size());
+  for (StringRef Module : sortedKeys(Data->FoldedFunctions)) {
+    const auto &Folded = Data->FoldedFunctions.find(Module)->getValue();
+    W.writeString(Module);
+    W.writeU64(Folded.size());
+    for (const auto &F : Folded) {
+      W.writeString(F.Name);
+      W.writeString(F.Target);
+      W.writeString(F.TargetModule);
+    }
+  }
+
+  std::string IndexData;
+  {
+    raw_string_ostream IndexOS(IndexData);
+    WriteIndexToFile(Data->Index, IndexOS);
+  }
+  W.writeString(IndexData);
+
+  OS.close();
+  if (OS.has_error()) {
+    OS.clear_error();
+    LLVMRustSetLastError("failed to write ThinLTO data");
+    return LLVMRustResult::Failure;
+  }
+  return LLVMRustResult::Success;
+}
+
+// Loads data previously written by `LLVMRustThinLTODataWrite`, for the given
+// set of modules, preserved symbols and import options (which may be null,
+// as for `LLVMRustCreateThinLTOData`).
+//
+// If any of the modules differ from the ones the data was computed for (or
+// any are new), `Changed[i]` is set for each such module and null is
+// returned. `Changed` must point to `num_modules` entries and may be null if
+// the caller isn't interested. If the data can't be used for some other
+// reason, null is returned as well and an error is reported.
+extern "C" LLVMRustThinLTOData*
+LLVMRustThinLTODataLoad(const char *Path,
+                        LLVMRustThinLTOModule *modules,
+                        int num_modules,
+                        const char **preserved_symbols,
+                        int num_symbols,
+                        const LLVMRustThinLTOImportOptions *Options,
+                        bool *Changed) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufOr =
+      MemoryBuffer::getFile(Path, -1, false);
+  if (!BufOr) {
+    LLVMRustSetLastError(BufOr.getError().message().c_str());
+    return nullptr;
+  }
+  StringRef Buf = BufOr.get()->getBuffer();
+  StringRef Magic(ThinLTODataMagic);
+  if (!Buf.startswith(Magic)) {
+    LLVMRustSetLastError("not a ThinLTO data file");
+    return nullptr;
+  }
+  ThinLTODataReader R(Buf.drop_front(Magic.size()));
+  if (R.readU64() != ThinLTODataVersion ||
+      R.readU64() != LLVM_VERSION_MAJOR ||
+      R.readU64() != LLVM_VERSION_MINOR) {
+    LLVMRustSetLastError("ThinLTO data was written by a different version");
+    return nullptr;
+  }
+
+  auto Ret = llvm::make_unique<LLVMRustThinLTOData>();
+  if (Options)
+    Ret->ImportOptions = *Options;
+
+  // The import lists depend on the options, so they must match as well.
+  bool SameOptions = true;
+  for (uint64_t Option : encodeImportOptions(Ret->ImportOptions))
+    SameOptions &= R.readU64() == Option;
+  if (R.failed() || !SameOptions) {
+    LLVMRustSetLastError("ThinLTO data has different import options");
+    return nullptr;
+  }
+
+  StringMap<std::pair<uint64_t, uint64_t>> Fingerprints;
+  for (uint64_t I = 0, N = R.readU64(); I < N && !R.failed(); I++) {
+    StringRef Identifier = R.readString();
+    uint64_t Low = R.readU64();
+    uint64_t High = R.readU64();
+    Fingerprints[Identifier] = std::make_pair(Low, High);
+  }
+
+  bool AnyChanged = Fingerprints.size() != (size_t)num_modules;
+  for (int i = 0; i < num_modules; i++) {
+    auto module = &modules[i];
+    StringRef buffer(module->data, module->len);
+    Ret->ModuleMap[module->identifier] = MemoryBufferRef(buffer, module->identifier);
+
+    auto Prev = Fingerprints.find(module->identifier);
+    bool ModuleChanged = Prev == Fingerprints.end() ||
+                         Prev->second != fingerprintModule(buffer);
+    if (Changed)
+      Changed[i] = ModuleChanged;
+    AnyChanged |= ModuleChanged;
+  }
+  if (AnyChanged) {
+    LLVMRustSetLastError("ThinLTO data is out of date");
+    return nullptr;
+  }
+
+  DenseSet<GlobalValue::GUID> Preserved;
+  for (int i = 0; i < num_symbols; i++)
+    Preserved.insert(GlobalValue::getGUID(preserved_symbols[i]));
+  for (uint64_t I = 0, N = R.readU64(); I < N && !R.failed(); I++)
+    Ret->GUIDPreservedSymbols.insert(R.readU64());
+  if (Preserved.size() != Ret->GUIDPreservedSymbols.size() ||
+      !llvm::all_of(Preserved, [&](GlobalValue::GUID GUID) {
+        return Ret->GUIDPreservedSymbols.count(GUID);
+      })) {
+    LLVMRustSetLastError("ThinLTO data has different preserved symbols");
+    return nullptr;
+  }
+
+  for (uint64_t I = 0, N = R.readU64(); I < N && !R.failed(); I++) {
+    auto &ImportList = Ret->ImportLists[R.readString()];
+    for (uint64_t J = 0, M = R.readU64(); J < M && !R.failed(); J++) {
+      auto &Functions = ImportList[R.readString()];
+      for (uint64_t K = 0, L = R.readU64(); K < L && !R.failed(); K++)
+        insertImportedGUID(Functions, R.readU64());
+    }
+  }
+
+  for (uint64_t I = 0, N = R.readU64(); I < N && !R.failed(); I++) {
+    auto &ExportList = Ret->ExportLists[R.readString()];
+    for (uint64_t J = 0, M = R.readU64(); J < M && !R.failed(); J++)
+      ExportList.insert(R.readU64());
+  }
+
+  for (uint64_t I = 0, N = R.readU64(); I < N && !R.failed(); I++) {
+    auto &Resolved = Ret->ResolvedODR[R.readString()];
+    for (uint64_t J = 0, M = R.readU64(); J < M && !R.failed(); J++) {
+      GlobalValue::GUID GUID = R.readU64();
+      Resolved[GUID] = static_cast<GlobalValue::LinkageTypes>(R.readU64());
+    }
+  }
+
+  for (uint64_t I = 0, N = R.readU64(); I < N && !R.failed(); I++) {
+    auto &Folded = Ret->FoldedFunctions[R.readString()];
+    for (uint64_t J = 0, M = R.readU64(); J < M && !R.failed(); J++) {
+      LLVMRustThinLTOData::FoldedFunction F;
+      F.Name = R.readString().str();
+      F.Target = R.readString().str();
+      F.TargetModule = R.readString().str();
+      Folded.push_back(std::move(F));
+    }
+  }
+
+  StringRef IndexData = R.readString();
+  if (R.failed()) {
+    LLVMRustSetLastError("truncated ThinLTO data file");
+    return nullptr;
+  }
+  if (Error Err = readModuleSummaryIndex(MemoryBufferRef(IndexData, Path),
+                                         Ret->Index, 0)) {
+    LLVMRustSetLastError(toString(std::move(Err)).c_str());
+    return nullptr;
+  }
+  Ret->Index.collectDefinedGVSummariesPerModule(Ret->ModuleToDefinedGVSummaries);
+  computeImportGraph(Ret.get());
+
+  return Ret.release();
+}
+
 // Below are the various passes that happen *per module* when doing ThinLTO.
 //
 // In other words, these are the functions that are all run concurrently
@@ -948,13 +3394,48 @@ LLVMRustFreeThinLTOData(LLVMRustThinLTOData *Data) {
 // `ProcessThinLTOModule` function. Here they're split up into separate steps
 // so rustc can save off the intermediate bytecode between each step.
 
+// Replaces the functions of `Mod` that `foldIdenticalFunctions` folded into
+// functions of other modules by declarations of those. The prevailing copies
+// are exported, so they're external by the time the modules are linked.
+static void applyFoldedFunctions(const LLVMRustThinLTOData *Data, Module &Mod) {
+  auto Folded = Data->FoldedFunctions.find(Mod.getModuleIdentifier());
+  if (Folded == Data->FoldedFunctions.end())
+    return;
+  for (const auto &Entry : Folded->second) {
+    Function *F = Mod.getFunction(Entry.Name);
+    if (!F || F->isDeclaration() || !F->hasLocalLinkage() ||
+        !F->hasGlobalUnnamedAddr())
+      continue;
+    GlobalValue *Existing = Mod.getNamedValue(Entry.Target);
+    if (Existing && !isa<Function>(Existing))
+      continue;
+    Function *Target = cast_or_null<Function>(Existing);
+    if (!Target) {
+      Target = Function::Create(F->getFunctionType(),
+                                GlobalValue::ExternalLinkage, Entry.Target,
+                                &Mod);
+      Target->setCallingConv(F->getCallingConv());
+      Target->setAttributes(F->getAttributes());
+      Target->setVisibility(GlobalValue::HiddenVisibility);
+    }
+    Constant *Replacement = Target;
+    if (Target->getType() != F->getType())
+      Replacement = ConstantExpr::getBitCast(Target, F->getType());
+    F->replaceAllUsesWith(Replacement);
+    F->eraseFromParent();
+  }
+}
+
 extern "C" bool
 LLVMRustPrepareThinLTORename(const LLVMRustThinLTOData *Data, LLVMModuleRef M) {
   Module &Mod = *unwrap(M);
   if (renameModuleForThinLTO(Mod, Data->Index)) {
-    LLVMRustSetLastError("renameModuleForThinLTO failed");
+    LLVMRustReportError(LLVMRustErrorKind::ThinLTO,
+                        Mod.getModuleIdentifier().c_str(),
+                        "renameModuleForThinLTO failed");
     return false;
   }
+  applyFoldedFunctions(Data, Mod);
   return true;
 }
 
@@ -978,15 +3459,43 @@ LLVMRustPrepareThinLTOInternalize(const LLVMRustThinLTOData *Data, LLVMModuleRef
   return true;
 }
 
+// Returns a handle on the bitcode of the module `Identifier` that we're about
+// to import from.
+//
+// Popular modules (think `core`) are imported from by nearly every other
+// module, so rather than scanning their bitcode again for every importer
+// this is only done once and then shared. The module itself still has to be
+// loaded lazily into each importer's own context, and can't be reused
+// between importers either as `FunctionImporter` moves the imported
+// functions out of it.
+static Expected<BitcodeModule>
+getImportSource(const LLVMRustThinLTOData *Data, StringRef Identifier) {
+  std::lock_guard<std::mutex> Lock(Data->ImportSourcesLock);
+  auto &Source = Data->ImportSources[Identifier];
+  if (!Source) {
+    const auto &Memory = Data->ModuleMap.lookup(Identifier);
+    Expected<std::vector<BitcodeModule>> BMsOrErr = getBitcodeModuleList(Memory);
+    if (!BMsOrErr)
+      return BMsOrErr.takeError();
+    if (BMsOrErr->size() != 1)
+      return make_error<StringError>("Expected a single module",
+                                     inconvertibleErrorCode());
+    Source = llvm::make_unique<BitcodeModule>((*BMsOrErr)[0]);
+  }
+  return *Source;
+}
+
 extern "C" bool
 LLVMRustPrepareThinLTOImport(const LLVMRustThinLTOData *Data, LLVMModuleRef M) {
   Module &Mod = *unwrap(M);
 
   const auto &ImportList = Data->ImportLists.lookup(Mod.getModuleIdentifier());
-  auto Loader = [&](StringRef Identifier) {
-    const auto &Memory = Data->ModuleMap.lookup(Identifier);
+  auto Loader = [&](StringRef Identifier) -> Expected<std::unique_ptr<Module>> {
+    Expected<BitcodeModule> SourceOrErr = getImportSource(Data, Identifier);
+    if (!SourceOrErr)
+      return SourceOrErr.takeError();
     auto &Context = Mod.getContext();
-    auto MOrErr = getLazyBitcodeModule(Memory, Context, true, true);
+    auto MOrErr = SourceOrErr->getLazyModule(Context, true, true);
 
     if (!MOrErr)
       return MOrErr;
@@ -1013,18 +3522,112 @@ LLVMRustPrepareThinLTOImport(const LLVMRustThinLTOData *Data, LLVMModuleRef M) {
     auto *WasmCustomSections = (*MOrErr)->getNamedMetadata("wasm.custom_sections");
     if (WasmCustomSections)
       WasmCustomSections->eraseFromParent();
+    // The importer links named metadata as well.
+    stripFunctionHashes(**MOrErr);
 
     return MOrErr;
   };
   FunctionImporter Importer(Data->Index, Loader);
   Expected<bool> Result = Importer.importFunctions(Mod, ImportList);
   if (!Result) {
-    LLVMRustSetLastError(toString(Result.takeError()).c_str());
+    LLVMRustReportError(LLVMRustErrorKind::ThinLTO,
+                        Mod.getModuleIdentifier().c_str(),
+                        toString(Result.takeError()).c_str());
     return false;
   }
   return true;
 }
 
+// The modules of a ThinLTO session and which of them import from which, in
+// flat arrays owned by the `LLVMRustThinLTOData` so that rustc can read the
+// whole graph at once instead of one callback per edge.
+//
+// Modules are numbered by their position in `ModuleNames`, which is sorted.
+// The modules the `i`th module imports from are
+// `Edges[EdgeOffsets[i]..EdgeOffsets[i + 1]]`, sorted as well, and the
+// GUIDs it imports over the `j`th edge are
+// `GUIDs[GUIDOffsets[j]..GUIDOffsets[j + 1]]`. Like
+// `LLVMRustGetThinLTOModuleImports`, this includes the modules whose
+// copies of folded functions are used, over edges which may have no GUIDs.
+//
+// Names are null terminated, and have their lengths in `ModuleNameLens`.
+struct LLVMRustThinLTOImportGraph {
+  size_t NumModules;
+  const char *const *ModuleNames;
+  const size_t *ModuleNameLens;
+  const uint32_t *EdgeOffsets;
+  const uint32_t *Edges;
+  const uint32_t *GUIDOffsets;
+  const uint64_t *GUIDs;
+};
+
+static void computeImportGraph(LLVMRustThinLTOData *Data) {
+  auto &Graph = Data->ImportGraph;
+  Graph = LLVMRustThinLTOData::ImportGraphData();
+
+  // The keys of `ModuleMap` are stored in its entries, which never move.
+  std::vector<StringRef> Names;
+  for (const auto &Module : Data->ModuleMap)
+    Names.push_back(Module.getKey());
+  std::sort(Names.begin(), Names.end());
+  StringMap<uint32_t> Indices;
+  for (uint32_t I = 0; I < Names.size(); I++) {
+    Indices[Names[I]] = I;
+    Graph.Names.push_back(Names[I].data());
+    Graph.NameLens.push_back(Names[I].size());
+  }
+
+  Graph.EdgeOffsets.push_back(0);
+  Graph.GUIDOffsets.push_back(0);
+  std::map<uint32_t, std::vector<uint64_t>> Targets;
+  for (StringRef Name : Names) {
+    Targets.clear();
+    auto ImportList = Data->ImportLists.find(Name);
+    if (ImportList != Data->ImportLists.end()) {
+      for (const auto &Source : ImportList->getValue()) {
+        auto Index = Indices.find(Source.getKey());
+        if (Index == Indices.end())
+          continue;
+        auto &GUIDs = Targets[Index->second];
+        for (const auto &Entry : Source.getValue())
+          GUIDs.push_back(importedGUID(Entry));
+      }
+    }
+    auto Folded = Data->FoldedFunctions.find(Name);
+    if (Folded != Data->FoldedFunctions.end()) {
+      for (const auto &F : Folded->getValue()) {
+        auto Index = Indices.find(F.TargetModule);
+        if (Index != Indices.end())
+          Targets[Index->second];
+      }
+    }
+
+    for (auto &Target : Targets) {
+      Graph.Edges.push_back(Target.first);
+      std::sort(Target.second.begin(), Target.second.end());
+      Graph.GUIDs.insert(Graph.GUIDs.end(), Target.second.begin(),
+                         Target.second.end());
+      Graph.GUIDOffsets.push_back(Graph.GUIDs.size());
+    }
+    Graph.EdgeOffsets.push_back(Graph.Edges.size());
+  }
+}
+
+// Points `Graph` at the import graph of `Data`, which stays valid for as
+// long as `Data` does.
+extern "C" void
+LLVMRustThinLTOGetImportGraph(const LLVMRustThinLTOData *Data,
+                              LLVMRustThinLTOImportGraph *Graph) {
+  const auto &G = Data->ImportGraph;
+  Graph->NumModules = G.Names.size();
+  Graph->ModuleNames = G.Names.data();
+  Graph->ModuleNameLens = G.NameLens.data();
+  Graph->EdgeOffsets = G.EdgeOffsets.data();
+  Graph->Edges = G.Edges.data();
+  Graph->GUIDOffsets = G.GUIDOffsets.data();
+  Graph->GUIDs = G.GUIDs.data();
+}
+
 extern "C" typedef void (*LLVMRustModuleNameCallback)(void*, // payload
                                                       const char*, // importing module name
                                                       const char*); // imported module name
@@ -1045,6 +3648,344 @@ LLVMRustGetThinLTOModuleImports(const LLVMRustThinLTOData *data,
                            imported_module_id.c_str());
     }
   }
+
+  // Modules with folded functions refer to the prevailing copies, so they
+  // depend on those modules like on the ones they import from.
+  for (const auto &Folded : data->FoldedFunctions) {
+    const std::string importing_module_id = Folded.getKey().str();
+    StringSet<> Targets;
+    for (const auto &F : Folded.getValue())
+      if (Targets.insert(F.TargetModule).second)
+        module_name_callback(callback_payload,
+                             importing_module_id.c_str(),
+                             F.TargetModule.c_str());
+  }
+}
+
+// What ThinLTO decided to import into one module, see
+// `LLVMRustThinLTOGetImportStats`.
+struct LLVMRustThinLTOImportStats {
+  unsigned SourceModules;
+  unsigned Functions;
+  unsigned Globals;
+  uint64_t Instructions;
+};
+
+// Fills in `Stats` with how much the module `ModuleId` imports from all
+// other modules. The size of imported functions is measured in IR
+// instructions as recorded in their summaries, which is the same unit as
+// `LLVMRustThinLTOImportOptions::InstrLimit`.
+//
+// Returns false if `ModuleId` isn't one of the modules of `Data`.
+extern "C" bool
+LLVMRustThinLTOGetImportStats(const LLVMRustThinLTOData *Data,
+                              const char *ModuleId,
+                              LLVMRustThinLTOImportStats *Stats) {
+  *Stats = LLVMRustThinLTOImportStats();
+  if (!Data->ModuleMap.count(ModuleId))
+    return false;
+
+  auto ImportList = Data->ImportLists.find(ModuleId);
+  if (ImportList == Data->ImportLists.end())
+    return true;
+  for (const auto &Source : ImportList->getValue()) {
+    Stats->SourceModules++;
+    for (const auto &Entry : Source.getValue()) {
+      const GlobalValueSummary *Summary =
+          Data->Index.findSummaryInModule(importedGUID(Entry), Source.getKey());
+      const FunctionSummary *FS = Summary ?
+          dyn_cast<FunctionSummary>(Summary->getBaseObject()) : nullptr;
+      if (FS) {
+        Stats->Functions++;
+        Stats->Instructions += FS->instCount();
+      } else {
+        Stats->Globals++;
+      }
+    }
+  }
+  return true;
+}
+
+// A measurement of one stage of work on a module, such as one of the
+// `LLVMRustPrepareThinLTO*` steps above or running the optimization passes.
+// rustc brackets the stage with `LLVMRustModuleStageTimerStart` and
+// `LLVMRustModuleStageTimerFinish`, and the latter reports the result as a
+// single JSON object for merging into its own self-profile:
+//
+//     {"module":"foo.1234-cgu.0","stage":"import","wall_ns":1234,
+//      "user_ns":1000,"system_ns":100,"malloc_bytes_before":1024,
+//      "malloc_bytes_after":2048,"instructions_before":100,
+//      "instructions_after":200,"functions_before":10,"functions_after":14}
+//
+// The number of functions imported is the difference in defined functions
+// across the "import" stage. Memory is current malloc usage at either end;
+// there's no way to find the peak in between without hooking the allocator.
+// On platforms where LLVM can't tell the malloc usage both memory fields are
+// `null`.
+struct LLVMRustModuleStageTimer {
+  std::string Stage;
+  TimeRecord Start;
+  size_t MallocBytes;
+  uint64_t Instructions;
+  uint64_t Functions;
+};
+
+extern "C" typedef void (*LLVMRustModuleStageCallback)(void*, // payload
+                                                       const char*, // module name
+                                                       const char*); // JSON report
+
+// Counts the instructions and function definitions in `Mod`.
+static std::pair<uint64_t, uint64_t> measureModule(const Module &Mod) {
+  uint64_t Instructions = 0, Functions = 0;
+  for (const Function &F : Mod) {
+    if (F.isDeclaration())
+      continue;
+    Functions++;
+    for (const BasicBlock &BB : F)
+      Instructions += BB.size();
+  }
+  return std::make_pair(Instructions, Functions);
+}
+
+static void writeJSONString(raw_ostream &OS, StringRef S) {
+  OS << '"';
+  for (unsigned char C : S) {
+    if (C == '"' || C == '\\')
+      OS << '\\' << C;
+    else if (C < 0x20)
+      OS << format("\\u%04x", C);
+    else
+      OS << C;
+  }
+  OS << '"';
+}
+
+extern "C" LLVMRustModuleStageTimer *
+LLVMRustModuleStageTimerStart(LLVMModuleRef M, const char *Stage) {
+  auto Sizes = measureModule(*unwrap(M));
+  auto *Timer = new LLVMRustModuleStageTimer();
+  Timer->Stage = Stage;
+  Timer->Instructions = Sizes.first;
+  Timer->Functions = Sizes.second;
+  // `TimeRecord` only samples memory with `-track-memory`, so do it here.
+  Timer->MallocBytes = sys::Process::GetMallocUsage();
+  // Sampled last so that measuring the module isn't included.
+  Timer->Start = TimeRecord::getCurrentTime(true);
+  return Timer;
+}
+
+// Finishes the measurement started by `LLVMRustModuleStageTimerStart`,
+// passes the report to `callback` and frees `Timer`.
+extern "C" void
+LLVMRustModuleStageTimerFinish(LLVMRustModuleStageTimer *Timer,
+                               LLVMModuleRef M,
+                               LLVMRustModuleStageCallback callback,
+                               void *callback_payload) {
+  TimeRecord End = TimeRecord::getCurrentTime(false);
+  size_t MallocBytes = sys::Process::GetMallocUsage();
+  auto Sizes = measureModule(*unwrap(M));
+  const std::string &ModuleId = unwrap(M)->getModuleIdentifier();
+
+  std::string Report;
+  raw_string_ostream OS(Report);
+  OS << "{\"module\":";
+  writeJSONString(OS, ModuleId);
+  OS << ",\"stage\":";
+  writeJSONString(OS, Timer->Stage);
+  OS << ",\"wall_ns\":"
+     << (uint64_t)((End.getWallTime() - Timer->Start.getWallTime()) * 1e9)
+     << ",\"user_ns\":"
+     << (uint64_t)((End.getUserTime() - Timer->Start.getUserTime()) * 1e9)
+     << ",\"system_ns\":"
+     << (uint64_t)((End.getSystemTime() - Timer->Start.getSystemTime()) * 1e9);
+  // `GetMallocUsage` is always zero where it isn't implemented.
+  if (Timer->MallocBytes == 0 && MallocBytes == 0)
+    OS << ",\"malloc_bytes_before\":null,\"malloc_bytes_after\":null";
+  else
+    OS << ",\"malloc_bytes_before\":" << (uint64_t)Timer->MallocBytes
+       << ",\"malloc_bytes_after\":" << (uint64_t)MallocBytes;
+  OS << ",\"instructions_before\":" << Timer->Instructions
+     << ",\"instructions_after\":" << Sizes.first
+     << ",\"functions_before\":" << Timer->Functions
+     << ",\"functions_after\":" << Sizes.second
+     << "}";
+  OS.flush();
+
+  delete Timer;
+  callback(callback_payload, ModuleId.c_str(), Report.c_str());
+}
+
+// Computes the key under which the optimized output of the module
+// `ModuleId` can be cached, writing it as a hex string into `KeyOut`.
+//
+// This mirrors `ModuleCacheEntry` in `lib/LTO/ThinLTOCodeGenerator.cpp`: the
+// key covers the hash of the module's own bitcode, the hashes of everything
+// it imports from, its import and export lists, the resolved linkage of its
+// LinkOnce/Weak symbols and the options of the target machine it'll be
+// compiled with. `Extra` is mixed in as well so rustc can add anything else
+// that affects the output (compiler version, `-C` flags, etc).
+//
+// Returns false if no key could be computed, which happens when the module
+// was serialized without a module hash. Such modules must not be cached.
+extern "C" bool
+LLVMRustThinLTOComputeCacheKey(RustStringRef KeyOut,
+                               const LLVMRustThinLTOData *Data,
+                               const char *ModuleId,
+                               LLVMTargetMachineRef TMR,
+                               LLVMRustCodeGenOptLevel OptLevel,
+                               const char *Extra) {
+  StringRef ModuleIdentifier(ModuleId);
+  if (!Data->Index.modulePaths().count(ModuleIdentifier))
+    return false;
+  if (all_of(Data->Index.getModuleHash(ModuleIdentifier),
+             [](uint32_t V) { return V == 0; }))
+    return false;
+
+  TargetMachine *Target = unwrap(TMR);
+  lto::Config Conf;
+  Conf.OptLevel = fromRust(OptLevel);
+  Conf.Options = Target->Options;
+  Conf.CPU = Target->getTargetCPU().str();
+  Conf.MAttrs.push_back(Target->getTargetFeatureString().str());
+  Conf.RelocModel = Target->getRelocationModel();
+  Conf.CodeModel = Target->getCodeModel();
+  Conf.CGOptLevel = Target->getOptLevel();
+
+  static const FunctionImporter::ImportMapTy EmptyImportList;
+  static const FunctionImporter::ExportSetTy EmptyExportList;
+  static const std::map<GlobalValue::GUID, GlobalValue::LinkageTypes> EmptyResolvedODR;
+  static const GVSummaryMapTy EmptyDefinedGlobals;
+
+  auto Imports = Data->ImportLists.find(ModuleIdentifier);
+  auto Exports = Data->ExportLists.find(ModuleIdentifier);
+  auto Resolved = Data->ResolvedODR.find(ModuleIdentifier);
+  auto Defined = Data->ModuleToDefinedGVSummaries.find(ModuleIdentifier);
+
+  SmallString<40> Key;
+  computeLTOCacheKey(
+      Key, Conf, Data->Index, ModuleIdentifier,
+      Imports != Data->ImportLists.end() ? Imports->second : EmptyImportList,
+      Exports != Data->ExportLists.end() ? Exports->second : EmptyExportList,
+      Resolved != Data->ResolvedODR.end() ? Resolved->second : EmptyResolvedODR,
+      Defined != Data->ModuleToDefinedGVSummaries.end() ? Defined->second
+                                                        : EmptyDefinedGlobals);
+
+  // Folding changes the module's code without showing up in any of the
+  // above (the prevailing copies are just export list entries for the
+  // modules they're in).
+  auto Folded = Data->FoldedFunctions.find(ModuleIdentifier);
+  if (Folded != Data->FoldedFunctions.end()) {
+    SHA1 Hasher;
+    Hasher.update(Key);
+    for (const auto &F : Folded->second) {
+      Hasher.update(F.Name);
+      Hasher.update(StringRef("\0", 1));
+      Hasher.update(F.Target);
+      Hasher.update(StringRef("\0", 1));
+    }
+    Key = toHex(Hasher.result());
+  }
+
+  if (Extra && *Extra) {
+    SHA1 Hasher;
+    Hasher.update(Key);
+    Hasher.update(Extra);
+    Key = toHex(Hasher.result());
+  }
+
+  RawRustStringOstream OS(KeyOut);
+  OS << Key;
+  return true;
+}
+
+// A content-addressed on-disk cache for the per-module output of ThinLTO,
+// keyed by `LLVMRustThinLTOComputeCacheKey` above. Entries are written to a
+// temporary file first and then renamed into place, so concurrent rustc
+// processes sharing one cache directory never observe partial entries. They
+// are named like the entries of LLVM's own cache, as `pruneCache` only ever
+// removes files starting with `llvmcache-`.
+struct LLVMRustThinLTOCache {
+  std::string Path;
+};
+
+extern "C" LLVMRustThinLTOCache*
+LLVMRustThinLTOCacheCreate(const char *Path) {
+  if (std::error_code EC = sys::fs::create_directories(Path)) {
+    LLVMRustSetLastError(EC.message().c_str());
+    return nullptr;
+  }
+  auto Ret = llvm::make_unique<LLVMRustThinLTOCache>();
+  Ret->Path = Path;
+  return Ret.release();
+}
+
+extern "C" void
+LLVMRustThinLTOCacheFree(LLVMRustThinLTOCache *Cache) {
+  delete Cache;
+}
+
+// Returns the cached entry for `Key`, or null if there is none. The returned
+// buffer must be freed with `LLVMDisposeMemoryBuffer`.
+extern "C" LLVMMemoryBufferRef
+LLVMRustThinLTOCacheLookup(const LLVMRustThinLTOCache *Cache, const char *Key) {
+  SmallString<128> EntryPath;
+  sys::path::append(EntryPath, Cache->Path, "llvmcache-" + Twine(Key));
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufOr =
+      MemoryBuffer::getFile(EntryPath, -1, false);
+  if (!BufOr)
+    return nullptr;
+  return wrap(BufOr.get().release());
+}
+
+extern "C" LLVMRustResult
+LLVMRustThinLTOCacheStore(const LLVMRustThinLTOCache *Cache, const char *Key,
+                          const char *Data, size_t Len) {
+  SmallString<128> EntryPath;
+  sys::path::append(EntryPath, Cache->Path, "llvmcache-" + Twine(Key));
+
+  // Write to a temporary to avoid race conditions with other processes
+  // reading or writing the same entry. Like the entries of LLVM's own cache
+  // it's created with the permissions the umask allows, so that everyone
+  // sharing the cache directory can read the entries.
+  SmallString<128> TempFilename;
+  sys::path::append(TempFilename, Cache->Path, "Thin-%%%%%%.tmp.o");
+  Expected<sys::fs::TempFile> Temp = sys::fs::TempFile::create(TempFilename);
+  if (!Temp) {
+    LLVMRustSetLastError(toString(Temp.takeError()).c_str());
+    return LLVMRustResult::Failure;
+  }
+  {
+    raw_fd_ostream OS(Temp->FD, /* ShouldClose */ false);
+    OS.write(Data, Len);
+    OS.flush();
+    if (OS.has_error()) {
+      OS.clear_error();
+      consumeError(Temp->discard());
+      LLVMRustSetLastError("failed to write ThinLTO cache entry");
+      return LLVMRustResult::Failure;
+    }
+  }
+
+  // Renaming is atomic, so readers either see the old entry or the new one.
+  if (Error Err = Temp->keep(EntryPath)) {
+    LLVMRustSetLastError(toString(std::move(Err)).c_str());
+    return LLVMRustResult::Failure;
+  }
+  return LLVMRustResult::Success;
+}
+
+// Prunes the cache according to `Policy`, which uses the same syntax as
+// `-thinlto-cache-policy` in LLVM (e.g. `prune_after=1h:cache_size=10%`).
+extern "C" LLVMRustResult
+LLVMRustThinLTOCachePrune(const LLVMRustThinLTOCache *Cache,
+                          const char *Policy) {
+  Expected<CachePruningPolicy> PolicyOrErr = parseCachePruningPolicy(Policy);
+  if (!PolicyOrErr) {
+    LLVMRustSetLastError(toString(PolicyOrErr.takeError()).c_str());
+    return LLVMRustResult::Failure;
+  }
+  pruneCache(Cache->Path, *PolicyOrErr);
+  return LLVMRustResult::Success;
 }
 
 // This struct and various functions are sort of a hack right now, but the
@@ -1056,20 +3997,138 @@ LLVMRustGetThinLTOModuleImports(const LLVMRustThinLTOData *data,
 // This structure is basically an owned version of a serialize module, with
 // a ThinLTO summary attached.
 struct LLVMRustThinLTOBuffer {
-  std::string data;
+  SmallVector<char, 0> data;
 };
 
+// `WithFunctionHashes` records the hashes ThinLTO folds identical functions
+// by, which is only worth it if that's enabled, see `FunctionHashesName`.
 extern "C" LLVMRustThinLTOBuffer*
-LLVMRustThinLTOBufferCreate(LLVMModuleRef M) {
+LLVMRustThinLTOBufferCreate(LLVMModuleRef M, bool WithFunctionHashes) {
   auto Ret = llvm::make_unique<LLVMRustThinLTOBuffer>();
+  NamedMDNode *Hashes =
+      WithFunctionHashes ? addFunctionHashes(*unwrap(M)) : nullptr;
   {
-    raw_string_ostream OS(Ret->data);
+    raw_svector_ostream OS(Ret->data);
     {
       legacy::PassManager PM;
       PM.add(createWriteThinLTOBitcodePass(OS));
       PM.run(*unwrap(M));
     }
   }
+  if (Hashes)
+    unwrap(M)->eraseNamedMetadata(Hashes);
+  return Ret.release();
+}
+
+// Writes `M` and its summary `Index` (if any) as bitcode straight into
+// `Buffer`, the same way `WriteBitcodeToFile` does except for the final copy
+// from its internal buffer into the output stream.
+static void writeModuleBitcode(const Module &M, const ModuleSummaryIndex *Index,
+                               SmallVectorImpl<char> &Buffer) {
+  ModuleHash Hash;
+  BitcodeWriter Writer(Buffer);
+#if LLVM_VERSION_GE(7, 0)
+  Writer.writeModule(M, /* ShouldPreserveUseListOrder = */ false, Index,
+                     /* GenerateHash = */ Index != nullptr,
+                     Index ? &Hash : nullptr);
+#else
+  Writer.writeModule(&M, /* ShouldPreserveUseListOrder = */ false, Index,
+                     /* GenerateHash = */ Index != nullptr,
+                     Index ? &Hash : nullptr);
+#endif
+  Writer.writeSymtab();
+  Writer.writeStrtab();
+}
+
+namespace llvm {
+  void initializeRustSummaryBitcodeWriterPass(PassRegistry&);
+}
+
+namespace {
+
+// Writes a module and its summary with `writeModuleBitcode`. The summary is
+// the one `ModuleSummaryIndexWrapperPass` builds, which is also what
+// `createWriteThinLTOBitcodePass` writes. That way it has the block
+// frequencies of every function, and with them the hotness PGO gives calls.
+class RustSummaryBitcodeWriter : public ModulePass {
+  SmallVectorImpl<char> *Buffer;
+public:
+  static char ID;
+  RustSummaryBitcodeWriter() : ModulePass(ID), Buffer(nullptr) {}
+  RustSummaryBitcodeWriter(SmallVectorImpl<char> &Buffer)
+      : ModulePass(ID), Buffer(&Buffer) {
+    initializeRustSummaryBitcodeWriterPass(*PassRegistry::getPassRegistry());
+  }
+
+  bool runOnModule(Module &M) override {
+    writeModuleBitcode(
+        M, &getAnalysis<ModuleSummaryIndexWrapperPass>().getIndex(), *Buffer);
+    return false;
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.setPreservesAll();
+    AU.addRequired<ModuleSummaryIndexWrapperPass>();
+  }
+
+  static StringRef name() { return "RustSummaryBitcodeWriter"; }
+};
+
+} // namespace
+
+char RustSummaryBitcodeWriter::ID = 0;
+INITIALIZE_PASS_BEGIN(RustSummaryBitcodeWriter, "write-rust-summary-bitcode",
+                      "Write bitcode with a module summary", false, true)
+INITIALIZE_PASS_DEPENDENCY(ModuleSummaryIndexWrapperPass)
+INITIALIZE_PASS_END(RustSummaryBitcodeWriter, "write-rust-summary-bitcode",
+                    "Write bitcode with a module summary", false, true)
+
+// Serializes `M` once for all of rustc's uses of bitcode. With a summary the
+// result is the same as `LLVMRustThinLTOBufferCreate`, and it can be used
+// for ThinLTO as well as everything `LLVMRustModuleBufferCreate` output is
+// used for (regular LTO and embedding in rlibs just ignore the summary), so
+// there's no need to serialize a module twice. Without a summary it's the
+// same as `LLVMRustModuleBufferCreate`.
+//
+// `SizeHint` is the number of bytes to reserve up front, e.g. the size of
+// the same module's bitcode in the previous session, so that the buffer
+// isn't reallocated as it grows. `WithFunctionHashes` is as for
+// `LLVMRustThinLTOBufferCreate`, and only applies with a summary.
+extern "C" LLVMRustThinLTOBuffer*
+LLVMRustModuleSerialize(LLVMModuleRef M, bool WithSummary,
+                        bool WithFunctionHashes, size_t SizeHint) {
+  Module &Mod = *unwrap(M);
+  auto Ret = llvm::make_unique<LLVMRustThinLTOBuffer>();
+  Ret->data.reserve(SizeHint);
+
+  // Modules with type metadata (for CFI) are split in two by the ThinLTO
+  // bitcode writer, and Darwin wants a wrapper header around bitcode, so
+  // those fall back to the regular writer passes.
+  Triple TT(Mod.getTargetTriple());
+  bool NeedsPass = TT.isOSDarwin() || TT.isOSBinFormatMachO();
+  if (WithSummary) {
+    for (const GlobalObject &GO : Mod.global_objects())
+      NeedsPass |= GO.hasMetadata(LLVMContext::MD_type);
+  }
+  NamedMDNode *Hashes =
+      WithSummary && WithFunctionHashes ? addFunctionHashes(Mod) : nullptr;
+  if (NeedsPass) {
+    raw_svector_ostream OS(Ret->data);
+    legacy::PassManager PM;
+    PM.add(WithSummary ? createWriteThinLTOBitcodePass(OS)
+                       : createBitcodeWriterPass(OS));
+    PM.run(Mod);
+  } else if (WithSummary) {
+    // This is what `ThinLTOBitcodeWriter` does for modules that don't need
+    // to be split, with the summary built the same way.
+    legacy::PassManager PM;
+    PM.add(new RustSummaryBitcodeWriter(Ret->data));
+    PM.run(Mod);
+  } else {
+    writeModuleBitcode(Mod, nullptr, Ret->data);
+  }
+  if (Hashes)
+    Mod.eraseNamedMetadata(Hashes);
   return Ret.release();
 }
 
@@ -1085,7 +4144,7 @@ LLVMRustThinLTOBufferPtr(const LLVMRustThinLTOBuffer *Buffer) {
 
 extern "C" size_t
 LLVMRustThinLTOBufferLen(const LLVMRustThinLTOBuffer *Buffer) {
-  return Buffer->data.length();
+  return Buffer->data.size();
 }
 
 // This is what we used to parse upstream bitcode for actual ThinLTO
@@ -1105,6 +4164,7 @@ LLVMRustParseBitcodeForLTO(LLVMContextRef Context,
     LLVMRustSetLastError(toString(SrcOrError.takeError()).c_str());
     return nullptr;
   }
+  stripFunctionHashes(**SrcOrError);
   return wrap(std::move(*SrcOrError).release());
 }
 
@@ -1144,28 +4204,70 @@ LLVMRustThinLTOPatchDICompileUnit(LLVMModuleRef Mod, DICompileUnit *Unit) {
       return;
   }
 
-  // Use LLVM's built-in `DebugInfoFinder` to find a bunch of debuginfo and
-  // process it recursively. Note that we specifically iterate over instructions
-  // to ensure we feed everything into it.
-  DebugInfoFinder Finder;
-  Finder.processModule(*M);
+  // Find all subprograms which may refer to a compile unit. `DebugInfoFinder`
+  // would also walk the entire type graph for this, but all the subprogram
+  // definitions that rustc emits are reachable without it: they're attached
+  // to functions, or they're in the scope chains (including inlined-at
+  // chains) of debug locations, global variables and imported entities.
+  SmallPtrSet<const MDNode *, 32> Seen;
+  SmallVector<DISubprogram *, 32> Subprograms;
+  auto VisitScope = [&](DIScope *Scope) {
+    while (Scope && Seen.insert(Scope).second) {
+      if (auto *SP = dyn_cast<DISubprogram>(Scope)) {
+        Subprograms.push_back(SP);
+        Scope = SP->getScope().resolve();
+      } else if (auto *LB = dyn_cast<DILexicalBlockBase>(Scope)) {
+        Scope = LB->getScope();
+      } else if (auto *NS = dyn_cast<DINamespace>(Scope)) {
+        Scope = NS->getScope();
+      } else if (auto *Mod = dyn_cast<DIModule>(Scope)) {
+        Scope = Mod->getScope();
+      } else {
+        // Types, files and compile units.
+        break;
+      }
+    }
+  };
+  auto VisitLocation = [&](const DILocation *Loc) {
+    for (; Loc && Seen.insert(Loc).second; Loc = Loc->getInlinedAt())
+      VisitScope(Loc->getScope());
+  };
+
+  for (DICompileUnit *CU : M->debug_compile_units()) {
+    for (DIGlobalVariableExpression *GVE : CU->getGlobalVariables())
+      VisitScope(GVE->getVariable()->getScope());
+    for (DIImportedEntity *IE : CU->getImportedEntities()) {
+      VisitScope(IE->getScope());
+      if (auto *Entity = dyn_cast_or_null<DIScope>(IE->getEntity().resolve()))
+        VisitScope(Entity);
+    }
+  }
+  SmallVector<DIGlobalVariableExpression *, 1> GVEs;
+  for (GlobalVariable &GV : M->globals()) {
+    GVEs.clear();
+    GV.getDebugInfo(GVEs);
+    for (DIGlobalVariableExpression *GVE : GVEs)
+      VisitScope(GVE->getVariable()->getScope());
+  }
   for (Function &F : M->functions()) {
+    VisitScope(F.getSubprogram());
+    // Consecutive instructions mostly share their location, so only changes
+    // are looked at.
+    const DILocation *Last = nullptr;
     for (auto &FI : F) {
       for (Instruction &BI : FI) {
-        if (auto Loc = BI.getDebugLoc())
-          Finder.processLocation(*M, Loc);
-        if (auto DVI = dyn_cast<DbgValueInst>(&BI))
-          Finder.processValue(*M, DVI);
-        if (auto DDI = dyn_cast<DbgDeclareInst>(&BI))
-          Finder.processDeclare(*M, DDI);
+        const DILocation *Loc = BI.getDebugLoc().get();
+        if (Loc && Loc != Last)
+          VisitLocation(Loc);
+        Last = Loc;
       }
     }
   }
 
   // After we've found all our debuginfo, rewrite all subprograms to point to
   // the same `DICompileUnit`.
-  for (auto &F : Finder.subprograms()) {
-    F->replaceUnit(Unit);
+  for (DISubprogram *SP : Subprograms) {
+    SP->replaceUnit(Unit);
   }
 
   // Erase any other references to other `DICompileUnit` instances, the verifier
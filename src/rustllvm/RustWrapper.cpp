@@ -5,13 +5,27 @@
 #include "llvm/IR/DiagnosticPrinter.h"
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/TrackingMDRef.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/YAMLTraits.h"
 #include "llvm/Object/Archive.h"
 #include "llvm/Object/ObjectFile.h"
 #include "llvm/Bitcode/BitcodeWriterPass.h"
 #include "llvm/Support/Signals.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/ADT/Optional.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Process.h"
 
 #include <iostream>
+#include <mutex>
+
+#ifdef LLVM_ON_UNIX
+#include <sys/mman.h>
+#endif
 
 //===----------------------------------------------------------------------===
 //
@@ -47,8 +61,6 @@ static AtomicOrdering fromRust(LLVMAtomicOrdering Ordering) {
   report_fatal_error("Invalid LLVMAtomicOrdering value!");
 }
 
-static LLVM_THREAD_LOCAL char *LastError;
-
 // Custom error handler for fatal LLVM errors.
 //
 // Notably it exits the process with code 101, unlike LLVM's default of 1.
@@ -70,10 +82,92 @@ extern "C" void LLVMRustInstallFatalErrorHandler() {
   install_fatal_error_handler(FatalErrorHandler);
 }
 
+namespace {
+
+// A whole file mapped into memory. Unlike `MemoryBuffer::getFile` this maps
+// files of any size, as reading a small file into the heap isn't any faster
+// than faulting in its few pages, and can't be told to start early.
+class MappedFileBuffer : public MemoryBuffer {
+  fs::mapped_file_region Region;
+  std::string Identifier;
+
+public:
+  MappedFileBuffer(int FD, size_t Size, StringRef Identifier,
+                   std::error_code &EC)
+      : Region(FD, fs::mapped_file_region::readonly, Size, 0, EC),
+        Identifier(Identifier) {
+    if (!EC)
+      init(Region.const_data(), Region.const_data() + Size,
+           /* RequiresNullTerminator = */ false);
+  }
+
+  StringRef getBufferIdentifier() const override { return Identifier; }
+
+  BufferKind getBufferKind() const override { return MemoryBuffer_MMap; }
+};
+
+} // namespace
+
+void rustAdviseFileRange(const MemoryBuffer &Buf, StringRef Range,
+                         LLVMRustFileAccess Access) {
+#ifdef LLVM_ON_UNIX
+  if (Access == LLVMRustFileAccess::Default || Range.empty() ||
+      Buf.getBufferKind() != MemoryBuffer::MemoryBuffer_MMap)
+    return;
+  int Advice;
+  switch (Access) {
+  case LLVMRustFileAccess::Random:
+    Advice = POSIX_MADV_RANDOM;
+    break;
+  case LLVMRustFileAccess::Sequential:
+    Advice = POSIX_MADV_SEQUENTIAL;
+    break;
+  case LLVMRustFileAccess::WillNeed:
+    Advice = POSIX_MADV_WILLNEED;
+    break;
+  default:
+    report_fatal_error("bad FileAccess.");
+  }
+  // Mappings start at a page boundary, so rounding down stays within them.
+  uintptr_t PageSize = Process::getPageSize();
+  uintptr_t Start = reinterpret_cast<uintptr_t>(Range.data()) & ~(PageSize - 1);
+  uintptr_t End = reinterpret_cast<uintptr_t>(Range.data() + Range.size());
+  // This is only a hint, so failing to give it is fine.
+  (void)posix_madvise(reinterpret_cast<void *>(Start), End - Start, Advice);
+#endif
+}
+
+ErrorOr<std::unique_ptr<MemoryBuffer>>
+rustOpenFile(const char *Path, LLVMRustFileAccess Access) {
+  if (Access == LLVMRustFileAccess::Default)
+    return MemoryBuffer::getFile(Path, -1, false);
+
+  int FD;
+  if (std::error_code EC = fs::openFileForRead(Path, FD))
+    return EC;
+  fs::file_status Status;
+  std::error_code EC = fs::status(FD, Status);
+  // Empty files can't be mapped, and neither can anything but regular files.
+  if (!EC && (Status.getSize() == 0 ||
+              Status.type() != fs::file_type::regular_file)) {
+    Process::SafelyCloseFileDescriptor(FD);
+    return MemoryBuffer::getFile(Path, -1, false);
+  }
+  std::unique_ptr<MemoryBuffer> Buf;
+  if (!EC)
+    Buf.reset(new MappedFileBuffer(FD, Status.getSize(), Path, EC));
+  // The mapping stays valid after the file is closed.
+  Process::SafelyCloseFileDescriptor(FD);
+  if (EC)
+    return EC;
+  rustAdviseFileRange(*Buf, Buf->getBuffer(), Access);
+  return std::move(Buf);
+}
+
 extern "C" LLVMMemoryBufferRef
-LLVMRustCreateMemoryBufferWithContentsOfFile(const char *Path) {
-  ErrorOr<std::unique_ptr<MemoryBuffer>> BufOr =
-      MemoryBuffer::getFile(Path, -1, false);
+LLVMRustCreateMemoryBufferWithContentsOfFile(const char *Path,
+                                             LLVMRustFileAccess Access) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufOr = rustOpenFile(Path, Access);
   if (!BufOr) {
     LLVMRustSetLastError(BufOr.getError().message().c_str());
     return nullptr;
@@ -81,15 +175,121 @@ LLVMRustCreateMemoryBufferWithContentsOfFile(const char *Path) {
   return wrap(BufOr.get().release());
 }
 
-extern "C" char *LLVMRustGetLastError(void) {
-  char *Ret = LastError;
-  LastError = nullptr;
-  return Ret;
+// Errors reported to Rust are kept in a small ring per thread, so that a
+// thread which runs into several of them (say, a ThinLTO worker whose
+// every import fails) gets to report all of them rather than just the last.
+// Once the ring is full the oldest error is dropped.
+//
+// The ring lives in thread local storage and each slot has a buffer of its
+// own, so reporting an error doesn't allocate unless its message is too
+// long for that. The text of an error stays where it is until the slot is
+// reused or the errors are cleared, and Rust copies it out. Whatever is left
+// when the thread exits is freed by the ring's destructor, which is why it's
+// a C++ `thread_local` rather than `LLVM_THREAD_LOCAL`.
+static const unsigned ErrorRingSize = 8;
+static const size_t ErrorInlineSize = 256;
+
+namespace {
+struct ErrorRecord {
+  LLVMRustErrorKind Kind;
+  size_t ModuleLen;
+  size_t MessageLen;
+  // Holds the module identifier and message, each followed by a NUL. Points
+  // at `Inline` unless they didn't fit, in which case it's owned.
+  char *Text;
+  char Inline[ErrorInlineSize];
+};
+
+struct ErrorRing {
+  ErrorRecord Slots[ErrorRingSize] = {};
+  unsigned First = 0;
+  unsigned Count = 0;
+
+  ~ErrorRing() {
+    for (ErrorRecord &Record : Slots)
+      if (Record.Text != Record.Inline)
+        free(Record.Text);
+  }
+};
+} // namespace
+
+static thread_local ErrorRing Errors;
+
+static void releaseText(ErrorRecord &Record) {
+  if (Record.Text != Record.Inline)
+    free(Record.Text);
+  Record.Text = nullptr;
+}
+
+extern "C" void LLVMRustReportError(LLVMRustErrorKind Kind, const char *Module,
+                                    const char *Message) {
+  unsigned Index;
+  if (Errors.Count == ErrorRingSize) {
+    Index = Errors.First;
+    Errors.First = (Errors.First + 1) % ErrorRingSize;
+  } else {
+    Index = (Errors.First + Errors.Count) % ErrorRingSize;
+    Errors.Count++;
+  }
+  ErrorRecord &Record = Errors.Slots[Index];
+  releaseText(Record);
+
+  size_t ModuleLen = Module ? strlen(Module) : 0;
+  size_t MessageLen = strlen(Message);
+  size_t Size = ModuleLen + MessageLen + 2;
+  Record.Text = Size <= ErrorInlineSize ? Record.Inline
+                                        : static_cast<char *>(malloc(Size));
+  if (!Record.Text) {
+    // Nothing better to do than keep the start of the message.
+    Record.Text = Record.Inline;
+    ModuleLen = 0;
+    MessageLen = std::min(MessageLen, ErrorInlineSize - 2);
+  }
+  if (ModuleLen)
+    memcpy(Record.Text, Module, ModuleLen);
+  Record.Text[ModuleLen] = '\0';
+  memcpy(Record.Text + ModuleLen + 1, Message, MessageLen);
+  Record.Text[ModuleLen + MessageLen + 1] = '\0';
+  Record.Kind = Kind;
+  Record.ModuleLen = ModuleLen;
+  Record.MessageLen = MessageLen;
 }
 
 extern "C" void LLVMRustSetLastError(const char *Err) {
-  free((void *)LastError);
-  LastError = strdup(Err);
+  LLVMRustReportError(LLVMRustErrorKind::Other, nullptr, Err);
+}
+
+struct LLVMRustErrorInfo {
+  LLVMRustErrorKind Kind;
+  const char *Module;
+  size_t ModuleLen;
+  const char *Message;
+  size_t MessageLen;
+};
+
+extern "C" size_t LLVMRustGetErrorCount() { return Errors.Count; }
+
+// Describes the `Index`th error reported on this thread, oldest first. The
+// strings stay valid until the next error is reported or the errors are
+// cleared.
+extern "C" bool LLVMRustGetError(size_t Index, LLVMRustErrorInfo *Info) {
+  if (Index >= Errors.Count)
+    return false;
+  const ErrorRecord &Record =
+      Errors.Slots[(Errors.First + Index) % ErrorRingSize];
+  Info->Kind = Record.Kind;
+  Info->Module = Record.Text;
+  Info->ModuleLen = Record.ModuleLen;
+  Info->Message = Record.Text + Record.ModuleLen + 1;
+  Info->MessageLen = Record.MessageLen;
+  return true;
+}
+
+extern "C" void LLVMRustClearErrors() {
+  for (unsigned I = 0; I < Errors.Count; I++)
+    releaseText(Errors.Slots[(Errors.First + I) % ErrorRingSize]);
+  Errors.First = 0;
+  Errors.Count = 0;
 }
 
 extern "C" LLVMContextRef LLVMRustContextCreate(bool shouldDiscardNames) {
@@ -98,6 +298,231 @@ extern "C" LLVMContextRef LLVMRustContextCreate(bool shouldDiscardNames) {
   return wrap(ctx);
 }
 
+// Types and metadata which rustc interns under dense IDs of its own, so that
+// looking them up again is an index into a vector rather than building the
+// same type or debuginfo node (and hashing it into LLVM's uniquing tables)
+// over again. Each table belongs to one context, is created by
+// `LLVMRustContextGetInternTable` and is freed along with its context by
+// `LLVMRustContextDispose`.
+//
+// Metadata is held through tracking references, so entries for temporary
+// nodes follow them when they're replaced.
+struct LLVMRustInternTable {
+  std::vector<Type *> Types;
+  std::vector<TrackingMDRef> Metadata;
+  // Results of `LLVMRustInlineAsmVerify` by function type and constraints.
+  DenseMap<FunctionType *, StringMap<bool>> AsmConstraints;
+  // Named structs created by `LLVMRustStructCreateNamed`.
+  std::vector<StructType *> NamedStructs;
+};
+
+static std::mutex InternTablesLock;
+static DenseMap<LLVMContext *, LLVMRustInternTable *> InternTables;
+
+// Only looking up the table takes a lock; it's used by the context's thread
+// alone after that.
+extern "C" LLVMRustInternTable *
+LLVMRustContextGetInternTable(LLVMContextRef C) {
+  std::lock_guard<std::mutex> Guard(InternTablesLock);
+  LLVMRustInternTable *&Table = InternTables[unwrap(C)];
+  if (!Table)
+    Table = new LLVMRustInternTable();
+  return Table;
+}
+
+// Same as `LLVMContextDispose`, which mustn't be used for contexts that may
+// have an intern table as that would be left behind.
+extern "C" void LLVMRustContextDispose(LLVMContextRef C) {
+  LLVMRustInternTable *Table = nullptr;
+  {
+    std::lock_guard<std::mutex> Guard(InternTablesLock);
+    auto It = InternTables.find(unwrap(C));
+    if (It != InternTables.end()) {
+      Table = It->second;
+      InternTables.erase(It);
+    }
+  }
+  delete Table;
+  delete unwrap(C);
+}
+
+// A process-wide pool of contexts for reuse across codegen units. LLVM has
+// no way to reset a context: types, constants and metadata strings stay
+// interned in it until it's destroyed. Reusing one therefore keeps the
+// uniquing tables and bump allocators warm (most of what one codegen unit
+// creates, such as the basic integer and pointer types and the common
+// constants, is needed by the next one as well), at the cost of keeping
+// whatever isn't around for longer. That growth is bounded by retiring each
+// context after `MaxUses` codegen units, and by only keeping up to `MaxIdle`
+// contexts around that nobody is using. A context being released takes its
+// slot in `Idle` before it's reset (and the lock dropped), counted in
+// `Returning`, so that concurrent releases can't end up keeping more.
+//
+// Pooling is off (`MaxIdle` is zero) until `LLVMRustContextPoolConfigure`
+// is called, in which case acquiring and releasing are the same as
+// `LLVMRustContextCreate` and `LLVMRustContextDispose`.
+namespace {
+struct ContextPool {
+  std::mutex Lock;
+  unsigned MaxIdle = 0;
+  unsigned MaxUses = 0;
+  unsigned Returning = 0;
+  std::vector<LLVMContext *> Idle;
+  DenseMap<LLVMContext *, unsigned> Uses;
+};
+} // namespace
+
+static ContextPool &getContextPool() {
+  static ContextPool *Pool = new ContextPool();
+  return *Pool;
+}
+
+extern "C" void LLVMRustContextPoolConfigure(unsigned MaxIdle,
+                                             unsigned MaxUses) {
+  ContextPool &Pool = getContextPool();
+  std::vector<LLVMContext *> Retired;
+  {
+    std::lock_guard<std::mutex> Guard(Pool.Lock);
+    Pool.MaxIdle = MaxIdle;
+    Pool.MaxUses = MaxUses;
+    while (Pool.Idle.size() > MaxIdle) {
+      Retired.push_back(Pool.Idle.back());
+      Pool.Uses.erase(Pool.Idle.back());
+      Pool.Idle.pop_back();
+    }
+  }
+  for (LLVMContext *C : Retired)
+    LLVMRustContextDispose(wrap(C));
+}
+
+// Returns an idle context from the pool if there is one, or a new one.
+extern "C" LLVMContextRef LLVMRustContextAcquire(bool shouldDiscardNames) {
+  ContextPool &Pool = getContextPool();
+  LLVMContext *C = nullptr;
+  {
+    std::lock_guard<std::mutex> Guard(Pool.Lock);
+    if (!Pool.Idle.empty()) {
+      C = Pool.Idle.back();
+      Pool.Idle.pop_back();
+    }
+  }
+  if (!C)
+    return LLVMRustContextCreate(shouldDiscardNames);
+  C->setDiscardValueNames(shouldDiscardNames);
+  return wrap(C);
+}
+
+// Disposes of `M` (which may be null) and hands its context `C` back to the
+// pool. Nothing else may be left in the context by then: any other modules
+// must have been disposed of already, and values of the context must not be
+// used once it's released.
+//
+// The context's intern table is freed, as the IDs are only meaningful to
+// the codegen unit that assigned them, and its diagnostic settings are
+// reset to LLVM's defaults. The named structs that were created give up
+// their names, so that the next codegen unit gets the same names rather
+// than ones with a numeric suffix.
+extern "C" void LLVMRustContextRelease(LLVMContextRef C, LLVMModuleRef M) {
+  if (M)
+    delete unwrap(M);
+
+  ContextPool &Pool = getContextPool();
+  LLVMContext *Ctx = unwrap(C);
+  bool Keep;
+  {
+    std::lock_guard<std::mutex> Guard(Pool.Lock);
+    unsigned &Uses = Pool.Uses[Ctx];
+    Uses++;
+    Keep = Pool.Idle.size() + Pool.Returning < Pool.MaxIdle &&
+           Uses < Pool.MaxUses;
+    if (Keep)
+      Pool.Returning++;
+    else
+      Pool.Uses.erase(Ctx);
+  }
+  if (!Keep) {
+    LLVMRustContextDispose(C);
+    return;
+  }
+
+  LLVMRustInternTable *Table = nullptr;
+  {
+    std::lock_guard<std::mutex> Guard(InternTablesLock);
+    auto It = InternTables.find(Ctx);
+    if (It != InternTables.end()) {
+      Table = It->second;
+      InternTables.erase(It);
+    }
+  }
+  if (Table)
+    for (StructType *Ty : Table->NamedStructs)
+      Ty->setName("");
+  delete Table;
+  Ctx->setDiagnosticHandler(llvm::make_unique<DiagnosticHandler>());
+  Ctx->setDiagnosticsHotnessRequested(false);
+  Ctx->setDiagnosticsHotnessThreshold(0);
+  Ctx->setYieldCallback(nullptr, nullptr);
+
+  {
+    std::lock_guard<std::mutex> Guard(Pool.Lock);
+    Pool.Returning--;
+    // The pool may have been shrunk by `LLVMRustContextPoolConfigure` since.
+    Keep = Pool.Idle.size() < Pool.MaxIdle;
+    if (Keep)
+      Pool.Idle.push_back(Ctx);
+    else
+      Pool.Uses.erase(Ctx);
+  }
+  if (!Keep)
+    LLVMRustContextDispose(C);
+}
+
+extern "C" LLVMTypeRef LLVMRustInternedType(LLVMRustInternTable *Table,
+                                            uint32_t Id) {
+  return Id < Table->Types.size() ? wrap(Table->Types[Id]) : nullptr;
+}
+
+extern "C" void LLVMRustInternType(LLVMRustInternTable *Table, uint32_t Id,
+                                   LLVMTypeRef Ty) {
+  if (Id >= Table->Types.size())
+    Table->Types.resize(Id + 1);
+  Table->Types[Id] = unwrap(Ty);
+}
+
+extern "C" LLVMMetadataRef LLVMRustInternedMetadata(LLVMRustInternTable *Table,
+                                                    uint32_t Id) {
+  return Id < Table->Metadata.size() ? wrap(Table->Metadata[Id].get())
+                                     : nullptr;
+}
+
+extern "C" void LLVMRustInternMetadata(LLVMRustInternTable *Table, uint32_t Id,
+                                       LLVMMetadataRef MD) {
+  if (Id >= Table->Metadata.size())
+    Table->Metadata.resize(Id + 1);
+  Table->Metadata[Id].reset(unwrap(MD));
+}
+
+// Same as `LLVMRustArrayType`, interned under `Id`.
+extern "C" LLVMTypeRef LLVMRustInternArrayType(LLVMRustInternTable *Table,
+                                               uint32_t Id,
+                                               LLVMTypeRef ElementTy,
+                                               uint64_t ElementCount) {
+  if (LLVMTypeRef Ty = LLVMRustInternedType(Table, Id))
+    return Ty;
+  LLVMTypeRef Ty = wrap(ArrayType::get(unwrap(ElementTy), ElementCount));
+  LLVMRustInternType(Table, Id, Ty);
+  return Ty;
+}
+
+// Same as `LLVMStructCreateNamed`, except that the name is given up again when
+// the context is released to the pool, see `LLVMRustContextRelease`.
+extern "C" LLVMTypeRef LLVMRustStructCreateNamed(LLVMContextRef C,
+                                                 const char *Name) {
+  StructType *Ty = StructType::create(*unwrap(C), Name);
+  LLVMRustContextGetInternTable(C)->NamedStructs.push_back(Ty);
+  return wrap(Ty);
+}
+
 extern "C" void LLVMRustSetNormalizedTarget(LLVMModuleRef M,
                                             const char *Triple) {
   unwrap(M)->setTargetTriple(Triple::normalize(Triple));
@@ -288,6 +713,88 @@ extern "C" void LLVMRustRemoveFunctionAttributes(LLVMValueRef Fn,
   F->setAttributes(PALNew);
 }
 
+enum class LLVMRustAttributeSpecKind {
+  Enum,
+  Alignment,
+  Dereferenceable,
+  DereferenceableOrNull,
+};
+
+// One attribute to add with `LLVMRustAddFunctionAttributes` or
+// `LLVMRustAddCallSiteAttributes`. `Attr` is only used for `Enum` attributes,
+// and `Value` for the others.
+struct LLVMRustAttributeSpec {
+  unsigned Index;
+  LLVMRustAttributeSpecKind Kind;
+  LLVMRustAttribute Attr;
+  uint64_t Value;
+};
+
+// Returns `PAL` with all of `Specs` added, built all at once rather than one
+// attribute at a time like the functions above, which each copy and unique
+// the whole list again.
+static AttributeList addAttributeSpecs(LLVMContext &Ctx, AttributeList PAL,
+                                       unsigned NumArgs,
+                                       const LLVMRustAttributeSpec *Specs,
+                                       size_t Len) {
+  AttrBuilder FnAttrs(PAL.getFnAttributes());
+  AttrBuilder RetAttrs(PAL.getRetAttributes());
+  std::vector<AttrBuilder> ArgAttrs;
+  for (unsigned I = 0; I < NumArgs; I++)
+    ArgAttrs.emplace_back(PAL.getParamAttributes(I));
+
+  for (size_t I = 0; I < Len; I++) {
+    const LLVMRustAttributeSpec &Spec = Specs[I];
+    AttrBuilder *B;
+    if (Spec.Index == AttributeList::FunctionIndex) {
+      B = &FnAttrs;
+    } else if (Spec.Index == AttributeList::ReturnIndex) {
+      B = &RetAttrs;
+    } else {
+      unsigned ArgNo = Spec.Index - AttributeList::FirstArgIndex;
+      if (ArgNo >= ArgAttrs.size())
+        ArgAttrs.resize(ArgNo + 1);
+      B = &ArgAttrs[ArgNo];
+    }
+    switch (Spec.Kind) {
+    case LLVMRustAttributeSpecKind::Enum:
+      B->addAttribute(fromRust(Spec.Attr));
+      break;
+    case LLVMRustAttributeSpecKind::Alignment:
+      B->addAlignmentAttr(Spec.Value);
+      break;
+    case LLVMRustAttributeSpecKind::Dereferenceable:
+      B->addDereferenceableAttr(Spec.Value);
+      break;
+    case LLVMRustAttributeSpecKind::DereferenceableOrNull:
+      B->addDereferenceableOrNullAttr(Spec.Value);
+      break;
+    }
+  }
+
+  std::vector<AttributeSet> ArgSets;
+  for (const AttrBuilder &B : ArgAttrs)
+    ArgSets.push_back(AttributeSet::get(Ctx, B));
+  return AttributeList::get(Ctx, AttributeSet::get(Ctx, FnAttrs),
+                            AttributeSet::get(Ctx, RetAttrs), ArgSets);
+}
+
+extern "C" void LLVMRustAddFunctionAttributes(LLVMValueRef Fn,
+                                              const LLVMRustAttributeSpec *Specs,
+                                              size_t Len) {
+  Function *F = unwrap<Function>(Fn);
+  F->setAttributes(addAttributeSpecs(F->getContext(), F->getAttributes(),
+                                     F->arg_size(), Specs, Len));
+}
+
+extern "C" void LLVMRustAddCallSiteAttributes(LLVMValueRef Instr,
+                                              const LLVMRustAttributeSpec *Specs,
+                                              size_t Len) {
+  CallSite Call = CallSite(unwrap<Instruction>(Instr));
+  Call.setAttributes(addAttributeSpecs(Call->getContext(), Call.getAttributes(),
+                                       Call.arg_size(), Specs, Len));
+}
+
 // enable fpmath flag UnsafeAlgebra
 extern "C" void LLVMRustSetHasUnsafeAlgebra(LLVMValueRef V) {
   if (auto I = dyn_cast<Instruction>(unwrap<Value>(V))) {
@@ -295,6 +802,52 @@ extern "C" void LLVMRustSetHasUnsafeAlgebra(LLVMValueRef V) {
   }
 }
 
+// These values **must** match FastMathFlags on the Rust side. Each one
+// corresponds to one of LLVM's fast-math flags, so that e.g. reassociation
+// and contraction can be allowed for a reduction without also assuming that
+// there are no NaNs or infinities.
+enum class LLVMRustFastMathFlags : uint32_t {
+  AllowReassoc = (1 << 0),
+  NoNaNs = (1 << 1),
+  NoInfs = (1 << 2),
+  NoSignedZeros = (1 << 3),
+  AllowReciprocal = (1 << 4),
+  AllowContract = (1 << 5),
+  ApproxFunc = (1 << 6),
+};
+
+static bool isSet(LLVMRustFastMathFlags Flags, LLVMRustFastMathFlags Flag) {
+  return (static_cast<uint32_t>(Flags) & static_cast<uint32_t>(Flag)) != 0;
+}
+
+static FastMathFlags fromRust(LLVMRustFastMathFlags Flags) {
+  FastMathFlags FMF;
+  if (isSet(Flags, LLVMRustFastMathFlags::AllowReassoc))
+    FMF.setAllowReassoc();
+  if (isSet(Flags, LLVMRustFastMathFlags::NoNaNs))
+    FMF.setNoNaNs();
+  if (isSet(Flags, LLVMRustFastMathFlags::NoInfs))
+    FMF.setNoInfs();
+  if (isSet(Flags, LLVMRustFastMathFlags::NoSignedZeros))
+    FMF.setNoSignedZeros();
+  if (isSet(Flags, LLVMRustFastMathFlags::AllowReciprocal))
+    FMF.setAllowReciprocal();
+  if (isSet(Flags, LLVMRustFastMathFlags::AllowContract))
+    FMF.setAllowContract(true);
+  if (isSet(Flags, LLVMRustFastMathFlags::ApproxFunc))
+    FMF.setApproxFunc();
+  return FMF;
+}
+
+// Replaces the fast-math flags of `V` with exactly `Flags`. Does nothing if
+// `V` isn't a floating point operation, like `LLVMRustSetHasUnsafeAlgebra`.
+extern "C" void LLVMRustSetFastMathFlags(LLVMValueRef V,
+                                         LLVMRustFastMathFlags Flags) {
+  if (auto I = dyn_cast<Instruction>(unwrap<Value>(V)))
+    if (isa<FPMathOperator>(I))
+      I->copyFastMathFlags(fromRust(Flags));
+}
+
 extern "C" LLVMValueRef
 LLVMRustBuildAtomicLoad(LLVMBuilderRef B, LLVMValueRef Source, const char *Name,
                         LLVMAtomicOrdering Order) {
@@ -373,16 +926,75 @@ extern "C" LLVMValueRef LLVMRustInlineAsm(LLVMTypeRef Ty, char *AsmString,
                              HasSideEffects, IsAlignStack, fromRust(Dialect)));
 }
 
+// `InlineAsm::Verify` parses the constraints every time, even though the
+// same handful of them come up over and over in crates with a lot of `asm!`
+// (usually through `std::arch`), so its result is remembered in the intern
+// table of the type's context.
 extern "C" bool LLVMRustInlineAsmVerify(LLVMTypeRef Ty,
                                           char *Constraints) {
-  return InlineAsm::Verify(unwrap<FunctionType>(Ty), Constraints);
+  FunctionType *FTy = unwrap<FunctionType>(Ty);
+  LLVMRustInternTable *Table =
+      LLVMRustContextGetInternTable(wrap(&FTy->getContext()));
+  auto Inserted = Table->AsmConstraints[FTy].insert(
+      std::make_pair(StringRef(Constraints), false));
+  if (Inserted.second)
+    Inserted.first->second = InlineAsm::Verify(FTy, Constraints);
+  return Inserted.first->second;
 }
 
 extern "C" void LLVMRustAppendModuleInlineAsm(LLVMModuleRef M, const char *Asm) {
   unwrap(M)->appendModuleInlineAsm(StringRef(Asm));
 }
 
-typedef DIBuilder *LLVMRustDIBuilderRef;
+// Same as calling `LLVMRustAppendModuleInlineAsm` for each of the `N` strings
+// in `Asms`, but only copies the module's assembly once instead of growing
+// it by every string in turn.
+extern "C" void LLVMRustAppendModuleInlineAsmBulk(LLVMModuleRef M,
+                                                  const char *const *Asms,
+                                                  const size_t *Lens,
+                                                  size_t N) {
+  Module *Mod = unwrap(M);
+  std::string Asm = Mod->getModuleInlineAsm();
+  size_t Size = Asm.size();
+  for (size_t I = 0; I < N; I++)
+    Size += Lens[I] + 1;
+  Asm.reserve(Size);
+  for (size_t I = 0; I < N; I++) {
+    Asm.append(Asms[I], Lens[I]);
+    if (!Asm.empty() && Asm.back() != '\n')
+      Asm += '\n';
+  }
+  Mod->setModuleInlineAsm(Asm);
+}
+
+// A DIBuilder which can also put off creating the members of composite
+// types until it's finalized, see `LLVMRustDIBuilderDeferMembers`.
+class RustDIBuilder : public DIBuilder {
+public:
+  struct DeferredMember {
+    StringRef Name;
+    DIFile *File;
+    unsigned LineNo;
+    uint64_t SizeInBits;
+    uint32_t AlignInBits;
+    uint64_t OffsetInBits;
+    DINode::DIFlags Flags;
+    TrackingMDRef Ty;
+    ConstantInt *Discriminant;
+    bool IsVariant;
+  };
+
+  Module &M;
+  BumpPtrAllocator Alloc;
+  StringSaver Saver;
+  DenseMap<DICompositeType *, std::vector<DeferredMember>> Deferred;
+
+  RustDIBuilder(Module &M) : DIBuilder(M), M(M), Saver(Alloc) {}
+
+  void materializeDeferred();
+};
+
+typedef RustDIBuilder *LLVMRustDIBuilderRef;
 
 template <typename DIT> DIT *unwrapDIPtr(LLVMMetadataRef Ref) {
   return (DIT *)(Ref ? unwrap<MDNode>(Ref) : nullptr);
@@ -625,14 +1237,91 @@ extern "C" LLVMValueRef LLVMRustMetadataAsValue(LLVMContextRef C, LLVMMetadataRe
 }
 
 extern "C" LLVMRustDIBuilderRef LLVMRustDIBuilderCreate(LLVMModuleRef M) {
-  return new DIBuilder(*unwrap(M));
+  return new RustDIBuilder(*unwrap(M));
 }
 
 extern "C" void LLVMRustDIBuilderDispose(LLVMRustDIBuilderRef Builder) {
   delete Builder;
 }
 
+// Creates the deferred members of all composite types which are reachable
+// from the module's functions, globals and compile units, and of any types
+// they reach in turn. Types nothing refers to keep their empty member lists;
+// they're never emitted.
+void RustDIBuilder::materializeDeferred() {
+  if (Deferred.empty())
+    return;
+
+  SmallVector<MDNode *, 64> Worklist;
+  SmallPtrSet<MDNode *, 64> Visited;
+  auto Push = [&](Metadata *MD) {
+    if (auto *N = dyn_cast_or_null<MDNode>(MD))
+      if (Visited.insert(N).second)
+        Worklist.push_back(N);
+  };
+
+  SmallVector<std::pair<unsigned, MDNode *>, 4> Attachments;
+  for (GlobalVariable &GV : M.globals()) {
+    GV.getAllMetadata(Attachments);
+    for (auto &A : Attachments)
+      Push(A.second);
+  }
+  for (Function &F : M) {
+    F.getAllMetadata(Attachments);
+    for (auto &A : Attachments)
+      Push(A.second);
+    for (BasicBlock &BB : F)
+      for (Instruction &I : BB) {
+        I.getAllMetadata(Attachments);
+        for (auto &A : Attachments)
+          Push(A.second);
+        // Variables of `llvm.dbg.*` intrinsics.
+        if (auto *CI = dyn_cast<CallInst>(&I))
+          for (Value *Op : CI->arg_operands())
+            if (auto *MAV = dyn_cast<MetadataAsValue>(Op))
+              Push(MAV->getMetadata());
+      }
+  }
+  for (NamedMDNode &NMD : M.named_metadata())
+    for (MDNode *N : NMD.operands())
+      Push(N);
+
+  while (!Worklist.empty()) {
+    MDNode *N = Worklist.pop_back_val();
+    if (auto *CT = dyn_cast<DICompositeType>(N)) {
+      auto It = Deferred.find(CT);
+      if (It != Deferred.end()) {
+        std::vector<DeferredMember> Members = std::move(It->second);
+        Deferred.erase(It);
+        SmallVector<Metadata *, 16> Elements;
+        for (const DeferredMember &D : Members) {
+          DIType *Ty = cast_or_null<DIType>(D.Ty.get());
+#if LLVM_VERSION_GE(7, 0)
+          if (D.IsVariant) {
+            Elements.push_back(createVariantMemberType(
+                CT, D.Name, D.File, D.LineNo, D.SizeInBits, D.AlignInBits,
+                D.OffsetInBits, D.Discriminant, D.Flags, Ty));
+            continue;
+          }
+#endif
+          Elements.push_back(createMemberType(
+              CT, D.Name, D.File, D.LineNo, D.SizeInBits, D.AlignInBits,
+              D.OffsetInBits, D.Flags, Ty));
+        }
+        replaceArrays(CT, getOrCreateArray(Elements));
+      }
+    }
+    for (const MDOperand &Op : N->operands())
+      Push(Op.get());
+  }
+  Deferred.clear();
+}
+
 extern "C" void LLVMRustDIBuilderFinalize(LLVMRustDIBuilderRef Builder) {
+  // The deferred members have to exist before `finalize` resolves the cycles
+  // through temporary nodes, and everything they're needed for is already
+  // attached to the module.
+  Builder->materializeDeferred();
   Builder->finalize();
 }
 
@@ -923,8 +1612,54 @@ LLVMRustDICompositeTypeReplaceArrays(LLVMRustDIBuilderRef Builder,
                                      LLVMMetadataRef Elements,
                                      LLVMMetadataRef Params) {
   DICompositeType *Tmp = unwrapDI<DICompositeType>(CompositeTy);
-  Builder->replaceArrays(Tmp, DINodeArray(unwrap<MDTuple>(Elements)),
-                         DINodeArray(unwrap<MDTuple>(Params)));
+  Builder->replaceArrays(Tmp, DINodeArray(unwrapDI<MDTuple>(Elements)),
+                         DINodeArray(unwrapDI<MDTuple>(Params)));
+}
+
+// A member of a composite type for `LLVMRustDIBuilderDeferMembers`, with the
+// arguments of `LLVMRustDIBuilderCreateMemberType`, or of
+// `LLVMRustDIBuilderCreateVariantMemberType` if `IsVariant` is set.
+struct LLVMRustDIMember {
+  const char *Name;
+  LLVMMetadataRef File;
+  unsigned LineNo;
+  uint64_t SizeInBits;
+  uint32_t AlignInBits;
+  uint64_t OffsetInBits;
+  LLVMRustDIFlags Flags;
+  LLVMMetadataRef Ty;
+  LLVMValueRef Discriminant;
+  bool IsVariant;
+};
+
+// Sets the members of `CompositeTy`, like creating each of them and calling
+// `LLVMRustDICompositeTypeReplaceArrays`, except that the members are only
+// created when the builder is finalized, and only if the type is reachable
+// from something in the module by then. Until that they're kept as a copy of
+// `Members`, which is much smaller than the metadata nodes and uniquing table
+// entries for them.
+extern "C" void
+LLVMRustDIBuilderDeferMembers(LLVMRustDIBuilderRef Builder,
+                              LLVMMetadataRef CompositeTy,
+                              const LLVMRustDIMember *Members, size_t Len) {
+  std::vector<RustDIBuilder::DeferredMember> &Deferred =
+      Builder->Deferred[unwrapDI<DICompositeType>(CompositeTy)];
+  Deferred.clear();
+  Deferred.reserve(Len);
+  for (size_t I = 0; I < Len; I++) {
+    const LLVMRustDIMember &M = Members[I];
+    Deferred.push_back({Builder->Saver.save(M.Name),
+                        unwrapDI<DIFile>(M.File),
+                        M.LineNo,
+                        M.SizeInBits,
+                        M.AlignInBits,
+                        M.OffsetInBits,
+                        fromRust(M.Flags),
+                        TrackingMDRef(unwrap(M.Ty)),
+                        M.Discriminant ? unwrap<ConstantInt>(M.Discriminant)
+                                       : nullptr,
+                        M.IsVariant});
+  }
 }
 
 extern "C" LLVMValueRef
@@ -1031,6 +1766,127 @@ extern "C" void LLVMRustUnpackOptimizationDiagnostic(
   MessageOS << Opt->getMsg();
 }
 
+namespace {
+
+// Writes the optimization remarks of the passes matching `Filter` to a YAML
+// file as they're emitted, instead of sending each of them through the
+// diagnostic callback to be unpacked by rustc. Anything else, and remarks
+// the callback asked for as well, still go to the callback, which
+// `LLVMContextSetDiagnosticHandler` sets on this handler like on any other.
+class RemarkStreamHandler : public DiagnosticHandler {
+  std::unique_ptr<ToolOutputFile> File;
+  yaml::Output Out;
+  mutable Regex Filter;
+  uint64_t HotnessThreshold;
+
+  bool streams(StringRef PassName) const { return Filter.match(PassName); }
+
+public:
+  RemarkStreamHandler(std::unique_ptr<ToolOutputFile> File, Regex Filter,
+                      uint64_t HotnessThreshold)
+      : File(std::move(File)), Out(this->File->os()),
+        Filter(std::move(Filter)), HotnessThreshold(HotnessThreshold) {
+    this->File->keep();
+  }
+
+  bool handleDiagnostics(const DiagnosticInfo &DI) override {
+    auto *R = dyn_cast<DiagnosticInfoOptimizationBase>(&DI);
+    if (!R || !streams(R->getPassName()))
+      return DiagnosticHandler::handleDiagnostics(DI);
+
+    // Without profile data there's no hotness, and the remark is kept. This
+    // is why the context's own threshold isn't used: it drops those.
+    if (R->getHotness().getValueOr(HotnessThreshold) >= HotnessThreshold) {
+      auto *P = const_cast<DiagnosticInfoOptimizationBase *>(R);
+      Out << P;
+    }
+    bool Wanted;
+    switch (R->getKind()) {
+    case DK_OptimizationRemarkAnalysis:
+    case DK_OptimizationRemarkAnalysisFPCommute:
+    case DK_OptimizationRemarkAnalysisAliasing:
+    case DK_MachineOptimizationRemarkAnalysis:
+      Wanted = DiagnosticHandler::isAnalysisRemarkEnabled(R->getPassName());
+      break;
+    case DK_OptimizationRemarkMissed:
+    case DK_MachineOptimizationRemarkMissed:
+      Wanted = DiagnosticHandler::isMissedOptRemarkEnabled(R->getPassName());
+      break;
+    default:
+      Wanted = DiagnosticHandler::isPassedOptRemarkEnabled(R->getPassName());
+      break;
+    }
+    if (Wanted)
+      DiagnosticHandler::handleDiagnostics(DI);
+    return true;
+  }
+
+  bool isAnalysisRemarkEnabled(StringRef PassName) const override {
+    return streams(PassName) ||
+           DiagnosticHandler::isAnalysisRemarkEnabled(PassName);
+  }
+  bool isMissedOptRemarkEnabled(StringRef PassName) const override {
+    return streams(PassName) ||
+           DiagnosticHandler::isMissedOptRemarkEnabled(PassName);
+  }
+  bool isPassedOptRemarkEnabled(StringRef PassName) const override {
+    return streams(PassName) ||
+           DiagnosticHandler::isPassedOptRemarkEnabled(PassName);
+  }
+  bool isAnyRemarkEnabled() const override { return true; }
+};
+
+} // namespace
+
+// Streams the optimization remarks emitted in `C` to a YAML file at `Path`,
+// in the format of `-fsave-optimization-record`, until the context is
+// disposed or `LLVMRustContextStopRemarks` is called. Only remarks of passes
+// matching the regex `PassFilter` (all of them if it's null) are written.
+//
+// If `WithHotness` is set, remarks carry the profile count of their code and
+// those below `HotnessThreshold` are dropped. That needs profile data, i.e.
+// PGO, and remarks about code without a count are kept.
+extern "C" bool LLVMRustContextStreamRemarks(LLVMContextRef C, const char *Path,
+                                             const char *PassFilter,
+                                             bool WithHotness,
+                                             uint64_t HotnessThreshold) {
+  LLVMContext &Ctx = *unwrap(C);
+  Regex Filter(PassFilter ? PassFilter : ".*");
+  std::string Error;
+  if (!Filter.isValid(Error)) {
+    LLVMRustSetLastError(Error.c_str());
+    return false;
+  }
+
+  std::error_code EC;
+  auto File = llvm::make_unique<ToolOutputFile>(Path, EC, sys::fs::F_None);
+  if (EC) {
+    LLVMRustSetLastError(EC.message().c_str());
+    return false;
+  }
+
+  std::unique_ptr<DiagnosticHandler> Prev = Ctx.getDiagnosticHandler();
+  auto Handler = llvm::make_unique<RemarkStreamHandler>(
+      std::move(File), std::move(Filter), WithHotness ? HotnessThreshold : 0);
+  Handler->DiagHandlerCallback = Prev->DiagHandlerCallback;
+  Handler->DiagnosticContext = Prev->DiagnosticContext;
+  Ctx.setDiagnosticHandler(std::move(Handler));
+  Ctx.setDiagnosticsHotnessRequested(WithHotness);
+  return true;
+}
+
+// Stops streaming remarks started by `LLVMRustContextStreamRemarks`, and
+// closes the file.
+extern "C" void LLVMRustContextStopRemarks(LLVMContextRef C) {
+  LLVMContext &Ctx = *unwrap(C);
+  std::unique_ptr<DiagnosticHandler> Prev = Ctx.getDiagnosticHandler();
+  auto Handler = llvm::make_unique<DiagnosticHandler>();
+  Handler->DiagHandlerCallback = Prev->DiagHandlerCallback;
+  Handler->DiagnosticContext = Prev->DiagnosticContext;
+  Ctx.setDiagnosticHandler(std::move(Handler));
+  Ctx.setDiagnosticsHotnessRequested(false);
+}
+
 extern "C" void
 LLVMRustUnpackInlineAsmDiagnostic(LLVMDiagnosticInfoRef DI, unsigned *CookieOut,
                                   LLVMTwineRef *MessageOut,
@@ -1268,6 +2124,108 @@ extern "C" LLVMValueRef LLVMRustBuildMemMove(LLVMBuilderRef B,
 #endif
 }
 
+extern "C" LLVMValueRef LLVMRustBuildMemSet(LLVMBuilderRef B,
+                                            LLVMValueRef Dst, unsigned DstAlign,
+                                            LLVMValueRef Val,
+                                            LLVMValueRef Size, bool IsVolatile) {
+  return wrap(unwrap(B)->CreateMemSet(
+      unwrap(Dst), unwrap(Val), unwrap(Size), DstAlign, IsVolatile));
+}
+
+// The element-wise unordered atomic variants of the above, where each
+// `ElementSize` bytes are copied or set by a single unordered atomic access.
+// `Size` must be a multiple of `ElementSize`, and both alignments at least
+// `ElementSize`.
+extern "C" LLVMValueRef
+LLVMRustBuildElementAtomicMemCpy(LLVMBuilderRef B,
+                                 LLVMValueRef Dst, unsigned DstAlign,
+                                 LLVMValueRef Src, unsigned SrcAlign,
+                                 LLVMValueRef Size, uint32_t ElementSize) {
+  return wrap(unwrap(B)->CreateElementUnorderedAtomicMemCpy(
+      unwrap(Dst), DstAlign, unwrap(Src), SrcAlign, unwrap(Size),
+      ElementSize));
+}
+
+extern "C" LLVMValueRef
+LLVMRustBuildElementAtomicMemMove(LLVMBuilderRef B,
+                                  LLVMValueRef Dst, unsigned DstAlign,
+                                  LLVMValueRef Src, unsigned SrcAlign,
+                                  LLVMValueRef Size, uint32_t ElementSize) {
+#if LLVM_VERSION_GE(7, 0)
+  return wrap(unwrap(B)->CreateElementUnorderedAtomicMemMove(
+      unwrap(Dst), DstAlign, unwrap(Src), SrcAlign, unwrap(Size),
+      ElementSize));
+#else
+  report_fatal_error("element atomic memmove requires LLVM 7.");
+#endif
+}
+
+extern "C" LLVMValueRef
+LLVMRustBuildElementAtomicMemSet(LLVMBuilderRef B,
+                                 LLVMValueRef Dst, unsigned DstAlign,
+                                 LLVMValueRef Val,
+                                 LLVMValueRef Size, uint32_t ElementSize) {
+#if LLVM_VERSION_GE(7, 0)
+  return wrap(unwrap(B)->CreateElementUnorderedAtomicMemSet(
+      unwrap(Dst), unwrap(Val), unwrap(Size), DstAlign, ElementSize));
+#else
+  report_fatal_error("element atomic memset requires LLVM 7.");
+#endif
+}
+
+// Copies `Size` bytes with loads and stores emitted right here instead of a
+// call to `llvm.memcpy`, for small copies of a size known at compile time
+// (LLVM 8 has no `llvm.memcpy.inline` yet). The copy is done in chunks of
+// up to 8 bytes, each as aligned as `DstAlign`/`SrcAlign` allow at its
+// offset, so that the backend can merge neighbouring chunks into vector
+// moves. Larger copies are better left to `llvm.memcpy`, so anything above
+// `MaxInlineMemCpySize` falls back to that.
+//
+// Returns the last store, or null if `Size` is zero.
+static const uint64_t MaxInlineMemCpySize = 128;
+
+extern "C" LLVMValueRef
+LLVMRustBuildMemCpyInline(LLVMBuilderRef B,
+                          LLVMValueRef Dst, unsigned DstAlign,
+                          LLVMValueRef Src, unsigned SrcAlign,
+                          uint64_t Size, bool IsVolatile) {
+  IRBuilder<> &Builder = *unwrap(B);
+  if (Size > MaxInlineMemCpySize)
+    return LLVMRustBuildMemCpy(B, Dst, DstAlign, Src, SrcAlign,
+                               wrap(Builder.getInt64(Size)), IsVolatile);
+
+  LLVMContext &Ctx = Builder.getContext();
+  Value *DstPtr = unwrap(Dst);
+  Value *SrcPtr = unwrap(Src);
+  unsigned DstAS = DstPtr->getType()->getPointerAddressSpace();
+  unsigned SrcAS = SrcPtr->getType()->getPointerAddressSpace();
+  Value *DstBytes =
+      Builder.CreatePointerCast(DstPtr, Type::getInt8PtrTy(Ctx, DstAS));
+  Value *SrcBytes =
+      Builder.CreatePointerCast(SrcPtr, Type::getInt8PtrTy(Ctx, SrcAS));
+
+  Value *Last = nullptr;
+  for (uint64_t Offset = 0; Offset < Size;) {
+    uint64_t Chunk = 8;
+    while (Chunk > Size - Offset)
+      Chunk /= 2;
+    Type *ChunkTy = Type::getIntNTy(Ctx, Chunk * 8);
+    Value *From = Builder.CreatePointerCast(
+        Builder.CreateConstInBoundsGEP1_64(SrcBytes, Offset),
+        ChunkTy->getPointerTo(SrcAS));
+    Value *To = Builder.CreatePointerCast(
+        Builder.CreateConstInBoundsGEP1_64(DstBytes, Offset),
+        ChunkTy->getPointerTo(DstAS));
+    LoadInst *Load = Builder.CreateLoad(From, IsVolatile);
+    Load->setAlignment(MinAlign(SrcAlign ? SrcAlign : 1, Offset));
+    StoreInst *Store = Builder.CreateStore(Load, To, IsVolatile);
+    Store->setAlignment(MinAlign(DstAlign ? DstAlign : 1, Offset));
+    Last = Store;
+    Offset += Chunk;
+  }
+  return wrap(Last);
+}
+
 extern "C" LLVMValueRef
 LLVMRustBuildInvoke(LLVMBuilderRef B, LLVMValueRef Fn, LLVMValueRef *Args,
                     unsigned NumArgs, LLVMBasicBlockRef Then,
@@ -1475,10 +2433,227 @@ LLVMRustModuleBufferLen(const LLVMRustModuleBuffer *Buffer) {
   return Buffer->data.length();
 }
 
+// The raw measurements behind `LLVMRustModuleCost`, exposed separately so
+// that rustc can correlate them with the optimization time it actually
+// measures for each module and weigh them differently.
+struct LLVMRustModuleCostInfo {
+  uint64_t Functions;
+  uint64_t BasicBlocks;
+  uint64_t Instructions;
+  uint64_t Calls;
+  uint64_t Loops;
+};
+
+// Only function definitions are counted, declarations don't cost anything to
+// optimize or codegen, and calls to debug info intrinsics aren't counted as
+// calls as they don't feed the inliner. Loops are estimated by the number of
+// branches to a block at or before the branching one in layout order. That
+// avoids building dominator trees for every function, but it's only a
+// heuristic: a loop may have several such back branches and a block laid out
+// before its predecessor needn't be part of a loop at all.
+extern "C" void
+LLVMRustGetModuleCostInfo(LLVMModuleRef M, LLVMRustModuleCostInfo *Info) {
+  *Info = LLVMRustModuleCostInfo();
+  DenseMap<const BasicBlock *, unsigned> Order;
+  for (const Function &F : *unwrap(M)) {
+    if (F.isDeclaration())
+      continue;
+    Info->Functions++;
+
+    Order.clear();
+    unsigned NumBlocks = 0;
+    for (const BasicBlock &BB : F)
+      Order[&BB] = NumBlocks++;
+
+    for (const BasicBlock &BB : F) {
+      Info->BasicBlocks++;
+      Info->Instructions += BB.size();
+      for (const Instruction &I : BB)
+        if ((isa<CallInst>(I) && !isa<DbgInfoIntrinsic>(I)) ||
+            isa<InvokeInst>(I))
+          Info->Calls++;
+      unsigned Index = Order.lookup(&BB);
+      for (const BasicBlock *Succ : successors(&BB))
+        if (Order.lookup(Succ) <= Index)
+          Info->Loops++;
+    }
+  }
+}
+
+// An estimate of how long it takes LLVM to optimize and codegen a module,
+// used to schedule the most expensive modules first. The unit is roughly one
+// instruction, with extra weight on the things most passes scale with: calls
+// feed the inliner and blocks the CFG passes, and loops go through the whole
+// loop pipeline (and may get unrolled or vectorized).
 extern "C" uint64_t
 LLVMRustModuleCost(LLVMModuleRef M) {
-  auto f = unwrap(M)->functions();
-  return std::distance(std::begin(f), std::end(f));
+  LLVMRustModuleCostInfo Info;
+  LLVMRustGetModuleCostInfo(M, &Info);
+  return Info.Instructions + 4 * Info.Calls + 2 * Info.BasicBlocks +
+         32 * Info.Loops + 16 * Info.Functions;
+}
+
+// Turns the definition `Fn` into a function which calls the best of
+// `NumVersions + 1` versions of it for the CPU it ends up running on, and
+// returns that function.
+//
+// Version `I` is a clone of `Fn` which is additionally compiled with the
+// target features `Features[I]` (like "+avx2,+fma"), and is picked if calling
+// `Conditions[I]`, a function returning a non-zero integer if the CPU has
+// those features, does. Conditions are tried in order and the original body
+// is kept as the fallback, so the most specific versions have to go first.
+//
+// If `UseIFunc` is set the dispatch is an ifunc resolved by the dynamic
+// loader, which is only supported for ELF. Otherwise it's a function which
+// resolves the version on its first call, caches it and tail calls it, which
+// works everywhere but can't forward variadic arguments.
+//
+// All uses of `Fn` are replaced by the returned function, which takes over
+// its name and linkage, so this should be called once the module is
+// complete.
+extern "C" LLVMValueRef
+LLVMRustMultiversionFunction(LLVMValueRef Fn, const char **Features,
+                             LLVMValueRef *Conditions, size_t NumVersions,
+                             bool UseIFunc) {
+  // Aliases and variables can't be cloned, and a condition which isn't a
+  // function returning an integer can't be called by the resolver, so all of
+  // that is rejected before anything is changed.
+  Function *F = dyn_cast<Function>(unwrap(Fn));
+  if (!F) {
+    LLVMRustSetLastError("only functions can be multiversioned");
+    return nullptr;
+  }
+  for (size_t I = 0; I < NumVersions; I++) {
+    Function *Cond = dyn_cast<Function>(unwrap(Conditions[I]));
+    if (!Cond || Cond->isVarArg() || Cond->arg_size() != 0 ||
+        !Cond->getReturnType()->isIntegerTy()) {
+      std::string Msg = "condition `" + unwrap(Conditions[I])->getName().str() +
+                        "` isn't a function taking no arguments and "
+                        "returning an integer";
+      LLVMRustSetLastError(Msg.c_str());
+      return nullptr;
+    }
+  }
+  Module &M = *F->getParent();
+  LLVMContext &Ctx = F->getContext();
+
+  if (F->isDeclaration()) {
+    LLVMRustSetLastError("can't multiversion a declaration");
+    return nullptr;
+  }
+  if (!UseIFunc && F->isVarArg()) {
+    LLVMRustSetLastError("variadic functions can only be multiversioned "
+                         "through an ifunc");
+    return nullptr;
+  }
+
+  std::string Name = F->getName().str();
+  GlobalValue::LinkageTypes Linkage = F->getLinkage();
+  GlobalValue::VisibilityTypes Visibility = F->getVisibility();
+  GlobalValue::DLLStorageClassTypes DLLStorage = F->getDLLStorageClass();
+  StringRef BaseFeatures =
+      F->getFnAttribute("target-features").getValueAsString();
+
+  std::vector<Function *> Versions;
+  for (size_t I = 0; I < NumVersions; I++) {
+    ValueToValueMapTy VMap;
+    Function *Clone = CloneFunction(F, VMap);
+    Clone->setName(Name + ".mv." + Twine(I));
+    Clone->setLinkage(GlobalValue::InternalLinkage);
+    Clone->setVisibility(GlobalValue::DefaultVisibility);
+    Clone->setComdat(nullptr);
+    std::string CloneFeatures = BaseFeatures.str();
+    if (!CloneFeatures.empty())
+      CloneFeatures += ",";
+    CloneFeatures += Features[I];
+    Clone->addFnAttr("target-features", CloneFeatures);
+    Versions.push_back(Clone);
+  }
+
+  F->setName(Name + ".mv.default");
+  F->setLinkage(GlobalValue::InternalLinkage);
+  F->setVisibility(GlobalValue::DefaultVisibility);
+  F->setDLLStorageClass(GlobalValue::DefaultStorageClass);
+  F->setComdat(nullptr);
+
+  // Returns the first version whose condition holds, or the original body.
+  ReturnInst *Fallback;
+  Function *Resolver = Function::Create(
+      FunctionType::get(F->getType(), false), GlobalValue::InternalLinkage,
+      Name + ".mv.resolver", &M);
+  {
+    IRBuilder<> B(BasicBlock::Create(Ctx, "entry", Resolver));
+    for (size_t I = 0; I < NumVersions; I++) {
+      Value *Cond = B.CreateCall(unwrap(Conditions[I]));
+      Cond = B.CreateICmpNE(Cond, Constant::getNullValue(Cond->getType()));
+      BasicBlock *Found = BasicBlock::Create(Ctx, "found", Resolver);
+      BasicBlock *Next = BasicBlock::Create(Ctx, "next", Resolver);
+      B.CreateCondBr(Cond, Found, Next);
+      B.SetInsertPoint(Found);
+      B.CreateRet(Versions[I]);
+      B.SetInsertPoint(Next);
+    }
+    Fallback = B.CreateRet(F);
+  }
+
+  GlobalValue *Dispatch;
+  if (UseIFunc) {
+    Dispatch = GlobalIFunc::create(F->getFunctionType(),
+                                   F->getType()->getAddressSpace(), Linkage,
+                                   Name, Resolver, &M);
+  } else {
+    Function *Dispatcher =
+        Function::Create(F->getFunctionType(), Linkage, Name, &M);
+    Dispatcher->copyAttributesFrom(F);
+    Dispatcher->setLinkage(Linkage);
+    Dispatcher->setComdat(nullptr);
+    Dispatcher->removeFnAttr("target-features");
+
+    GlobalVariable *Cache = new GlobalVariable(
+        M, F->getType(), false, GlobalValue::InternalLinkage,
+        ConstantPointerNull::get(F->getType()), Name + ".mv.cache");
+    unsigned Align = M.getDataLayout().getPointerABIAlignment(
+        F->getType()->getAddressSpace());
+
+    BasicBlock *Entry = BasicBlock::Create(Ctx, "entry", Dispatcher);
+    BasicBlock *Resolve = BasicBlock::Create(Ctx, "resolve", Dispatcher);
+    BasicBlock *Call = BasicBlock::Create(Ctx, "call", Dispatcher);
+    IRBuilder<> B(Entry);
+    LoadInst *Cached = B.CreateAlignedLoad(Cache, Align);
+    Cached->setAtomic(AtomicOrdering::Monotonic);
+    B.CreateCondBr(B.CreateIsNull(Cached), Resolve, Call);
+
+    B.SetInsertPoint(Resolve);
+    Value *Resolved = B.CreateCall(Resolver);
+    B.CreateAlignedStore(Resolved, Cache, Align)
+        ->setAtomic(AtomicOrdering::Monotonic);
+    B.CreateBr(Call);
+
+    B.SetInsertPoint(Call);
+    PHINode *Target = B.CreatePHI(F->getType(), 2);
+    Target->addIncoming(Cached, Entry);
+    Target->addIncoming(Resolved, Resolve);
+    std::vector<Value *> Args;
+    for (Argument &Arg : Dispatcher->args())
+      Args.push_back(&Arg);
+    CallInst *CI = B.CreateCall(Target, Args);
+    CI->setTailCall();
+    CI->setCallingConv(F->getCallingConv());
+    CI->setAttributes(F->getAttributes());
+    if (F->getReturnType()->isVoidTy())
+      B.CreateRetVoid();
+    else
+      B.CreateRet(CI);
+    Dispatch = Dispatcher;
+  }
+  Dispatch->setVisibility(Visibility);
+  Dispatch->setDLLStorageClass(DLLStorage);
+
+  // The resolver's fallback is the one use of `F` which has to stay, or the
+  // dispatch would resolve to itself.
+  F->replaceAllUsesWith(Dispatch);
+  Fallback->setOperand(0, F);
+  return wrap(Dispatch);
 }
 
 // Vector reductions:
@@ -1490,6 +2665,25 @@ extern "C" LLVMValueRef
 LLVMRustBuildVectorReduceFMul(LLVMBuilderRef B, LLVMValueRef Acc, LLVMValueRef Src) {
     return wrap(unwrap(B)->CreateFMulReduce(unwrap(Acc),unwrap(Src)));
 }
+// The reductions above are ordered (strictly sequential) unless the call is
+// allowed to reassociate, which these set up front along with any other
+// flags.
+extern "C" LLVMValueRef
+LLVMRustBuildVectorReduceFAddWithFlags(LLVMBuilderRef B, LLVMValueRef Acc,
+                                       LLVMValueRef Src,
+                                       LLVMRustFastMathFlags Flags) {
+  Instruction *I = unwrap(B)->CreateFAddReduce(unwrap(Acc), unwrap(Src));
+  I->copyFastMathFlags(fromRust(Flags));
+  return wrap(I);
+}
+extern "C" LLVMValueRef
+LLVMRustBuildVectorReduceFMulWithFlags(LLVMBuilderRef B, LLVMValueRef Acc,
+                                       LLVMValueRef Src,
+                                       LLVMRustFastMathFlags Flags) {
+  Instruction *I = unwrap(B)->CreateFMulReduce(unwrap(Acc), unwrap(Src));
+  I->copyFastMathFlags(fromRust(Flags));
+  return wrap(I);
+}
 extern "C" LLVMValueRef
 LLVMRustBuildVectorReduceAdd(LLVMBuilderRef B, LLVMValueRef Src) {
     return wrap(unwrap(B)->CreateAddReduce(unwrap(Src)));
@@ -1535,3 +2729,161 @@ extern "C" LLVMValueRef
 LLVMRustBuildMaxNum(LLVMBuilderRef B, LLVMValueRef LHS, LLVMValueRef RHS) {
     return wrap(unwrap(B)->CreateMaxNum(unwrap(LHS),unwrap(RHS)));
 }
+
+// Masked and gathered memory operations. `Mask` is a vector of i1 with one
+// element per lane and `PassThru` (which may be null for undef) supplies the
+// lanes which aren't loaded.
+extern "C" LLVMValueRef
+LLVMRustBuildMaskedLoad(LLVMBuilderRef B, LLVMValueRef Ptr, unsigned Align,
+                        LLVMValueRef Mask, LLVMValueRef PassThru) {
+  return wrap(unwrap(B)->CreateMaskedLoad(
+      unwrap(Ptr), Align, unwrap(Mask),
+      PassThru ? unwrap(PassThru) : nullptr));
+}
+
+extern "C" LLVMValueRef
+LLVMRustBuildMaskedStore(LLVMBuilderRef B, LLVMValueRef Val, LLVMValueRef Ptr,
+                         unsigned Align, LLVMValueRef Mask) {
+  return wrap(unwrap(B)->CreateMaskedStore(unwrap(Val), unwrap(Ptr), Align,
+                                           unwrap(Mask)));
+}
+
+// `Ptrs` is a vector of pointers, one per lane.
+extern "C" LLVMValueRef
+LLVMRustBuildMaskedGather(LLVMBuilderRef B, LLVMValueRef Ptrs, unsigned Align,
+                          LLVMValueRef Mask, LLVMValueRef PassThru) {
+  return wrap(unwrap(B)->CreateMaskedGather(
+      unwrap(Ptrs), Align, unwrap(Mask),
+      PassThru ? unwrap(PassThru) : nullptr));
+}
+
+extern "C" LLVMValueRef
+LLVMRustBuildMaskedScatter(LLVMBuilderRef B, LLVMValueRef Val,
+                           LLVMValueRef Ptrs, unsigned Align,
+                           LLVMValueRef Mask) {
+  return wrap(unwrap(B)->CreateMaskedScatter(unwrap(Val), unwrap(Ptrs), Align,
+                                             unwrap(Mask)));
+}
+
+enum class LLVMRustSaturatingOp {
+  SAdd,
+  UAdd,
+  SSub,
+  USub,
+};
+
+// Integer addition and subtraction which clamp to the range of the type
+// instead of wrapping, on scalars or vectors. LLVM 8 has intrinsics for
+// these that backends lower to instructions like `paddsb`/`uqadd`; before
+// that the equivalent compare and select sequence is emitted, which
+// instruction selection recognizes for the common cases.
+extern "C" LLVMValueRef
+LLVMRustBuildSaturatingOp(LLVMBuilderRef B, LLVMRustSaturatingOp Op,
+                          LLVMValueRef LHS, LLVMValueRef RHS) {
+  IRBuilder<> &Builder = *unwrap(B);
+  Value *L = unwrap(LHS);
+  Value *R = unwrap(RHS);
+#if LLVM_VERSION_GE(8, 0)
+  Intrinsic::ID ID;
+  switch (Op) {
+  case LLVMRustSaturatingOp::SAdd:
+    ID = Intrinsic::sadd_sat;
+    break;
+  case LLVMRustSaturatingOp::UAdd:
+    ID = Intrinsic::uadd_sat;
+    break;
+  case LLVMRustSaturatingOp::SSub:
+    ID = Intrinsic::ssub_sat;
+    break;
+  case LLVMRustSaturatingOp::USub:
+    ID = Intrinsic::usub_sat;
+    break;
+  default:
+    report_fatal_error("bad SaturatingOp.");
+  }
+  Module *M = Builder.GetInsertBlock()->getModule();
+  Function *F = Intrinsic::getDeclaration(M, ID, L->getType());
+  return wrap(Builder.CreateCall(F, {L, R}));
+#else
+  Type *Ty = L->getType();
+  unsigned Bits = Ty->getScalarSizeInBits();
+  switch (Op) {
+  case LLVMRustSaturatingOp::UAdd: {
+    Value *Sum = Builder.CreateAdd(L, R);
+    return wrap(Builder.CreateSelect(Builder.CreateICmpULT(Sum, L),
+                                     Constant::getAllOnesValue(Ty), Sum));
+  }
+  case LLVMRustSaturatingOp::USub:
+    return wrap(Builder.CreateSelect(Builder.CreateICmpULT(L, R),
+                                     Constant::getNullValue(Ty),
+                                     Builder.CreateSub(L, R)));
+  case LLVMRustSaturatingOp::SAdd:
+  case LLVMRustSaturatingOp::SSub: {
+    bool IsAdd = Op == LLVMRustSaturatingOp::SAdd;
+    Value *Res = IsAdd ? Builder.CreateAdd(L, R) : Builder.CreateSub(L, R);
+    // The result overflowed if its sign differs from that of `L` and, for
+    // addition, also from that of `R` (for subtraction, `R`'s sign differs
+    // from `L`'s).
+    Value *Flip = Builder.CreateXor(L, Res);
+    Value *Other = IsAdd ? Builder.CreateXor(R, Res) : Builder.CreateXor(L, R);
+    Value *Overflow = Builder.CreateICmpSLT(Builder.CreateAnd(Flip, Other),
+                                           Constant::getNullValue(Ty));
+    Value *Clamped = Builder.CreateSelect(
+        Builder.CreateICmpSLT(L, Constant::getNullValue(Ty)),
+        ConstantInt::get(Ty, APInt::getSignedMinValue(Bits)),
+        ConstantInt::get(Ty, APInt::getSignedMaxValue(Bits)));
+    return wrap(Builder.CreateSelect(Overflow, Clamped, Res));
+  }
+  default:
+    report_fatal_error("bad SaturatingOp.");
+  }
+#endif
+}
+
+// Funnel shifts: the concatenation of `Hi` and `Lo` shifted left (or right)
+// by `Amt` modulo the bit width, keeping the high (or low) half. With the
+// same value for both halves this is a rotate.
+extern "C" LLVMValueRef
+LLVMRustBuildFunnelShift(LLVMBuilderRef B, LLVMValueRef Hi, LLVMValueRef Lo,
+                         LLVMValueRef Amt, bool IsLeft) {
+  IRBuilder<> &Builder = *unwrap(B);
+  Value *H = unwrap(Hi);
+  Value *L = unwrap(Lo);
+  Value *A = unwrap(Amt);
+#if LLVM_VERSION_GE(7, 0)
+  Module *M = Builder.GetInsertBlock()->getModule();
+  Function *F = Intrinsic::getDeclaration(
+      M, IsLeft ? Intrinsic::fshl : Intrinsic::fshr, H->getType());
+  return wrap(Builder.CreateCall(F, {H, L, A}));
+#else
+  Type *Ty = H->getType();
+  Constant *Width = ConstantInt::get(Ty, Ty->getScalarSizeInBits());
+  Value *Shift = Builder.CreateURem(A, Width);
+  Value *Inverse = Builder.CreateSub(Width, Shift);
+  Value *Res = IsLeft
+      ? Builder.CreateOr(Builder.CreateShl(H, Shift),
+                         Builder.CreateLShr(L, Inverse))
+      : Builder.CreateOr(Builder.CreateShl(H, Inverse),
+                         Builder.CreateLShr(L, Shift));
+  // Shifting by the full width is poison, and a shift by zero returns one
+  // of the halves unchanged.
+  Value *IsZero = Builder.CreateICmpEQ(Shift, Constant::getNullValue(Ty));
+  return wrap(Builder.CreateSelect(IsZero, IsLeft ? H : L, Res));
+#endif
+}
+
+// A shuffle whose mask is given as `Len` lane indices rather than as a
+// constant vector, which saves building the mask one constant at a time. A
+// negative index leaves that lane undefined.
+extern "C" LLVMValueRef
+LLVMRustBuildShuffleVector(LLVMBuilderRef B, LLVMValueRef V1, LLVMValueRef V2,
+                           const int32_t *Mask, size_t Len) {
+  LLVMContext &Ctx = unwrap(B)->getContext();
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  SmallVector<Constant *, 16> Elements;
+  for (size_t I = 0; I < Len; I++)
+    Elements.push_back(Mask[I] < 0 ? UndefValue::get(Int32Ty)
+                                   : ConstantInt::get(Int32Ty, Mask[I]));
+  return wrap(unwrap(B)->CreateShuffleVector(unwrap(V1), unwrap(V2),
+                                             ConstantVector::get(Elements)));
+}
@@ -0,0 +1,338 @@
+// A standalone benchmark for the wrappers in this directory, which replays
+// inputs recorded from real builds against them directly, without rustc in
+// the way. It isn't built by default: set `RUSTC_LLVM_BENCH` when building
+// `rustc_llvm`, e.g.
+//
+//     RUSTC_LLVM_BENCH=1 ./x.py build src/librustc_llvm
+//
+// and `rustllvm-bench` ends up in the `rustc_llvm` build script's output
+// directory, next to `librustllvm.a`. Usage:
+//
+//     rustllvm-bench [-n REPEAT] [-s SIZES] BENCH LIST [SYMBOLS]
+//
+// `LIST` is a file with one input path per line: bitcode files for the
+// `thinlto`, `link` and `serialize` benchmarks and archive members for
+// `archive`. These are easy to record with `-C save-temps` (or by keeping
+// the `.o` files a build passes to the archiver). `SYMBOLS` optionally lists
+// the symbols preserved by ThinLTO, one per line (the exported symbols of
+// the crate being benchmarked).
+//
+//   - `thinlto` times `LLVMRustCreateThinLTOData` over all modules.
+//   - `link` times linking all modules into one with `LLVMRustLinkerAdd`.
+//   - `serialize` parses each module up front and times
+//     `LLVMRustModuleBufferCreate` on all of them.
+//   - `archive` times `LLVMRustWriteArchive` writing all members into a GNU
+//     archive in the temporary directory.
+//
+// `SIZES` is a comma separated list of input counts (default: the whole
+// list), each of which is run on the first that many inputs. Each size runs
+// in a child process of its own, which reads only its own inputs, and
+// reports one line of tab separated fields: benchmark, inputs, input
+// bytes, best wall time out of `REPEAT` runs, throughput and peak RSS. The
+// peak RSS leaves out what the child started with, so it's what reading and
+// processing that many inputs took.
+
+#include "rustllvm.h"
+
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <fstream>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+// Only rustc can create the strings the wrappers write to, and none of the
+// benchmarked ones do, but the wrappers need the symbol to link.
+extern "C" void LLVMRustStringWriteImpl(RustStringRef, const char *, size_t) {
+  report_fatal_error("rustllvm-bench: unexpected write to a Rust string");
+}
+
+// The parts of the rustllvm interface used here, declared the way the Rust
+// side sees them.
+struct LLVMRustThinLTOData;
+struct LLVMRustThinLTOImportOptions;
+struct LLVMRustModuleBuffer;
+struct RustLinker;
+struct RustArchiveMember;
+
+struct LLVMRustThinLTOModule {
+  const char *identifier;
+  const char *data;
+  size_t len;
+};
+
+enum class LLVMRustArchiveKind {
+  Other,
+  GNU,
+  BSD,
+  COFF,
+};
+
+struct LLVMRustErrorInfo {
+  LLVMRustErrorKind Kind;
+  const char *Module;
+  size_t ModuleLen;
+  const char *Message;
+  size_t MessageLen;
+};
+
+extern "C" {
+LLVMRustThinLTOData *
+LLVMRustCreateThinLTOData(LLVMRustThinLTOModule *modules, int num_modules,
+                          const char **preserved_symbols, int num_symbols,
+                          const LLVMRustThinLTOImportOptions *Options);
+void LLVMRustFreeThinLTOData(LLVMRustThinLTOData *Data);
+RustLinker *LLVMRustLinkerNew(LLVMModuleRef DstRef);
+bool LLVMRustLinkerAdd(RustLinker *L, char *BC, size_t Len);
+void LLVMRustLinkerFree(RustLinker *L);
+LLVMRustModuleBuffer *LLVMRustModuleBufferCreate(LLVMModuleRef M);
+void LLVMRustModuleBufferFree(LLVMRustModuleBuffer *Buffer);
+RustArchiveMember *LLVMRustArchiveMemberNewFromBuffer(char *Name,
+                                                      const char *Data,
+                                                      size_t Len);
+void LLVMRustArchiveMemberFree(RustArchiveMember *Member);
+LLVMRustResult LLVMRustWriteArchive(char *Dst, size_t NumMembers,
+                                    RustArchiveMember *const *NewMembers,
+                                    bool WriteSymbtab,
+                                    LLVMRustArchiveKind RustKind);
+size_t LLVMRustGetErrorCount();
+bool LLVMRustGetError(size_t Index, LLVMRustErrorInfo *Info);
+}
+
+namespace {
+
+struct Input {
+  std::string Path;
+  std::unique_ptr<MemoryBuffer> Buffer;
+};
+
+typedef bool (*BenchFn)(std::vector<Input> &Inputs,
+                        std::vector<const char *> &Symbols);
+
+[[noreturn]] void fail(const Twine &Message) {
+  errs() << "rustllvm-bench: " << Message << "\n";
+  for (size_t I = 0, N = LLVMRustGetErrorCount(); I < N; I++) {
+    LLVMRustErrorInfo Info;
+    if (LLVMRustGetError(I, &Info))
+      errs() << "  " << StringRef(Info.Message, Info.MessageLen) << "\n";
+  }
+  exit(1);
+}
+
+bool benchThinLTO(std::vector<Input> &Inputs,
+                  std::vector<const char *> &Symbols) {
+  std::vector<LLVMRustThinLTOModule> Modules;
+  for (Input &In : Inputs)
+    Modules.push_back({In.Path.c_str(), In.Buffer->getBufferStart(),
+                       In.Buffer->getBufferSize()});
+  LLVMRustThinLTOData *Data = LLVMRustCreateThinLTOData(
+      Modules.data(), Modules.size(), Symbols.data(), Symbols.size(),
+      nullptr);
+  if (!Data)
+    return false;
+  LLVMRustFreeThinLTOData(Data);
+  return true;
+}
+
+bool benchLink(std::vector<Input> &Inputs, std::vector<const char *> &) {
+  LLVMContext Ctx;
+  Module *Dst = new Module("bench", Ctx);
+  RustLinker *L = LLVMRustLinkerNew(wrap(Dst));
+  bool Ok = true;
+  for (Input &In : Inputs) {
+    Ok = LLVMRustLinkerAdd(L, const_cast<char *>(In.Buffer->getBufferStart()),
+                           In.Buffer->getBufferSize());
+    if (!Ok)
+      break;
+  }
+  LLVMRustLinkerFree(L);
+  delete Dst;
+  return Ok;
+}
+
+// Parsing isn't part of what's measured, see `runSize`.
+std::vector<std::unique_ptr<Module>> ParsedModules;
+
+bool benchSerialize(std::vector<Input> &, std::vector<const char *> &) {
+  for (auto &M : ParsedModules)
+    LLVMRustModuleBufferFree(LLVMRustModuleBufferCreate(wrap(M.get())));
+  return true;
+}
+
+bool benchArchive(std::vector<Input> &Inputs, std::vector<const char *> &) {
+  std::vector<std::string> Names;
+  std::vector<RustArchiveMember *> Members;
+  for (Input &In : Inputs)
+    Names.push_back(sys::path::filename(In.Path).str());
+  for (size_t I = 0; I < Inputs.size(); I++)
+    Members.push_back(LLVMRustArchiveMemberNewFromBuffer(
+        &Names[I][0], Inputs[I].Buffer->getBufferStart(),
+        Inputs[I].Buffer->getBufferSize()));
+
+  SmallString<128> Path;
+  sys::path::system_temp_directory(true, Path);
+  sys::path::append(Path, "rustllvm-bench-" + Twine(getpid()) + ".a");
+  LLVMRustResult Result =
+      LLVMRustWriteArchive(&Path[0], Members.size(), Members.data(),
+                           /* WriteSymbtab = */ true, LLVMRustArchiveKind::GNU);
+  sys::fs::remove(Path);
+  for (RustArchiveMember *Member : Members)
+    LLVMRustArchiveMemberFree(Member);
+  return Result == LLVMRustResult::Success;
+}
+
+std::vector<std::string> readLines(const char *Path) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> BufOr = MemoryBuffer::getFile(Path);
+  if (!BufOr)
+    fail(Twine(Path) + ": " + BufOr.getError().message());
+  SmallVector<StringRef, 64> Lines;
+  BufOr.get()->getBuffer().split(Lines, '\n', -1, false);
+  std::vector<std::string> Result;
+  for (StringRef Line : Lines)
+    if (!Line.trim().empty())
+      Result.push_back(Line.trim().str());
+  return Result;
+}
+
+// The resident set of this process in KiB, or 0 if it can't be read.
+uint64_t residentKiB() {
+  std::ifstream Statm("/proc/self/statm");
+  uint64_t Size = 0, Resident = 0;
+  if (!(Statm >> Size >> Resident))
+    return 0;
+  return Resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Runs one size in a child process and prints its line.
+void runSize(const char *Name, BenchFn Fn, std::vector<std::string> &Paths,
+             std::vector<const char *> &Symbols, size_t Size,
+             unsigned Repeat) {
+  pid_t Pid = fork();
+  if (Pid < 0)
+    fail("fork failed");
+  if (Pid == 0) {
+    // The child starts out with the parent's resident pages, which are
+    // taken out of its peak again below.
+    uint64_t Baseline = residentKiB();
+
+    std::vector<Input> Inputs;
+    uint64_t Bytes = 0;
+    for (size_t I = 0; I < Size; I++) {
+      ErrorOr<std::unique_ptr<MemoryBuffer>> BufOr =
+          MemoryBuffer::getFile(Paths[I], -1, false);
+      if (!BufOr)
+        fail(Paths[I] + ": " + BufOr.getError().message());
+      Bytes += BufOr.get()->getBufferSize();
+      Inputs.push_back({Paths[I], std::move(BufOr.get())});
+    }
+
+    LLVMContext Ctx;
+    if (Fn == benchSerialize) {
+      for (Input &In : Inputs) {
+        Expected<std::unique_ptr<Module>> MOrErr =
+            parseBitcodeFile(In.Buffer->getMemBufferRef(), Ctx);
+        if (!MOrErr)
+          fail(In.Path + ": " + toString(MOrErr.takeError()));
+        ParsedModules.push_back(std::move(*MOrErr));
+      }
+    }
+
+    double Best = 0;
+    for (unsigned R = 0; R < Repeat; R++) {
+      auto Start = std::chrono::steady_clock::now();
+      if (!Fn(Inputs, Symbols))
+        fail(Twine(Name) + " failed");
+      std::chrono::duration<double> Elapsed =
+          std::chrono::steady_clock::now() - Start;
+      if (R == 0 || Elapsed.count() < Best)
+        Best = Elapsed.count();
+    }
+    // `ru_maxrss` is in KiB on Linux.
+    struct rusage Usage;
+    getrusage(RUSAGE_SELF, &Usage);
+    uint64_t Peak = uint64_t(Usage.ru_maxrss) > Baseline
+                        ? Usage.ru_maxrss - Baseline
+                        : 0;
+    outs() << Name << "\t" << Size << "\t" << Bytes << "\t"
+           << format("%.6f", Best) << "s\t"
+           << format("%.1f", Bytes / Best / (1 << 20)) << "MiB/s\t"
+           << format("%.1f", Peak / 1024.0) << "MiB\n";
+    outs().flush();
+    ParsedModules.clear();
+    _exit(0);
+  }
+
+  int Status;
+  if (waitpid(Pid, &Status, 0) != Pid || !WIFEXITED(Status) ||
+      WEXITSTATUS(Status) != 0)
+    exit(1);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  unsigned Repeat = 3;
+  std::vector<size_t> Sizes;
+  int Arg = 1;
+  for (; Arg + 1 < argc && argv[Arg][0] == '-'; Arg += 2) {
+    if (StringRef(argv[Arg]) == "-n") {
+      Repeat = std::max(atoi(argv[Arg + 1]), 1);
+    } else if (StringRef(argv[Arg]) == "-s") {
+      SmallVector<StringRef, 8> Parts;
+      StringRef(argv[Arg + 1]).split(Parts, ',', -1, false);
+      for (StringRef Part : Parts) {
+        size_t Size;
+        if (Part.getAsInteger(10, Size) || Size == 0)
+          fail("bad size: " + Part);
+        Sizes.push_back(Size);
+      }
+    } else {
+      fail(Twine("unknown option ") + argv[Arg]);
+    }
+  }
+  if (argc - Arg < 2 || argc - Arg > 3)
+    fail("usage: rustllvm-bench [-n REPEAT] [-s SIZES] "
+         "thinlto|link|serialize|archive LIST [SYMBOLS]");
+
+  StringRef Name = argv[Arg];
+  BenchFn Fn = StringSwitch<BenchFn>(Name)
+                   .Case("thinlto", benchThinLTO)
+                   .Case("link", benchLink)
+                   .Case("serialize", benchSerialize)
+                   .Case("archive", benchArchive)
+                   .Default(nullptr);
+  if (!Fn)
+    fail("unknown benchmark " + Name);
+
+  InitializeAllTargetInfos();
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+
+  std::vector<std::string> Paths = readLines(argv[Arg + 1]);
+  std::vector<std::string> SymbolNames;
+  if (argc - Arg == 3)
+    SymbolNames = readLines(argv[Arg + 2]);
+  std::vector<const char *> Symbols;
+  for (const std::string &Symbol : SymbolNames)
+    Symbols.push_back(Symbol.c_str());
+
+  if (Sizes.empty())
+    Sizes.push_back(Paths.size());
+  for (size_t Size : Sizes) {
+    if (Size > Paths.size())
+      fail("size " + Twine(Size) + " is larger than the input list");
+    runSize(argv[Arg], Fn, Paths, Symbols, Size, Repeat);
+  }
+  return 0;
+}
@@ -55,10 +55,44 @@
 #include "llvm/IR/IRPrintingPasses.h"
 #include "llvm/Linker/Linker.h"
 
+// What went wrong, for errors reported with `LLVMRustReportError`.
+enum class LLVMRustErrorKind {
+  Other,
+  Io,
+  Bitcode,
+  Archive,
+  Link,
+  ThinLTO,
+};
+
+// Records an error for the calling thread. `Module` is the identifier of the
+// module the error is about, and may be null.
+extern "C" void LLVMRustReportError(LLVMRustErrorKind Kind, const char *Module,
+                                    const char *Message);
+
 extern "C" void LLVMRustSetLastError(const char *);
 
 enum class LLVMRustResult { Success, Failure };
 
+// How a file opened by `rustOpenFile` is going to be read. Anything but
+// `Default` maps the whole file into memory and passes the corresponding
+// hint to the kernel, where supported.
+enum class LLVMRustFileAccess {
+  Default,    // `MemoryBuffer::getFile`, which reads small files instead
+  Random,     // only parts will be read, so don't read ahead
+  Sequential, // read from front to back
+  WillNeed,   // all of it will be read soon, so start reading now
+};
+
+// Opens `Path` to be read as described by `Access`, see `LLVMRustFileAccess`.
+llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+rustOpenFile(const char *Path, LLVMRustFileAccess Access);
+
+// Passes `Access` as a hint for `Range`, which is part of `Buf`, to the
+// kernel. This does nothing unless `Buf` is mapped.
+void rustAdviseFileRange(const llvm::MemoryBuffer &Buf, llvm::StringRef Range,
+                         LLVMRustFileAccess Access);
+
 enum LLVMRustAttribute {
   AlwaysInline = 0,
   ByVal = 1,
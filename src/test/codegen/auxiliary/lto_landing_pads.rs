@@ -0,0 +1,27 @@
+// compile-flags: -C panic=unwind -O
+
+#![crate_type = "rlib"]
+
+pub struct Noisy(pub usize);
+
+impl Drop for Noisy {
+    fn drop(&mut self) {
+        println!("drop {}", self.0);
+    }
+}
+
+// The call to `step` may unwind, so it's an invoke with a landing pad that
+// drops `_guard`.
+#[inline(never)]
+pub fn run(n: usize) {
+    let _guard = Noisy(n);
+    step(n);
+}
+
+#[inline(never)]
+fn step(n: usize) {
+    if n > 100 {
+        panic!("too many");
+    }
+    println!("step {}", n);
+}
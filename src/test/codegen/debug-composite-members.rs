@@ -0,0 +1,31 @@
+// Checks that the members of composite types are created when debuginfo is
+// finalized, including those of types only reachable through another
+// composite's members, and that the type parameters are kept.
+
+// ignore-tidy-linelength
+
+// compile-flags: -g -C no-prepopulate-passes
+
+// CHECK-DAG: !DICompositeType(tag: DW_TAG_structure_type, name: "Outer<u8>",{{.*}}elements: [[OUTER:![0-9]+]],{{.*}}templateParams: [[PARAMS:![0-9]+]]
+// CHECK-DAG: [[OUTER]] = !{[[INNER_MEMBER:![0-9]+]], [[EXTRA_MEMBER:![0-9]+]]}
+// CHECK-DAG: [[INNER_MEMBER]] = !DIDerivedType(tag: DW_TAG_member, name: "inner",{{.*}}baseType: [[INNER:![0-9]+]]
+// CHECK-DAG: [[EXTRA_MEMBER]] = !DIDerivedType(tag: DW_TAG_member, name: "extra",
+// CHECK-DAG: [[INNER]] = !DICompositeType(tag: DW_TAG_structure_type, name: "Inner",{{.*}}elements: [[INNER_ELEMS:![0-9]+]]
+// CHECK-DAG: [[INNER_ELEMS]] = !{[[VALUE_MEMBER:![0-9]+]]}
+// CHECK-DAG: [[VALUE_MEMBER]] = !DIDerivedType(tag: DW_TAG_member, name: "value",
+// CHECK-DAG: [[PARAMS]] = !{[[PARAM:![0-9]+]]}
+// CHECK-DAG: [[PARAM]] = !DITemplateTypeParameter(name: "T",
+
+pub struct Inner {
+    value: u32,
+}
+
+pub struct Outer<T> {
+    inner: Inner,
+    extra: T,
+}
+
+pub fn main() {
+    let x = Outer { inner: Inner { value: 1 }, extra: 2u8 };
+    let _ = x.inner.value;
+}
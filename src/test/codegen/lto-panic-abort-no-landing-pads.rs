@@ -0,0 +1,18 @@
+// aux-build:lto_landing_pads.rs
+// compile-flags: -C lto -C panic=abort -O
+// no-prefer-dynamic
+// ignore-windows
+
+// The auxiliary crate and the standard library are built with unwinding, but
+// once they're linked into a `panic=abort` program with LTO nothing unwinds,
+// so every invoke is lowered to a call and no landing pads are left.
+
+extern crate lto_landing_pads;
+
+// CHECK-NOT: landingpad
+// CHECK-NOT: invoke
+// CHECK-NOT: cleanuppad
+
+fn main() {
+    lto_landing_pads::run(std::env::args().count());
+}
@@ -0,0 +1,17 @@
+// Without profile data only `#[cold]` functions are given a section prefix,
+// even though `opt-level=z` makes every function `minsize`.
+
+// compile-flags: -C opt-level=z -Z profile-section-prefixes
+
+#![crate_type = "lib"]
+
+// CHECK-LABEL: define void @cold_function()
+// CHECK-SAME: !section_prefix
+#[cold]
+#[no_mangle]
+pub fn cold_function() {}
+
+// CHECK-LABEL: define void @other_function()
+// CHECK-NOT: !section_prefix
+#[no_mangle]
+pub fn other_function() {}
@@ -0,0 +1,19 @@
+// Checks that a condition which isn't a function is rejected instead of
+// being called by the resolver.
+
+// only-x86_64
+// compile-flags: -Z multiversion=picked=+avx2@NOT_A_FUNCTION
+// error-pattern: condition `NOT_A_FUNCTION` isn't a function taking no arguments
+
+#[no_mangle]
+pub static NOT_A_FUNCTION: u32 = 1;
+
+#[no_mangle]
+#[inline(never)]
+pub fn picked(xs: &[u32]) -> u32 {
+    xs.iter().sum()
+}
+
+fn main() {
+    picked(&[1, 2, 3]);
+}
@@ -0,0 +1,7 @@
+extern crate xyzsys;
+
+fn main() {
+    unsafe {
+        println!("blub: {}", xyzsys::c_always_inlined() + xyzsys::c_never_inlined());
+    }
+}
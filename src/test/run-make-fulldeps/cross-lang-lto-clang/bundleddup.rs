@@ -0,0 +1,8 @@
+extern crate xyzdupsys;
+
+fn main() {
+    unsafe {
+        println!("blub: {}", xyzdupsys::c_always_inlined() + xyzdupsys::c_never_inlined() +
+                             xyzdupsys::c_other_always_inlined() + xyzdupsys::c_regular());
+    }
+}
@@ -0,0 +1,11 @@
+#include <stdint.h>
+
+uint32_t c_other_always_inlined() {
+    return 4321;
+}
+
+// Only called from the regular object `clib_regular.c`, which isn't part of
+// LTO, so this has to stay defined even though nothing in LTO refers to it.
+uint32_t c_other_for_regular() {
+    return 321;
+}
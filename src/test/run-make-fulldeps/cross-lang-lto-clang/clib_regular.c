@@ -0,0 +1,7 @@
+#include <stdint.h>
+
+uint32_t c_other_for_regular();
+
+uint32_t c_regular() {
+    return 54000 + c_other_for_regular();
+}
@@ -0,0 +1,9 @@
+#![crate_type = "rlib"]
+
+#[link(name = "xyzdup", kind = "static")]
+extern "C" {
+    pub fn c_always_inlined() -> u32;
+    pub fn c_never_inlined() -> u32;
+    pub fn c_other_always_inlined() -> u32;
+    pub fn c_regular() -> u32;
+}
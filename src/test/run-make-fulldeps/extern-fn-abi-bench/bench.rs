@@ -0,0 +1,307 @@
+// Measures the cost of a call for each of the aggregate shapes passed by
+// `rust_test_helpers.c`, see the Makefile.
+
+#![feature(test)]
+#![allow(unused_unsafe)]
+
+extern crate test;
+
+use std::collections::HashMap;
+use std::env;
+use std::fs;
+use std::io::Write;
+use std::time::Instant;
+use test::black_box;
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+#[repr(C)]
+pub struct TwoU8s {
+    one: u8,
+    two: u8,
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+#[repr(C)]
+pub struct TwoU16s {
+    one: u16,
+    two: u16,
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+#[repr(C)]
+pub struct TwoU32s {
+    one: u32,
+    two: u32,
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+#[repr(C)]
+pub struct TwoU64s {
+    one: u64,
+    two: u64,
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+#[repr(C)]
+pub struct TwoDoubles {
+    one: f64,
+    two: f64,
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+#[repr(C)]
+pub struct Quad {
+    a: u64,
+    b: u64,
+    c: u64,
+    d: u64,
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+#[repr(C)]
+pub struct Floats {
+    a: f64,
+    b: u8,
+    c: f64,
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+#[repr(C)]
+pub struct S {
+    x: u64,
+    y: u64,
+    z: u64,
+}
+
+#[derive(Clone, Copy)]
+#[repr(C)]
+pub struct LargeIntegerParts {
+    low_part: u32,
+    high_part: u32,
+}
+
+#[derive(Clone, Copy)]
+#[repr(C)]
+pub union LargeInteger {
+    parts: LargeIntegerParts,
+    quad_part: u64,
+}
+
+#[link(name = "rust_test_helpers", kind = "static")]
+extern {
+    fn rust_dbg_do_nothing();
+    fn rust_dbg_extern_identity_u8(u: u8) -> u8;
+    fn rust_dbg_extern_identity_u32(u: u32) -> u32;
+    fn rust_dbg_extern_identity_u64(u: u64) -> u64;
+    fn rust_dbg_extern_identity_double(u: f64) -> f64;
+    fn rust_dbg_extern_identity_TwoU8s(u: TwoU8s) -> TwoU8s;
+    fn rust_dbg_extern_identity_TwoU16s(u: TwoU16s) -> TwoU16s;
+    fn rust_dbg_extern_identity_TwoU32s(u: TwoU32s) -> TwoU32s;
+    fn rust_dbg_extern_identity_TwoU64s(u: TwoU64s) -> TwoU64s;
+    fn rust_dbg_extern_identity_TwoDoubles(u: TwoDoubles) -> TwoDoubles;
+    fn rust_dbg_abi_1(q: Quad) -> Quad;
+    fn rust_dbg_abi_2(f: Floats) -> Floats;
+    fn get_x(s: S) -> u64;
+    fn get_c_many_params(a: *const u8, b: *const u8, c: *const u8, d: *const u8,
+                         f: Quad) -> u64;
+    fn increment_all_parts(li: LargeInteger) -> LargeInteger;
+    fn rust_interesting_average(n: u64, ...) -> f64;
+}
+
+// The same functions as in `rust_test_helpers.c`, defined in Rust for each
+// ABI to compare the C ABI against.
+macro_rules! abi_variants {
+    ($($module:ident = $abi:tt,)*) => ($(
+        mod $module {
+            use super::*;
+
+            #[inline(never)]
+            pub extern $abi fn identity_two_u8s(u: TwoU8s) -> TwoU8s { u }
+
+            #[inline(never)]
+            pub extern $abi fn identity_two_u16s(u: TwoU16s) -> TwoU16s { u }
+
+            #[inline(never)]
+            pub extern $abi fn identity_two_u32s(u: TwoU32s) -> TwoU32s { u }
+
+            #[inline(never)]
+            pub extern $abi fn identity_two_u64s(u: TwoU64s) -> TwoU64s { u }
+
+            #[inline(never)]
+            pub extern $abi fn identity_two_doubles(u: TwoDoubles) -> TwoDoubles { u }
+
+            #[inline(never)]
+            pub extern $abi fn abi_1(q: Quad) -> Quad {
+                Quad { a: q.c + 1, b: q.d - 1, c: q.a + 1, d: q.b - 1 }
+            }
+
+            #[inline(never)]
+            pub extern $abi fn abi_2(f: Floats) -> Floats {
+                Floats { a: f.c + 1.0, b: 0xff, c: f.a - 1.0 }
+            }
+
+            #[inline(never)]
+            pub extern $abi fn get_x(s: S) -> u64 { s.x }
+        }
+    )*)
+}
+
+abi_variants! {
+    rust_abi = "Rust",
+}
+
+#[cfg(target_arch = "x86_64")]
+abi_variants! {
+    sysv64_abi = "sysv64",
+    win64_abi = "win64",
+}
+
+const ITERATIONS: u32 = 1_000_000;
+const RUNS: u32 = 5;
+
+struct Record {
+    shape: &'static str,
+    abi: &'static str,
+    nanos_per_call: f64,
+}
+
+// Checks that `f` computes the right thing at all, then records the fastest
+// of a few runs of calling it over and over.
+fn bench<A: Copy, R>(results: &mut Vec<Record>,
+                     shape: &'static str,
+                     abi: &'static str,
+                     arg: A,
+                     f: impl Fn(A) -> R,
+                     check: impl Fn(&R) -> bool) {
+    assert!(check(&f(arg)), "wrong result for {} through the {} ABI", shape, abi);
+    for _ in 0..ITERATIONS / 10 {
+        black_box(f(black_box(arg)));
+    }
+    let mut best = std::f64::MAX;
+    for _ in 0..RUNS {
+        let start = Instant::now();
+        for _ in 0..ITERATIONS {
+            black_box(f(black_box(arg)));
+        }
+        let elapsed = start.elapsed();
+        let nanos = elapsed.as_secs() as f64 * 1e9 + elapsed.subsec_nanos() as f64;
+        best = best.min(nanos / ITERATIONS as f64);
+    }
+    results.push(Record { shape, abi, nanos_per_call: best });
+}
+
+// Benchmarks a function defined in this crate. It's called through a pointer
+// that LLVM can't see through, so that it's neither inlined nor are its
+// arguments and results propagated across the call.
+macro_rules! bench_fn {
+    ($results:expr, $shape:expr, $abi:expr, $f:expr => $fty:ty, $arg:expr, $check:expr) => {{
+        let f = black_box($f as $fty);
+        bench($results, $shape, $abi, $arg, |a| f(a), $check)
+    }}
+}
+
+macro_rules! bench_variants {
+    ($results:expr, $module:ident, $abi:tt) => {{
+        let results = $results;
+        bench_fn!(results, "TwoU8s", $abi,
+                  $module::identity_two_u8s => extern $abi fn(TwoU8s) -> TwoU8s,
+                  TwoU8s { one: 10, two: 20 }, |r| r.two == 20);
+        bench_fn!(results, "TwoU16s", $abi,
+                  $module::identity_two_u16s => extern $abi fn(TwoU16s) -> TwoU16s,
+                  TwoU16s { one: 10, two: 20 }, |r| r.two == 20);
+        bench_fn!(results, "TwoU32s", $abi,
+                  $module::identity_two_u32s => extern $abi fn(TwoU32s) -> TwoU32s,
+                  TwoU32s { one: 10, two: 20 }, |r| r.two == 20);
+        bench_fn!(results, "TwoU64s", $abi,
+                  $module::identity_two_u64s => extern $abi fn(TwoU64s) -> TwoU64s,
+                  TwoU64s { one: 10, two: 20 }, |r| r.two == 20);
+        bench_fn!(results, "TwoDoubles", $abi,
+                  $module::identity_two_doubles => extern $abi fn(TwoDoubles) -> TwoDoubles,
+                  TwoDoubles { one: 10.0, two: 20.0 }, |r| r.two == 20.0);
+        bench_fn!(results, "quad", $abi,
+                  $module::abi_1 => extern $abi fn(Quad) -> Quad,
+                  Quad { a: 1, b: 2, c: 3, d: 4 }, |r| r.a == 4);
+        bench_fn!(results, "floats", $abi,
+                  $module::abi_2 => extern $abi fn(Floats) -> Floats,
+                  Floats { a: 1.0, b: 0, c: 2.0 }, |r| r.a == 3.0);
+        bench_fn!(results, "S", $abi,
+                  $module::get_x => extern $abi fn(S) -> u64,
+                  S { x: 1, y: 2, z: 3 }, |&r| r == 1);
+    }}
+}
+
+fn bench_c(results: &mut Vec<Record>) {
+    unsafe {
+        bench(results, "()", "C", (), |()| rust_dbg_do_nothing(), |_| true);
+        bench(results, "u8", "C", 10, |u| rust_dbg_extern_identity_u8(u), |&r| r == 10);
+        bench(results, "u32", "C", 10, |u| rust_dbg_extern_identity_u32(u), |&r| r == 10);
+        bench(results, "u64", "C", 10, |u| rust_dbg_extern_identity_u64(u), |&r| r == 10);
+        bench(results, "f64", "C", 10.0, |u| rust_dbg_extern_identity_double(u),
+              |&r| r == 10.0);
+        bench(results, "TwoU8s", "C", TwoU8s { one: 10, two: 20 },
+              |u| rust_dbg_extern_identity_TwoU8s(u), |r| r.two == 20);
+        bench(results, "TwoU16s", "C", TwoU16s { one: 10, two: 20 },
+              |u| rust_dbg_extern_identity_TwoU16s(u), |r| r.two == 20);
+        bench(results, "TwoU32s", "C", TwoU32s { one: 10, two: 20 },
+              |u| rust_dbg_extern_identity_TwoU32s(u), |r| r.two == 20);
+        bench(results, "TwoU64s", "C", TwoU64s { one: 10, two: 20 },
+              |u| rust_dbg_extern_identity_TwoU64s(u), |r| r.two == 20);
+        bench(results, "TwoDoubles", "C", TwoDoubles { one: 10.0, two: 20.0 },
+              |u| rust_dbg_extern_identity_TwoDoubles(u), |r| r.two == 20.0);
+        bench(results, "quad", "C", Quad { a: 1, b: 2, c: 3, d: 4 },
+              |q| rust_dbg_abi_1(q), |r| r.a == 4);
+        bench(results, "floats", "C", Floats { a: 1.0, b: 0, c: 2.0 },
+              |f| rust_dbg_abi_2(f), |r| r.a == 3.0);
+        bench(results, "S", "C", S { x: 1, y: 2, z: 3 }, |s| get_x(s), |&r| r == 1);
+        let p = std::ptr::null();
+        bench(results, "pointers+quad", "C", Quad { a: 1, b: 2, c: 3, d: 4 },
+              |q| get_c_many_params(p, p, p, p, q), |&r| r == 3);
+        bench(results, "LARGE_INTEGER", "C",
+              LargeInteger { parts: LargeIntegerParts { low_part: 1, high_part: 2 } },
+              |li| increment_all_parts(li), |r| r.parts.high_part == 4);
+        bench(results, "varargs", "C", (10i64, 20.0f64),
+              |(x, y)| rust_interesting_average(2, x, y, x, y), |&r| r == 30.0);
+    }
+}
+
+// Reads the results of an earlier run, as written by `main`.
+fn read_baseline(path: &str) -> HashMap<(String, String), f64> {
+    let contents = fs::read_to_string(path).expect("failed to read the baseline");
+    contents.lines().filter_map(|line| {
+        let mut fields = line.split_whitespace();
+        let shape = fields.next()?.to_string();
+        let abi = fields.next()?.to_string();
+        let nanos = fields.next()?.parse().ok()?;
+        Some(((shape, abi), nanos))
+    }).collect()
+}
+
+fn main() {
+    let mut results = Vec::new();
+    bench_c(&mut results);
+    bench_variants!(&mut results, rust_abi, "Rust");
+    #[cfg(target_arch = "x86_64")]
+    {
+        bench_variants!(&mut results, sysv64_abi, "sysv64");
+        bench_variants!(&mut results, win64_abi, "win64");
+    }
+
+    let baseline = env::var("ABI_BENCH_BASELINE").ok().map(|path| read_baseline(&path));
+    let mut out = Vec::new();
+    for r in &results {
+        writeln!(out, "{} {} {:.3}", r.shape, r.abi, r.nanos_per_call).unwrap();
+        let compared = baseline.as_ref()
+            .and_then(|b| b.get(&(r.shape.to_string(), r.abi.to_string())));
+        match compared {
+            Some(&before) => {
+                println!("{:<14} {:<7} {:>8.3} ns/call (was {:.3}, {:+.1}%)",
+                         r.shape, r.abi, r.nanos_per_call, before,
+                         (r.nanos_per_call / before - 1.0) * 100.0);
+            }
+            None => println!("{:<14} {:<7} {:>8.3} ns/call", r.shape, r.abi, r.nanos_per_call),
+        }
+    }
+    if let Some(path) = env::args().nth(1) {
+        fs::write(&path, out).expect("failed to write the results");
+    }
+}
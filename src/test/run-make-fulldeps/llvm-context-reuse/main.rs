@@ -0,0 +1,53 @@
+// Every module ends up in a codegen unit of its own, and all of them return
+// a `Triple` (which is passed through memory, so its named type stays in the
+// optimized IR), so each one creates the same named types.
+
+pub struct Triple<T> {
+    pub a: T,
+    pub b: T,
+    pub c: T,
+}
+
+impl<T: Copy + std::ops::Add<Output = T>> Triple<T> {
+    #[inline]
+    pub fn sum(&self) -> T {
+        self.a + self.b + self.c
+    }
+}
+
+macro_rules! unit {
+    ($name:ident, $t:ty) => {
+        pub mod $name {
+            use super::Triple;
+
+            #[inline(never)]
+            pub fn run(xs: &[$t]) -> Triple<$t> {
+                let mut t = Triple { a: xs[0], b: xs[0], c: xs[0] };
+                for &x in &xs[1..] {
+                    t = Triple { a: t.sum(), b: t.c, c: x };
+                }
+                t
+            }
+        }
+    };
+}
+
+unit!(a, u8);
+unit!(b, u16);
+unit!(c, u32);
+unit!(d, u64);
+unit!(e, i8);
+unit!(f, i16);
+unit!(g, i32);
+unit!(h, i64);
+
+fn main() {
+    println!("{}", a::run(&[1, 2, 3]).sum());
+    println!("{}", b::run(&[1, 2, 3]).sum());
+    println!("{}", c::run(&[1, 2, 3]).sum());
+    println!("{}", d::run(&[1, 2, 3]).sum());
+    println!("{}", e::run(&[1, 2, 3]).sum());
+    println!("{}", f::run(&[1, 2, 3]).sum());
+    println!("{}", g::run(&[1, 2, 3]).sum());
+    println!("{}", h::run(&[1, 2, 3]).sum());
+}
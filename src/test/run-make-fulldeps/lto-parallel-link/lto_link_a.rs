@@ -0,0 +1,16 @@
+#![crate_type = "rlib"]
+
+pub fn sum<T: Copy + Into<u64>>(xs: &[T]) -> u64 {
+    xs.iter().fold(0, |acc, &x| acc.wrapping_mul(31).wrapping_add(x.into()))
+}
+
+#[inline(never)]
+pub fn a_value(n: u32) -> u64 {
+    let xs: Vec<u32> = (0..n).collect();
+    sum(&xs)
+}
+
+// Not used by anything downstream.
+pub fn a_unused(n: u64) -> u64 {
+    n.rotate_left(7) ^ 0x5555
+}
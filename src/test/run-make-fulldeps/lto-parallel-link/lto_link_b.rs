@@ -0,0 +1,10 @@
+#![crate_type = "rlib"]
+
+extern crate lto_link_a;
+extern crate lto_link_used;
+
+#[inline(never)]
+pub fn b_value(n: u32) -> u64 {
+    let xs: Vec<u32> = (0..n).map(|x| x * 3).collect();
+    lto_link_a::sum(&xs) + lto_link_a::a_value(n) + lto_link_used::used_value()
+}
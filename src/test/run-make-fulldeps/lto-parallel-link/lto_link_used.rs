@@ -0,0 +1,9 @@
+#![crate_type = "rlib"]
+
+// Nothing refers to this, only `#[used]` keeps it.
+#[used]
+pub static USED_MARKER: [u8; 8] = *b"lto-used";
+
+pub fn used_value() -> u64 {
+    3
+}
@@ -0,0 +1,7 @@
+extern crate lto_link_a;
+extern crate lto_link_b;
+
+fn main() {
+    let n = std::env::args().count() as u32 * 100;
+    println!("{} {}", lto_link_a::a_value(n), lto_link_b::b_value(n));
+}
@@ -0,0 +1,9 @@
+#![crate_type = "lib"]
+
+fn square(x: u32) -> u32 {
+    x * x
+}
+
+pub fn sum_of_squares(xs: &[u32]) -> u32 {
+    xs.iter().map(|&x| square(x)).sum()
+}
@@ -0,0 +1,17 @@
+// Calls across codegen units and into the standard library, which only the
+// LTO passes can inline.
+
+mod helpers {
+    #[inline(never)]
+    pub fn scale(v: &mut Vec<u64>, by: u64) {
+        for x in v.iter_mut() {
+            *x *= by;
+        }
+    }
+}
+
+fn main() {
+    let mut v: Vec<u64> = (0..std::env::args().count() as u64 * 100).collect();
+    helpers::scale(&mut v, 3);
+    println!("{}", v.iter().sum::<u64>());
+}
@@ -0,0 +1,10 @@
+#![crate_type = "lib"]
+
+pub struct Point {
+    pub x: i32,
+    pub y: i32,
+}
+
+pub fn manhattan(p: &Point) -> i32 {
+    p.x.abs() + p.y.abs()
+}
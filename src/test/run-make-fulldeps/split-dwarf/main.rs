@@ -0,0 +1,19 @@
+// A few modules, so that several codegen units and their compile units get
+// merged by fat LTO.
+
+mod parse {
+    pub fn digits(s: &str) -> Vec<u32> {
+        s.chars().filter_map(|c| c.to_digit(10)).collect()
+    }
+}
+
+mod sum {
+    pub fn total(v: &[u32]) -> u32 {
+        v.iter().sum()
+    }
+}
+
+fn main() {
+    let digits = parse::digits("a1b2c3");
+    assert_eq!(sum::total(&digits), 6);
+}
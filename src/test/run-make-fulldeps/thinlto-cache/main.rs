@@ -0,0 +1,32 @@
+// A few modules calling into each other, so that each codegen unit imports
+// from the others and its cache key depends on them.
+
+mod numbers {
+    pub fn collatz(mut n: u64) -> u64 {
+        let mut steps = 0;
+        while n != 1 {
+            n = if n % 2 == 0 { n / 2 } else { 3 * n + 1 };
+            steps += 1;
+        }
+        steps
+    }
+}
+
+mod words {
+    pub fn describe(steps: u64) -> String {
+        format!("{} steps", steps)
+    }
+}
+
+mod run {
+    use super::{numbers, words};
+
+    pub fn longest(limit: u64) -> String {
+        let steps = (1..limit).map(numbers::collatz).max().unwrap_or(0);
+        words::describe(steps)
+    }
+}
+
+fn main() {
+    println!("{}", run::longest(std::env::args().count() as u64 * 1000));
+}
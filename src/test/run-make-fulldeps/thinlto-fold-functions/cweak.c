@@ -0,0 +1,14 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// Overrides the weak definition of `weak.rs`.
+uint64_t weak_checksum(const uint64_t *xs, size_t len) {
+  (void) xs;
+  (void) len;
+  return 42;
+}
+
+// Referenced from Rust so that this object is linked in.
+uint32_t cweak_marker(void) {
+  return 1;
+}
@@ -0,0 +1,35 @@
+// `checksum::<u64>` is instantiated as an internal copy in the codegen units
+// of both `a` and `b`, which are identical but for their module.
+
+#[inline(never)]
+fn checksum<T: Copy + Into<u64>>(xs: &[T], seed: u64) -> u64 {
+    let mut hash = seed;
+    for (i, &x) in xs.iter().enumerate() {
+        let x: u64 = x.into();
+        hash ^= x.wrapping_mul(0x9e37_79b9_7f4a_7c15);
+        hash = hash.rotate_left(31).wrapping_add(i as u64);
+        if hash % 7 == 3 {
+            hash = hash.wrapping_mul(hash | 1);
+        }
+    }
+    hash ^ (hash >> 29)
+}
+
+mod a {
+    #[inline(never)]
+    pub fn run(xs: &[u64]) -> u64 {
+        super::checksum(xs, 1)
+    }
+}
+
+mod b {
+    #[inline(never)]
+    pub fn run(xs: &[u64]) -> u64 {
+        super::checksum(xs, 2)
+    }
+}
+
+fn main() {
+    let xs: Vec<u64> = (0..100).collect();
+    assert_ne!(a::run(&xs), b::run(&xs));
+}
@@ -0,0 +1,58 @@
+#![feature(linkage)]
+
+// `a::weak_checksum` is a weak definition which `cweak.c` overrides, and
+// `b::local_checksum` is an internal function with the same body. Folding
+// the internal copy into the weak one would make it call the C function.
+
+use std::slice;
+
+macro_rules! checksum {
+    ($xs:expr) => {{
+        let mut hash = 7u64;
+        for (i, &x) in $xs.iter().enumerate() {
+            hash ^= x.wrapping_mul(0x9e37_79b9_7f4a_7c15);
+            hash = hash.rotate_left(31).wrapping_add(i as u64);
+            if hash % 7 == 3 {
+                hash = hash.wrapping_mul(hash | 1);
+            }
+        }
+        hash ^ (hash >> 29)
+    }}
+}
+
+mod a {
+    use std::slice;
+
+    #[no_mangle]
+    #[linkage = "weak"]
+    #[inline(never)]
+    pub unsafe extern "C" fn weak_checksum(xs: *const u64, len: usize) -> u64 {
+        checksum!(slice::from_raw_parts(xs, len))
+    }
+}
+
+mod b {
+    use std::slice;
+
+    #[inline(never)]
+    unsafe extern "C" fn local_checksum(xs: *const u64, len: usize) -> u64 {
+        checksum!(slice::from_raw_parts(xs, len))
+    }
+
+    pub fn run(xs: &[u64]) -> u64 {
+        unsafe { local_checksum(xs.as_ptr(), xs.len()) }
+    }
+}
+
+#[link(name = "cweak", kind = "static")]
+extern "C" {
+    fn cweak_marker() -> u32;
+}
+
+fn main() {
+    let xs: Vec<u64> = (0..100).collect();
+    let expected = checksum!(unsafe { slice::from_raw_parts(xs.as_ptr(), xs.len()) });
+    assert_eq!(unsafe { cweak_marker() }, 1);
+    assert_eq!(unsafe { a::weak_checksum(xs.as_ptr(), xs.len()) }, 42);
+    assert_eq!(b::run(&xs), expected);
+}
@@ -0,0 +1,52 @@
+// A few modules calling into each other and into the standard library, so
+// that the combined index has imports, exports and variables to compare.
+
+mod counter {
+    use std::sync::atomic::{AtomicUsize, Ordering};
+
+    static CALLS: AtomicUsize = AtomicUsize::new(0);
+    pub static TABLE: [u32; 4] = [3, 1, 4, 1];
+
+    pub fn bump() -> usize {
+        CALLS.fetch_add(1, Ordering::Relaxed) + 1
+    }
+}
+
+mod shapes {
+    pub trait Area {
+        fn area(&self) -> f64;
+    }
+
+    pub struct Square(pub f64);
+    pub struct Circle(pub f64);
+
+    impl Area for Square {
+        fn area(&self) -> f64 { self.0 * self.0 }
+    }
+
+    impl Area for Circle {
+        fn area(&self) -> f64 { 3.0 * self.0 * self.0 }
+    }
+}
+
+mod run {
+    use super::counter;
+    use super::shapes::{Area, Circle, Square};
+
+    pub fn total(n: usize) -> f64 {
+        let shapes: Vec<Box<dyn Area>> = (0..n).map(|i| {
+            counter::bump();
+            if i % 2 == 0 {
+                Box::new(Square(i as f64)) as Box<dyn Area>
+            } else {
+                Box::new(Circle(counter::TABLE[i % 4] as f64))
+            }
+        }).collect();
+        shapes.iter().map(|s| s.area()).sum()
+    }
+}
+
+fn main() {
+    let n = std::env::args().count() * 10;
+    println!("{} {}", run::total(n), counter::bump());
+}
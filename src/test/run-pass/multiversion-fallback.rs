@@ -0,0 +1,60 @@
+// Checks that a multiversioned function calls its original body when no
+// condition holds, and the version whose condition does otherwise. The
+// versions are clones of the same body, so which one runs is told apart by
+// the conditions the resolver called: it stops at the first one returning
+// non-zero, and only resolves each function once.
+
+// only-x86_64
+// compile-flags: -Z multiversion=never_picked=+avx2@cpu_never
+// compile-flags: -Z multiversion=always_picked=+avx2@cpu_never
+// compile-flags: -Z multiversion=always_picked=+sse2@cpu_always
+
+use std::sync::atomic::{AtomicU32, Ordering};
+
+static NEVER_CALLS: AtomicU32 = AtomicU32::new(0);
+static ALWAYS_CALLS: AtomicU32 = AtomicU32::new(0);
+
+#[no_mangle]
+pub extern "C" fn cpu_never() -> u32 {
+    NEVER_CALLS.fetch_add(1, Ordering::SeqCst);
+    0
+}
+
+#[no_mangle]
+pub extern "C" fn cpu_always() -> u32 {
+    ALWAYS_CALLS.fetch_add(1, Ordering::SeqCst);
+    1
+}
+
+#[no_mangle]
+#[inline(never)]
+pub fn never_picked(xs: &[u32]) -> u32 {
+    xs.iter().sum()
+}
+
+#[no_mangle]
+#[inline(never)]
+pub fn always_picked(xs: &[u32]) -> u32 {
+    xs.iter().map(|x| x * 2).sum()
+}
+
+fn main() {
+    let xs = [1, 2, 3, 4];
+
+    // Only `cpu_never` was asked, so the original body ran.
+    assert_eq!(never_picked(&xs), 10);
+    assert_eq!(NEVER_CALLS.load(Ordering::SeqCst), 1);
+    assert_eq!(ALWAYS_CALLS.load(Ordering::SeqCst), 0);
+
+    // `cpu_never` said no to the `+avx2` version and `cpu_always` picked the
+    // `+sse2` one, so that's the one which ran.
+    assert_eq!(always_picked(&xs), 20);
+    assert_eq!(NEVER_CALLS.load(Ordering::SeqCst), 2);
+    assert_eq!(ALWAYS_CALLS.load(Ordering::SeqCst), 1);
+
+    // Later calls go straight to the versions picked before.
+    assert_eq!(never_picked(&xs), 10);
+    assert_eq!(always_picked(&xs), 20);
+    assert_eq!(NEVER_CALLS.load(Ordering::SeqCst), 2);
+    assert_eq!(ALWAYS_CALLS.load(Ordering::SeqCst), 1);
+}